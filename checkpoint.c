@@ -0,0 +1,320 @@
+
+#include <time.h>
+
+#include "util.h"
+#include "uthash.h"
+#include "checkpoint.h"
+
+
+#define CHECKPOINT_SECS (10)
+
+static char magic[] = "xbup journal";
+
+static FILE *journal_fp = 0;
+static char *journal_name = 0;
+
+static char **pending = 0;
+static long num_pending = 0;
+static long max_pending = 0;
+
+static time_t last_flush = 0;
+static time_t deadline = 0;
+
+
+/* done_table is the set of directories read from the journal */
+
+struct done_entry {
+   char *key;
+   UT_hash_handle hh;
+};
+
+static
+struct done_entry *done_table = NULL;
+
+static
+void add_done(const char *s)
+{
+   struct done_entry *ptr;
+   char *dup;
+
+   HASH_FIND(hh, done_table, s, strlen(s), ptr);
+   if (ptr) return;
+
+   ptr = malloc(sizeof(struct done_entry));
+   dup = strdup(s);
+   if (!ptr || !dup) {
+      Warning("malloc error");
+      exit(-1);
+   }
+
+   ptr->key = dup;
+
+   HASH_ADD_KEYPTR(hh, done_table, ptr->key, strlen(ptr->key), ptr);
+}
+
+
+/* reads the journal; a partial record at the end (left by a crash)
+ * is cut off, so that new records are not appended to it.
+ */
+
+static
+int read_journal(const char *fname, const char *tag)
+{
+   FILE *fp;
+   char *buf;
+   size_t bufsize;
+   ssize_t len;
+   off_t good;
+
+   fp = fopen(fname, "r");
+   if (!fp) {
+      WARN("can't open %s\n", fname);
+      return -1;
+   }
+
+   buf = 0;
+   bufsize = 0;
+
+   if (getdelim(&buf, &bufsize, '\0', fp) != sizeof(magic) ||
+       strcmp(buf, magic) != 0 ||
+       getdelim(&buf, &bufsize, '\0', fp) != strlen(tag)+1 ||
+       strcmp(buf, tag) != 0) {
+      WARN("%s: not a journal of this run (%s)\n", fname, tag);
+      free(buf);
+      fclose(fp);
+      return -1;
+   }
+
+   good = ftello(fp);
+
+   while ( (len = getdelim(&buf, &bufsize, '\0', fp)) > 0 ) {
+      if (buf[len-1] != '\0') break;
+      add_done(buf);
+      good = ftello(fp);
+   }
+
+   free(buf);
+
+   if (ferror(fp)) {
+      WARN("error reading %s\n", fname);
+      fclose(fp);
+      return -1;
+   }
+
+   fclose(fp);
+
+   if (truncate(fname, good)) {
+      WARN("can't truncate %s\n", fname);
+      return -1;
+   }
+
+   return 0;
+}
+
+
+static
+int sync_journal(void)
+{
+   if (fflush(journal_fp) || fsync(fileno(journal_fp))) {
+      WARN("error writing %s\n", journal_name);
+      return -1;
+   }
+
+   return 0;
+}
+
+
+/* the options that may change from one run of a walk to the next,
+ * and whether they take a value
+ */
+
+static struct {
+   const char *name;
+   int has_value;
+} run_options[] = {
+   { "--resume", 0 },
+   { "--deadline", 1 },
+   { "--progress", 1 },
+   { "--jobs", 1 },
+   { "--max-ops", 1 },
+   { "--max-meta-ops", 1 },
+   { "--max-bytes", 1 },
+   { "--throttle-file", 1 },
+   { "--nice", 1 },
+   { "--low-io", 0 },
+   { "--hotspots", 1 },
+   { "--hotspots-json", 1 },
+   { 0, 0 }
+};
+
+char *checkpoint_tag(const char *tool, int argc, char *argv[])
+{
+   char *tag;
+   long len;
+   int i, k;
+
+   len = strlen(tool) + 1;
+   for (i = 1; i < argc; i++) len += strlen(argv[i]) + 1;
+
+   tag = (char *) malloc(len);
+   if (!tag) {
+      Warning("malloc error");
+      exit(-1);
+   }
+
+   strcpy(tag, tool);
+
+   for (i = 1; i < argc; i++) {
+      for (k = 0; run_options[k].name; k++)
+         if (strcmp(argv[i], run_options[k].name) == 0) break;
+
+      if (run_options[k].name) {
+         i += run_options[k].has_value;
+         continue;
+      }
+
+      strcat(tag, " ");
+      strcat(tag, argv[i]);
+   }
+
+   return tag;
+}
+
+
+int checkpoint_open(const char *fname, const char *tag, int resume)
+{
+   if (resume) {
+      if (read_journal(fname, tag)) return -1;
+      journal_fp = fopen(fname, "a");
+   }
+   else {
+      journal_fp = fopen(fname, "w");
+   }
+
+   if (!journal_fp) {
+      WARN("can't open %s\n", fname);
+      return -1;
+   }
+
+   journal_name = strdup(fname);
+   if (!journal_name) {
+      Warning("malloc error");
+      exit(-1);
+   }
+
+   last_flush = time(0);
+
+   if (!resume) {
+      if (fwrite(magic, 1, sizeof(magic), journal_fp) != sizeof(magic) ||
+          fwrite(tag, 1, strlen(tag)+1, journal_fp) != strlen(tag)+1) {
+         WARN("error writing %s\n", fname);
+         return -1;
+      }
+
+      return sync_journal();
+   }
+
+   return 0;
+}
+
+
+int checkpoint_is_done(const char *path)
+{
+   struct done_entry *ptr;
+
+   if (!done_table) return 0;
+
+   HASH_FIND(hh, done_table, path, strlen(path), ptr);
+   return (ptr != 0);
+}
+
+
+void checkpoint_done(const char *path)
+{
+   if (!journal_fp) return;
+
+   if (num_pending == max_pending) {
+      max_pending = (max_pending == 0) ? 256 : 2*max_pending;
+      pending = realloc(pending, max_pending*sizeof(char *));
+      if (!pending) {
+         Warning("malloc error");
+         exit(-1);
+      }
+   }
+
+   pending[num_pending] = strdup(path);
+   if (!pending[num_pending]) {
+      Warning("malloc error");
+      exit(-1);
+   }
+
+   num_pending++;
+}
+
+
+int checkpoint_due(void)
+{
+   return journal_fp && time(0) - last_flush >= CHECKPOINT_SECS;
+}
+
+
+int checkpoint_flush(int keep)
+{
+   long i, len;
+   int ret;
+
+   if (!journal_fp) return 0;
+
+   ret = 0;
+
+   for (i = 0; i < num_pending; i++) {
+      if (keep && ret == 0) {
+         len = strlen(pending[i]) + 1;
+         if (fwrite(pending[i], 1, len, journal_fp) != len) {
+            WARN("error writing %s\n", journal_name);
+            ret = -1;
+         }
+      }
+      free(pending[i]);
+   }
+
+   num_pending = 0;
+   last_flush = time(0);
+
+   if (ret == 0 && keep) ret = sync_journal();
+
+   return ret;
+}
+
+
+int checkpoint_close(void)
+{
+   int ret;
+
+   if (!journal_fp) return 0;
+
+   ret = checkpoint_flush(0);
+
+   if (fclose(journal_fp)) {
+      WARN("error writing %s\n", journal_name);
+      ret = -1;
+   }
+
+   journal_fp = 0;
+   return ret;
+}
+
+
+void checkpoint_deadline(long secs)
+{
+   if (secs > 0)
+      deadline = time(0) + secs;
+   else
+      deadline = 0;
+}
+
+
+int checkpoint_expired(void)
+{
+   return deadline && time(0) >= deadline;
+}
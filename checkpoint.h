@@ -0,0 +1,63 @@
+#ifndef XBUP__checkpoint_H
+#define XBUP__checkpoint_H
+
+/* checkpoint: a journal of the directories that a tree walker
+ * (split_xattr, join_xattr) has finished, so that a walk that was
+ * interrupted, or stopped at its deadline, can be resumed without
+ * doing those directories again.
+ *
+ * The journal starts with a tag naming the walk (the program and its
+ * arguments), followed by the paths of the finished directories,
+ * relative to the root of the walk ("" for the root itself), in the
+ * order they were finished.  Each is terminated by a '\0', and a
+ * path whose '\0' never made it to the disk is ignored.
+ */
+
+/* checkpoint_open opens the journal fname: with resume, the directories
+ * already in it are read in, and new ones are appended; otherwise, the
+ * journal is started afresh.  Returns 0 on success, and -1 on error
+ * (including a journal with a different tag).
+ *
+ * Until checkpoint_open is called, checkpoint_is_done always returns 0,
+ * and the other functions (but the deadline ones) do nothing.
+ */
+
+int checkpoint_open(const char *fname, const char *tag, int resume);
+
+/* checkpoint_tag returns the tag for tool run with argv (malloc'ed):
+ * the tool name and all of its arguments, but for those that only
+ * say how a run is carried out, and so may differ from one run of a
+ * walk to the next: --resume, --deadline, --progress, --jobs, the
+ * throttling and priority options (--max-ops, --max-meta-ops,
+ * --max-bytes, --throttle-file, --nice, --low-io) and --hotspots,
+ * --hotspots-json.
+ */
+
+char *checkpoint_tag(const char *tool, int argc, char *argv[]);
+
+int checkpoint_is_done(const char *path);
+
+/* Directories are recorded in batches: checkpoint_done only notes
+ * that a directory is finished, and checkpoint_flush appends the
+ * noted directories to the journal (and syncs it), or drops them if
+ * keep is 0 --- say, because errors were detected since the last
+ * flush, so that some of them may not really be finished.
+ * checkpoint_due says when a flush is in order (every few seconds).
+ * checkpoint_close drops whatever was not flushed.
+ * checkpoint_flush and checkpoint_close return 0 on success,
+ * and -1 on error.
+ */
+
+void checkpoint_done(const char *path);
+int checkpoint_due(void);
+int checkpoint_flush(int keep);
+int checkpoint_close(void);
+
+/* Once checkpoint_deadline(secs) is called (with secs > 0),
+ * checkpoint_expired returns true after secs seconds have passed.
+ */
+
+void checkpoint_deadline(long secs);
+int checkpoint_expired(void);
+
+#endif
@@ -0,0 +1,342 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "digest.h"
+
+
+static const uint32_t K[64] = {
+   0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 
+   0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+   0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 
+   0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+   0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 
+   0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+   0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 
+   0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+   0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 
+   0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+   0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 
+   0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+   0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 
+   0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+   0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 
+   0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x,n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+
+static
+void sha256_block(sha256_ctx_t *ctx, const unsigned char *p)
+{
+   uint32_t w[64];
+   uint32_t a, b, c, d, e, f, g, h, s0, s1, t1, t2;
+   int i;
+
+   for (i = 0; i < 16; i++) {
+      w[i] = ((uint32_t) p[4*i] << 24) | ((uint32_t) p[4*i+1] << 16) |
+             ((uint32_t) p[4*i+2] << 8) | ((uint32_t) p[4*i+3]);
+   }
+
+   for (i = 16; i < 64; i++) {
+      s0 = ROTR(w[i-15], 7) ^ ROTR(w[i-15], 18) ^ (w[i-15] >> 3);
+      s1 = ROTR(w[i-2], 17) ^ ROTR(w[i-2], 19) ^ (w[i-2] >> 10);
+      w[i] = w[i-16] + s0 + w[i-7] + s1;
+   }
+
+   a = ctx->h[0]; b = ctx->h[1]; c = ctx->h[2]; d = ctx->h[3];
+   e = ctx->h[4]; f = ctx->h[5]; g = ctx->h[6]; h = ctx->h[7];
+
+   for (i = 0; i < 64; i++) {
+      s1 = ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25);
+      t1 = h + s1 + ((e & f) ^ (~e & g)) + K[i] + w[i];
+      s0 = ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22);
+      t2 = s0 + ((a & b) ^ (a & c) ^ (b & c));
+
+      h = g; g = f; f = e; e = d + t1;
+      d = c; c = b; b = a; a = t1 + t2;
+   }
+
+   ctx->h[0] += a; ctx->h[1] += b; ctx->h[2] += c; ctx->h[3] += d;
+   ctx->h[4] += e; ctx->h[5] += f; ctx->h[6] += g; ctx->h[7] += h;
+}
+
+
+void sha256_init(sha256_ctx_t *ctx)
+{
+   ctx->h[0] = 0x6a09e667; ctx->h[1] = 0xbb67ae85; 
+   ctx->h[2] = 0x3c6ef372; ctx->h[3] = 0xa54ff53a;
+   ctx->h[4] = 0x510e527f; ctx->h[5] = 0x9b05688c; 
+   ctx->h[6] = 0x1f83d9ab; ctx->h[7] = 0x5be0cd19;
+   ctx->nbytes = 0;
+   ctx->buflen = 0;
+}
+
+
+void sha256_update(sha256_ctx_t *ctx, const void *data, size_t len)
+{
+   const unsigned char *p = (const unsigned char *) data;
+   size_t n;
+
+   ctx->nbytes += len;
+
+   if (ctx->buflen > 0) {
+      n = 64 - ctx->buflen;
+      if (n > len) n = len;
+      memcpy(ctx->buf + ctx->buflen, p, n);
+      ctx->buflen += n;
+      p += n;
+      len -= n;
+      if (ctx->buflen < 64) return;
+      sha256_block(ctx, ctx->buf);
+      ctx->buflen = 0;
+   }
+
+   while (len >= 64) {
+      sha256_block(ctx, p);
+      p += 64;
+      len -= 64;
+   }
+
+   memcpy(ctx->buf, p, len);
+   ctx->buflen = len;
+}
+
+
+void sha256_final(sha256_ctx_t *ctx, unsigned char *md)
+{
+   uint64_t nbits = ctx->nbytes * 8;
+   unsigned char pad[72];
+   long padlen;
+   int i;
+
+   padlen = (ctx->buflen < 56) ? (56 - ctx->buflen) : (120 - ctx->buflen);
+
+   memset(pad, 0, sizeof(pad));
+   pad[0] = 0x80;
+   for (i = 0; i < 8; i++) 
+      pad[padlen + i] = (nbits >> (56 - 8*i)) & 0xff;
+
+   sha256_update(ctx, pad, padlen + 8);
+
+   for (i = 0; i < 8; i++) {
+      md[4*i]   = (ctx->h[i] >> 24) & 0xff;
+      md[4*i+1] = (ctx->h[i] >> 16) & 0xff;
+      md[4*i+2] = (ctx->h[i] >> 8) & 0xff;
+      md[4*i+3] = ctx->h[i] & 0xff;
+   }
+}
+
+
+void sha256(const void *data, size_t len, unsigned char *md)
+{
+   sha256_ctx_t ctx;
+
+   sha256_init(&ctx);
+   sha256_update(&ctx, data, len);
+   sha256_final(&ctx, md);
+}
+
+
+int sha256_file(const char *fname, unsigned char *md)
+{
+   sha256_ctx_t ctx;
+   unsigned char buf[16*1024];
+   FILE *fp;
+   size_t n;
+   int err;
+
+   fp = fopen(fname, "r");
+   if (!fp) return -1;
+
+   sha256_init(&ctx);
+   while ( (n = fread(buf, 1, sizeof(buf), fp)) > 0 ) 
+      sha256_update(&ctx, buf, n);
+
+   err = ferror(fp);
+   fclose(fp);
+   if (err) return -1;
+
+   sha256_final(&ctx, md);
+   return 0;
+}
+
+
+#define P64_1 0x9E3779B185EBCA87ULL
+#define P64_2 0xC2B2AE3D27D4EB4FULL
+#define P64_3 0x165667B19E3779F9ULL
+#define P64_4 0x85EBCA77C2B2AE63ULL
+#define P64_5 0x27D4EB2F165667C5ULL
+
+#define ROTL64(x,n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+
+static
+uint64_t get64(const unsigned char *p)
+{
+   return ((uint64_t) p[0]) | ((uint64_t) p[1] << 8) | 
+          ((uint64_t) p[2] << 16) | ((uint64_t) p[3] << 24) |
+          ((uint64_t) p[4] << 32) | ((uint64_t) p[5] << 40) | 
+          ((uint64_t) p[6] << 48) | ((uint64_t) p[7] << 56);
+}
+
+static
+uint32_t get32(const unsigned char *p)
+{
+   return ((uint32_t) p[0]) | ((uint32_t) p[1] << 8) | 
+          ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static
+uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+   acc += input * P64_2;
+   acc = ROTL64(acc, 31);
+   return acc * P64_1;
+}
+
+static
+uint64_t xxh64_merge(uint64_t acc, uint64_t val)
+{
+   acc ^= xxh64_round(0, val);
+   return acc * P64_1 + P64_4;
+}
+
+static
+void xxh64_stripe(xxh64_ctx_t *ctx, const unsigned char *p)
+{
+   ctx->v[0] = xxh64_round(ctx->v[0], get64(p));
+   ctx->v[1] = xxh64_round(ctx->v[1], get64(p+8));
+   ctx->v[2] = xxh64_round(ctx->v[2], get64(p+16));
+   ctx->v[3] = xxh64_round(ctx->v[3], get64(p+24));
+}
+
+
+void xxh64_init(xxh64_ctx_t *ctx)
+{
+   ctx->v[0] = P64_1 + P64_2;
+   ctx->v[1] = P64_2;
+   ctx->v[2] = 0;
+   ctx->v[3] = -P64_1;
+   ctx->nbytes = 0;
+   ctx->buflen = 0;
+}
+
+
+void xxh64_update(xxh64_ctx_t *ctx, const void *data, size_t len)
+{
+   const unsigned char *p = (const unsigned char *) data;
+   size_t n;
+
+   ctx->nbytes += len;
+
+   if (ctx->buflen > 0) {
+      n = 32 - ctx->buflen;
+      if (n > len) n = len;
+      memcpy(ctx->buf + ctx->buflen, p, n);
+      ctx->buflen += n;
+      p += n;
+      len -= n;
+      if (ctx->buflen < 32) return;
+      xxh64_stripe(ctx, ctx->buf);
+      ctx->buflen = 0;
+   }
+
+   while (len >= 32) {
+      xxh64_stripe(ctx, p);
+      p += 32;
+      len -= 32;
+   }
+
+   memcpy(ctx->buf, p, len);
+   ctx->buflen = len;
+}
+
+
+uint64_t xxh64_final(xxh64_ctx_t *ctx)
+{
+   const unsigned char *p = ctx->buf;
+   long len = ctx->buflen;
+   uint64_t h;
+
+   if (ctx->nbytes >= 32) {
+      h = ROTL64(ctx->v[0], 1) + ROTL64(ctx->v[1], 7) + 
+          ROTL64(ctx->v[2], 12) + ROTL64(ctx->v[3], 18);
+      h = xxh64_merge(h, ctx->v[0]);
+      h = xxh64_merge(h, ctx->v[1]);
+      h = xxh64_merge(h, ctx->v[2]);
+      h = xxh64_merge(h, ctx->v[3]);
+   }
+   else {
+      h = ctx->v[2] + P64_5;
+   }
+
+   h += ctx->nbytes;
+
+   while (len >= 8) {
+      h ^= xxh64_round(0, get64(p));
+      h = ROTL64(h, 27) * P64_1 + P64_4;
+      p += 8;
+      len -= 8;
+   }
+
+   if (len >= 4) {
+      h ^= (uint64_t) get32(p) * P64_1;
+      h = ROTL64(h, 23) * P64_2 + P64_3;
+      p += 4;
+      len -= 4;
+   }
+
+   while (len > 0) {
+      h ^= (*p) * P64_5;
+      h = ROTL64(h, 11) * P64_1;
+      p++;
+      len--;
+   }
+
+   h ^= h >> 33;
+   h *= P64_2;
+   h ^= h >> 29;
+   h *= P64_3;
+   h ^= h >> 32;
+
+   return h;
+}
+
+
+int xxh64_file(const char *fname, uint64_t *h)
+{
+   xxh64_ctx_t ctx;
+   unsigned char buf[128*1024];
+   ssize_t n;
+   int fd;
+
+   fd = open(fname, O_RDONLY);
+   if (fd < 0) return -1;
+
+   xxh64_init(&ctx);
+   while ( (n = read(fd, buf, sizeof(buf))) > 0 ) 
+      xxh64_update(&ctx, buf, n);
+
+   close(fd);
+   if (n < 0) return -1;
+
+   *h = xxh64_final(&ctx);
+   return 0;
+}
+
+
+void digest_to_hex(const unsigned char *md, long len, char *s)
+{
+   static const char hex[] = "0123456789abcdef";
+   long i;
+
+   for (i = 0; i < len; i++) {
+      s[2*i] = hex[(md[i] >> 4) & 0xf];
+      s[2*i+1] = hex[md[i] & 0xf];
+   }
+   s[2*len] = '\0';
+}
+
@@ -0,0 +1,63 @@
+#ifndef XBUP__digest_H
+#define XBUP__digest_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* SHA-256, used to fingerprint xattr containers and manifests,
+ * and XXH64, a much faster non-cryptographic hash, used to 
+ * fingerprint data files.
+ */
+
+#define SHA256_LEN (32)
+
+struct sha256_ctx {
+   uint32_t h[8];
+   uint64_t nbytes;
+   unsigned char buf[64];
+   long buflen;
+};
+
+typedef struct sha256_ctx sha256_ctx_t;
+
+void sha256_init(sha256_ctx_t *ctx);
+void sha256_update(sha256_ctx_t *ctx, const void *data, size_t len);
+void sha256_final(sha256_ctx_t *ctx, unsigned char *md);
+
+void sha256(const void *data, size_t len, unsigned char *md);
+
+/* sha256_file hashes the contents of the file fname; 
+ * returns 0 on success, -1 on error.
+ */
+
+int sha256_file(const char *fname, unsigned char *md);
+
+#define XXH64_LEN (8)
+
+struct xxh64_ctx {
+   uint64_t v[4];
+   uint64_t nbytes;
+   unsigned char buf[32];
+   long buflen;
+};
+
+typedef struct xxh64_ctx xxh64_ctx_t;
+
+void xxh64_init(xxh64_ctx_t *ctx);
+void xxh64_update(xxh64_ctx_t *ctx, const void *data, size_t len);
+uint64_t xxh64_final(xxh64_ctx_t *ctx);
+
+/* xxh64_file hashes the contents of the file fname (with seed 0);
+ * returns 0 on success, -1 on error.
+ */
+
+int xxh64_file(const char *fname, uint64_t *h);
+
+/* writes the first len bytes of md as 2*len hex digits, 
+ * null terminated, into s 
+ */
+
+void digest_to_hex(const unsigned char *md, long len, char *s);
+
+#endif
+
@@ -0,0 +1,360 @@
+
+#include "util.h"
+#include "dirscan.h"
+
+
+#define BATCH_NAMES (64*1024)      /* max names per in-memory batch */
+#define BATCH_BYTES (4*1024*1024)  /* max name bytes per in-memory batch */
+
+/* the batch buffers start small, and double as needed up to the
+ * limits above, so that the many small directories of a tree
+ * don't cost a full batch each
+ */
+
+#define FIRST_NAMES (256)
+#define FIRST_BYTES (16*1024)
+
+#define MAXNAMELEN (1024)
+
+
+/* a run is a sorted sequence of entries spilled to a temporary file;
+ * each record is a type byte followed by a null-terminated name.
+ */
+
+struct run {
+   FILE *fp;
+   int valid;
+   unsigned char type;
+   char name[MAXNAMELEN];
+};
+
+/* the names of a batch are kept in a list of chunks, newest first,
+ * rather than one buffer that is realloc'ed, so that the pointers
+ * to them stay valid as the batch grows.
+ */
+
+struct chunk {
+   struct chunk *next;
+   long size, used;
+   char *buf;
+};
+
+struct dirscan {
+   DIR *dir;
+   int sorted;
+
+   /* current in-memory batch: names[i] points to a type byte
+    * followed by a null-terminated name
+    */
+   struct chunk *chunks;
+   long chunk_size, names_bytes;
+   char **names;
+   long names_size;
+   long num_names, pos;
+
+   /* spilled runs, merged on output */
+   struct run *runs;
+   long num_runs;
+
+   struct dirscan_item item;
+   char name[MAXNAMELEN];
+
+   int error;     /* entries were lost (see dirscan_close) */
+};
+
+
+static
+int cmp_names(const void *a, const void *b)
+{
+   return strcmp(*(char * const *)a + 1, *(char * const *)b + 1);
+}
+
+static
+void sort_batch(dirscan_t *ds)
+{
+   qsort(ds->names, ds->num_names, sizeof(char *), cmp_names);
+}
+
+
+static
+void free_chunks(dirscan_t *ds)
+{
+   struct chunk *cp;
+
+   while ( (cp = ds->chunks) ) {
+      ds->chunks = cp->next;
+      free(cp->buf);
+      free(cp);
+   }
+
+   ds->names_bytes = 0;
+}
+
+static
+void free_batch(dirscan_t *ds)
+{
+   free_chunks(ds);
+   free(ds->names);
+   ds->names = 0;
+   ds->names_size = 0;
+   ds->num_names = 0;
+}
+
+
+static
+int read_run(struct run *rp)
+{
+   int c, k;
+
+   c = getc(rp->fp);
+   if (c == EOF) {
+      rp->valid = 0;
+      return 0;
+   }
+   rp->type = c;
+
+   k = 0;
+   for (;;) {
+      c = getc(rp->fp);
+      if (c == EOF || k >= MAXNAMELEN) return -1;
+      rp->name[k++] = c;
+      if (c == 0) break;
+   }
+
+   rp->valid = 1;
+   return 0;
+}
+
+
+static
+int spill_batch(dirscan_t *ds)
+{
+   struct run *rp;
+   const char *p;
+   long i;
+
+   sort_batch(ds);
+
+   rp = (struct run *) realloc(ds->runs, (ds->num_runs+1)*sizeof(struct run));
+   if (!rp) return -1;
+   ds->runs = rp;
+   rp = &ds->runs[ds->num_runs];
+   rp->valid = 0;
+
+   rp->fp = tmpfile();
+   if (!rp->fp) return -1;
+   ds->num_runs++;
+
+   for (i = 0; i < ds->num_names; i++) {
+      p = ds->names[i];
+      if (fwrite(p, 1, strlen(p+1) + 2, rp->fp) != strlen(p+1) + 2)
+         return -1;
+   }
+
+   if (fflush(rp->fp) || fseek(rp->fp, 0, SEEK_SET)) return -1;
+
+   /* the names array is kept (it is full by now), but the chunks
+    * are freed; the first chunk of the next batch is sized from the
+    * last one
+    */
+
+   free_chunks(ds);
+   ds->num_names = 0;
+   return 0;
+}
+
+
+static
+int add_name(dirscan_t *ds, const struct dirent *de)
+{
+   long len = strlen(de->d_name);
+   struct chunk *cp;
+   char **np;
+   long n;
+
+   if (len >= MAXNAMELEN) {
+      errno = ENAMETOOLONG;
+      return -1;
+   }
+
+   if (ds->num_names >= BATCH_NAMES || 
+       ds->names_bytes + len + 2 > BATCH_BYTES) {
+      if (spill_batch(ds)) return -1;
+   }
+
+   if (ds->num_names >= ds->names_size) {
+      n = ds->names_size ? 2 * ds->names_size : FIRST_NAMES;
+      if (n > BATCH_NAMES) n = BATCH_NAMES;
+      np = (char **) realloc(ds->names, n * sizeof(char *));
+      if (!np) return -1;
+      ds->names = np;
+      ds->names_size = n;
+   }
+
+   cp = ds->chunks;
+   if (!cp || cp->used + len + 2 > cp->size) {
+      n = ds->chunk_size ? 2 * ds->chunk_size : FIRST_BYTES;
+      if (n > BATCH_BYTES) n = BATCH_BYTES;
+      ds->chunk_size = n;
+
+      /* the chunks of a batch add up to no more than BATCH_BYTES */
+
+      if (n > BATCH_BYTES - ds->names_bytes) 
+         n = BATCH_BYTES - ds->names_bytes;
+
+      cp = (struct chunk *) malloc(sizeof(struct chunk));
+      if (!cp) return -1;
+      cp->buf = (char *) malloc(n);
+      if (!cp->buf) {
+         free(cp);
+         return -1;
+      }
+      cp->size = n;
+      cp->used = 0;
+      cp->next = ds->chunks;
+      ds->chunks = cp;
+   }
+
+   ds->names[ds->num_names++] = cp->buf + cp->used;
+   cp->buf[cp->used] = de->d_type;
+   memcpy(cp->buf + cp->used + 1, de->d_name, len + 1);
+   cp->used += len + 2;
+   ds->names_bytes += len + 2;
+
+   return 0;
+}
+
+
+/* reads all of the directory, and closes it, so that the walkers
+ * don't hold a descriptor per level as they recurse
+ */
+
+static
+int collect(dirscan_t *ds)
+{
+   struct dirent *de;
+   long i;
+
+   errno = 0;
+   while ( (de = readdir(ds->dir)) ) {
+      if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+         continue;
+      if (add_name(ds, de)) return -1;
+   }
+   if (errno) return -1;
+
+   closedir(ds->dir);
+   ds->dir = 0;
+
+   if (ds->num_runs > 0) {
+      if (ds->num_names > 0 && spill_batch(ds)) return -1;
+      free_batch(ds);
+      for (i = 0; i < ds->num_runs; i++) 
+         if (read_run(&ds->runs[i])) return -1;
+   }
+   else {
+      sort_batch(ds);
+   }
+
+   ds->pos = 0;
+   return 0;
+}
+
+
+dirscan_t *dirscan_open(const char *dirname, int sorted)
+{
+   dirscan_t *ds;
+   int err;
+
+   ds = (dirscan_t *) calloc(1, sizeof(dirscan_t));
+   if (!ds) return 0;
+
+   ds->dir = opendir(dirname);
+   if (!ds->dir) {
+      err = errno;
+      free(ds);
+      errno = err;
+      return 0;
+   }
+
+   ds->sorted = sorted;
+
+   if (sorted && collect(ds)) {
+      err = errno;
+      dirscan_close(ds);
+      errno = err;
+      return 0;
+   }
+
+   return ds;
+}
+
+
+struct dirscan_item *dirscan_next(dirscan_t *ds)
+{
+   struct dirent *de;
+   struct run *best;
+   const char *p;
+   long i;
+
+   if (!ds->sorted) {
+      errno = 0;
+      while ( (de = readdir(ds->dir)) ) {
+         if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+         ds->item.d_name = de->d_name;
+         ds->item.d_type = de->d_type;
+         return &ds->item;
+      }
+      if (errno) ds->error = 1;
+      return 0;
+   }
+
+   if (ds->num_runs == 0) {
+      if (ds->pos >= ds->num_names) return 0;
+      p = ds->names[ds->pos++];
+      ds->item.d_type = p[0];
+      ds->item.d_name = (char *) p + 1;
+      return &ds->item;
+   }
+
+   /* merge: the number of runs is small, so a linear scan will do */
+
+   best = 0;
+   for (i = 0; i < ds->num_runs; i++) {
+      if (ds->runs[i].valid && 
+          (!best || strcmp(ds->runs[i].name, best->name) < 0))
+         best = &ds->runs[i];
+   }
+
+   if (!best) return 0;
+
+   ds->item.d_type = best->type;
+   strcpy(ds->name, best->name);
+   ds->item.d_name = ds->name;
+
+   if (read_run(best)) {
+      WARN("dirscan: error reading temporary file\n");
+      best->valid = 0;
+      ds->error = 1;
+   }
+
+   return &ds->item;
+}
+
+
+int dirscan_close(dirscan_t *ds)
+{
+   int ret = ds->error ? -1 : 0;
+   long i;
+
+   if (ds->dir) closedir(ds->dir);
+   for (i = 0; i < ds->num_runs; i++) 
+      if (ds->runs[i].fp) fclose(ds->runs[i].fp);
+   free(ds->runs);
+   free_batch(ds);
+   free(ds);
+
+   return ret;
+}
+
@@ -0,0 +1,36 @@
+
+#ifndef XBUP__dirscan_H
+#define XBUP__dirscan_H
+
+/* dirscan: reads the entries of a directory, either in raw readdir
+ * order, or (if sorted is set) in strcmp order of their names.
+ *
+ * In sorted mode, the whole directory is read (and closed) by
+ * dirscan_open.  Names are collected in batches, whose buffers grow
+ * with the directory; when a directory is too large for one batch,
+ * each batch is sorted and spilled to a temporary file, and the
+ * resulting runs are merged, so memory use stays bounded no matter
+ * how large the directory is.
+ *
+ * The entries "." and ".." are never returned.
+ * dirscan_open returns NULL (with errno set) if opendir fails.
+ * dirscan_next returns NULL at the end of the directory; the
+ * returned item is only valid until the next call.
+ * dirscan_close returns -1 if some entries could not be read (a
+ * readdir error, or a spilled run that could not be read back), so
+ * that the caller can count the directory as failed, and 0 otherwise.
+ */
+
+struct dirscan_item {
+   char *d_name;
+   unsigned char d_type;
+};
+
+typedef struct dirscan dirscan_t;
+
+dirscan_t *dirscan_open(const char *dirname, int sorted);
+struct dirscan_item *dirscan_next(dirscan_t *ds);
+int dirscan_close(dirscan_t *ds);
+
+#endif
+
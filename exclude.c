@@ -0,0 +1,420 @@
+
+#include "util.h"
+#include "uthash.h"
+#include "exclude.h"
+
+
+#define NO_RULE (LONG_MAX)
+
+struct rule {
+   char *pat;       /* without the leading /, trailing /, or / *** */
+   int include;
+   int dironly;
+   int anchored;
+   int fullpath;    /* matched against the path, not the last component */
+   int contents;    /* also matches everything below */
+};
+
+static struct rule *rules = 0;
+static long num_rules = 0;
+static long max_rules = 0;
+
+/* the rules with wildcards (and the odd others), in order */
+
+static long *glob_rules = 0;
+static long num_glob = 0;
+
+static int any_dironly = 0;
+
+
+/* literal_table maps a literal pattern to the first rule with that
+ * pattern, and the first such rule that only applies to directories;
+ * there is one table for anchored patterns (keyed by path), and one
+ * for patterns that match the last component (keyed by name).
+ */
+
+struct literal_table_entry {
+   char *key;
+   long any_rule;
+   long dir_rule;
+   UT_hash_handle hh;
+};
+
+static
+struct literal_table_entry *path_table = NULL;
+
+static
+struct literal_table_entry *name_table = NULL;
+
+
+static
+void add_literal(struct literal_table_entry **table, const char *s,
+                 long r, int dironly)
+{
+   struct literal_table_entry *ptr;
+
+   HASH_FIND(hh, *table, s, strlen(s), ptr);
+
+   if (!ptr) {
+      ptr = malloc(sizeof(struct literal_table_entry));
+      if (!ptr) {
+         Warning("malloc error");
+         exit(-1);
+      }
+
+      ptr->key = rules[r].pat;
+      ptr->any_rule = NO_RULE;
+      ptr->dir_rule = NO_RULE;
+      HASH_ADD_KEYPTR(hh, *table, ptr->key, strlen(ptr->key), ptr);
+   }
+
+   if (dironly) {
+      if (ptr->dir_rule == NO_RULE) ptr->dir_rule = r;
+   }
+   else {
+      if (ptr->any_rule == NO_RULE) ptr->any_rule = r;
+   }
+}
+
+
+static
+long find_literal(struct literal_table_entry *table, const char *s,
+                  int isdir)
+{
+   struct literal_table_entry *ptr;
+
+   HASH_FIND(hh, table, s, strlen(s), ptr);
+   if (!ptr) return NO_RULE;
+
+   if (isdir && ptr->dir_rule < ptr->any_rule)
+      return ptr->dir_rule;
+   else
+      return ptr->any_rule;
+}
+
+
+static
+int has_wildcards(const char *s)
+{
+   return strpbrk(s, "*?[\\") != 0;
+}
+
+
+int exclude_add(const char *pat, int include)
+{
+   struct rule *rp;
+   char *s;
+   long len;
+
+   if (num_rules == max_rules) {
+      max_rules = (max_rules == 0) ? 64 : 2*max_rules;
+      rules = realloc(rules, max_rules*sizeof(struct rule));
+      glob_rules = realloc(glob_rules, max_rules*sizeof(long));
+      if (!rules || !glob_rules) {
+         Warning("malloc error");
+         exit(-1);
+      }
+   }
+
+   rp = &rules[num_rules];
+
+   rp->include = include;
+   rp->anchored = 0;
+   rp->dironly = 0;
+   rp->contents = 0;
+
+   if (*pat == '/') {
+      rp->anchored = 1;
+      pat++;
+   }
+
+   s = strdup(pat);
+   if (!s) {
+      Warning("malloc error");
+      exit(-1);
+   }
+
+   len = strlen(s);
+
+   if (len >= 4 && strcmp(s + len - 4, "/***") == 0) {
+      rp->contents = 1;
+      len -= 4;
+      s[len] = '\0';
+   }
+   else if (len >= 1 && s[len-1] == '/') {
+      rp->dironly = 1;
+      len--;
+      s[len] = '\0';
+   }
+
+   if (len == 0) {
+      free(s);
+      return -1;
+   }
+
+   rp->pat = s;
+   rp->fullpath = rp->anchored || strchr(s, '/') || strstr(s, "**");
+
+   if (rp->dironly) any_dironly = 1;
+
+   if (rp->contents || has_wildcards(s))
+      glob_rules[num_glob++] = num_rules;
+   else if (rp->anchored)
+      add_literal(&path_table, s, num_rules, rp->dironly);
+   else if (!rp->fullpath)
+      add_literal(&name_table, s, num_rules, rp->dironly);
+   else
+      glob_rules[num_glob++] = num_rules;
+
+   num_rules++;
+
+   return 0;
+}
+
+
+int exclude_add_file(const char *fname)
+{
+   FILE *fp;
+   char line[MAXLEN];
+   long len;
+   int ret;
+
+   if (strcmp(fname, "-") == 0)
+      fp = stdin;
+   else
+      fp = fopen(fname, "r");
+
+   if (!fp) {
+      WARN("can't open %s\n", fname);
+      return -1;
+   }
+
+   ret = 0;
+
+   while (fgets(line, MAXLEN, fp)) {
+      len = strlen(line);
+      if (len > 0 && line[len-1] == '\n') line[--len] = '\0';
+      if (len > 0 && line[len-1] == '\r') line[--len] = '\0';
+
+      if (len == 0 || line[0] == ';' || line[0] == '#') continue;
+
+      if (strncmp(line, "- ", 2) == 0)
+         ret = exclude_add(line + 2, 0);
+      else if (strncmp(line, "+ ", 2) == 0)
+         ret = exclude_add(line + 2, 1);
+      else
+         ret = exclude_add(line, 0);
+
+      if (ret) {
+         WARN("%s: bad pattern: %s\n", fname, line);
+         break;
+      }
+   }
+
+   if (ferror(fp)) {
+      WARN("error reading %s\n", fname);
+      ret = -1;
+   }
+
+   if (fp != stdin) fclose(fp);
+
+   return ret;
+}
+
+
+/* matches a character class; p points just past the [.
+ * Returns a pointer to the closing ], or null if there is none.
+ */
+
+static
+const char *match_class(const char *p, char c, int *matched)
+{
+   int negate, found;
+   char lo, hi;
+
+   negate = 0;
+   if (*p == '!' || *p == '^') {
+      negate = 1;
+      p++;
+   }
+
+   found = 0;
+
+   /* a ] right after the [ (or [!) stands for itself */
+
+   do {
+      if (!*p) return 0;
+
+      lo = *p;
+      if (lo == '\\' && p[1]) lo = *++p;
+
+      if (p[1] == '-' && p[2] && p[2] != ']') {
+         p += 2;
+         hi = *p;
+         if (hi == '\\' && p[1]) hi = *++p;
+         if (lo <= c && c <= hi) found = 1;
+      }
+      else if (c == lo) {
+         found = 1;
+      }
+
+      p++;
+   } while (*p != ']');
+
+   *matched = (found != negate) && c != '/';
+   return p;
+}
+
+
+static
+int wildmatch(const char *p, const char *t)
+{
+   const char *q;
+   int matched;
+
+   for (; *p; p++, t++) {
+      switch (*p) {
+
+      case '?':
+         if (!*t || *t == '/') return 0;
+         break;
+
+      case '*':
+         if (p[1] == '*') {
+            while (*p == '*') p++;
+            if (!*p) return 1;
+
+            for (; *t; t++)
+               if (wildmatch(p, t)) return 1;
+
+            return wildmatch(p, t);
+         }
+
+         p++;
+         if (!*p) return strchr(t, '/') == 0;
+
+         for (;; t++) {
+            if (wildmatch(p, t)) return 1;
+            if (!*t || *t == '/') return 0;
+         }
+
+      case '[':
+         if (!*t) return 0;
+
+         q = match_class(p + 1, *t, &matched);
+         if (q) {
+            if (!matched) return 0;
+            p = q;
+            break;
+         }
+
+         /* no closing ]: just a [ */
+
+         if (*t != '[') return 0;
+         break;
+
+      case '\\':
+         if (p[1]) p++;
+         if (*p != *t) return 0;
+         break;
+
+      default:
+         if (*p != *t) return 0;
+         break;
+      }
+   }
+
+   return *t == '\0';
+}
+
+
+static
+int match_one(const struct rule *rp, const char *path)
+{
+   const char *s;
+
+   if (!rp->fullpath) {
+      s = strrchr(path, '/');
+      return wildmatch(rp->pat, s ? s+1 : path);
+   }
+
+   if (rp->anchored) return wildmatch(rp->pat, path);
+
+   for (s = path; s; s = strchr(s, '/')) {
+      if (*s == '/') s++;
+      if (wildmatch(rp->pat, s)) return 1;
+   }
+
+   return 0;
+}
+
+
+static
+int match_rule(const struct rule *rp, const char *path, int isdir)
+{
+   char buf[MAXLEN];
+   char *s;
+
+   if (rp->dironly && !isdir) return 0;
+
+   if (match_one(rp, path)) return 1;
+
+   if (!rp->contents) return 0;
+
+   /* try the directories above */
+
+   if (snprintf(buf, MAXLEN, "%s", path) >= MAXLEN) overflow();
+
+   while ( (s = strrchr(buf, '/')) ) {
+      *s = '\0';
+      if (match_one(rp, buf)) return 1;
+   }
+
+   return 0;
+}
+
+
+int exclude_match(const char *path, int isdir)
+{
+   const char *name;
+   long best, r, i;
+
+   if (num_rules == 0) return 0;
+
+   name = strrchr(path, '/');
+   name = name ? name+1 : path;
+
+   best = find_literal(path_table, path, isdir);
+
+   r = find_literal(name_table, name, isdir);
+   if (r < best) best = r;
+
+   for (i = 0; i < num_glob && glob_rules[i] < best; i++) {
+      if (match_rule(&rules[glob_rules[i]], path, isdir)) {
+         best = glob_rules[i];
+         break;
+      }
+   }
+
+   if (best == NO_RULE) return 0;
+
+   return !rules[best].include;
+}
+
+
+int exclude_item(const char *path, const char *itemname, int d_type)
+{
+   struct stat itemstat;
+   int isdir;
+
+   if (num_rules == 0) return 0;
+
+   if (d_type != DT_UNKNOWN)
+      isdir = (d_type == DT_DIR);
+   else if (any_dironly && lstat(itemname, &itemstat) == 0)
+      isdir = S_ISDIR(itemstat.st_mode);
+   else
+      isdir = 0;
+
+   return exclude_match(path, isdir);
+}
@@ -0,0 +1,58 @@
+#ifndef XBUP__exclude_H
+#define XBUP__exclude_H
+
+/* exclude: rsync-style exclude rules for the tree walkers, so that
+ * excluded subtrees are pruned as the walk goes, rather than walked
+ * and then filtered out by rsync.
+ *
+ * The rules are those of rsync's --exclude and --exclude-from
+ * (without merge files, modifiers, or "!"):
+ *
+ *    a pattern starting with / is anchored at the root of the walk,
+ *      and is matched against the whole path;
+ *    otherwise, a pattern with a / (but for a trailing one) or a **
+ *      is matched against the end of the path, starting at a
+ *      component, and any other pattern against the last component;
+ *    a pattern ending with / only matches directories;
+ *    a pattern whose last component is *** matches the directory
+ *      named by the rest of it, and everything below that;
+ *    * matches anything but /, ** matches anything, ? matches any
+ *      character but /, [...] matches a character class, and a
+ *      backslash quotes the next character.
+ *
+ * Rules are tried in the order they were added, and the first that
+ * matches decides; an object that matches no rule is not excluded.
+ * In a file of rules, a line starting with "- " is an exclude rule,
+ * and one starting with "+ " an include rule (so the files that
+ * gen_pat writes can be used); blank lines, and lines starting with
+ * ; or #, are ignored, and any other line is an exclude pattern.
+ *
+ * Patterns without wildcards (the common case: /Library/Caches,
+ * node_modules, build/) are looked up in hash tables, keyed by path
+ * or by name, so the cost per object hardly grows with their number;
+ * only the others are matched one by one.
+ */
+
+/* exclude_add adds a rule; include is 1 for an include rule.
+ * exclude_add_file adds the rules in fname (- for stdin).
+ * Both return 0 on success, and -1 on error.
+ */
+
+int exclude_add(const char *pat, int include);
+int exclude_add_file(const char *fname);
+
+/* exclude_match returns 1 if path (relative to the root of the walk,
+ * without a leading /) is excluded, and 0 otherwise.
+ */
+
+int exclude_match(const char *path, int isdir);
+
+/* exclude_item is exclude_match for a directory entry whose type (as
+ * in struct dirent) is d_type; itemname (the full name of the entry)
+ * is only lstat'ed if d_type is DT_UNKNOWN, and the answer depends
+ * on whether it is a directory.
+ */
+
+int exclude_item(const char *path, const char *itemname, int d_type);
+
+#endif
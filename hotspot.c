@@ -0,0 +1,264 @@
+
+#include <pthread.h>
+#include <time.h>
+
+#include "util.h"
+#include "hotspot.h"
+
+
+struct hot {
+   long value;
+   char *path;
+};
+
+/* heaps[kind] is a min-heap of used[kind] entries, out of max_hot */
+
+static struct hot *heaps[HOTSPOT_KINDS];
+static long used[HOTSPOT_KINDS];
+static long max_hot = 0;
+
+static pthread_mutex_t hotspot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *titles[HOTSPOT_KINDS] = {
+   "directories by time (secs, not counting subdirectories)",
+   "directories by entries",
+   "objects by container size (bytes)",
+   "objects by xattrs"
+};
+
+static const char *json_names[HOTSPOT_KINDS] = {
+   "dir_time", "dir_entries", "size", "xattrs"
+};
+
+
+void hotspot_init(long n)
+{
+   int k;
+
+   for (k = 0; k < HOTSPOT_KINDS; k++) {
+      heaps[k] = (struct hot *) malloc(n * sizeof(struct hot));
+      if (!heaps[k]) {
+         Warning("malloc error");
+         exit(-1);
+      }
+      used[k] = 0;
+   }
+
+   max_hot = n;
+}
+
+
+long hotspot_time(void)
+{
+   struct timespec ts;
+
+   if (max_hot <= 0) return 0;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+
+static
+void sift_down(struct hot *h, long n, long i)
+{
+   struct hot tmp;
+   long c;
+
+   for (;;) {
+      c = 2*i + 1;
+      if (c >= n) return;
+      if (c+1 < n && h[c+1].value < h[c].value) c++;
+      if (h[i].value <= h[c].value) return;
+
+      tmp = h[i]; h[i] = h[c]; h[c] = tmp;
+      i = c;
+   }
+}
+
+static
+void sift_up(struct hot *h, long i)
+{
+   struct hot tmp;
+   long p;
+
+   while (i > 0) {
+      p = (i - 1) / 2;
+      if (h[p].value <= h[i].value) return;
+
+      tmp = h[i]; h[i] = h[p]; h[p] = tmp;
+      i = p;
+   }
+}
+
+
+void hotspot_add(int kind, long value, const char *path)
+{
+   struct hot *h;
+   char *p;
+
+   if (max_hot <= 0 || value <= 0) return;
+
+   pthread_mutex_lock(&hotspot_lock);
+
+   h = heaps[kind];
+
+   /* a full heap only takes values larger than its smallest */
+
+   if (used[kind] == max_hot && value <= h[0].value) {
+      pthread_mutex_unlock(&hotspot_lock);
+      return;
+   }
+
+   p = strdup(path);
+   if (!p) {
+      Warning("malloc error");
+      exit(-1);
+   }
+
+   if (used[kind] < max_hot) {
+      h[used[kind]].value = value;
+      h[used[kind]].path = p;
+      sift_up(h, used[kind]);
+      used[kind]++;
+   }
+   else {
+      free(h[0].path);
+      h[0].value = value;
+      h[0].path = p;
+      sift_down(h, max_hot, 0);
+   }
+
+   pthread_mutex_unlock(&hotspot_lock);
+}
+
+
+static
+int cmp_hot(const void *a, const void *b)
+{
+   const struct hot *x = (const struct hot *) a;
+   const struct hot *y = (const struct hot *) b;
+
+   if (x->value != y->value) return (x->value > y->value) ? -1 : 1;
+   return strcmp(x->path, y->path);
+}
+
+/* sorts the heaps, largest first; they are no longer heaps after that,
+ * so this is only done once the walk is over
+ */
+
+static
+void sort_heaps(void)
+{
+   int k;
+
+   for (k = 0; k < HOTSPOT_KINDS; k++)
+      qsort(heaps[k], used[k], sizeof(struct hot), cmp_hot);
+}
+
+
+void hotspot_report(FILE *fp, const char *tool)
+{
+   struct hot *h;
+   long i;
+   int k;
+
+   if (max_hot <= 0) return;
+
+   pthread_mutex_lock(&hotspot_lock);
+
+   sort_heaps();
+
+   fprintf(fp, "%s: hotspots\n", tool);
+
+   for (k = 0; k < HOTSPOT_KINDS; k++) {
+      fprintf(fp, "  %s:\n", titles[k]);
+
+      h = heaps[k];
+
+      for (i = 0; i < used[k]; i++) {
+         if (k == HOTSPOT_DIR_TIME)
+            fprintf(fp, "%14.3f  %s\n", h[i].value / 1e6, h[i].path);
+         else
+            fprintf(fp, "%14ld  %s\n", h[i].value, h[i].path);
+      }
+
+      if (used[k] == 0) fprintf(fp, "%14s\n", "-");
+   }
+
+   pthread_mutex_unlock(&hotspot_lock);
+}
+
+
+/* writes s as a JSON string; the bytes of a name that are not ASCII
+ * are passed through, as they are UTF-8 on HFS+ and APFS
+ */
+
+static
+void json_string(FILE *fp, const char *s)
+{
+   const unsigned char *p;
+
+   putc('"', fp);
+
+   for (p = (const unsigned char *) s; *p; p++) {
+      if (*p == '"' || *p == '\\')
+         fprintf(fp, "\\%c", *p);
+      else if (*p < 0x20)
+         fprintf(fp, "\\u%04x", *p);
+      else
+         putc(*p, fp);
+   }
+
+   putc('"', fp);
+}
+
+
+int hotspot_json(const char *fname, const char *tool)
+{
+   FILE *fp;
+   struct hot *h;
+   long i;
+   int k;
+
+   if (max_hot <= 0) return 0;
+
+   fp = fopen(fname, "w");
+   if (!fp) return -1;
+
+   pthread_mutex_lock(&hotspot_lock);
+
+   sort_heaps();
+
+   fprintf(fp, "{\n  \"tool\": ");
+   json_string(fp, tool);
+
+   for (k = 0; k < HOTSPOT_KINDS; k++) {
+      fprintf(fp, ",\n  \"%s\": [", json_names[k]);
+
+      h = heaps[k];
+
+      for (i = 0; i < used[k]; i++) {
+         fprintf(fp, "%s\n    { \"path\": ", i ? "," : "");
+         json_string(fp, h[i].path);
+
+         if (k == HOTSPOT_DIR_TIME)
+            fprintf(fp, ", \"value\": %.6f }", h[i].value / 1e6);
+         else
+            fprintf(fp, ", \"value\": %ld }", h[i].value);
+      }
+
+      fprintf(fp, "%s]", used[k] ? "\n  " : "");
+   }
+
+   fprintf(fp, "\n}\n");
+
+   pthread_mutex_unlock(&hotspot_lock);
+
+   if (ferror(fp)) {
+      fclose(fp);
+      return -1;
+   }
+
+   return fclose(fp) ? -1 : 0;
+}
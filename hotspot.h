@@ -0,0 +1,62 @@
+#ifndef XBUP__hotspot_H
+#define XBUP__hotspot_H
+
+/* hotspot: keeps the top n directories and objects of a walk by
+ * several measures, so that the few pathological ones that make a
+ * walk slow (a directory with a million entries, a file with a giant
+ * resource fork...) can be found, and excluded or restructured.
+ *
+ * The measures are:
+ *    HOTSPOT_DIR_TIME      the time spent on the entries of a directory,
+ *                          not counting its subdirectories (microseconds)
+ *    HOTSPOT_DIR_ENTRIES   the entries of a directory
+ *    HOTSPOT_SIZE          the size of the container of an object (bytes)
+ *    HOTSPOT_XATTRS        the xattrs of an object
+ *
+ * Each is a min-heap of n entries, so the memory used does not depend
+ * on the size of the tree, and a value that does not make the top n
+ * (which, once the heap is full, is nearly all of them) costs one
+ * comparison.
+ */
+
+#include <stdio.h>
+
+#define HOTSPOT_DIR_TIME    (0)
+#define HOTSPOT_DIR_ENTRIES (1)
+#define HOTSPOT_SIZE        (2)
+#define HOTSPOT_XATTRS      (3)
+
+#define HOTSPOT_KINDS (4)
+
+#define HOTSPOT_DEFAULT (10)
+
+/* hotspot_init starts keeping the top n of each measure; until it
+ * is called, hotspot_add does nothing.
+ */
+
+void hotspot_init(long n);
+
+/* hotspot_add offers value for path; values <= 0 are ignored.
+ * May be called from any thread.
+ */
+
+void hotspot_add(int kind, long value, const char *path);
+
+/* hotspot_time returns a monotonic time in microseconds, to measure
+ * HOTSPOT_DIR_TIME with (0 until hotspot_init is called)
+ */
+
+long hotspot_time(void);
+
+/* hotspot_report prints the top n of each measure, largest first,
+ * to fp; hotspot_json writes them to the file fname as a JSON object
+ *    { "tool": tool, "dir_time": [ { "path": p, "value": v }, ... ],
+ *      "dir_entries": [...], "size": [...], "xattrs": [...] }
+ * with dir_time in seconds.  hotspot_json returns 0 on success, and
+ * -1 on error.
+ */
+
+void hotspot_report(FILE *fp, const char *tool);
+int hotspot_json(const char *fname, const char *tool);
+
+#endif
@@ -0,0 +1,137 @@
+
+#include <pthread.h>
+
+#include "util.h"
+#include "uthash.h"
+#include "inodes.h"
+
+
+struct inode_key {
+   uint64_t dev;
+   uint64_t ino;
+};
+
+/* state is 0 while the first link is being worked on, 1 once it
+ * is done, and -1 if it failed (the next link takes over)
+ */
+
+struct inode_table_entry {
+   struct inode_key key;
+   int state;
+   long links_left;
+   char *name;
+   UT_hash_handle hh;
+};
+
+static
+struct inode_table_entry *inode_table = NULL;
+
+static pthread_mutex_t inode_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t inode_cond = PTHREAD_COND_INITIALIZER;
+
+
+static
+int is_shared(const struct stat *st)
+{
+   return !S_ISDIR(st->st_mode) && st->st_nlink > 1;
+}
+
+
+int inode_lookup(const struct stat *st, char *name)
+{
+   struct inode_key key;
+   struct inode_table_entry *ptr;
+   int ret;
+
+   if (!is_shared(st)) return 0;
+
+   memset(&key, 0, sizeof(key));
+   key.dev = st->st_dev;
+   key.ino = st->st_ino;
+
+   pthread_mutex_lock(&inode_lock);
+
+   HASH_FIND(hh, inode_table, &key, sizeof(struct inode_key), ptr);
+
+   if (!ptr) {
+      ptr = malloc(sizeof(struct inode_table_entry));
+      if (!ptr) {
+         Warning("malloc error");
+         exit(-1);
+      }
+
+      ptr->key = key;
+      ptr->state = 0;
+      ptr->links_left = st->st_nlink;
+      ptr->name = 0;
+      HASH_ADD(hh, inode_table, key, sizeof(struct inode_key), ptr);
+   }
+   else {
+      while (ptr->state == 0)
+         pthread_cond_wait(&inode_cond, &inode_lock);
+   }
+
+   if (ptr->state == -1) {
+      ptr->state = 0;  /* this link takes over */
+      ret = 0;
+   }
+   else if (ptr->state == 0) {
+      ret = 0;  /* first link */
+   }
+   else {
+      if (snprintf(name, MAXLEN, "%s", ptr->name ? ptr->name : "") >= MAXLEN)
+         overflow();
+      ret = 1;
+   }
+
+   ptr->links_left--;
+
+   if (ret == 1 && ptr->links_left <= 0) {
+      HASH_DEL(inode_table, ptr);
+      free(ptr->name);
+      free(ptr);
+   }
+
+   pthread_mutex_unlock(&inode_lock);
+
+   return ret;
+}
+
+
+void inode_done(const struct stat *st, const char *name, int ok)
+{
+   struct inode_key key;
+   struct inode_table_entry *ptr;
+
+   if (!is_shared(st)) return;
+
+   memset(&key, 0, sizeof(key));
+   key.dev = st->st_dev;
+   key.ino = st->st_ino;
+
+   pthread_mutex_lock(&inode_lock);
+
+   HASH_FIND(hh, inode_table, &key, sizeof(struct inode_key), ptr);
+
+   if (ptr) {
+      if (ok && name) {
+         ptr->name = strdup(name);
+         if (!ptr->name) {
+            Warning("malloc error");
+            exit(-1);
+         }
+      }
+
+      ptr->state = ok ? 1 : -1;
+
+      if (ptr->links_left <= 0) {
+         HASH_DEL(inode_table, ptr);
+         free(ptr->name);
+         free(ptr);
+      }
+
+      pthread_cond_broadcast(&inode_cond);
+   }
+
+   pthread_mutex_unlock(&inode_lock);
+}
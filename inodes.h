@@ -0,0 +1,36 @@
+#ifndef XBUP__inodes_H
+#define XBUP__inodes_H
+
+#include <sys/stat.h>
+
+/* inodes: a table, keyed by (dev, inode), of the objects with more
+ * than one link that a tree walker has come across, so that the
+ * metadata of each is read (or restored) only once, at the first of
+ * its links; the other links then reuse what was done for it.
+ *
+ * Objects with a single link, and directories, are never entered,
+ * and cost nothing.  An entry is dropped once all of the links of
+ * its object have been seen.  Both functions may be called from any
+ * thread.
+ */
+
+/* inode_lookup returns 0 if st is the first link of its object to be
+ * looked up; the caller then does the work for it, and must call
+ * inode_done.  Otherwise, it waits until inode_done has been called
+ * for the first link, and returns 1, with the name that was passed to
+ * inode_done copied into name (of length MAXLEN), or "" if none was;
+ * but if the first link failed, it returns 0, and the caller does the
+ * work after all (and must call inode_done in turn).
+ */
+
+int inode_lookup(const struct stat *st, char *name);
+
+/* inode_done records that the work for the first link of st is over;
+ * name (which may be null) is whatever the other links should reuse
+ * (split_xattr: the container written for it), and ok is 0 if the
+ * work failed.
+ */
+
+void inode_done(const struct stat *st, const char *name, int ok);
+
+#endif
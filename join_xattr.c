@@ -1,6 +1,10 @@
 
 /* usage: join_xattr options srcdir dstdir
  *    options:  --files-from file 
+ *              --sorted
+ *              --exclude pattern
+ *              --exclude-from file
+ *              --one-file-system
  *              --acl
  *              --owner oname
  *              --group gname
@@ -9,6 +13,18 @@
  *              --ignore-uuids
  *              --usermap map
  *              --groupmap map
+ *              --max-ops n
+ *              --max-meta-ops n
+ *              --max-bytes n
+ *              --throttle-file file
+ *              --nice n
+ *              --low-io
+ *              --progress file
+ *              --hotspots n
+ *              --hotspots-json file
+ *              --journal file
+ *              --resume
+ *              --deadline secs
  * 
  * this "undoes" split_xattr, setting xattrs in srcdir
  * based on the xattr container appearing files in dstdir.
@@ -17,6 +33,17 @@
  * with the --files-from flag, the only files in srcdir that
  * are examined are those listed in file.
  *
+ * the --sorted flag causes the entries of each directory to be
+ * visited in sorted (strcmp) order, rather than in readdir order.
+ *
+ * the --exclude and --exclude-from options add rsync-style exclude
+ * rules (see exclude.h), in the order given; they are matched against
+ * paths relative to srcdir, and excluded directories are not walked.
+ *
+ * the --one-file-system flag keeps the walk on the file system of
+ * srcdir: the metadata of a mount point itself is restored, but
+ * it is not walked.
+ *
  * with the --acl flag, acls are restored
  *
  * the --owner flag causes the file owner to be restored;
@@ -47,29 +74,109 @@
  * The --usermap and --groupmap options allow translation
  * of users/groups
  *
- * Returns -1 if errors detected, and 0 otherwise.
+ * the --max-ops, --max-meta-ops and --max-bytes options limit the walk
+ * to about n objects, n metadata operations (lstat, setxattr, lchown,
+ * the ACL calls...), and n bytes of containers read, per second (see
+ * throttle.h), so that a restore can run alongside other work.  The
+ * --throttle-file, --nice and --low-io options are as in split_xattr.
+ *
+ * with the --progress file option, the objects walked, the containers
+ * applied, the rate and an estimate of the time left are written to
+ * file every few seconds (see progress.h).
+ *
+ * the --hotspots n and --hotspots-json file options are as in
+ * split_xattr, with the containers applied in place of those written.
+ *
+ * with the --journal file option, the directories that are finished
+ * are recorded in file, every few seconds (see checkpoint.h); with
+ * the --resume flag as well, an interrupted run is carried on, 
+ * skipping the directories recorded in file.  The same options must
+ * be given each time, but for those that only say how the run is
+ * carried out (--resume, --deadline, --progress, the throttling
+ * options, --nice, --low-io and the hotspot options).
+ *
+ * the --deadline flag makes join_xattr stop, cleanly, after secs
+ * seconds; with --journal, the run can then be resumed later.
+ *
+ * The metadata of a file with several links is only restored once,
+ * at the first of its links that is visited (see inodes.h).
+ *
+ * Returns -1 if errors detected, 1 if stopped at the deadline,
+ * and 0 otherwise.
  *
  */
 
 #include "util.h"
 #include "xattr_util.h"
+#include "dirscan.h"
+#include "exclude.h"
+#include "checkpoint.h"
+#include "inodes.h"
+#include "throttle.h"
+#include "progress.h"
+#include "hotspot.h"
 
 
 static int aclflag=0;
 static owner_prefs_t oprefs;
 
 static int return_value = 0;
+static int sortedflag = 0;
+static int xdevflag = 0;
+static dev_t root_dev = 0;
+static int journalflag = 0;
+static int stopped = 0;
+static long error_count = 0;
+static long flushed_errors = 0;
 static int source_name_len = 0;
 static char *destination_name = 0;
 
 static char dblname[MAXLEN];
 
+
+static
+void set_error(void)
+{
+   return_value = -1;
+   error_count++;
+}
+
+
+/* the directories finished are recorded in batches, and a batch
+ * is dropped if any errors were detected while it was being done
+ */
+
+static
+void save_checkpoint(void)
+{
+   if (checkpoint_flush(error_count == flushed_errors)) {
+      WARN("join_xattr: failed to write journal\n");
+      set_error();
+   }
+
+   flushed_errors = error_count;
+}
+
 void process_xattrs(const char *itemname, const struct stat *itemstat, 
                     const char *dirname, const char *basename)
 {
    int has_d;
+   int ok;
    struct stat dblstat;
+   char firstname[MAXLEN];
+   long ops, bytes;
+
+
+   /* the other links of an object with several links share
+    * whatever was restored for the first one
+    */
 
+   if (inode_lookup(itemstat, firstname)) return;
+
+   ok = 1;
+
+   ops = xattr_meta_ops;
+   bytes = xattr_io_bytes;
 
    if (snprintf(dblname, MAXLEN, "%s%s/%s%s", 
       destination_name, 
@@ -85,35 +192,66 @@ void process_xattrs(const char *itemname, const struct stat *itemstat,
        if (join_xattr(itemname, itemstat, dn, aclflag, &oprefs)) {
 
           WARN("join_xattr: error processing %s\n", itemname);
-          return_value = -1;
+          set_error();
+          ok = 0;
 
        }
+       else if (has_d) {
+          progress_item(dblstat.st_size);
+          hotspot_add(HOTSPOT_SIZE, dblstat.st_size, itemname);
+          hotspot_add(HOTSPOT_XATTRS, xattr_count, itemname);
+       }
 
    }
+
+   inode_done(itemstat, 0, ok);
+
+   /* the lstat of the object was charged by the walker, the lstat of
+    * its container is charged here
+    */
+
+   throttle(THROTTLE_OPS, 1 + xattr_meta_ops - ops);
+   throttle(THROTTLE_BYTES, xattr_io_bytes - bytes);
 }
 
 void dirwalk(const char *dirname, const struct stat *dirstat, int walk_state)
 {
    char itemname[MAXLEN];
-   DIR *dirlist;
-   struct dirent *diritem; 
+   dirscan_t *dirlist;
+   struct dirscan_item *diritem;
    struct stat itemstat;
    int walk_state1;
+   long errors;
+   long start, below, t, entries;
 
 
-   dirlist = opendir(dirname);
+   errors = error_count;
+
+   progress_current(dirname);
+
+   start = hotspot_time();
+   below = 0;
+   entries = 0;
+
+   dirlist = dirscan_open(dirname, sortedflag);
 
    if (!dirlist) {
       WARN("join_xattr: opendir failed on %s\n", dirname);
-      return_value = -1;
+      set_error();
       return;
    }
 
-   while ( (diritem = readdir(dirlist)) ) {
+   while ( (diritem = dirscan_next(dirlist)) ) {
 
-      if (strcmp(diritem->d_name, ".") == 0 
-          || strcmp(diritem->d_name, "..") == 0)
-         continue;
+      if (checkpoint_expired()) {
+         stopped = 1;
+         break;
+      }
+
+      throttle(THROTTLE_OBJECTS, 1);
+      throttle(THROTTLE_OPS, 1);
+      progress_object();
+      entries++;
 
       if (snprintf(itemname, MAXLEN, "%s/%s", 
           dirname, diritem->d_name) >= MAXLEN) overflow();
@@ -125,9 +263,12 @@ void dirwalk(const char *dirname, const struct stat *dirstat, int walk_state)
 	    if (walk_state1 == -1) continue; /* pruning */
       }
 
+      if (exclude_item(itemname + source_name_len + 1, 
+                       itemname, diritem->d_type)) continue;
+
       if (lstat(itemname, &itemstat)) {
          WARN("join_xattr: lstat failed on %s\n", itemname);
-         return_value = -1;
+         set_error();
          continue;
       }
 
@@ -142,21 +283,50 @@ void dirwalk(const char *dirname, const struct stat *dirstat, int walk_state)
       }
 
       if (S_ISDIR(itemstat.st_mode)) {
+         if (xdevflag && itemstat.st_dev != root_dev) {
+            /* a mount point: just the directory itself */
+            process_xattrs(itemname, &itemstat, itemname, ".");
+            continue;
+         }
+
+         if (checkpoint_is_done(itemname + source_name_len)) continue;
+
+         t = hotspot_time();
 	 dirwalk(itemname, &itemstat, walk_state1);
+         below += hotspot_time() - t;
+         if (stopped) break;
       }
 
    }
 
-   closedir(dirlist);
+   if (dirscan_close(dirlist)) {
+      WARN("join_xattr: readdir failed on %s\n", dirname);
+      set_error();
+   }
+
+   if (stopped) return;
 
    process_xattrs(dirname, dirstat, dirname, ".");
 
+   if (journalflag) {
+      if (error_count == errors) 
+         checkpoint_done(dirname + source_name_len);
+
+      if (checkpoint_due()) save_checkpoint();
+   }
+
+   hotspot_add(HOTSPOT_DIR_TIME, hotspot_time() - start - below, dirname);
+   hotspot_add(HOTSPOT_DIR_ENTRIES, entries, dirname);
 }
 
 void usage()
 {
    WARN("usage: join_xattr options srcdir dstdir\n");
    WARN("  option: --files-from file\n");
+   WARN("          --sorted\n");
+   WARN("          --exclude pattern\n");
+   WARN("          --exclude-from file\n");
+   WARN("          --one-file-system\n");
    WARN("          --acl\n");
    WARN("          --owner oname\n");
    WARN("          --group gname\n");
@@ -165,6 +335,18 @@ void usage()
    WARN("          --ignore-uuids\n");
    WARN("          --usermap map\n");
    WARN("          --groupmap map\n");
+   WARN("          --max-ops n\n");
+   WARN("          --max-meta-ops n\n");
+   WARN("          --max-bytes n\n");
+   WARN("          --throttle-file file\n");
+   WARN("          --nice n\n");
+   WARN("          --low-io\n");
+   WARN("          --progress file\n");
+   WARN("          --hotspots n\n");
+   WARN("          --hotspots-json file\n");
+   WARN("          --journal file\n");
+   WARN("          --resume\n");
+   WARN("          --deadline secs\n");
 }
 
 
@@ -178,6 +360,17 @@ int main(int argc, char **argv)
    char *owner_name, *group_name;
    int owner_status;
    char *usermap, *groupmap;
+   char *jname;
+   int resumeflag;
+   long deadline;
+   char *tag;
+   long max_ops, max_meta_ops, max_bytes;
+   char *tname;
+   long nice_incr;
+   int lowioflag;
+   char *pname;
+   long hotspots;
+   char *hname;
 
    int i;
 
@@ -185,6 +378,18 @@ int main(int argc, char **argv)
    owner_name = 0;
    group_name = 0;
    usermap = groupmap = 0;
+   jname = 0;
+   resumeflag = 0;
+   deadline = 0;
+   max_ops = 0;
+   max_meta_ops = 0;
+   max_bytes = 0;
+   tname = 0;
+   nice_incr = 0;
+   lowioflag = 0;
+   pname = 0;
+   hotspots = 0;
+   hname = 0;
 
    i = 1;
    while (i < argc) {
@@ -197,6 +402,35 @@ int main(int argc, char **argv)
          fname = argv[i];
          i++;
       }
+      else if (strcmp(argv[i], "--sorted") == 0) {
+         i++;
+         sortedflag = 1;
+      }
+      else if (strcmp(argv[i], "--exclude") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         if (exclude_add(argv[i], 0)) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--exclude-from") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         if (exclude_add_file(argv[i])) return -1;
+         i++;
+      }
+      else if (strcmp(argv[i], "--one-file-system") == 0) {
+         i++;
+         xdevflag = 1;
+      }
       else if (strcmp(argv[i], "--acl") == 0) {
          i++;
          aclflag = 1;
@@ -249,12 +483,134 @@ int main(int argc, char **argv)
          groupmap = argv[i];
          i++;
       }
+      else if (strcmp(argv[i], "--journal") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         jname = argv[i];
+         i++;
+      }
+      else if (strcmp(argv[i], "--resume") == 0) {
+         i++;
+         resumeflag = 1;
+      }
+      else if (strcmp(argv[i], "--deadline") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         deadline = string_to_long(argv[i]);
+         if (conversion_error || deadline < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--max-ops") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         max_ops = string_to_long(argv[i]);
+         if (conversion_error || max_ops < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--max-meta-ops") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         max_meta_ops = string_to_long(argv[i]);
+         if (conversion_error || max_meta_ops < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--max-bytes") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         max_bytes = string_to_long(argv[i]);
+         if (conversion_error || max_bytes < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--throttle-file") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         tname = argv[i];
+         i++;
+      }
+      else if (strcmp(argv[i], "--nice") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         nice_incr = string_to_long(argv[i]);
+         if (conversion_error || nice_incr < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--low-io") == 0) {
+         i++;
+         lowioflag = 1;
+      }
+      else if (strcmp(argv[i], "--progress") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         pname = argv[i];
+         i++;
+      }
+      else if (strcmp(argv[i], "--hotspots") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         hotspots = string_to_long(argv[i]);
+         if (conversion_error || hotspots < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--hotspots-json") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         hname = argv[i];
+         i++;
+      }
 
       else
          break;
    }
 
-   if (i != argc-2) {
+   if (i != argc-2 || (resumeflag && !jname)) {
       usage();
       return -1;
    }
@@ -282,6 +638,8 @@ int main(int argc, char **argv)
       return -1;
    }
 
+   root_dev = srcstat.st_dev;
+
    if (lstat(dstname, &dststat) || !S_ISDIR(dststat.st_mode)) {
       usage();
       return -1;
@@ -301,7 +659,58 @@ int main(int argc, char **argv)
       return -1;
    }
 
-   dirwalk(srcname, &srcstat, walk_state);
+   if (jname) {
+      tag = checkpoint_tag("join_xattr", argc, argv);
+
+      if (checkpoint_open(jname, tag, resumeflag)) {
+         WARN("join_xattr: bad journal %s\n", jname);
+         return -1;
+      }
+      free(tag);
+      journalflag = 1;
+   }
+
+   throttle_init(THROTTLE_OBJECTS, max_ops);
+   throttle_init(THROTTLE_OPS, max_meta_ops);
+   throttle_init(THROTTLE_BYTES, max_bytes);
+
+   if (tname && throttle_control(tname)) {
+      WARN("join_xattr: bad throttle file %s\n", tname);
+      return -1;
+   }
+
+   if (throttle_priority(nice_incr, lowioflag))
+      WARN("join_xattr: could not lower priority\n");
+
+   if (pname && progress_open(pname, "join_xattr"))
+      WARN("join_xattr: failed to write %s\n", pname);
+
+   if (hname && hotspots == 0) hotspots = HOTSPOT_DEFAULT;
+   if (hotspots > 0) hotspot_init(hotspots);
+
+   checkpoint_deadline(deadline);
+
+   if (!checkpoint_is_done(""))
+      dirwalk(srcname, &srcstat, walk_state);
+
+   if (journalflag) {
+      save_checkpoint();
+      if (checkpoint_close()) set_error();
+   }
+
+   progress_close(!stopped);
+
+   if (hotspots > 0) hotspot_report(stderr, "join_xattr");
+
+   if (hname && hotspot_json(hname, "join_xattr")) {
+      WARN("join_xattr: failed to write %s\n", hname);
+      set_error();
+   }
+
+   if (stopped) {
+      WARN("join_xattr: deadline reached -- stopped early\n");
+      return (return_value ? -1 : 1);
+   }
 
    return return_value;
 
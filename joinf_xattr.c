@@ -8,9 +8,23 @@
  *              --ignore-uuids
  *              --usermap map
  *              --groupmap map
+ *              --jobs n
+ *              --reset
+ *              --files-from file
+ *              --exclude pattern
+ *              --exclude-from file
+ *              --max-ops n
+ *              --max-meta-ops n
+ *              --max-bytes n
+ *              --throttle-file file
+ *              --nice n
+ *              --low-io
+ *              --progress file
  * 
  * this "undoes" splitf_xattr, setting xattrs in srcdir
  * based on the xattr containers appearing in stdin.
+ * An entry whose path is "." (and which has no container) marks
+ * the end of the stream; see splitf_xattr --merge and packf_xattr.
  *
  * the --acl flag cause the acl of each file to be restored
  *
@@ -42,16 +56,66 @@
  * The --usermap and --groupmap options allow translation
  * of users/groups
  *
+ * the --jobs flag applies the containers in a pipelined fashion:
+ * the main thread frames the entries in stdin into a bounded ring
+ * of memory buffers, and n worker threads apply them concurrently.
+ * An entry is not applied until all entries below it in the
+ * stream (i.e., the children of a directory, which splitf_xattr
+ * always writes before the directory itself) have been applied.
+ *
+ * the --reset flag causes the objects in srcdir that had no entry
+ * in the stream to be reset (their xattrs, ACLs, etc. removed) if
+ * need be, just as join_xattr does for objects without a container;
+ * this is done once the end of the stream has been reached, and
+ * only if the stream ends with the "." entry written by packf_xattr,
+ * so that a stream cut short never causes anything to be reset.
+ *
+ * with the --files-from file option, only those files and
+ * directories listed in file (and the directories above them)
+ * are reset by --reset; the entries in the stream are applied
+ * in any case.
+ *
+ * the --exclude and --exclude-from options add rsync-style exclude
+ * rules (see exclude.h), which keep --reset away from the objects
+ * they exclude (those that were excluded from the backup, say); the
+ * entries in the stream are applied in any case.
+ *
+ * the --max-ops, --max-meta-ops and --max-bytes options limit the
+ * objects restored (or reset), the metadata operations made on them,
+ * and the bytes of containers read, to about n per second each (see
+ * throttle.h); since a reader of the stream is throttled, so is the
+ * writer at the other end.  The --throttle-file, --nice and --low-io
+ * options are as in split_xattr.
+ *
+ * with the --progress file option, the objects restored (or reset),
+ * the entries applied, the rate and an estimate of the time left are
+ * written to file every few seconds (see progress.h).
+ *
  * Returns -1 if errors detected, and 0 otherwise.
  *
  */
 
+#include <pthread.h>
+
 #include "util.h"
 #include "xattr_util.h"
+#include "dirscan.h"
+#include "exclude.h"
+#include "throttle.h"
+#include "progress.h"
+#include "uthash.h"
 
 
 static char magic[8] = { 0xb7, 0x0e, 0xbf, 0xb2, 0xc2, 0x91, 0xf2, 0x92 };
 
+static char *source_name = 0;
+static int source_name_len = 0;
+static int aclflag = 0;
+static int resetflag = 0;
+static int stream_complete = 0;
+static int stream_read = 0;     /* to its end, with no fatal error */
+static owner_prefs_t oprefs;
+
 
 void usage()
 {
@@ -64,6 +128,18 @@ void usage()
    WARN("          --ignore-uuids\n");
    WARN("          --usermap map\n");
    WARN("          --groupmap map\n");
+   WARN("          --jobs n\n");
+   WARN("          --reset\n");
+   WARN("          --files-from file\n");
+   WARN("          --exclude pattern\n");
+   WARN("          --exclude-from file\n");
+   WARN("          --max-ops n\n");
+   WARN("          --max-meta-ops n\n");
+   WARN("          --max-bytes n\n");
+   WARN("          --throttle-file file\n");
+   WARN("          --nice n\n");
+   WARN("          --low-io\n");
+   WARN("          --progress file\n");
 }
 
 
@@ -71,26 +147,541 @@ static char extension[MAXLEN];
 static char itemname[MAXLEN];
 
 
-int main(int argc, char **argv)
+/**** with --reset, the paths of the entries in the stream */
+
+struct seen_table_entry {
+   char *key;
+   UT_hash_handle hh;
+};
+
+static
+struct seen_table_entry *seen_table = NULL;
+
+static
+void add_seen(const char *s)
 {
-   char *srcname;
-   struct stat srcstat, itemstat;
-   int srcname_len;
-   char mbuf[8];
+   struct seen_table_entry *p;
+
+   HASH_FIND(hh, seen_table, s, strlen(s), p);
+   if (p) return;
+
+   p = malloc(sizeof(struct seen_table_entry));
+   if (!p) {
+      Warning("malloc error");
+      exit(-1);
+   }
+
+   p->key = strdup(s);
+   if (!p->key) {
+      Warning("malloc error");
+      exit(-1);
+   }
+
+   HASH_ADD_KEYPTR(hh, seen_table, p->key, strlen(p->key), p);
+}
+
+static
+int is_seen(const char *s)
+{
+   struct seen_table_entry *p;
+
+   HASH_FIND(hh, seen_table, s, strlen(s), p);
+   return p != 0;
+}
+
+
+/* charges an object to the throttles: its lstat, and the metadata
+ * operations and bytes of containers counted (see xattr_util.h)
+ * since ops and bytes were taken; and counts it as done
+ */
+
+static
+void charge(long ops, long bytes)
+{
+   throttle(THROTTLE_OBJECTS, 1);
+   throttle(THROTTLE_OPS, 1 + xattr_meta_ops - ops);
+   throttle(THROTTLE_BYTES, xattr_io_bytes - bytes);
+   progress_object();
+}
+
+
+/* reset_xattrs does for an object with no entry in the stream what
+ * join_xattr does for an object with no container.
+ */
+
+static
+int reset_xattrs(const char *name, const struct stat *itemstat)
+{
+   long ops, bytes;
+   int ret;
+
+   ops = xattr_meta_ops;
+   bytes = xattr_io_bytes;
+
+   ret = 0;
+
+   if (!is_seen(name + source_name_len) &&
+       need_reset(name, itemstat, aclflag, &oprefs) &&
+       join_xattr(name, itemstat, 0, aclflag, &oprefs)) {
+      WARN("joinf_xattr: error resetting %s\n", name);
+      ret = -1;
+   }
+
+   charge(ops, bytes);
+
+   return ret;
+}
+
+static
+int reset_walk(const char *dirname, const struct stat *dirstat, int walk_state)
+{
+   char name[MAXLEN];
+   dirscan_t *dirlist;
+   struct dirscan_item *diritem;
+   struct stat itemstat;
+   int walk_state1;
+   int ret;
+
+   ret = 0;
+
+   progress_current(dirname);
+
+   dirlist = dirscan_open(dirname, 0);
+
+   if (!dirlist) {
+      WARN("joinf_xattr: opendir failed on %s\n", dirname);
+      return -1;
+   }
+
+   while ( (diritem = dirscan_next(dirlist)) ) {
+
+      if (snprintf(name, MAXLEN, "%s/%s", 
+          dirname, diritem->d_name) >= MAXLEN) overflow();
+
+      walk_state1 = walk_state;
+
+      if (walk_state1 == 0) {
+	    walk_state1 = lookup_name(name + source_name_len + 1);
+	    if (walk_state1 == -1) continue; /* pruning */
+      }
+
+      if (exclude_item(name + source_name_len + 1, 
+                       name, diritem->d_type)) continue;
+
+      if (lstat(name, &itemstat)) {
+         WARN("joinf_xattr: lstat failed on %s\n", name);
+         ret = -1;
+         continue;
+      }
+
+      if (walk_state1 == 1 && !S_ISDIR(itemstat.st_mode)) {
+         if (reset_xattrs(name, &itemstat)) ret = -1;
+      }
+
+      if (S_ISDIR(itemstat.st_mode)) {
+	 if (reset_walk(name, &itemstat, walk_state1)) ret = -1;
+      }
+   }
+
+   if (dirscan_close(dirlist)) {
+      WARN("joinf_xattr: readdir failed on %s\n", dirname);
+      ret = -1;
+   }
+
+   if (reset_xattrs(dirname, dirstat)) ret = -1;
+
+   return ret;
+}
+
+
+/* The ring used by --jobs.  
+ * Each slot holds one entry of the input stream, and goes from
+ * SLOT_FREE (owned by the reader) to SLOT_READY (framed, waiting for
+ * a worker) to SLOT_BUSY (being applied) and back to SLOT_FREE.
+ * Slots are filled and taken in stream order, but may be released
+ * in any order.
+ */
+
+#define MAXJOBS (256)
+#define SLOTS_PER_JOB (4)
+
+#define SLOT_FREE  (0)
+#define SLOT_READY (1)
+#define SLOT_BUSY  (2)
+
+struct slot {
+   int state;
+   long seq;
+   char ext[MAXLEN];
+   char *buf;
+   size_t len;
+};
+
+static struct slot *ring = 0;
+static long num_slots = 0;
+static long ring_head = 0; /* seq of next slot to be taken by a worker */
+static long ring_tail = 0; /* seq of next slot to be filled by the reader */
+static int ring_eof = 0;
+static int ring_fatal = 0;
+static int ring_retval = 0;
+
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ring_cond = PTHREAD_COND_INITIALIZER;
+
+
+/* returns 1 if the entry ext lies strictly below the entry dir */
+
+static
+int is_below(const char *ext, const char *dir)
+{
+   long len = strlen(dir);
+
+   return strncmp(ext, dir, len) == 0 && ext[len] == '/';
+}
+
+/* returns 1 if some earlier entry below sp is still being applied;
+ * ring_lock must be held.
+ */
+
+static
+int pending_below(const struct slot *sp)
+{
+   long i;
+
+   for (i = 0; i < num_slots; i++) {
+      if (ring[i].state == SLOT_BUSY && ring[i].seq < sp->seq &&
+          is_below(ring[i].ext, sp->ext))
+         return 1;
+   }
+
+   return 0;
+}
+
+
+static
+void *worker(void *arg)
+{
+   char name[MAXLEN];
+   struct stat itemstat;
+   struct slot *sp;
+   FILE *cfp;
+   long ops, bytes;
+   int ret;
+
+   for (;;) {
+      pthread_mutex_lock(&ring_lock);
+
+      for (;;) {
+         if (ring_fatal || (ring_eof && ring_head == ring_tail)) {
+            pthread_mutex_unlock(&ring_lock);
+            return 0;
+         }
+
+         sp = &ring[ring_head % num_slots];
+         if (ring_head < ring_tail && sp->state == SLOT_READY) break;
+
+         pthread_cond_wait(&ring_cond, &ring_lock);
+      }
+
+      sp->state = SLOT_BUSY;
+      ring_head++;
+      pthread_cond_broadcast(&ring_cond);
+
+      while (!ring_fatal && pending_below(sp)) 
+         pthread_cond_wait(&ring_cond, &ring_lock);
+
+      /* as in the serial path, nothing is applied past a fatal error */
+
+      if (ring_fatal) {
+         free(sp->buf);
+         sp->buf = 0;
+         sp->state = SLOT_FREE;
+         pthread_cond_broadcast(&ring_cond);
+         pthread_mutex_unlock(&ring_lock);
+         continue;
+      }
+
+      pthread_mutex_unlock(&ring_lock);
+
+      if (snprintf(name, MAXLEN, "%s%s", source_name, sp->ext) >= MAXLEN) 
+         overflow();
+
+      ret = 0;
+
+      ops = xattr_meta_ops;
+      bytes = xattr_io_bytes;
+
+      progress_current(name);
+
+      if (!lstat(name, &itemstat)) {
+         cfp = fmemopen(sp->buf, sp->len, "r");
+         if (!cfp) {
+            WARNING;
+            ret = -2;
+         }
+         else {
+            ret = join_xattr_fp(name, &itemstat, cfp, aclflag, &oprefs);
+            fclose(cfp);
+            if (ret == 0) progress_item(xattr_io_bytes - bytes);
+         }
+      }
+
+      charge(ops, bytes);
+
+      if (ret) {
+         if (ret == -1) 
+            WARN("recoverble error processing %s -- continuing\n", name); 
+         else 
+            WARN("unrecoverble error processing %s -- aborting\n", name); 
+      }
+
+      pthread_mutex_lock(&ring_lock);
+
+      if (ret == -1) ring_retval = -1;
+      if (ret == -2) ring_fatal = 1;
+
+      free(sp->buf);
+      sp->buf = 0;
+      sp->state = SLOT_FREE;
+      pthread_cond_broadcast(&ring_cond);
+
+      pthread_mutex_unlock(&ring_lock);
+   }
+}
+
+
+/* reads the entries in stdin into the ring, and returns when
+ * the input is exhausted or a fatal error occurs.
+ */
+
+static
+int reader(void)
+{
+   struct slot *sp;
+   FILE *ofp;
+   int c, k, ret;
+
+   for (;;) {
+
+      c = getchar();
+      if (c == EOF) {
+         stream_read = 1;
+         return 0;
+      }
+
+      pthread_mutex_lock(&ring_lock);
+
+      sp = &ring[ring_tail % num_slots];
+      while (!ring_fatal && sp->state != SLOT_FREE) 
+         pthread_cond_wait(&ring_cond, &ring_lock);
+
+      ret = ring_fatal;
+      pthread_mutex_unlock(&ring_lock);
+
+      if (ret) return -1;
+
+      k = 0;
+      for (;;) {
+         if (c == EOF) return -1;
+         if (k >= MAXLEN) {
+            WARN("buffer overflow\n");
+            return -1;
+         }
+         sp->ext[k] = c; 
+         k++;
+         if (c == 0) break;
+         c = getchar();
+      }
+
+      if (strcmp(sp->ext, ".") == 0) {
+         stream_complete = 1;
+         stream_read = 1;
+         return 0;
+      }
+
+      if (resetflag) add_seen(sp->ext);
+
+      sp->buf = 0;
+      sp->len = 0;
+
+      ofp = open_memstream(&sp->buf, &sp->len);
+      if (!ofp) {
+         WARNING;
+         return -1;
+      }
+
+      ret = copy_xattr(stdin, ofp);
+
+      if (fclose(ofp) || ret) {
+         WARN("unrecoverble error processing %s%s -- aborting\n", 
+              source_name, sp->ext); 
+         free(sp->buf);
+         sp->buf = 0;
+         return -1;
+      }
+
+      pthread_mutex_lock(&ring_lock);
+
+      sp->seq = ring_tail;
+      sp->state = SLOT_READY;
+      ring_tail++;
+      pthread_cond_broadcast(&ring_cond);
+
+      pthread_mutex_unlock(&ring_lock);
+   }
+}
+
+
+static
+int run_jobs(long jobs)
+{
+   pthread_t *threads;
+   long i, started;
+   int ret;
 
+   num_slots = SLOTS_PER_JOB*jobs;
+   ring = (struct slot *) calloc(num_slots, sizeof(struct slot));
+   threads = (pthread_t *) calloc(jobs, sizeof(pthread_t));
+
+   if (!ring || !threads) {
+      WARNING;
+      return -1;
+   }
+
+   started = 0;
+   for (i = 0; i < jobs; i++) {
+      if (pthread_create(&threads[i], 0, worker, 0)) {
+         WARNING;
+         break;
+      }
+      started++;
+   }
+
+   if (started == 0) {
+      WARN("joinf_xattr: no worker threads\n");
+      return -1;
+   }
+
+   ret = reader();
+
+   pthread_mutex_lock(&ring_lock);
+   if (ret) ring_fatal = 1;
+   ring_eof = 1;
+   pthread_cond_broadcast(&ring_cond);
+   pthread_mutex_unlock(&ring_lock);
+
+   for (i = 0; i < started; i++) 
+      pthread_join(threads[i], 0);
+
+   if (ring_fatal) {
+      stream_complete = 0;
+      stream_read = 0;
+      return -1;
+   }
+
+   return ring_retval;
+}
+
+
+/* applies the entries in stdin one at a time (without --jobs) */
+
+static
+int read_stream(void)
+{
+   struct stat itemstat;
    int c, k;
+   long ops, bytes;
    int ret, retval;
 
-   int aclflag = 0;
+   retval = 0;
+
+   for (;;) {
+
+      c = getchar();
+      if (c == EOF) {
+         stream_read = 1;
+         return retval;
+      }
+
+      k = 0;
+      for (;;) {
+         if (c == EOF) return -1;
+         if (k >= MAXLEN) {
+            WARN("buffer overflow\n");
+            return -1;
+         }
+         extension[k] = c; 
+         k++;
+         if (c == 0) break;
+         c = getchar();
+      }
+
+      if (strcmp(extension, ".") == 0) {
+         stream_complete = 1;
+         stream_read = 1;
+         return retval;
+      }
+
+      if (resetflag) add_seen(extension);
+
+      if (snprintf(itemname, MAXLEN, "%s%s", source_name, extension) >= MAXLEN) 
+         overflow();
+
+      ret = 0;
+
+      ops = xattr_meta_ops;
+      bytes = xattr_io_bytes;
+
+      progress_current(itemname);
+
+      if (lstat(itemname, &itemstat)) {
+         ret = skip_xattr("");
+      }
+      else {
+         ret = join_xattr(itemname, &itemstat, "", aclflag, &oprefs);
+         if (ret == 0) progress_item(xattr_io_bytes - bytes);
+      }
+
+      charge(ops, bytes);
+
+      if (ret) {
+         if (ret == -1) {
+            WARN("recoverble error processing %s -- continuing\n", itemname); 
+            retval = -1;
+         }
+         else {
+            WARN("unrecoverble error processing %s -- aborting\n", itemname); 
+            return -1;
+         }
+
+      }
+   }
+}
+
+
+int main(int argc, char **argv)
+{
+   char *srcname, *fname;
+   struct stat srcstat;
+   int srcname_len;
+   char mbuf[8];
+
+   int walk_state;
+   int retval;
 
-   owner_prefs_t oprefs;
    char *owner_name = 0, *group_name = 0;
    int owner_status;
    char *usermap = 0, *groupmap = 0;
+   long jobs = 0;
+   long max_ops = 0, max_meta_ops = 0, max_bytes = 0;
+   char *tname = 0;
+   long nice_incr = 0;
+   int lowioflag = 0;
+   char *pname = 0;
 
    int i;
 
-   retval = 0;
+   fname = 0;
 
 
    i = 1;
@@ -147,6 +738,127 @@ int main(int argc, char **argv)
          groupmap = argv[i];
          i++;
       }
+      else if (strcmp(argv[i], "--jobs") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         jobs = string_to_long(argv[i]);
+         if (conversion_error || jobs < 1 || jobs > MAXJOBS) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--reset") == 0) {
+         i++;
+         resetflag = 1;
+      }
+      else if (strcmp(argv[i], "--files-from") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         fname = argv[i];
+         i++;
+      }
+      else if (strcmp(argv[i], "--exclude") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         if (exclude_add(argv[i], 0)) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--exclude-from") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         if (exclude_add_file(argv[i])) return -1;
+         i++;
+      }
+      else if (strcmp(argv[i], "--max-ops") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         max_ops = string_to_long(argv[i]);
+         if (conversion_error || max_ops < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--max-meta-ops") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         max_meta_ops = string_to_long(argv[i]);
+         if (conversion_error || max_meta_ops < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--max-bytes") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         max_bytes = string_to_long(argv[i]);
+         if (conversion_error || max_bytes < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--throttle-file") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         tname = argv[i];
+         i++;
+      }
+      else if (strcmp(argv[i], "--nice") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         nice_incr = string_to_long(argv[i]);
+         if (conversion_error || nice_incr < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--low-io") == 0) {
+         i++;
+         lowioflag = 1;
+      }
+      else if (strcmp(argv[i], "--progress") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         pname = argv[i];
+         i++;
+      }
 
       else
          break;
@@ -162,8 +874,19 @@ int main(int argc, char **argv)
    process_usermap(usermap);
    process_groupmap(groupmap);
 
+   if (fname) {
+      collect_names(fname);
+      walk_state = 0;
+   }
+   else {
+      walk_state = 1;
+   }
+
    srcname_len = strip_slashes(srcname);
 
+   source_name = srcname;
+   source_name_len = srcname_len;
+
    if (lstat(srcname, &srcstat) || !S_ISDIR(srcstat.st_mode)) {
       usage();
       return -1;
@@ -179,51 +902,55 @@ int main(int argc, char **argv)
       return -1;
    }
 
+   throttle_init(THROTTLE_OBJECTS, max_ops);
+   throttle_init(THROTTLE_OPS, max_meta_ops);
+   throttle_init(THROTTLE_BYTES, max_bytes);
+
+   if (tname && throttle_control(tname)) {
+      WARN("joinf_xattr: bad throttle file %s\n", tname);
+      return -1;
+   }
+
+   if (throttle_priority(nice_incr, lowioflag))
+      WARN("joinf_xattr: could not lower priority\n");
+
+   if (pname && progress_open(pname, "joinf_xattr"))
+      WARN("joinf_xattr: failed to write %s\n", pname);
+
    if (fread(mbuf, 1, 8, stdin) != 8 || memcmp(magic, mbuf, 8)) {
       WARN("bad file format\n");
+      progress_close(0);
       return -1;
    }
 
-   for (;;) {
+   if (jobs > 0) 
+      retval = run_jobs(jobs);
+   else
+      retval = read_stream();
 
-      c = getchar();
-      if (c == EOF) return retval;
+   if (stream_complete && getchar() != EOF) {
+      WARN("bad file format\n");
+      progress_close(0);
+      return -1;
+   }
 
-      k = 0;
-      for (;;) {
-         if (c == EOF) return -1;
-         if (k >= MAXLEN) {
-            WARN("buffer overflow\n");
-            return -1;
-         }
-         extension[k] = c; 
-         k++;
-         if (c == 0) break;
-         c = getchar();
+   if (resetflag) {
+      if (!stream_complete) {
+         WARN("joinf_xattr: incomplete stream --- nothing reset\n");
+         progress_close(0);
+         return -1;
       }
 
-      if (snprintf(itemname, MAXLEN, "%s%s", srcname, extension) >= MAXLEN) 
-         overflow();
-
-      ret = 0;
+      if (lstat(srcname, &srcstat) || reset_walk(srcname, &srcstat, walk_state))
+         retval = -1;
+   }
 
-      if (lstat(itemname, &itemstat)) {
-         ret = skip_xattr("");
-      }
-      else {
-         ret = join_xattr(itemname, &itemstat, "", aclflag, &oprefs);
-      }
+   /* recoverable errors still leave a finished run (and the next run
+    * its count of objects); only a fatal error does not
+    */
 
-      if (ret) {
-         if (ret == -1) {
-            WARN("recoverble error processing %s -- continuing\n", itemname); 
-            retval = -1;
-         }
-         else {
-            WARN("unrecoverble error processing %s -- aborting\n", itemname); 
-            return -1;
-         }
+   progress_close(stream_read);
 
-      }
-   }
+   return retval;
 }
+
@@ -0,0 +1,174 @@
+
+#include "util.h"
+#include "xattr_util.h"
+#include "xbup_acl_translate.h"
+#include "libxbup.h"
+
+
+int xbup_ctx_init(xbup_ctx_t *ctx, int options,
+                  const char *owner_name, const char *group_name)
+{
+   memset(ctx, 0, sizeof(xbup_ctx_t));
+   ctx->options = options;
+
+   return set_owner_prefs(&ctx->oprefs, owner_name, group_name);
+}
+
+
+/* split_fp and join_fp do the work, for a stream; xattr_access_error
+ * and xbup_acl_from_text_warning are thread-local, so they can be
+ * handed back to the caller through ctx.
+ */
+
+static
+int split_fp(xbup_ctx_t *ctx, const char *fname, FILE *ofp)
+{
+   struct stat sbuf;
+   acl_t acl;
+   int opts = ctx->options;
+   int islnk, ret;
+
+   ctx->access_error = 0;
+   ctx->acl_warning = 0;
+
+   if (lstat(fname, &sbuf)) return -1;
+
+   islnk = S_ISLNK(sbuf.st_mode);
+
+   xattr_access_error = 0;
+
+   acl = (opts & XBUP_ACL) ? get_acl(fname, &sbuf) : 0;
+
+   ret = split_xattr_fp(fname, &sbuf, ofp,
+                        (opts & XBUP_CRTIME) != 0,
+                        (opts & XBUP_MTIME) || ((opts & XBUP_LNKMTIME) && islnk),
+                        acl,
+                        (opts & XBUP_PERMS) || ((opts & XBUP_LNKPERMS) && islnk)
+                        || ((opts & XBUP_FIXPERMS) && problem_perms(&sbuf)),
+                        &ctx->oprefs);
+
+   if (acl) acl_free(acl);
+
+   ctx->access_error = xattr_access_error;
+   if (ctx->access_error) ret = -1;
+
+   return ret;
+}
+
+static
+int join_fp(xbup_ctx_t *ctx, const char *fname, FILE *cfp)
+{
+   struct stat sbuf;
+   int ret;
+
+   ctx->access_error = 0;
+   ctx->acl_warning = 0;
+
+   if (lstat(fname, &sbuf)) return -1;
+
+   xbup_acl_from_text_warning = 0;
+
+   ret = join_xattr_fp(fname, &sbuf, cfp, (ctx->options & XBUP_ACL) != 0,
+                       &ctx->oprefs);
+
+   ctx->acl_warning = xbup_acl_from_text_warning;
+
+   return ret;
+}
+
+
+int xbup_split_fd(xbup_ctx_t *ctx, const char *fname, int fd)
+{
+   FILE *ofp;
+   int fd1, ret;
+
+   fd1 = dup(fd);
+   if (fd1 < 0) return -1;
+
+   ofp = fdopen(fd1, "w");
+   if (!ofp) {
+      close(fd1);
+      return -1;
+   }
+
+   ret = split_fp(ctx, fname, ofp);
+
+   if (fclose(ofp)) ret = -1;
+
+   return ret;
+}
+
+int xbup_split_mem(xbup_ctx_t *ctx, const char *fname,
+                   char **buf, size_t *len)
+{
+   FILE *ofp;
+   int ret;
+
+   *buf = 0;
+   *len = 0;
+
+   ofp = open_memstream(buf, len);
+   if (!ofp) return -1;
+
+   ret = split_fp(ctx, fname, ofp);
+
+   if (fclose(ofp)) ret = -1;
+
+   if (ret) {
+      free(*buf);
+      *buf = 0;
+      *len = 0;
+   }
+
+   return ret;
+}
+
+
+int xbup_join_fd(xbup_ctx_t *ctx, const char *fname, int fd)
+{
+   FILE *cfp;
+   off_t start;
+   long pos;
+   int fd1, ret;
+
+   start = lseek(fd, 0, SEEK_CUR);
+
+   fd1 = dup(fd);
+   if (fd1 < 0) return -2;
+
+   cfp = fdopen(fd1, "r");
+   if (!cfp) {
+      close(fd1);
+      return -2;
+   }
+
+   ret = join_fp(ctx, fname, cfp);
+
+   /* the stream reads ahead, so put fd back just past the container */
+
+   pos = (start >= 0) ? ftell(cfp) : -1;
+
+   fclose(cfp);
+
+   if (pos >= 0) lseek(fd, pos, SEEK_SET);
+
+   return ret;
+}
+
+int xbup_join_mem(xbup_ctx_t *ctx, const char *fname,
+                  const char *buf, size_t len)
+{
+   FILE *cfp;
+   int ret;
+
+   if (len == 0) return -2;
+
+   cfp = fmemopen((void *) buf, len, "r");
+   if (!cfp) return -2;
+
+   ret = join_fp(ctx, fname, cfp);
+
+   fclose(cfp);
+
+   return ret;
+}
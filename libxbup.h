@@ -0,0 +1,82 @@
+#ifndef XBUP__libxbup_H
+#define XBUP__libxbup_H
+
+#include "xattr_util.h"
+
+/* libxbup: saving the metadata of an object into an xattr container,
+ * and restoring it from one, in process, for programs that would
+ * otherwise run split1_xattr and join1_xattr on each object.  The
+ * containers are those of split_xattr and join_xattr (see the format
+ * in xattr_util.c), read from or written to a file descriptor or a
+ * memory buffer.
+ *
+ * Everything a call depends on, or reports, is in its context: the
+ * options, and whether some metadata could not be read, or some ACL
+ * entry could not be translated.  Any number of contexts may be used
+ * concurrently, from any number of threads, as long as each context
+ * is used by one thread at a time.  What the contexts share is
+ * process-wide, and locked: the caches of user and group names and
+ * UUIDs (util.c), which may be loaded with load_id_cache; and the id
+ * translation options (xbup_opt_numeric_ids, xbup_opt_preserve_uuids,
+ * process_usermap and process_groupmap), which should be set before
+ * any contexts are used.
+ *
+ * libxbup.a (or libxbup.dylib) holds this, along with util.o,
+ * xattr_util.o and xbup_acl_translate.o.
+ */
+
+/* the options: what split saves, and (XBUP_ACL) what join restores */
+
+#define XBUP_CRTIME     (0x0001)   /* the creation time */
+#define XBUP_MTIME      (0x0002)   /* the mod time */
+#define XBUP_LNKMTIME   (0x0004)   /* the mod time of symlinks */
+#define XBUP_ACL        (0x0008)   /* the ACL */
+#define XBUP_PERMS      (0x0010)   /* the permissions */
+#define XBUP_LNKPERMS   (0x0020)   /* the permissions of symlinks */
+#define XBUP_FIXPERMS   (0x0040)   /* "problematic" permissions */
+
+struct xbup_ctx_struct {
+   int options;
+   owner_prefs_t oprefs;
+
+   /* set by each call */
+   int access_error;   /* split: some metadata could not be read */
+   int acl_warning;    /* join: some ACL entries could not be
+                          translated to UUIDs */
+};
+
+typedef struct xbup_ctx_struct xbup_ctx_t;
+
+/* xbup_ctx_init sets up ctx with the options, and the owner and group
+ * names, as in split_xattr and join_xattr --owner and --group (null
+ * for no option).  Returns 0 on success; otherwise, bit 0 is set if
+ * owner_name is bad, and bit 1 if group_name is.
+ */
+
+int xbup_ctx_init(xbup_ctx_t *ctx, int options,
+                  const char *owner_name, const char *group_name);
+
+/* xbup_split_fd writes the container of fname to fd;
+ * xbup_split_mem writes it to a newly allocated buffer, returned in
+ * *buf (to be freed by the caller), and its length in *len.
+ * Both return 0 on success, and -1 on error (including metadata that
+ * could not be read, in which case ctx->access_error is set).
+ */
+
+int xbup_split_fd(xbup_ctx_t *ctx, const char *fname, int fd);
+int xbup_split_mem(xbup_ctx_t *ctx, const char *fname,
+                   char **buf, size_t *len);
+
+/* xbup_join_fd restores the metadata of fname from the container read
+ * from fd: if fd is seekable, it is left just past the container;
+ * otherwise, input may have been read beyond it.
+ * xbup_join_mem restores it from the container in buf, of length len.
+ * Both return 0 on success, -1 if some of the metadata could not be
+ * restored, and -2 if the container could not be read.
+ */
+
+int xbup_join_fd(xbup_ctx_t *ctx, const char *fname, int fd);
+int xbup_join_mem(xbup_ctx_t *ctx, const char *fname,
+                  const char *buf, size_t len);
+
+#endif
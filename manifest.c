@@ -0,0 +1,515 @@
+#include "util.h"
+#include "uthash.h"
+#include "digest.h"
+#include "dirscan.h"
+#include "manifest.h"
+
+
+static
+void add_record(FILE *mfp, const unsigned char *md, char type, 
+                const char *name)
+{
+   char hex[2*SHA256_LEN+1];
+
+   digest_to_hex(md, MANIFEST_DIGEST_LEN, hex);
+   fprintf(mfp, "%s %c %s", hex, type, name);
+   fputc('\0', mfp);
+}
+
+
+static
+int build_dir(const char *dirname, unsigned char *md, int recurse)
+{
+   char itemname[MAXLEN];
+   char mname[MAXLEN];
+   unsigned char item_md[SHA256_LEN];
+   dirscan_t *dirlist;
+   struct dirscan_item *diritem;
+   struct stat itemstat;
+   int isdir;
+   FILE *mfp, *fp;
+   char *buf;
+   size_t len;
+   int ret;
+
+   dirlist = dirscan_open(dirname, 1);
+
+   if (!dirlist) {
+      WARN("manifest: opendir failed on %s\n", dirname);
+      return -1;
+   }
+
+   buf = 0;
+   len = 0;
+   mfp = open_memstream(&buf, &len);
+   if (!mfp) {
+      Warning("open_memstream error");
+      exit(-1);
+   }
+
+   ret = 0;
+
+   while ( (diritem = dirscan_next(dirlist)) ) {
+
+      if (snprintf(itemname, MAXLEN, "%s/%s", 
+          dirname, diritem->d_name) >= MAXLEN) overflow();
+
+      if (diritem->d_type == DT_DIR) 
+         isdir = 1;
+      else if (diritem->d_type == DT_REG) 
+         isdir = 0;
+      else {
+         if (lstat(itemname, &itemstat)) {
+            WARN("manifest: lstat failed on %s\n", itemname);
+            ret = -1;
+            break;
+         }
+
+         if (S_ISDIR(itemstat.st_mode)) 
+            isdir = 1;
+         else if (S_ISREG(itemstat.st_mode))
+            isdir = 0;
+         else
+            continue;
+      }
+
+      if (isdir) {
+         if (!recurse) {
+            /* take the digest from the existing manifest, if any */
+
+            if (snprintf(mname, MAXLEN, "%s/%s", 
+                itemname, MANIFEST_NAME) >= MAXLEN) overflow();
+
+            if (sha256_file(mname, item_md) == 0) {
+               add_record(mfp, item_md, 'd', diritem->d_name);
+               continue;
+            }
+         }
+
+         if (build_dir(itemname, item_md, 1)) {
+            ret = -1;
+            break;
+         }
+         add_record(mfp, item_md, 'd', diritem->d_name);
+      }
+      else {
+         if (strcmp(diritem->d_name, MANIFEST_NAME) == 0) continue;
+
+         if (sha256_file(itemname, item_md)) {
+            WARN("manifest: error reading %s\n", itemname);
+            ret = -1;
+            break;
+         }
+         add_record(mfp, item_md, 'f', diritem->d_name);
+      }
+   }
+
+   if (dirscan_close(dirlist)) {
+      WARN("manifest: readdir failed on %s\n", dirname);
+      ret = -1;
+   }
+
+   if (fclose(mfp)) {
+      Warning("open_memstream error");
+      exit(-1);
+   }
+
+   if (ret == 0) {
+      if (snprintf(itemname, MAXLEN, "%s/%s", 
+          dirname, MANIFEST_NAME) >= MAXLEN) overflow();
+
+      fp = fopen(itemname, "w");
+      if (!fp || fwrite(buf, 1, len, fp) != len || fclose(fp)) {
+         WARN("manifest: error writing %s\n", itemname);
+         ret = -1;
+      }
+      else if (md) {
+         sha256(buf, len, md);
+      }
+   }
+
+   free(buf);
+   return ret;
+}
+
+
+int manifest_build(const char *dirname, unsigned char *md)
+{
+   return build_dir(dirname, md, 1);
+}
+
+
+int manifest_update(const char *dirname, unsigned char *md)
+{
+   return build_dir(dirname, md, 0);
+}
+
+
+char *manifest_read(const char *dirname, long *len)
+{
+   char fname[MAXLEN];
+   FILE *fp;
+   char *buf;
+   long size, n;
+
+   if (snprintf(fname, MAXLEN, "%s/%s", 
+       dirname, MANIFEST_NAME) >= MAXLEN) overflow();
+
+   fp = fopen(fname, "r");
+   if (!fp) return 0;
+
+   size = 4096;
+   n = 0;
+   buf = (char *) malloc(size);
+   if (!buf) {
+      Warning("malloc error");
+      exit(-1);
+   }
+
+   for (;;) {
+      n += fread(buf + n, 1, size - n, fp);
+      if (n < size) break;
+
+      size *= 2;
+      buf = (char *) realloc(buf, size);
+      if (!buf) {
+         Warning("malloc error");
+         exit(-1);
+      }
+   }
+
+   if (ferror(fp)) {
+      fclose(fp);
+      free(buf);
+      return 0;
+   }
+
+   fclose(fp);
+   *len = n;
+   return buf;
+}
+
+
+int manifest_next(char *buf, long len, long *pos, 
+                  struct manifest_entry *entry)
+{
+   char *p, *end;
+
+   if (*pos >= len) return 0;
+
+   p = buf + *pos;
+
+   if (len - *pos < MANIFEST_MIN_RECORD ||
+       p[MANIFEST_HEX_LEN] != ' ' || p[MANIFEST_HEX_LEN+2] != ' ') 
+      return -1;
+
+   end = memchr(p + MANIFEST_HEX_LEN + 3, '\0', 
+                len - *pos - MANIFEST_HEX_LEN - 3);
+   if (!end) return -1;
+
+   entry->digest = p;
+   entry->type = p[MANIFEST_HEX_LEN+1];
+   entry->name = p + MANIFEST_HEX_LEN + 3;
+
+   if ((entry->type != 'f' && entry->type != 'd') || entry->name[0] == '\0')
+      return -1;
+
+   *pos = (end - buf) + 1;
+   return 1;
+}
+
+
+/* state for manifest_flatten and manifest_diff */
+
+static const char *base_name = 0;
+static FILE *out = 0;
+
+
+static
+int flatten_aux(const char *relpath)
+{
+   char dirname[MAXLEN];
+   char subpath[MAXLEN];
+   struct manifest_entry entry;
+   char *buf;
+   long len, pos;
+   int ret, status;
+
+   if (snprintf(dirname, MAXLEN, "%s/%s", base_name, relpath) >= MAXLEN)
+      overflow();
+
+   buf = manifest_read(dirname, &len);
+   if (!buf) {
+      WARN("manifest: no manifest in %s\n", dirname);
+      return -1;
+   }
+
+   fprintf(out, "%s", relpath);
+   putc('\0', out);
+   fprintf(out, "%ld", len);
+   putc('\0', out);
+   fwrite(buf, 1, len, out);
+
+   ret = 0;
+   pos = 0;
+
+   while ( (status = manifest_next(buf, len, &pos, &entry)) == 1 ) {
+      if (entry.type != 'd') continue;
+
+      if (strcmp(relpath, ".") == 0) {
+         if (snprintf(subpath, MAXLEN, "%s", entry.name) >= MAXLEN)
+            overflow();
+      }
+      else {
+         if (snprintf(subpath, MAXLEN, "%s/%s",
+             relpath, entry.name) >= MAXLEN) overflow();
+      }
+
+      if (flatten_aux(subpath)) {
+         ret = -1;
+         break;
+      }
+   }
+
+   if (status == -1) {
+      WARN("manifest: bad manifest in %s\n", dirname);
+      ret = -1;
+   }
+
+   free(buf);
+   return ret;
+}
+
+
+/* block_table maps relative paths to the blocks of a flattened manifest */
+
+struct block_table_entry {
+   char *key;
+   char *buf;
+   long len;
+   UT_hash_handle hh;
+};
+
+static
+struct block_table_entry *block_table = NULL;
+
+
+static
+int read_blocks(char *input, long n)
+{
+   char *p, *end, *q, *key;
+   long len;
+   struct block_table_entry *ptr;
+
+   p = input;
+   end = input + n;
+
+   while (p < end) {
+      key = p;
+      q = memchr(p, '\0', end - p);
+      if (!q) break;
+
+      p = q + 1;
+      q = memchr(p, '\0', end - p);
+      if (!q) break;
+
+      len = string_to_long(p);
+      if (conversion_error || len < 0 || len > end - (q + 1)) break;
+
+      ptr = malloc(sizeof(struct block_table_entry));
+      if (!ptr) {
+         Warning("malloc error");
+         exit(-1);
+      }
+
+      ptr->key = key;
+      ptr->buf = q + 1;
+      ptr->len = len;
+      HASH_ADD_KEYPTR(hh, block_table, ptr->key, strlen(ptr->key), ptr);
+
+      p = q + 1 + len;
+   }
+
+   if (p != end) {
+      WARN("manifest: bad flattened manifest\n");
+      return -1;
+   }
+
+   return 0;
+}
+
+
+static
+void emit(const char *relpath, const char *name)
+{
+   if (strcmp(relpath, ".") == 0)
+      fprintf(out, "%s", name);
+   else
+      fprintf(out, "%s/%s", relpath, name);
+
+   putc('\0', out);
+}
+
+
+static
+void emit_dir(const char *relpath)
+{
+   fprintf(out, "%s", relpath);
+   putc('\0', out);
+}
+
+
+static
+int diff_aux(const char *relpath)
+{
+   char dirname[MAXLEN];
+   char subpath[MAXLEN];
+   struct block_table_entry *ptr;
+   struct manifest_entry new_entry, old_entry;
+   char *buf;
+   long len, new_pos, old_pos;
+   int new_status, old_status, cmp;
+   int ret;
+
+   HASH_FIND(hh, block_table, relpath, strlen(relpath), ptr);
+   if (!ptr) {
+      WARN("manifest: no manifest for %s in flattened manifest\n", relpath);
+      return -1;
+   }
+
+   if (snprintf(dirname, MAXLEN, "%s/%s", base_name, relpath) >= MAXLEN)
+      overflow();
+
+   buf = manifest_read(dirname, &len);
+
+   if (!buf) {
+      /* no manifest on our side: copy the whole directory */
+      emit_dir(relpath);
+      return 0;
+   }
+
+   if (len == ptr->len && memcmp(buf, ptr->buf, len) == 0) {
+      free(buf);
+      return 0;
+   }
+
+   ret = 0;
+   new_pos = old_pos = 0;
+   new_status = manifest_next(ptr->buf, ptr->len, &new_pos, &new_entry);
+   old_status = manifest_next(buf, len, &old_pos, &old_entry);
+
+   while ((new_status == 1 || old_status == 1) &&
+          new_status != -1 && old_status != -1) {
+
+      if (new_status == 1 && old_status == 1)
+         cmp = strcmp(new_entry.name, old_entry.name);
+      else if (new_status == 1)
+         cmp = -1;
+      else
+         cmp = 1;
+
+      if (cmp < 0) {
+         /* new object */
+         emit(relpath, new_entry.name);
+      }
+      else if (cmp > 0) {
+         /* deleted object */
+         emit(relpath, old_entry.name);
+      }
+      else if (new_entry.type != old_entry.type) {
+         emit(relpath, new_entry.name);
+      }
+      else if (memcmp(new_entry.digest, old_entry.digest,
+                      MANIFEST_HEX_LEN) != 0) {
+         if (new_entry.type == 'f') {
+            emit(relpath, new_entry.name);
+         }
+         else {
+            if (strcmp(relpath, ".") == 0) {
+               if (snprintf(subpath, MAXLEN, "%s",
+                   new_entry.name) >= MAXLEN) overflow();
+            }
+            else {
+               if (snprintf(subpath, MAXLEN, "%s/%s",
+                   relpath, new_entry.name) >= MAXLEN) overflow();
+            }
+
+            if (diff_aux(subpath)) {
+               ret = -1;
+               break;
+            }
+         }
+      }
+
+      if (cmp <= 0)
+         new_status = manifest_next(ptr->buf, ptr->len,
+                                    &new_pos, &new_entry);
+      if (cmp >= 0)
+         old_status = manifest_next(buf, len, &old_pos, &old_entry);
+   }
+
+   if (new_status == -1) {
+      WARN("manifest: bad manifest for %s in flattened manifest\n", relpath);
+      ret = -1;
+   }
+
+   if (old_status == -1 && ret == 0) {
+      /* a damaged manifest on our side: just copy the whole directory */
+      WARN("manifest: bad manifest in %s\n", dirname);
+      emit_dir(relpath);
+   }
+
+   if (ret == 0)
+      emit(relpath, MANIFEST_NAME);
+
+   free(buf);
+   return ret;
+}
+
+
+static
+void free_blocks(void)
+{
+   struct block_table_entry *ptr;
+
+   while (block_table) {
+      ptr = block_table;
+      HASH_DEL(block_table, ptr);
+      free(ptr);
+   }
+}
+
+
+int manifest_flatten(const char *dirname, FILE *ofp)
+{
+   base_name = dirname;
+   out = ofp;
+
+   return flatten_aux(".");
+}
+
+
+int manifest_diff(const char *dirname, char *input, long len, FILE *ofp)
+{
+   struct stat dirstat;
+   int ret;
+
+   base_name = dirname;
+   out = ofp;
+
+   if (read_blocks(input, len)) {
+      free_blocks();
+      return -1;
+   }
+
+   if (lstat(dirname, &dirstat) || !S_ISDIR(dirstat.st_mode)) {
+      emit_dir(".");
+      ret = 0;
+   }
+   else {
+      ret = diff_aux(".");
+   }
+
+   free_blocks();
+   return ret;
+}
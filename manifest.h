@@ -0,0 +1,90 @@
+#ifndef XBUP__manifest_H
+#define XBUP__manifest_H
+
+/* A manifest is a Merkle tree over a repository of xattr containers.
+ *
+ * Every directory of the repository gets a file MANIFEST_NAME,
+ * holding one record per entry (other than the manifest itself),
+ * in strcmp order of the names:
+ *
+ *    <digest> <type> <name>\0
+ *
+ * where type is 'f' for a container and 'd' for a subdirectory.
+ * The digest of a container is (a prefix of) the SHA-256 of its
+ * contents, and the digest of a subdirectory is that of its manifest
+ * file.  So two directories with identical manifests have identical
+ * contents, all the way down.
+ */
+
+#include "util.h"
+
+#define MANIFEST_NAME DBL_PREFIX "manifest"
+
+#define MANIFEST_DIGEST_LEN (16)                     /* bytes */
+#define MANIFEST_HEX_LEN (2*MANIFEST_DIGEST_LEN)     /* hex digits */
+#define MANIFEST_MIN_RECORD (MANIFEST_HEX_LEN + 5)
+
+struct manifest_entry {
+   char *digest;   /* MANIFEST_HEX_LEN hex digits, not null terminated */
+   char type;
+   char *name;
+};
+
+/* manifest_build writes the manifests of the tree rooted at dirname,
+ * bottom up, and (if md is non-null) stores the digest of the
+ * top-level manifest in md.  Returns 0 on success, -1 on error;
+ * on error, the manifest of dirname is not written. 
+ */
+
+int manifest_build(const char *dirname, unsigned char *md);
+
+/* manifest_update rewrites the manifest of dirname alone, taking the
+ * digests of its subdirectories from their existing manifests (those
+ * that have none are built from scratch).  After some containers have
+ * changed, calling it on the directories holding them, and then on
+ * their ancestors, deepest first, brings all the manifests up to date.
+ * Returns 0 on success, -1 on error.
+ */
+
+int manifest_update(const char *dirname, unsigned char *md);
+
+/* manifest_read reads the manifest of dirname into a malloc'ed
+ * buffer, and stores its length in *len.  
+ * Returns NULL if there is no (readable) manifest.
+ */
+
+char *manifest_read(const char *dirname, long *len);
+
+/* manifest_next parses the record of buf starting at *pos,
+ * advancing *pos.  The entry points into buf.
+ * Returns 1 if a record was parsed, 0 at the end of buf, 
+ * and -1 if buf is malformed.
+ */
+
+int manifest_next(char *buf, long len, long *pos, 
+                  struct manifest_entry *entry);
+
+/* manifest_flatten writes the manifests of the tree rooted at dirname
+ * to ofp, as a sequence of blocks, one per directory:
+ *
+ *    <path>\0<length>\0<manifest>
+ *
+ * where path is relative to dirname ("." for dirname itself).
+ * Returns 0 on success, -1 on error.
+ */
+
+int manifest_flatten(const char *dirname, FILE *ofp);
+
+/* manifest_diff compares the flattened manifests in input (of the 
+ * "new" tree) against the tree rooted at dirname (the "old" tree).
+ * The names of the containers and directories that need to be copied
+ * to or deleted from dirname, along with the manifests of all 
+ * directories that differ, are written to ofp, null terminated, 
+ * relative to dirname.  Subtrees whose digests agree are skipped 
+ * without being read.  If dirname has no manifest at all, 
+ * the list is just ".".  Returns 0 on success, -1 on error.
+ */
+
+int manifest_diff(const char *dirname, char *input, long len, FILE *ofp);
+
+#endif
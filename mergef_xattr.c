@@ -0,0 +1,727 @@
+
+/* usage: mergef_xattr options dstdir
+ *    options:  --backup-dir dir
+ *              --dry-run
+ *              --verbose
+ *              --exclude pattern
+ *              --include pattern
+ *              --exclude-from file
+ *              --max-ops n
+ *              --max-meta-ops n
+ *              --max-bytes n
+ *              --throttle-file file
+ *              --nice n
+ *              --low-io
+ *
+ * merges the stream written by splitf_xattr --merge (read from stdin)
+ * into dstdir, a repository of xattr containers like the one
+ * split_xattr creates, so that afterwards dstdir holds exactly the
+ * containers in the stream; this does the work of split_xattr
+ * followed by rsync --checksum --delete, without a local copy of
+ * the repository.  Typically, it runs on the remote host:
+ *
+ *    splitf_xattr --merge srcdir | ssh host mergef_xattr dstdir
+ *
+ * (or, without the ssh, on the same host).
+ *
+ * A container is only written if its contents differ from those of
+ * the container already in dstdir.  Once the whole stream has been
+ * read, every other file in dstdir is deleted (along with any stale
+ * manifest files, see manifest.h), as are directories left empty.
+ * If the stream was cut short, or splitf_xattr reported errors,
+ * nothing is deleted.
+ *
+ * with the --backup-dir dir option, containers that are replaced
+ * or deleted are first moved into dir (at the same relative path),
+ * like rsync -b --backup-dir dir.
+ *
+ * the --dry-run flag causes nothing to be changed.
+ *
+ * the --verbose flag causes the names of the containers written
+ * and deleted, and some totals, to be written to stdout.
+ *
+ * the --exclude, --include and --exclude-from options add rsync-style
+ * rules (see exclude.h), in the order given, matched against the
+ * paths of the objects (relative to the srcdir of splitf_xattr) that
+ * the containers in dstdir belong to.  The containers of excluded
+ * objects, and the directories of excluded directories, are kept
+ * rather than deleted, as rsync --delete keeps excluded files; given
+ * the rules splitf_xattr was given, they leave the containers of the
+ * objects it did not walk as they were.
+ *
+ * the --max-ops flag limits the merge to about n containers (and,
+ * in the walk that deletes what was not in the stream, objects) per
+ * second (see throttle.h), so as to leave some of the disk to others;
+ * --max-meta-ops does the same for the lstat, open, unlink... calls,
+ * and --max-bytes for the bytes of containers read and written.  The
+ * --throttle-file, --nice and --low-io options are as in split_xattr.
+ *
+ * Returns -1 if errors detected, and 0 otherwise.
+ *
+ */
+
+#include "util.h"
+#include "xattr_util.h"
+#include "dirscan.h"
+#include "exclude.h"
+#include "manifest.h"
+#include "uthash.h"
+#include "throttle.h"
+
+
+static char magic[8] = { 0xb7, 0x0e, 0xbf, 0xb2, 0xc2, 0x91, 0xf2, 0x92 };
+
+static char *destination_name = 0;
+static char *backup_name = 0;
+static int dryrunflag = 0;
+static int verboseflag = 0;
+static int return_value = 0;
+
+static long num_entries = 0;
+static long num_written = 0;
+static long num_deleted = 0;
+
+
+/**** the containers in the stream, by path relative to dstdir */
+
+struct seen_table_entry {
+   char *key;
+   UT_hash_handle hh;
+};
+
+static
+struct seen_table_entry *seen_table = NULL;
+
+static
+int add_seen(const char *s)
+{
+   struct seen_table_entry *p;
+
+   HASH_FIND(hh, seen_table, s, strlen(s), p);
+   if (p) return -1;
+
+   p = malloc(sizeof(struct seen_table_entry));
+   if (!p) {
+      Warning("malloc error");
+      exit(-1);
+   }
+
+   p->key = strdup(s);
+   if (!p->key) {
+      Warning("malloc error");
+      exit(-1);
+   }
+
+   HASH_ADD_KEYPTR(hh, seen_table, p->key, strlen(p->key), p);
+   return 0;
+}
+
+static
+int is_seen(const char *s)
+{
+   struct seen_table_entry *p;
+
+   HASH_FIND(hh, seen_table, s, strlen(s), p);
+   return p != 0;
+}
+
+
+/* read_path reads the null-terminated path of the next entry.
+ * Returns 1 if a path was read, 0 at end of file, and -1 on error.
+ */
+
+static
+int read_path(char *path)
+{
+   int c, k;
+
+   c = getchar();
+   if (c == EOF) return 0;
+
+   k = 0;
+   for (;;) {
+      if (c == EOF) return -1;
+      if (k >= MAXLEN) return -1;
+      path[k] = c;
+      k++;
+      if (c == 0) return 1;
+      c = getchar();
+   }
+}
+
+
+/* check_path makes sure that path is of the form /a/b/c or /a/b/.,
+ * so that nothing outside of dstdir is ever touched.
+ */
+
+static
+int check_path(const char *path)
+{
+   const char *p, *q;
+   long len;
+
+   if (path[0] != '/') return -1;
+
+   p = path + 1;
+   for (;;) {
+      q = strchr(p, '/');
+      len = q ? q - p : strlen(p);
+
+      if (len == 0) return -1;
+      if (len == 2 && p[0] == '.' && p[1] == '.') return -1;
+      if (len == 1 && p[0] == '.' && q) return -1;
+
+      if (!q) return 0;
+      p = q + 1;
+   }
+}
+
+
+/* read_file reads the file fname into a newly allocated buffer,
+ * if it is a regular file of length len; returns 0 if so,
+ * and -1 otherwise.
+ */
+
+static
+int read_file(const char *fname, long len, char **buf)
+{
+   struct stat st;
+   FILE *fp;
+
+   *buf = 0;
+
+   if (lstat(fname, &st) || !S_ISREG(st.st_mode) || st.st_size != len)
+      return -1;
+
+   fp = fopen(fname, "r");
+   if (!fp) return -1;
+
+   *buf = (char *) malloc(len + 1);
+   if (!*buf) {
+      Warning("malloc error");
+      exit(-1);
+   }
+
+   if (fread(*buf, 1, len, fp) != len) {
+      fclose(fp);
+      free(*buf);
+      *buf = 0;
+      return -1;
+   }
+
+   fclose(fp);
+   return 0;
+}
+
+
+/* make_parent makes sure that the directory that will hold fname exists */
+
+static
+int make_parent(const char *fname)
+{
+   char dir[MAXLEN];
+   char *p;
+
+   if (snprintf(dir, MAXLEN, "%s", fname) >= MAXLEN) overflow();
+
+   p = strrchr(dir, '/');
+   if (!p || p == dir) return 0;
+   *p = '\0';
+
+   return make_dirs(dir);
+}
+
+
+/* remove_entry removes (or, with --backup-dir, moves away) the file
+ * at relative path rel in dstdir.
+ */
+
+static
+int remove_entry(const char *rel)
+{
+   char dblname[MAXLEN];
+   char bakname[MAXLEN];
+
+   if (snprintf(dblname, MAXLEN, "%s%s", destination_name, rel) >= MAXLEN)
+      overflow();
+
+   if (!backup_name) {
+      if (unlink(dblname) && errno != ENOENT) {
+         WARN("mergef_xattr: failed to remove %s\n", dblname);
+         return -1;
+      }
+      return 0;
+   }
+
+   if (snprintf(bakname, MAXLEN, "%s%s", backup_name, rel) >= MAXLEN)
+      overflow();
+
+   if (make_parent(bakname) || rename(dblname, bakname)) {
+      WARN("mergef_xattr: could not move %s to %s\n", dblname, bakname);
+      return -1;
+   }
+
+   return 0;
+}
+
+
+/* merge_entry writes the container in buf (of length len) to dstdir,
+ * at relative path rel, unless an identical one is already there.
+ */
+
+static
+void merge_entry(const char *rel, const char *buf, long len)
+{
+   char dblname[MAXLEN];
+   struct stat st;
+   char *oldbuf;
+   FILE *fp;
+   int same;
+   int ret;
+
+   num_entries++;
+
+   throttle(THROTTLE_OBJECTS, 1);
+   throttle(THROTTLE_OPS, 1);
+
+   if (add_seen(rel)) {
+      WARN("mergef_xattr: duplicate entry %s\n", rel);
+      return_value = -1;
+      return;
+   }
+
+   if (snprintf(dblname, MAXLEN, "%s%s", destination_name, rel) >= MAXLEN)
+      overflow();
+
+   same = 0;
+   if (read_file(dblname, len, &oldbuf) == 0) {
+      throttle(THROTTLE_BYTES, len);
+      same = (memcmp(oldbuf, buf, len) == 0);
+      free(oldbuf);
+   }
+
+   if (same) return;
+
+   num_written++;
+   if (verboseflag) printf("%s\n", rel + 1);
+   if (dryrunflag) return;
+
+   if (lstat(dblname, &st) == 0) {
+      if (S_ISDIR(st.st_mode)) {
+         WARN("mergef_xattr: %s is a directory\n", dblname);
+         return_value = -1;
+         return;
+      }
+
+      if (backup_name && remove_entry(rel)) {
+         return_value = -1;
+         return;
+      }
+   }
+
+   if (make_parent(dblname)) {
+      WARN("mergef_xattr: failed to create directory for %s\n", dblname);
+      return_value = -1;
+      return;
+   }
+
+   throttle(THROTTLE_OPS, 1);
+   throttle(THROTTLE_BYTES, len);
+
+   fp = fopen(dblname, "w");
+   if (!fp) {
+      WARN("mergef_xattr: failed to create %s\n", dblname);
+      return_value = -1;
+      return;
+   }
+
+   ret = 0;
+   if (len > 0 && fwrite(buf, 1, len, fp) != len) ret = -1;
+   if (fclose(fp)) ret = -1;
+
+   if (ret) {
+      WARN("mergef_xattr: error writing %s\n", dblname);
+      return_value = -1;
+   }
+}
+
+
+/* is_excluded tells if the container at relative path rel (with
+ * isdir set for a directory of dstdir) belongs to an excluded object;
+ * the container of a directory is in the directory itself, so is
+ * only ever reached if the directory is not excluded
+ */
+
+static
+int is_excluded(const char *rel, int isdir)
+{
+   char path[MAXLEN];
+   const char *base;
+   long len;
+
+   if (isdir) return exclude_match(rel + 1, 1);
+
+   base = strrchr(rel, '/') + 1;
+   len = strlen(rel);
+
+   if (strcmp(base, "." DBL_SUFFIX) == 0 ||
+       !is_suffix(DBL_SUFFIX, DBL_SUFFIX_LEN, base, strlen(base)))
+      return 0;
+
+   if (snprintf(path, MAXLEN, "%.*s", 
+                (int) (len - 1 - DBL_SUFFIX_LEN), rel + 1) >= MAXLEN)
+      overflow();
+
+   return exclude_match(path, 0);
+}
+
+
+/* delete_walk deletes everything below the directory at relative path
+ * rel in dstdir that was not in the stream (but for the containers of
+ * excluded objects); returns 1 if the directory was left empty.
+ */
+
+static
+int delete_walk(const char *rel)
+{
+   char dirname[MAXLEN];
+   char rel1[MAXLEN];
+   char itemname[MAXLEN];
+   dirscan_t *dirlist;
+   struct dirscan_item *diritem;
+   struct stat itemstat;
+   int isdir, empty;
+
+   if (snprintf(dirname, MAXLEN, "%s%s", destination_name, rel) >= MAXLEN)
+      overflow();
+
+   dirlist = dirscan_open(dirname, 1);
+
+   if (!dirlist) {
+      WARN("mergef_xattr: opendir failed on %s\n", dirname);
+      return_value = -1;
+      return 0;
+   }
+
+   empty = 1;
+
+   while ( (diritem = dirscan_next(dirlist)) ) {
+
+      throttle(THROTTLE_OBJECTS, 1);
+      throttle(THROTTLE_OPS, 1);
+
+      if (snprintf(rel1, MAXLEN, "%s/%s", rel, diritem->d_name) >= MAXLEN ||
+          snprintf(itemname, MAXLEN, "%s/%s",
+                   dirname, diritem->d_name) >= MAXLEN) overflow();
+
+      if (diritem->d_type == DT_DIR)
+         isdir = 1;
+      else if (diritem->d_type != DT_UNKNOWN)
+         isdir = 0;
+      else if (lstat(itemname, &itemstat) == 0)
+         isdir = S_ISDIR(itemstat.st_mode);
+      else
+         isdir = 0;
+
+      if (is_excluded(rel1, isdir)) {
+         empty = 0;
+      }
+      else if (isdir) {
+         if (delete_walk(rel1) && !dryrunflag && rmdir(itemname) == 0)
+            continue;
+         empty = 0;
+      }
+      else if (strcmp(diritem->d_name, MANIFEST_NAME) == 0) {
+         /* manifests would go stale, so are never kept */
+         if (!dryrunflag && unlink(itemname)) {
+            WARN("mergef_xattr: failed to remove %s\n", itemname);
+            return_value = -1;
+            empty = 0;
+         }
+      }
+      else if (!is_seen(rel1)) {
+         num_deleted++;
+         if (verboseflag) printf("deleting %s\n", rel1 + 1);
+         if (dryrunflag) {
+            empty = 0;
+         }
+         else if (remove_entry(rel1)) {
+            return_value = -1;
+            empty = 0;
+         }
+      }
+      else {
+         empty = 0;
+      }
+   }
+
+   if (dirscan_close(dirlist)) {
+      WARN("mergef_xattr: readdir failed on %s\n", dirname);
+      return_value = -1;
+      empty = 0;
+   }
+
+   return empty;
+}
+
+
+void usage()
+{
+   WARN("usage: mergef_xattr options dstdir\n");
+   WARN("  options:  --backup-dir dir\n");
+   WARN("            --dry-run\n");
+   WARN("            --verbose\n");
+   WARN("            --exclude pattern\n");
+   WARN("            --include pattern\n");
+   WARN("            --exclude-from file\n");
+   WARN("            --max-ops n\n");
+   WARN("            --max-meta-ops n\n");
+   WARN("            --max-bytes n\n");
+   WARN("            --throttle-file file\n");
+   WARN("            --nice n\n");
+   WARN("            --low-io\n");
+}
+
+
+int main(int argc, char **argv)
+{
+   char path[MAXLEN];
+   char rel[MAXLEN];
+   char mbuf[8];
+   struct stat dststat;
+   char *buf;
+   size_t len;
+   FILE *ofp;
+   int complete;
+   int ret;
+   long max_ops, max_meta_ops, max_bytes;
+   char *tname;
+   long nice_incr;
+   int lowioflag;
+
+   int i;
+
+   max_ops = 0;
+   max_meta_ops = 0;
+   max_bytes = 0;
+   tname = 0;
+   nice_incr = 0;
+   lowioflag = 0;
+
+   i = 1;
+   while (i < argc) {
+      if (strcmp(argv[i], "--backup-dir") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         backup_name = argv[i];
+         strip_slashes(backup_name);
+         i++;
+      }
+      else if (strcmp(argv[i], "--dry-run") == 0) {
+         i++;
+         dryrunflag = 1;
+      }
+      else if (strcmp(argv[i], "--verbose") == 0) {
+         i++;
+         verboseflag = 1;
+      }
+      else if (strcmp(argv[i], "--exclude") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         if (exclude_add(argv[i], 0)) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--include") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         if (exclude_add(argv[i], 1)) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--exclude-from") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         if (exclude_add_file(argv[i])) return -1;
+         i++;
+      }
+      else if (strcmp(argv[i], "--max-ops") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         max_ops = string_to_long(argv[i]);
+         if (conversion_error || max_ops < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--max-meta-ops") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         max_meta_ops = string_to_long(argv[i]);
+         if (conversion_error || max_meta_ops < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--max-bytes") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         max_bytes = string_to_long(argv[i]);
+         if (conversion_error || max_bytes < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--throttle-file") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         tname = argv[i];
+         i++;
+      }
+      else if (strcmp(argv[i], "--nice") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         nice_incr = string_to_long(argv[i]);
+         if (conversion_error || nice_incr < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--low-io") == 0) {
+         i++;
+         lowioflag = 1;
+      }
+      else
+         break;
+   }
+
+   if (i != argc-1) {
+      usage();
+      return -1;
+   }
+
+   destination_name = argv[argc-1];
+   strip_slashes(destination_name);
+
+   throttle_init(THROTTLE_OBJECTS, max_ops);
+   throttle_init(THROTTLE_OPS, max_meta_ops);
+   throttle_init(THROTTLE_BYTES, max_bytes);
+
+   if (tname && throttle_control(tname)) {
+      WARN("mergef_xattr: bad throttle file %s\n", tname);
+      return -1;
+   }
+
+   if (throttle_priority(nice_incr, lowioflag))
+      WARN("mergef_xattr: could not lower priority\n");
+
+   if (!dryrunflag && make_dirs(destination_name)) {
+      WARN("mergef_xattr: failed to create %s\n", destination_name);
+      return -1;
+   }
+
+   if (lstat(destination_name, &dststat) || !S_ISDIR(dststat.st_mode)) {
+      if (!dryrunflag) {
+         usage();
+         return -1;
+      }
+   }
+
+   if (fread(mbuf, 1, 8, stdin) != 8 || memcmp(magic, mbuf, 8)) {
+      WARN("bad file format\n");
+      return -1;
+   }
+
+   complete = 0;
+
+   while ( (ret = read_path(path)) > 0 ) {
+
+      if (strcmp(path, ".") == 0) {
+         complete = 1;
+         break;
+      }
+
+      if (check_path(path)) {
+         WARN("mergef_xattr: bad entry %s --- aborting\n", path);
+         return -1;
+      }
+
+      if (snprintf(rel, MAXLEN, "%s%s", path, DBL_SUFFIX) >= MAXLEN)
+         overflow();
+
+      buf = 0;
+      len = 0;
+
+      ofp = open_memstream(&buf, &len);
+      if (!ofp) {
+         WARNING;
+         return -1;
+      }
+
+      ret = copy_xattr(stdin, ofp);
+
+      if (fclose(ofp) || ret) {
+         WARN("mergef_xattr: bad container for %s --- aborting\n", path);
+         free(buf);
+         return -1;
+      }
+
+      merge_entry(rel, buf, len);
+      free(buf);
+   }
+
+   if (ret < 0 || (complete && getchar() != EOF)) {
+      WARN("bad file format\n");
+      return -1;
+   }
+
+   if (!complete) {
+      WARN("mergef_xattr: incomplete stream --- nothing deleted\n");
+      return -1;
+   }
+
+   if (lstat(destination_name, &dststat) == 0) delete_walk("");
+
+   if (verboseflag) {
+      printf("\ncontainers: %ld\n", num_entries);
+      printf("written: %ld\n", num_written);
+      printf("deleted: %ld\n", num_deleted);
+   }
+
+   return return_value;
+}
@@ -0,0 +1,367 @@
+
+/* usage: packf_xattr options dstdir
+ *    options:  --files-from file
+ *              --sorted
+ *              --max-ops n
+ *              --max-meta-ops n
+ *              --max-bytes n
+ *              --throttle-file file
+ *              --nice n
+ *              --low-io
+ *
+ * writes the containers in dstdir, a repository of xattr containers
+ * created by split_xattr (or mergef_xattr), to stdout, in the format
+ * written by splitf_xattr; so, typically, on the remote host,
+ *
+ *    ssh host packf_xattr dstdir | joinf_xattr srcdir
+ *
+ * does the work of join_xattr, without a local copy of the repository.
+ * As with splitf_xattr, the entries of a directory come before the
+ * directory itself.  If no errors were detected, the stream ends with
+ * an entry whose path is "." and which has no container (see
+ * joinf_xattr --reset).
+ *
+ * with the --files-from file option, only the containers of those
+ * files and directories listed in file (and of the directories
+ * above them) are written; file may be - for stdin.
+ *
+ * the --sorted flag causes the entries of each directory to be
+ * visited in sorted (strcmp) order, rather than in readdir order.
+ *
+ * the --max-ops flag limits the walk to about n objects per second
+ * (see throttle.h), so as to leave some of the disk to others;
+ * --max-meta-ops does the same for the opens of containers (and the
+ * lstat calls), which here come to about one per object, and
+ * --max-bytes for the bytes of containers read.  The --throttle-file,
+ * --nice and --low-io options are as in split_xattr.
+ *
+ * Returns -1 if errors detected, and 0 otherwise.
+ *
+ */
+
+#include "util.h"
+#include "xattr_util.h"
+#include "dirscan.h"
+#include "throttle.h"
+
+
+static char magic[8] = { 0xb7, 0x0e, 0xbf, 0xb2, 0xc2, 0x91, 0xf2, 0x92 };
+
+static int return_value = 0;
+static int sortedflag = 0;
+
+
+/* writes the entry for path ext, whose container is dblname;
+ * nothing is written if dblname does not exist.
+ */
+
+static
+void write_entry(const char *ext, const char *dblname)
+{
+   FILE *cfp, *ofp;
+   char *buf;
+   size_t len;
+   long extlen;
+   int ret;
+
+   cfp = fopen(dblname, "r");
+   if (!cfp) {
+      if (errno != ENOENT) {
+         WARN("packf_xattr: can't open %s\n", dblname);
+         return_value = -1;
+      }
+      return;
+   }
+
+   /* the container is checked before any of it is written,
+    * so that a bad one does not spoil the stream
+    */
+
+   buf = 0;
+   len = 0;
+
+   ofp = open_memstream(&buf, &len);
+   if (!ofp) {
+      WARNING;
+      exit(-1);
+   }
+
+   ret = copy_xattr(cfp, ofp);
+
+   fclose(cfp);
+
+   if (fclose(ofp) || ret) {
+      WARN("packf_xattr: bad container %s\n", dblname);
+      return_value = -1;
+      free(buf);
+      return;
+   }
+
+   /* len is only set once ofp is closed */
+
+   throttle(THROTTLE_BYTES, len);
+
+   extlen = strlen(ext);
+
+   if (fwrite(ext, 1, extlen+1, stdout) != extlen+1 ||
+       fwrite(buf, 1, len, stdout) != len) {
+      WARN("write error --- aborting\n");
+      exit(-1);
+   }
+
+   free(buf);
+}
+
+
+void dirwalk(const char *dirname, const char *ext, int walk_state)
+{
+   char itemname[MAXLEN];
+   char ext1[MAXLEN];
+   dirscan_t *dirlist;
+   struct dirscan_item *diritem;
+   struct stat itemstat;
+   int walk_state1;
+   long len;
+   int isdir;
+
+
+   dirlist = dirscan_open(dirname, sortedflag);
+
+   if (!dirlist) {
+      WARN("packf_xattr: opendir failed on %s\n", dirname);
+      return_value = -1;
+      return;
+   }
+
+   while ( (diritem = dirscan_next(dirlist)) ) {
+
+      throttle(THROTTLE_OBJECTS, 1);
+      throttle(THROTTLE_OPS, 1);
+
+      if (snprintf(itemname, MAXLEN, "%s/%s",
+          dirname, diritem->d_name) >= MAXLEN) overflow();
+
+      if (diritem->d_type == DT_DIR)
+         isdir = 1;
+      else if (diritem->d_type != DT_UNKNOWN)
+         isdir = 0;
+      else if (lstat(itemname, &itemstat) == 0)
+         isdir = S_ISDIR(itemstat.st_mode);
+      else
+         isdir = 0;
+
+      len = strlen(diritem->d_name);
+
+      if (isdir) {
+         if (snprintf(ext1, MAXLEN, "%s/%s", ext, diritem->d_name) >= MAXLEN)
+            overflow();
+      }
+      else {
+         /* skip anything but containers, and the container
+          * of the directory itself, which comes last
+          */
+
+         if (len <= DBL_SUFFIX_LEN ||
+             !is_suffix(DBL_SUFFIX, DBL_SUFFIX_LEN, diritem->d_name, len) ||
+             strcmp(diritem->d_name, "." DBL_SUFFIX) == 0)
+            continue;
+
+         if (snprintf(ext1, MAXLEN, "%s/%.*s", ext,
+             (int) (len - DBL_SUFFIX_LEN), diritem->d_name) >= MAXLEN)
+            overflow();
+      }
+
+      walk_state1 = walk_state;
+
+      if (walk_state1 == 0) {
+	    walk_state1 = lookup_name(ext1 + 1);
+	    if (walk_state1 == -1) continue; /* pruning */
+      }
+
+      if (isdir)
+         dirwalk(itemname, ext1, walk_state1);
+      else if (walk_state1 == 1)
+         write_entry(ext1, itemname);
+   }
+
+   if (dirscan_close(dirlist)) {
+      WARN("packf_xattr: readdir failed on %s\n", dirname);
+      return_value = -1;
+   }
+
+   if (snprintf(itemname, MAXLEN, "%s/.%s", dirname, DBL_SUFFIX) >= MAXLEN)
+      overflow();
+
+   write_entry(ext, itemname);
+}
+
+
+void usage()
+{
+   WARN("usage: packf_xattr options dstdir\n");
+   WARN("  options:  --files-from file\n");
+   WARN("            --sorted\n");
+   WARN("            --max-ops n\n");
+   WARN("            --max-meta-ops n\n");
+   WARN("            --max-bytes n\n");
+   WARN("            --throttle-file file\n");
+   WARN("            --nice n\n");
+   WARN("            --low-io\n");
+}
+
+
+int main(int argc, char **argv)
+{
+   char *fname, *dstname;
+   struct stat dststat;
+   int walk_state;
+   long max_ops, max_meta_ops, max_bytes;
+   char *tname;
+   long nice_incr;
+   int lowioflag;
+
+   int i;
+
+   fname = 0;
+   max_ops = 0;
+   max_meta_ops = 0;
+   max_bytes = 0;
+   tname = 0;
+   nice_incr = 0;
+   lowioflag = 0;
+
+   i = 1;
+   while (i < argc) {
+      if (strcmp(argv[i], "--files-from") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         fname = argv[i];
+         i++;
+      }
+      else if (strcmp(argv[i], "--sorted") == 0) {
+         i++;
+         sortedflag = 1;
+      }
+      else if (strcmp(argv[i], "--max-ops") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         max_ops = string_to_long(argv[i]);
+         if (conversion_error || max_ops < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--max-meta-ops") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         max_meta_ops = string_to_long(argv[i]);
+         if (conversion_error || max_meta_ops < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--max-bytes") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         max_bytes = string_to_long(argv[i]);
+         if (conversion_error || max_bytes < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--throttle-file") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         tname = argv[i];
+         i++;
+      }
+      else if (strcmp(argv[i], "--nice") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         nice_incr = string_to_long(argv[i]);
+         if (conversion_error || nice_incr < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--low-io") == 0) {
+         i++;
+         lowioflag = 1;
+      }
+      else
+         break;
+   }
+
+   if (i != argc-1) {
+      usage();
+      return -1;
+   }
+
+   dstname = argv[argc-1];
+
+   if (fname) {
+      if (strcmp(fname, "-") == 0) fname = "/dev/stdin";
+      collect_names(fname);
+      walk_state = 0;
+   }
+   else {
+      walk_state = 1;
+   }
+
+   strip_slashes(dstname);
+
+   if (lstat(dstname, &dststat) || !S_ISDIR(dststat.st_mode)) {
+      usage();
+      return -1;
+   }
+
+   throttle_init(THROTTLE_OBJECTS, max_ops);
+   throttle_init(THROTTLE_OPS, max_meta_ops);
+   throttle_init(THROTTLE_BYTES, max_bytes);
+
+   if (tname && throttle_control(tname)) {
+      WARN("packf_xattr: bad throttle file %s\n", tname);
+      return -1;
+   }
+
+   if (throttle_priority(nice_incr, lowioflag))
+      WARN("packf_xattr: could not lower priority\n");
+
+   if (fwrite(magic, 1, 8, stdout) != 8) {
+      WARN("write error --- aborting\n");
+      return -1;
+   }
+
+   dirwalk(dstname, "", walk_state);
+
+   if (return_value == 0) {
+      if (fwrite(".", 1, 2, stdout) != 2 || fflush(stdout)) {
+         WARN("write error --- aborting\n");
+         return -1;
+      }
+   }
+
+   return return_value;
+}
@@ -0,0 +1,276 @@
+
+#include <pthread.h>
+#include <time.h>
+
+#include "util.h"
+#include "progress.h"
+
+
+/* the rate is a moving average over about RATE_SECS seconds */
+
+#define RATE_SECS (60)
+
+static char *status_name = 0;
+static char *temp_name = 0;
+static char *tool_name = 0;
+
+static long objects = 0;
+static long items = 0;
+static long bytes = 0;
+static char current[MAXLEN];
+
+static time_t started = 0;
+static long expected = 0;
+
+static double rate = -1;
+static double last_time = 0;
+static long last_objects = 0;
+
+static int stop = 0;
+static int write_error = 0;
+static pthread_t writer;
+
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t progress_cond = PTHREAD_COND_INITIALIZER;
+
+
+static
+double now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+/* reads the number of objects visited by the run that left fname,
+ * if it finished; returns 0 otherwise
+ */
+
+static
+long read_expected(const char *fname)
+{
+   FILE *fp;
+   char line[MAXLEN];
+   long len, n;
+   int finished;
+
+   fp = fopen(fname, "r");
+   if (!fp) return 0;
+
+   n = 0;
+   finished = 0;
+
+   while (fgets(line, MAXLEN, fp)) {
+      len = strlen(line);
+      if (len > 0 && line[len-1] == '\n') line[--len] = '\0';
+
+      if (strcmp(line, "state finished") == 0)
+         finished = 1;
+      else if (strncmp(line, "objects ", 8) == 0) {
+         n = string_to_long(line + 8);
+         if (conversion_error || n < 0) n = 0;
+      }
+   }
+
+   fclose(fp);
+
+   return finished ? n : 0;
+}
+
+
+/* writes the status file; called with progress_lock held, which is
+ * released while the file is written.  Returns 0 on success, and -1
+ * on error.
+ */
+
+static
+int write_status(const char *state)
+{
+   FILE *fp;
+   double t, alpha;
+   long o, i, b, eta;
+   time_t updated;
+   char cur[MAXLEN];
+
+   t = now();
+   updated = time(0);
+
+   /* the first interval sets the rate; later ones are averaged in */
+
+   if (t - last_time >= 1) {
+      alpha = (rate < 0) ? 1 : (t - last_time) / RATE_SECS;
+      if (alpha > 1) alpha = 1;
+      rate += alpha * ((objects - last_objects) / (t - last_time) - rate);
+      last_time = t;
+      last_objects = objects;
+   }
+
+   o = objects;
+   i = items;
+   b = bytes;
+   strcpy(cur, current);
+
+   if (strcmp(state, "finished") == 0)
+      eta = 0;
+   else if (expected > o && rate > 0)
+      eta = (long) ((expected - o) / rate);
+   else
+      eta = -1;
+
+   pthread_mutex_unlock(&progress_lock);
+
+   fp = fopen(temp_name, "w");
+
+   if (!fp ||
+       fprintf(fp, "tool %s\n", tool_name) < 0 ||
+       fprintf(fp, "state %s\n", state) < 0 ||
+       fprintf(fp, "pid %ld\n", (long) getpid()) < 0 ||
+       fprintf(fp, "started %ld\n", (long) started) < 0 ||
+       fprintf(fp, "updated %ld\n", (long) updated) < 0 ||
+       fprintf(fp, "elapsed %ld\n", (long) (updated - started)) < 0 ||
+       fprintf(fp, "objects %ld\n", o) < 0 ||
+       fprintf(fp, "items %ld\n", i) < 0 ||
+       fprintf(fp, "bytes %ld\n", b) < 0 ||
+       fprintf(fp, "rate %ld\n", (long) (rate > 0 ? rate + 0.5 : 0)) < 0 ||
+       fprintf(fp, "expected %ld\n", expected) < 0 ||
+       fprintf(fp, "eta %ld\n", eta) < 0 ||
+       fprintf(fp, "current %s\n", cur) < 0 ||
+       fclose(fp) ||
+       rename(temp_name, status_name)) {
+
+      if (fp) unlink(temp_name);
+
+      pthread_mutex_lock(&progress_lock);
+      return -1;
+   }
+
+   pthread_mutex_lock(&progress_lock);
+   return 0;
+}
+
+
+static
+void *run_writer(void *arg)
+{
+   struct timeval tv;
+   struct timespec ts;
+
+   pthread_mutex_lock(&progress_lock);
+
+   for (;;) {
+      gettimeofday(&tv, 0);
+      ts.tv_sec = tv.tv_sec + PROGRESS_SECS;
+      ts.tv_nsec = tv.tv_usec * 1000;
+
+      while (!stop && pthread_cond_timedwait(&progress_cond,
+                                             &progress_lock, &ts) == 0) ;
+
+      if (stop) break;
+
+      /* a failure is only reported once, but the file is still
+       * rewritten, in case it was a passing one
+       */
+
+      if (write_status("running") && !write_error) {
+         WARN("progress: failed to write %s\n", status_name);
+         write_error = 1;
+      }
+   }
+
+   pthread_mutex_unlock(&progress_lock);
+
+   return 0;
+}
+
+
+int progress_open(const char *fname, const char *tool)
+{
+   long len = strlen(fname);
+   int ret;
+
+   status_name = strdup(fname);
+   tool_name = strdup(tool);
+   temp_name = (char *) malloc(len + 5);
+
+   if (!status_name || !tool_name || !temp_name) {
+      Warning("malloc error");
+      exit(-1);
+   }
+
+   sprintf(temp_name, "%s.tmp", fname);
+
+   expected = read_expected(fname);
+
+   started = time(0);
+   last_time = now();
+   current[0] = '\0';
+
+   pthread_mutex_lock(&progress_lock);
+   ret = write_status("running");
+   pthread_mutex_unlock(&progress_lock);
+
+   if (ret || pthread_create(&writer, 0, run_writer, 0)) {
+      free(status_name);
+      free(tool_name);
+      free(temp_name);
+      status_name = tool_name = temp_name = 0;
+      return -1;
+   }
+
+   return 0;
+}
+
+
+void progress_object(void)
+{
+   if (!status_name) return;
+
+   pthread_mutex_lock(&progress_lock);
+   objects++;
+   pthread_mutex_unlock(&progress_lock);
+}
+
+void progress_item(long n)
+{
+   if (!status_name) return;
+
+   pthread_mutex_lock(&progress_lock);
+   items++;
+   bytes += n;
+   pthread_mutex_unlock(&progress_lock);
+}
+
+void progress_current(const char *path)
+{
+   if (!status_name) return;
+
+   pthread_mutex_lock(&progress_lock);
+   if (snprintf(current, MAXLEN, "%s", path) >= MAXLEN) overflow();
+   pthread_mutex_unlock(&progress_lock);
+}
+
+
+int progress_close(int done)
+{
+   int ret;
+
+   if (!status_name) return 0;
+
+   pthread_mutex_lock(&progress_lock);
+   stop = 1;
+   pthread_cond_broadcast(&progress_cond);
+   pthread_mutex_unlock(&progress_lock);
+
+   pthread_join(writer, 0);
+
+   pthread_mutex_lock(&progress_lock);
+   ret = write_status(done ? "finished" : "stopped");
+   pthread_mutex_unlock(&progress_lock);
+
+   free(status_name);
+   status_name = 0;
+
+   return ret;
+}
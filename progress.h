@@ -0,0 +1,62 @@
+#ifndef XBUP__progress_H
+#define XBUP__progress_H
+
+/* progress: a status file that a tree walker (or joinf_xattr) rewrites
+ * every PROGRESS_SECS seconds while it runs, so that an operator can
+ * see how far along it is, and whether it is stuck, and a scheduler
+ * can decide what to do while it is still running.
+ *
+ * The file is a list of "key value" lines:
+ *    tool n          the program
+ *    state s         running, finished (the walk was completed), or
+ *                    stopped (cut short: deadline, fatal error...)
+ *    pid n
+ *    started t       the start time (seconds since the epoch)
+ *    updated t       the time of this update
+ *    elapsed n       seconds
+ *    objects n       objects visited
+ *    items n         containers written (split_xattr, splitf_xattr),
+ *                    or applied (join_xattr, joinf_xattr); files
+ *                    hashed (xsum); changes listed (scan_changes)
+ *    bytes n         bytes of those containers (or files)
+ *    rate n          objects per second, over the last minute or so
+ *    expected n      objects visited by the last finished run
+ *                    (0 if unknown)
+ *    eta n           seconds until done, going by expected and rate
+ *                    (-1 if unknown)
+ *    current path    the directory being walked (or, for joinf_xattr,
+ *                    the object being applied)
+ * The file is replaced by rename, so a reader always sees a complete
+ * one; the updated time stops moving if the process dies, and the
+ * counts stop moving if it is stuck.
+ *
+ * Since the file a run ends up with records how many objects it
+ * visited, the next run with the same file knows how many to expect.
+ */
+
+#define PROGRESS_SECS (2)
+
+/* progress_open starts writing the status file fname for the program
+ * tool, from a thread of its own.  Returns 0 on success, and -1 on
+ * error.  Until it is called, the other functions do nothing.
+ */
+
+int progress_open(const char *fname, const char *tool);
+
+/* progress_object counts an object visited; progress_item counts an
+ * item (see above) of n bytes; progress_current sets the current path.
+ * All may be called from any thread.
+ */
+
+void progress_object(void);
+void progress_item(long n);
+void progress_current(const char *path);
+
+/* progress_close writes the file a last time, with the state finished
+ * if done is set, and stopped otherwise, and stops the thread.
+ * Returns 0 on success, and -1 on error.
+ */
+
+int progress_close(int done);
+
+#endif
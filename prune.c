@@ -0,0 +1,494 @@
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "util.h"
+#include "prune.h"
+#include "throttle.h"
+
+
+/* a directory waiting to be (or being) emptied and removed;
+ * only the roots have a whole path as their name, the others are
+ * opened and removed relative to the descriptor of their parent,
+ * which stays open until they are gone
+ */
+
+struct node {
+   char *name;
+   struct node *parent;
+   int dfd;             /* once it has been scanned */
+   long pending;        /* its own scan, plus subdirectories not yet gone */
+   int failed;          /* something below could not be removed */
+   struct node *next;   /* link on the work stack */
+};
+
+static struct node *stack = 0;
+static long outstanding = 0;       /* nodes not yet finished */
+static struct prune_stats totals;
+
+static pthread_mutex_t prune_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prune_cond = PTHREAD_COND_INITIALIZER;
+
+
+static
+struct node *new_node(const char *name, struct node *parent)
+{
+   struct node *np;
+
+   np = (struct node *) malloc(sizeof(struct node));
+   if (!np) {
+      Warning("malloc error");
+      exit(-1);
+   }
+
+   np->name = strdup(name);
+   if (!np->name) {
+      Warning("malloc error");
+      exit(-1);
+   }
+
+   np->parent = parent;
+   np->dfd = -1;
+   np->pending = 1;
+   np->failed = 0;
+   np->next = 0;
+
+   return np;
+}
+
+
+/* the descriptor that the name of np is relative to */
+
+static
+int parent_fd(const struct node *np)
+{
+   return np->parent ? np->parent->dfd : AT_FDCWD;
+}
+
+
+/* writes the path of name in np (or of np itself, if name is null)
+ * into buf, for messages only: a path too long for buf is cut short
+ * at the front, since the end of it says the most
+ */
+
+static
+const char *node_path(const struct node *np, const char *name, 
+                      char *buf, long size)
+{
+   const struct node *p;
+   long len, pos;
+
+   pos = size - 1;
+   buf[pos] = '\0';
+
+   if (name) {
+      len = strlen(name);
+      if (len > pos) len = pos;
+      pos -= len;
+      memcpy(buf + pos, name + strlen(name) - len, len);
+   }
+
+   for (p = np; p && pos > 0; p = p->parent) {
+      if (p != np || name) buf[--pos] = '/';
+
+      len = strlen(p->name);
+      if (len > pos) len = pos;
+      pos -= len;
+      memcpy(buf + pos, p->name + strlen(p->name) - len, len);
+   }
+
+   if (p && pos == 0 && size > 4) memcpy(buf, "...", 3);
+
+   return buf + pos;
+}
+
+
+/* finish_node is called when one of the things np was waiting for
+ * is done; once nothing is pending, np itself is removed, which
+ * may in turn finish its parent.
+ */
+
+static
+void finish_node(struct node *np)
+{
+   struct node *parent;
+   char buf[MAXLEN];
+   int ret;
+
+   for (;;) {
+      pthread_mutex_lock(&prune_lock);
+      np->pending--;
+      if (np->pending > 0) {
+         pthread_mutex_unlock(&prune_lock);
+         return;
+      }
+      pthread_mutex_unlock(&prune_lock);
+
+      /* nothing below np needs its descriptor any more */
+
+      if (np->dfd >= 0) close(np->dfd);
+      np->dfd = -1;
+
+      ret = 0;
+      if (!np->failed) {
+         ret = unlinkat(parent_fd(np), np->name, AT_REMOVEDIR);
+         if (ret) 
+            WARN("prune: failed to remove %s\n", 
+                 node_path(np, 0, buf, MAXLEN));
+      }
+
+      pthread_mutex_lock(&prune_lock);
+
+      if (np->failed || ret) {
+         if (ret) totals.errors++;
+         if (np->parent) np->parent->failed = 1;
+      }
+      else {
+         totals.dirs++;
+      }
+
+      outstanding--;
+      if (outstanding == 0) pthread_cond_broadcast(&prune_cond);
+
+      pthread_mutex_unlock(&prune_lock);
+
+      parent = np->parent;
+      free(np->name);
+      free(np);
+
+      if (!parent) return;
+      np = parent;
+   }
+}
+
+
+/* scan_node removes all the non-directories in np,
+ * and queues up its subdirectories.
+ */
+
+static
+void scan_node(struct node *np)
+{
+   char buf[MAXLEN];
+   struct node *children, *cp;
+   long nchildren, files, errors;
+   struct dirent *dp;
+   struct stat st;
+   DIR *dir;
+   int dfd, fd, isdir;
+
+   children = 0;
+   nchildren = files = errors = 0;
+
+   /* the directory is read through a copy of its descriptor, so that
+    * the descriptor itself can be kept (without the buffers of the
+    * DIR) for as long as its subdirectories need it
+    */
+
+   dfd = openat(parent_fd(np), np->name, 
+                O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+   np->dfd = dfd;
+
+   dir = 0;
+   if (dfd >= 0) {
+      fd = dup(dfd);
+      if (fd >= 0) {
+         dir = fdopendir(fd);
+         if (!dir) close(fd);
+      }
+   }
+
+   if (!dir) {
+      WARN("prune: failed to open %s\n", node_path(np, 0, buf, MAXLEN));
+      errors++;
+      np->failed = 1;
+   }
+   else {
+      while ( (dp = readdir(dir)) ) {
+         if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0)
+            continue;
+
+         /* the unlinkat (or, for a directory, the unlinkat that
+          * will remove it) is charged now
+          */
+
+         throttle(THROTTLE_OBJECTS, 1);
+         throttle(THROTTLE_OPS, 1);
+
+         if (dp->d_type == DT_DIR)
+            isdir = 1;
+         else if (dp->d_type != DT_UNKNOWN)
+            isdir = 0;
+         else if (fstatat(dfd, dp->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+            isdir = S_ISDIR(st.st_mode);
+         else
+            isdir = 0;
+
+         if (isdir) {
+            cp = new_node(dp->d_name, np);
+            cp->next = children;
+            children = cp;
+            nchildren++;
+         }
+         else if (unlinkat(dfd, dp->d_name, 0) == 0) {
+            files++;
+         }
+         else if (errno != ENOENT) {
+            WARN("prune: failed to remove %s\n", 
+                 node_path(np, dp->d_name, buf, MAXLEN));
+            errors++;
+            np->failed = 1;
+         }
+      }
+
+      closedir(dir);
+   }
+
+   pthread_mutex_lock(&prune_lock);
+
+   totals.files += files;
+   totals.errors += errors;
+
+   if (children) {
+      for (cp = children; cp->next; cp = cp->next) ;
+      cp->next = stack;
+      stack = children;
+
+      np->pending += nchildren;
+      outstanding += nchildren;
+      pthread_cond_broadcast(&prune_cond);
+   }
+
+   pthread_mutex_unlock(&prune_lock);
+
+   finish_node(np);
+}
+
+
+static
+void *worker(void *dummy)
+{
+   struct node *np;
+
+   pthread_mutex_lock(&prune_lock);
+
+   for (;;) {
+      while (!stack && outstanding > 0)
+         pthread_cond_wait(&prune_cond, &prune_lock);
+
+      if (!stack) break;
+
+      np = stack;
+      stack = np->next;
+
+      pthread_mutex_unlock(&prune_lock);
+      scan_node(np);
+      pthread_mutex_lock(&prune_lock);
+   }
+
+   pthread_mutex_unlock(&prune_lock);
+   return 0;
+}
+
+
+/* every directory being emptied holds a descriptor, so a deep tree
+ * needs many of them: the soft limit is raised as far as it goes
+ */
+
+static
+void raise_fd_limit(void)
+{
+   struct rlimit rl;
+
+   if (getrlimit(RLIMIT_NOFILE, &rl)) return;
+
+#ifdef OPEN_MAX
+   if (rl.rlim_max == RLIM_INFINITY || rl.rlim_max > OPEN_MAX)
+      rl.rlim_max = OPEN_MAX;
+#endif
+
+   if (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur >= rl.rlim_max) return;
+
+   rl.rlim_cur = rl.rlim_max;
+   setrlimit(RLIMIT_NOFILE, &rl);
+}
+
+
+static
+void show_progress(void)
+{
+   WARN("prune: removed %ld files, %ld directories\n",
+        totals.files, totals.dirs);
+}
+
+
+int prune_tree(char **paths, long n, long nthreads, int progress,
+               struct prune_stats *stats)
+{
+   struct stat st;
+   struct node *np;
+   pthread_t *threads;
+   struct timespec deadline;
+   time_t next_report;
+   long i, started;
+
+   memset(&totals, 0, sizeof(totals));
+   stack = 0;
+   outstanding = 0;
+
+   raise_fd_limit();
+
+   for (i = 0; i < n; i++) {
+      if (lstat(paths[i], &st)) {
+         if (errno != ENOENT) {
+            WARN("prune: lstat failed on %s\n", paths[i]);
+            totals.errors++;
+         }
+         continue;
+      }
+
+      if (!S_ISDIR(st.st_mode)) {
+         if (unlink(paths[i]) == 0)
+            totals.files++;
+         else {
+            WARN("prune: failed to remove %s\n", paths[i]);
+            totals.errors++;
+         }
+         continue;
+      }
+
+      np = new_node(paths[i], 0);
+      np->next = stack;
+      stack = np;
+      outstanding++;
+   }
+
+   started = 0;
+   threads = 0;
+
+   if (nthreads > 1 && outstanding > 0) {
+      threads = (pthread_t *) calloc(nthreads, sizeof(pthread_t));
+      if (!threads) {
+         Warning("malloc error");
+         exit(-1);
+      }
+
+      for (started = 0; started < nthreads; started++)
+         if (pthread_create(&threads[started], 0, worker, 0)) break;
+   }
+
+   if (started == 0) {
+      worker(0);
+   }
+   else {
+      pthread_mutex_lock(&prune_lock);
+
+      next_report = time(0) + 1;
+
+      while (outstanding > 0) {
+         if (progress) {
+            deadline.tv_sec = next_report;
+            deadline.tv_nsec = 0;
+            pthread_cond_timedwait(&prune_cond, &prune_lock, &deadline);
+
+            if (outstanding > 0 && time(0) >= next_report) {
+               show_progress();
+               next_report = time(0) + 1;
+            }
+         }
+         else {
+            pthread_cond_wait(&prune_cond, &prune_lock);
+         }
+      }
+
+      pthread_mutex_unlock(&prune_lock);
+
+      for (i = 0; i < started; i++)
+         pthread_join(threads[i], 0);
+   }
+
+   free(threads);
+
+   if (progress) show_progress();
+
+   if (stats) *stats = totals;
+
+   return totals.errors ? -1 : 0;
+}
+
+
+int prune_entries(const char *dirname, const char *pattern, long days,
+                  long nthreads, int progress, struct prune_stats *stats)
+{
+   char itemname[MAXLEN];
+   struct stat st;
+   struct dirent *dp;
+   DIR *dir;
+   char **paths;
+   long n, size, i;
+   time_t now;
+   int ret;
+
+   dir = opendir(dirname);
+   if (!dir) {
+      WARN("prune: opendir failed on %s\n", dirname);
+      if (stats) {
+         memset(stats, 0, sizeof(*stats));
+         stats->errors = 1;
+      }
+      return -1;
+   }
+
+   now = time(0);
+   n = 0;
+   size = 16;
+   paths = (char **) malloc(size * sizeof(char *));
+   if (!paths) {
+      Warning("malloc error");
+      exit(-1);
+   }
+
+   while ( (dp = readdir(dir)) ) {
+      if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0)
+         continue;
+
+      if (pattern && fnmatch(pattern, dp->d_name, FNM_PERIOD) != 0)
+         continue;
+
+      if (snprintf(itemname, MAXLEN, "%s/%s",
+          dirname, dp->d_name) >= MAXLEN) overflow();
+
+      if (days >= 0) {
+         if (lstat(itemname, &st)) continue;
+         if ((now - st.st_mtime) / 86400 <= days) continue;
+      }
+
+      if (n == size) {
+         size *= 2;
+         paths = (char **) realloc(paths, size * sizeof(char *));
+         if (!paths) {
+            Warning("malloc error");
+            exit(-1);
+         }
+      }
+
+      paths[n] = strdup(itemname);
+      if (!paths[n]) {
+         Warning("malloc error");
+         exit(-1);
+      }
+      n++;
+   }
+
+   closedir(dir);
+
+   ret = prune_tree(paths, n, nthreads, progress, stats);
+
+   for (i = 0; i < n; i++) free(paths[i]);
+   free(paths);
+
+   return ret;
+}
@@ -0,0 +1,49 @@
+#ifndef XBUP__prune_H
+#define XBUP__prune_H
+
+/* prune: fast removal of large trees (old archives, scratch trees
+ * of xattr containers).
+ *
+ * Directories are read through directory file descriptors: each
+ * subdirectory is opened with openat relative to its parent, and
+ * entries are removed with unlinkat relative to their directory,
+ * so no path names are built, and a tree too deep for a path name
+ * (as rm -rf can remove) is no problem.
+ * Subdirectories are handed to a pool of threads, and a directory
+ * is removed as soon as the last of its subdirectories is gone.
+ * Symlinks are never followed.
+ *
+ * Each entry removed is charged to the THROTTLE_OBJECTS and
+ * THROTTLE_OPS buckets (see throttle.h), which do nothing unless the
+ * caller has set their rates.
+ *
+ * With nthreads <= 1, everything happens in the calling thread.
+ * If progress is set, running totals are written to stderr
+ * about once a second.
+ */
+
+struct prune_stats {
+   long files;    /* non-directories removed */
+   long dirs;     /* directories removed */
+   long errors;
+};
+
+/* prune_tree removes each of the n paths, along with everything
+ * below them; paths that do not exist are ignored (as with rm -rf).
+ * Returns 0 on success, and -1 if anything could not be removed.
+ */
+
+int prune_tree(char **paths, long n, long nthreads, int progress,
+               struct prune_stats *stats);
+
+/* prune_entries removes those entries of the directory dirname
+ * whose names match the shell pattern (if pattern is non-null),
+ * and whose mtime is more than days days old (if days >= 0),
+ * in the sense of find -mtime +days.
+ * Returns 0 on success, and -1 if anything could not be removed.
+ */
+
+int prune_entries(const char *dirname, const char *pattern, long days,
+                  long nthreads, int progress, struct prune_stats *stats);
+
+#endif
@@ -0,0 +1,491 @@
+
+/* usage: scan_changes options srcdir
+ *    options:  --snapshot file
+ *              --max-ops n
+ *              --max-meta-ops n
+ *              --throttle-file file
+ *              --nice n
+ *              --low-io
+ *              --progress file
+ *
+ * lists the objects in srcdir that have changed since the last scan.
+ *
+ * The state of srcdir is recorded as a snapshot of
+ * (path, inode, size, mtime, ctime, mode) for every object.
+ * The previous snapshot is read from file (if it exists), and the
+ * new one is written to file.new; it is up to the caller to rename
+ * file.new to file once the changes have been dealt with.
+ *
+ * The names of all new and changed objects, and of the top-most
+ * deleted objects, are written to stdout, relative to srcdir,
+ * null terminated.  This list is suitable for
+ * rsync -d --from0 --files-from --delete-missing-args.
+ * Since directories are not listed recursively, every object in
+ * a new directory is listed.
+ *
+ * The directory walk visits entries in sorted order, and the
+ * snapshot is kept in that same order, so the old and new snapshots
+ * are simply merged, and memory use does not depend on the size
+ * of srcdir.
+ *
+ * Objects whose ctime is too close to the time of the scan are
+ * recorded with a ctime of 0, so that they are listed again on
+ * the next scan (they may have changed again within the same second).
+ *
+ * If errors are detected, the list of changes is incomplete, and
+ * the caller should fall back to a full comparison.
+ *
+ * the --max-ops flag limits the walk to about n objects per second
+ * (see throttle.h), so as to leave some of the disk to others.
+ * The --max-meta-ops flag does the same for lstat calls, which here
+ * come to one per object (the snapshots are not counted); the
+ * --throttle-file, --nice and --low-io options are as in split_xattr.
+ *
+ * with the --progress file option, the objects walked, the changes
+ * listed, the rate and an estimate of the time left are written to
+ * file every few seconds (see progress.h).
+ *
+ * Returns -1 if errors detected, and 0 otherwise.
+ *
+ */
+
+#include <time.h>
+
+#include "util.h"
+#include "dirscan.h"
+#include "throttle.h"
+#include "progress.h"
+
+
+static const char snapshot_magic[8] =
+   { 'x', 'b', 's', 'n', 'a', 'p', '1', '\n' };
+
+struct snapshot_rec {
+   char path[MAXLEN];
+   uint64_t ino;
+   uint64_t size;
+   int64_t mtime;
+   int64_t ctime;
+   uint32_t mode;
+};
+
+static int return_value = 0;
+static int source_name_len = 0;
+static time_t scan_time = 0;
+
+static FILE *old_fp = 0;
+static FILE *new_fp = 0;
+static int old_valid = 0;
+static struct snapshot_rec old_rec;
+
+static char deleted_prefix[MAXLEN];
+static int deleted_prefix_len = -1;
+
+
+
+static
+int read_rec(FILE *fp, struct snapshot_rec *rec)
+{
+   int c;
+   long i;
+
+   i = 0;
+   while ( (c = getc(fp)) != EOF && c != '\0' ) {
+      if (i == MAXLEN-1) return -1;
+      rec->path[i++] = c;
+   }
+
+   if (c == EOF) {
+      if (i == 0 && !ferror(fp)) return 0;
+      return -1;
+   }
+
+   rec->path[i] = '\0';
+
+   if (fread(&rec->ino, sizeof(rec->ino), 1, fp) != 1 ||
+       fread(&rec->size, sizeof(rec->size), 1, fp) != 1 ||
+       fread(&rec->mtime, sizeof(rec->mtime), 1, fp) != 1 ||
+       fread(&rec->ctime, sizeof(rec->ctime), 1, fp) != 1 ||
+       fread(&rec->mode, sizeof(rec->mode), 1, fp) != 1) return -1;
+
+   return 1;
+}
+
+
+static
+void write_rec(FILE *fp, const struct snapshot_rec *rec)
+{
+   fwrite(rec->path, 1, strlen(rec->path) + 1, fp);
+   fwrite(&rec->ino, sizeof(rec->ino), 1, fp);
+   fwrite(&rec->size, sizeof(rec->size), 1, fp);
+   fwrite(&rec->mtime, sizeof(rec->mtime), 1, fp);
+   fwrite(&rec->ctime, sizeof(rec->ctime), 1, fp);
+   fwrite(&rec->mode, sizeof(rec->mode), 1, fp);
+}
+
+
+static
+void next_old(void)
+{
+   int ret;
+
+   if (!old_fp) {
+      old_valid = 0;
+      return;
+   }
+
+   ret = read_rec(old_fp, &old_rec);
+
+   if (ret == -1) {
+      WARN("scan_changes: bad snapshot\n");
+      return_value = -1;
+   }
+
+   old_valid = (ret == 1);
+}
+
+
+/* path_cmp compares paths in the order of the walk:
+ * a directory comes before its entries, and the entries of
+ * a directory are sorted by strcmp.  This is just strcmp,
+ * except that '/' comes before every other character.
+ * The root "." comes before everything.
+ */
+
+static
+int path_cmp(const char *a, const char *b)
+{
+   const unsigned char *p = (const unsigned char *) a;
+   const unsigned char *q = (const unsigned char *) b;
+   int c, d;
+
+   if (strcmp(a, ".") == 0) return strcmp(b, ".") == 0 ? 0 : -1;
+   if (strcmp(b, ".") == 0) return 1;
+
+   while (*p && *p == *q) {
+      p++;
+      q++;
+   }
+
+   c = (*p == '/') ? 1 : (*p == '\0') ? 0 : *p + 1;
+   d = (*q == '/') ? 1 : (*q == '\0') ? 0 : *q + 1;
+
+   return c - d;
+}
+
+
+static
+void emit(const char *path)
+{
+   printf("%s", path);
+   putchar('\0');
+
+   progress_item(0);
+}
+
+
+/* objects below a deleted directory are not listed */
+
+static
+void set_deleted_prefix(const char *path)
+{
+   if (snprintf(deleted_prefix, MAXLEN, "%s/", path) >= MAXLEN) overflow();
+   deleted_prefix_len = strlen(deleted_prefix);
+}
+
+static
+void deleted(const struct snapshot_rec *rec)
+{
+   if (deleted_prefix_len >= 0 &&
+       strncmp(rec->path, deleted_prefix, deleted_prefix_len) == 0)
+      return;
+
+   emit(rec->path);
+
+   if (S_ISDIR(rec->mode)) set_deleted_prefix(rec->path);
+}
+
+
+static
+void process_item(const char *path, const struct stat *itemstat)
+{
+   struct snapshot_rec rec;
+   int cmp;
+
+   if (snprintf(rec.path, MAXLEN, "%s", path) >= MAXLEN) overflow();
+   rec.ino = itemstat->st_ino;
+   rec.size = itemstat->st_size;
+   rec.mtime = itemstat->st_mtime;
+   rec.ctime = itemstat->st_ctime;
+   rec.mode = itemstat->st_mode;
+
+   cmp = 1;
+
+   while (old_valid && (cmp = path_cmp(old_rec.path, path)) < 0) {
+      deleted(&old_rec);
+      next_old();
+   }
+
+   if (old_valid && cmp == 0) {
+      if (old_rec.ino != rec.ino || old_rec.size != rec.size ||
+          old_rec.mtime != rec.mtime || old_rec.ctime != rec.ctime ||
+          old_rec.mode != rec.mode) {
+
+         emit(path);
+
+         /* a directory replaced by something else takes its
+          * contents with it
+          */
+         if (S_ISDIR(old_rec.mode) && !S_ISDIR(rec.mode))
+            set_deleted_prefix(path);
+      }
+
+      next_old();
+   }
+   else {
+      emit(path);
+   }
+
+   if (rec.ctime >= scan_time - 1) rec.ctime = 0;
+
+   write_rec(new_fp, &rec);
+}
+
+
+void dirwalk(const char *dirname)
+{
+   char itemname[MAXLEN];
+   dirscan_t *dirlist;
+   struct dirscan_item *diritem;
+   struct stat itemstat;
+
+
+   progress_current(dirname);
+
+   dirlist = dirscan_open(dirname, 1);
+
+   if (!dirlist) {
+      WARN("scan_changes: opendir failed on %s\n", dirname);
+      return_value = -1;
+      return;
+   }
+
+   while ( (diritem = dirscan_next(dirlist)) ) {
+
+      throttle(THROTTLE_OBJECTS, 1);
+      throttle(THROTTLE_OPS, 1);
+      progress_object();
+
+      if (snprintf(itemname, MAXLEN, "%s/%s",
+          dirname, diritem->d_name) >= MAXLEN) overflow();
+
+      if (lstat(itemname, &itemstat)) {
+         WARN("scan_changes: lstat failed on %s\n", itemname);
+         return_value = -1;
+         continue;
+      }
+
+      process_item(itemname + source_name_len + 1, &itemstat);
+
+      if (S_ISDIR(itemstat.st_mode)) {
+	 dirwalk(itemname);
+      }
+
+   }
+
+   if (dirscan_close(dirlist)) {
+      WARN("scan_changes: readdir failed on %s\n", dirname);
+      return_value = -1;
+   }
+}
+
+void usage()
+{
+   WARN("usage: scan_changes options srcdir\n");
+   WARN("  options:  --snapshot file\n");
+   WARN("            --max-ops n\n");
+   WARN("            --max-meta-ops n\n");
+   WARN("            --throttle-file file\n");
+   WARN("            --nice n\n");
+   WARN("            --low-io\n");
+   WARN("            --progress file\n");
+}
+
+
+int main(int argc, char **argv)
+{
+   char *sname, *srcname;
+   char newname[MAXLEN];
+   char magic[sizeof(snapshot_magic)];
+   struct stat srcstat;
+   long max_ops, max_meta_ops;
+   char *tname;
+   long nice_incr;
+   int lowioflag;
+   char *pname;
+   int i;
+
+   sname = 0;
+   max_ops = 0;
+   max_meta_ops = 0;
+   tname = 0;
+   nice_incr = 0;
+   lowioflag = 0;
+   pname = 0;
+
+   i = 1;
+   while (i < argc) {
+      if (strcmp(argv[i], "--snapshot") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         sname = argv[i];
+         i++;
+      }
+      else if (strcmp(argv[i], "--max-ops") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         max_ops = string_to_long(argv[i]);
+         if (conversion_error || max_ops < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--max-meta-ops") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         max_meta_ops = string_to_long(argv[i]);
+         if (conversion_error || max_meta_ops < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--throttle-file") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         tname = argv[i];
+         i++;
+      }
+      else if (strcmp(argv[i], "--nice") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         nice_incr = string_to_long(argv[i]);
+         if (conversion_error || nice_incr < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--low-io") == 0) {
+         i++;
+         lowioflag = 1;
+      }
+      else if (strcmp(argv[i], "--progress") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         pname = argv[i];
+         i++;
+      }
+
+      else
+         break;
+   }
+
+   if (i != argc-1 || !sname) {
+      usage();
+      return -1;
+   }
+
+   srcname = argv[argc-1];
+
+   source_name_len = strip_slashes(srcname);
+
+   if (lstat(srcname, &srcstat) || !S_ISDIR(srcstat.st_mode)) {
+      usage();
+      return -1;
+   }
+
+   if (snprintf(newname, MAXLEN, "%s.new", sname) >= MAXLEN) overflow();
+
+   old_fp = fopen(sname, "r");
+   if (old_fp) {
+      if (fread(magic, 1, sizeof(magic), old_fp) != sizeof(magic) ||
+          memcmp(magic, snapshot_magic, sizeof(magic)) != 0) {
+         WARN("scan_changes: %s is not a snapshot\n", sname);
+         return -1;
+      }
+   }
+   else if (errno != ENOENT) {
+      WARN("scan_changes: can't open %s\n", sname);
+      return -1;
+   }
+
+   new_fp = fopen(newname, "w");
+   if (!new_fp) {
+      WARN("scan_changes: can't create %s\n", newname);
+      return -1;
+   }
+
+   fwrite(snapshot_magic, 1, sizeof(snapshot_magic), new_fp);
+
+   scan_time = time(0);
+
+   throttle_init(THROTTLE_OBJECTS, max_ops);
+   throttle_init(THROTTLE_OPS, max_meta_ops);
+
+   if (tname && throttle_control(tname)) {
+      WARN("scan_changes: bad throttle file %s\n", tname);
+      return -1;
+   }
+
+   if (throttle_priority(nice_incr, lowioflag))
+      WARN("scan_changes: could not lower priority\n");
+
+   if (pname && progress_open(pname, "scan_changes"))
+      WARN("scan_changes: failed to write %s\n", pname);
+
+   next_old();
+
+   process_item(".", &srcstat);
+   dirwalk(srcname);
+
+   while (old_valid) {
+      deleted(&old_rec);
+      next_old();
+   }
+
+   if (old_fp) fclose(old_fp);
+
+   if (fclose(new_fp)) {
+      WARN("scan_changes: error writing %s\n", newname);
+      return_value = -1;
+   }
+
+   if (fflush(stdout) || ferror(stdout)) {
+      WARN("scan_changes: error writing stdout\n");
+      return_value = -1;
+   }
+
+   progress_close(1);
+
+   return return_value;
+}
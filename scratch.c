@@ -0,0 +1,150 @@
+
+#include "util.h"
+#include "scratch.h"
+
+
+#define SCRATCH_MIN (64*1024)
+#define ALIGN (16)
+
+#define ROUND(n) (((n) + ALIGN - 1) & ~((size_t) ALIGN - 1))
+
+/* the chunks of a thread's arena are chained from the newest;
+ * the data of a chunk follows its header
+ */
+
+struct chunk {
+   struct chunk *prev;
+   size_t size;
+   size_t used;
+};
+
+#define HEADER_SIZE ROUND(sizeof(struct chunk))
+#define DATA(c) ((char *) (c) + HEADER_SIZE)
+
+static __thread struct chunk *current = 0;
+static __thread size_t total = 0;   /* the size of all the chunks */
+
+
+static
+struct chunk *new_chunk(size_t size)
+{
+   struct chunk *c;
+
+   c = (struct chunk *) malloc(HEADER_SIZE + size);
+   if (!c) {
+      Warning("malloc error");
+      exit(-1);
+   }
+
+   c->prev = current;
+   c->size = size;
+   c->used = 0;
+
+   current = c;
+   total += size;
+
+   return c;
+}
+
+static
+void free_chunk(void)
+{
+   struct chunk *c = current;
+
+   current = c->prev;
+   total -= c->size;
+   free(c);
+}
+
+
+/* a mark taken on an empty arena is always the null mark, even when
+ * the arena has a chunk, so that releasing it merges all the chunks
+ * allocated since (if it were the bottom chunk, they would be freed
+ * one by one at the end of every object, and allocated again by the
+ * next).  This also keeps any outer mark valid: an outer mark on an
+ * empty arena is the null mark too.
+ */
+
+scratch_mark_t scratch_mark(void)
+{
+   scratch_mark_t m;
+
+   if (!current || (!current->prev && current->used == 0)) {
+      m.chunk = 0;
+      m.used = 0;
+   }
+   else {
+      m.chunk = current;
+      m.used = current->used;
+   }
+
+   return m;
+}
+
+void scratch_release(scratch_mark_t m)
+{
+   size_t size;
+   int several;
+
+   if (m.chunk) {
+      while (current != m.chunk) free_chunk();
+      current->used = m.used;
+      return;
+   }
+
+   /* the whole arena is released: keep it as a single chunk that would
+    * have held it all, up to SCRATCH_MAX
+    */
+
+   if (!current) return;
+
+   if (!current->prev && current->size <= SCRATCH_MAX) {
+      current->used = 0;
+      return;
+   }
+
+   several = (current->prev != 0);
+   size = (total < SCRATCH_MAX) ? total : SCRATCH_MAX;
+
+   while (current) free_chunk();
+
+   if (several) new_chunk(size);
+}
+
+
+void *scratch_alloc(size_t n)
+{
+   size_t size;
+   char *p;
+
+   n = ROUND(n);
+
+   if (!current || current->size - current->used < n) {
+      size = current ? 2*current->size : SCRATCH_MIN;
+      if (size < n) size = n;
+      new_chunk(size);
+   }
+
+   p = DATA(current) + current->used;
+   current->used += n;
+
+   return p;
+}
+
+void *scratch_grow(void *p, size_t n, size_t newn)
+{
+   char *q;
+
+   n = ROUND(n);
+
+   if (p && current && (char *) p + n == DATA(current) + current->used &&
+       (char *) p + ROUND(newn) <= DATA(current) + current->size) {
+      current->used = (char *) p + ROUND(newn) - DATA(current);
+      return p;
+   }
+
+   q = scratch_alloc(newn);
+   if (p) memcpy(q, p, (n < newn) ? n : newn);
+
+   return q;
+}
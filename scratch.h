@@ -0,0 +1,43 @@
+#ifndef XBUP__scratch_H
+#define XBUP__scratch_H
+
+#include <stddef.h>
+
+/* scratch: a per-thread arena for the buffers that only live while
+ * one object is split or joined (xattr names and values, ACL text),
+ * so that, once the arena has grown to fit the objects at hand, they
+ * cost no heap allocation at all.
+ *
+ * Blocks are carved out of the arena in stack order, and released
+ * together: scratch_mark notes where the arena stands, and
+ * scratch_release(m) gives back every block allocated since m was
+ * taken (so calls may nest).  Once the whole arena is released (to
+ * a mark taken while it was empty), it is merged into a single chunk
+ * large enough for the next object;
+ * but no more than SCRATCH_MAX bytes are kept, so a single huge
+ * resource fork does not pin its memory for the rest of the run.
+ */
+
+#define SCRATCH_MAX (4*1024*1024)
+
+struct scratch_mark_struct {
+   void *chunk;
+   size_t used;
+};
+
+typedef struct scratch_mark_struct scratch_mark_t;
+
+scratch_mark_t scratch_mark(void);
+void scratch_release(scratch_mark_t m);
+
+/* scratch_alloc returns a block of n bytes (suitably aligned for any
+ * type).  scratch_grow resizes the block p of n bytes to newn bytes,
+ * keeping its contents; p may be null (n is then 0), and the block is
+ * extended in place if it is the last one allocated.  Both exit on
+ * failure, as a malloc failure does elsewhere.
+ */
+
+void *scratch_alloc(size_t n);
+void *scratch_grow(void *p, size_t n, size_t newn);
+
+#endif
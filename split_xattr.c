@@ -1,6 +1,10 @@
 
 /* usage: split_xattr options srcdir dstdir
  *    options:  --files-from file
+ *              --sorted
+ *              --exclude pattern
+ *              --exclude-from file
+ *              --one-file-system
  *              --recycle olddst
  *              --crtime
  *              --mtime
@@ -11,13 +15,43 @@
  *              --perms
  *              --owner oname
  *              --group gname
+ *              --jobs n
+ *              --manifest
+ *              --max-ops n
+ *              --max-meta-ops n
+ *              --max-bytes n
+ *              --throttle-file file
+ *              --nice n
+ *              --low-io
+ *              --progress file
+ *              --hotspots n
+ *              --hotspots-json file
+ *              --id-cache file
+ *              --journal file
+ *              --resume
+ *              --deadline secs
  * 
  * creates dstdir, a repository of xattr containers from srcdir
- * dstdir should *not* exist prior to invocation.
+ * dstdir should *not* exist prior to invocation (unless --resume).
+ *
+ * The directories of the repository mirror those of srcdir, but
+ * a directory is only created when some container is actually
+ * written into it or below it.
  * 
  * with the --files-from file option, the contructed repository is 
  * pruned to only include those files and directories listed in file.
  *
+ * the --sorted flag causes the entries of each directory to be
+ * visited in sorted (strcmp) order, rather than in readdir order.
+ *
+ * the --exclude and --exclude-from options add rsync-style exclude
+ * rules (see exclude.h), in the order given; they are matched against
+ * paths relative to srcdir, and excluded directories are not walked.
+ *
+ * the --one-file-system flag keeps the walk on the file system of
+ * srcdir: a mount point gets a container of its own, but is not
+ * walked.
+ *
  * with the --recycle olddst option, an attempt is made to
  * move existing xattrs containers from olddst.
  * When an xattr container is created, its mtime is set to the ctime
@@ -56,187 +90,117 @@
  * as an optimization, if gname is not -, then the
  * group name will not be saved if it is equal to gname;
  * gname can be either symbolic or numeric.
-
  *
- * Returns -1 if errors detected, and 0 otherwise.
+ * the --jobs flag hands the per-object work (lstat, reading ACLs and
+ * xattrs, writing containers) to a pool of n threads, so that many
+ * metadata operations are in flight at once; the directory walk
+ * itself remains sequential.  If no threads can be started, the
+ * objects are processed synchronously.
+ *
+ * the --manifest flag causes a manifest file to be written into
+ * every directory of dstdir, once all containers have been written.
+ * The manifests form a Merkle tree over the containers (see manifest.h),
+ * which xmanifest uses to find the containers that changed since
+ * the last backup.
+ *
+ * the --max-ops flag limits the walk to about n objects per second
+ * (see throttle.h), so as to leave some of the disk to others; 
+ * likewise, --max-meta-ops limits the metadata operations (lstat,
+ * listxattr, getxattr, the ACL calls...) made on the objects, and
+ * --max-bytes the bytes of containers written, to about n per second.
+ * With the --throttle-file file option, these limits can be changed 
+ * while the walk runs, by editing file (see throttle_control).
+ *
+ * the --nice n option raises the nice value of split_xattr by n, and the
+ * --low-io flag has its disk I/O yield to that of other processes
+ * (see throttle_priority).
+ *
+ * with the --progress file option, the objects walked, the containers
+ * written, the rate and an estimate of the time left are written to
+ * file every few seconds (see progress.h).
+ *
+ * the --hotspots n option keeps track of the n directories that took
+ * the most time (not counting their subdirectories), and that have
+ * the most entries, and of the n objects with the largest containers,
+ * and with the most xattrs (see hotspot.h); they are listed on stderr
+ * at the end.  With --jobs, the time of a directory is that spent
+ * walking it, which includes waiting for the workers.  With the
+ * --hotspots-json file option, they are also written to file, as
+ * JSON (and n defaults to 10).
+ *
+ * with the --id-cache file option, the lookups of user and group
+ * names and ACL uuids start out with those saved in file, and all
+ * the lookups made are saved back to it at the end (see
+ * load_id_cache in util.c).
+ *
+ * with the --journal file option, the directories whose containers
+ * are all written are recorded in file, every few seconds (see
+ * checkpoint.h).  With the --resume flag as well, a run that was
+ * interrupted is carried on: dstdir is kept, and the directories
+ * recorded in file are skipped.  The directories that were not
+ * finished are done again from scratch (their old containers are
+ * removed first, along with those of subdirectories that no longer
+ * exist), but those that were finished are not looked at again.
+ * The same options must be given each time, but for those that only
+ * say how the run is carried out (--resume, --deadline, --progress,
+ * --jobs, the throttling options, --nice, --low-io and the hotspot
+ * options), so that each run can be fitted to its window.
+ *
+ * the --deadline flag makes split_xattr stop, cleanly, after secs
+ * seconds; with --journal, the run can then be resumed later.
+ * No manifest is written by a run that stops early.
+ *
+ * The metadata of a file with several links is only read once, at
+ * the first of its links that is visited; the containers of the
+ * other links are hard links to the one written for it (see inodes.h).
+ *
+ * Returns -1 if errors detected, 1 if stopped at the deadline,
+ * and 0 otherwise.
  *
  */
 
+#include <pthread.h>
+
 #include "util.h"
 #include "xattr_util.h"
+#include "exclude.h"
+#include "throttle.h"
+#include "progress.h"
+#include "hotspot.h"
+#include "workq.h"
+#include "manifest.h"
+#include "checkpoint.h"
+#include "splitwalk.h"
 
 
+#define MAXJOBS (1024)
+#define TASKS_PER_JOB (4)
 
 static int return_value = 0;
-static int source_name_len = 0;
-static char *destination_name = 0;
-static char *linkdir_name = 0;
+static pthread_mutex_t return_value_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static int crtimeflag = 0;
-static int mtimeflag = 0;
-static int lnkmtimeflag = 0;
-static int aclflag = 0;
-static int fixpermsflag = 0;
-static int allpermsflag = 0;
-static int lnkpermsflag = 0;
-static owner_prefs_t oprefs;
+/* the options of the walk (see splitwalk.h) */
 
-static char dblname[MAXLEN];
-static char linkname[MAXLEN];
+static struct split_walk walk;
 
 
-void process_xattrs(const char *itemname, const struct stat *itemstat, 
-                    const char *dirname, const char *basename)
+static
+void set_error(void)
 {
-   acl_t acl=0;
-   struct stat linkstat;
-   int gotlink;
-   int saveperms;
-   int savemtime;
-
-   xattr_access_error = 0;
-
-   if (aclflag) acl = get_acl(itemname, itemstat);
-
-   saveperms = allpermsflag || (lnkpermsflag && S_ISLNK(itemstat->st_mode)) 
-               || (fixpermsflag && problem_perms(itemstat));
-
-   savemtime = mtimeflag || (lnkmtimeflag && S_ISLNK(itemstat->st_mode));
-
-   if ( need_container(itemname, itemstat, crtimeflag, savemtime,
-                       acl, saveperms, &oprefs) ) {
-
-      gotlink = 0;
-
-      if (snprintf(dblname, MAXLEN, "%s%s/%s%s", 
-         destination_name, 
-         dirname + source_name_len, 
-         basename,
-         DBL_SUFFIX) >= MAXLEN) overflow();
-
-      if (linkdir_name) {
-         if (snprintf(linkname, MAXLEN, "%s%s/%s%s", 
-            linkdir_name, 
-            dirname + source_name_len, 
-            basename,
-            DBL_SUFFIX) >= MAXLEN) overflow();
-
-         if (lstat(linkname, &linkstat) == 0 &&
-             S_ISREG(linkstat.st_mode) &&
-             linkstat.st_mtime == itemstat->st_ctime) {
-
-            if (rename(linkname, dblname)) {
-               WARN("split_xattr: could not move %s to %s\n", 
-                    linkname, dblname);
-               return_value = -1;
-            }
-            else {
-               gotlink = 1;
-            }
-         }
-      }
-
-      if (!gotlink) {
-        
-         if ( split_xattr(itemname, itemstat, dblname, crtimeflag, savemtime,
-                          acl, saveperms, &oprefs) ||
-              set_mtime(dblname, itemstat->st_ctime) ) {
-
-               WARN("split_xattr: error making %s\n", dblname);
-               return_value = -1;
-
-         }
-
-      }
-   }
-
-   if (xattr_access_error) {
-      WARN("split_xattr: some metadata unreadable: %s\n", itemname);
-      return_value = -1;
-   }
-
-   if (acl) acl_free(acl);
+   pthread_mutex_lock(&return_value_lock);
+   return_value = -1;
+   pthread_mutex_unlock(&return_value_lock);
 }
 
 
-void dirwalk(const char *dirname, const struct stat *dirstat, int walk_state)
-{
-   char itemname[MAXLEN];
-   DIR *dirlist;
-   struct dirent *diritem; 
-   struct stat itemstat;
-   int walk_state1;
-
-
-   if (snprintf(dblname, MAXLEN, "%s%s", destination_name, 
-      dirname + source_name_len) >= MAXLEN) overflow();
-
-   if (mkdir(dblname, 0777)) {
-      WARN("split_xattr: failed to create %s\n", dblname);
-      return_value = -1;
-      return;
-   }
-
-   dirlist = opendir(dirname);
-
-   if (!dirlist) {
-      WARN("split_xattr: opendir failed on %s\n", dirname);
-      return_value = -1;
-      return;
-   }
-
-   while ( (diritem = readdir(dirlist)) ) {
-
-      if (strcmp(diritem->d_name, ".") == 0 
-          || strcmp(diritem->d_name, "..") == 0)
-         continue;
-
-      if (snprintf(itemname, MAXLEN, "%s/%s", 
-          dirname, diritem->d_name) >= MAXLEN) overflow();
-
-      if (is_suffix(DBL_SUFFIX, DBL_SUFFIX_LEN, 
-                    diritem->d_name, strlen(diritem->d_name))) {
-         WARN("split_xattr: name conflict: %s\n", itemname);
-         return_value = -1;
-      }
-
-      walk_state1 = walk_state;
-
-      if (walk_state1 == 0) {
-	    walk_state1 = lookup_name(itemname + source_name_len + 1);
-	    if (walk_state1 == -1) continue; /* pruning */
-      }
-
-      if (lstat(itemname, &itemstat)) {
-         WARN("split_xattr: lstat failed on %s\n", itemname);
-         return_value = -1;
-         continue;
-      }
-
-
-#if 0
-      if (!(S_ISDIR(itemstat.st_mode) || S_ISREG_OR_LNK(itemstat.st_mode)))
-         continue;
-#endif
-
-      if (walk_state1 == 1 && !S_ISDIR(itemstat.st_mode)) 
-         process_xattrs(itemname, &itemstat, dirname, diritem->d_name);
-
-      if (S_ISDIR(itemstat.st_mode)) {
-	 dirwalk(itemname, &itemstat, walk_state1);
-      }
-
-   }
-
-   closedir(dirlist);
-
-   process_xattrs(dirname, dirstat, dirname, ".");
-}
-
 void usage()
 {
    WARN("usage: split_xattr options srcdir dstdir\n");
    WARN("  options:  --files-from file\n");
+   WARN("            --sorted\n");
+   WARN("            --exclude pattern\n");
+   WARN("            --exclude-from file\n");
+   WARN("            --one-file-system\n");
    WARN("            --recycle olddst\n");
    WARN("            --crtime\n");
    WARN("            --mtime\n");
@@ -247,6 +211,21 @@ void usage()
    WARN("            --perms\n");
    WARN("            --owner oname\n");
    WARN("            --group gname\n");
+   WARN("            --jobs n\n");
+   WARN("            --manifest\n");
+   WARN("            --max-ops n\n");
+   WARN("            --max-meta-ops n\n");
+   WARN("            --max-bytes n\n");
+   WARN("            --throttle-file file\n");
+   WARN("            --nice n\n");
+   WARN("            --low-io\n");
+   WARN("            --progress file\n");
+   WARN("            --hotspots n\n");
+   WARN("            --hotspots-json file\n");
+   WARN("            --id-cache file\n");
+   WARN("            --journal file\n");
+   WARN("            --resume\n");
+   WARN("            --deadline secs\n");
 
 }
 
@@ -259,12 +238,35 @@ int main(int argc, char **argv)
    int walk_state;
    char *owner_name, *group_name;
    int owner_status;
+   char *cname;
+   long max_ops, max_meta_ops, max_bytes;
+   char *tname;
+   long nice_incr;
+   int lowioflag;
+   char *pname;
+   long hotspots;
+   char *hname;
+   char *jname;
+   long deadline;
+   char *tag;
 
    
 
    int i;
 
    fname = 0;
+   cname = 0;
+   max_ops = 0;
+   max_meta_ops = 0;
+   max_bytes = 0;
+   tname = 0;
+   nice_incr = 0;
+   lowioflag = 0;
+   pname = 0;
+   hotspots = 0;
+   hname = 0;
+   jname = 0;
+   deadline = 0;
    lname = 0;
 
    owner_name = 0;
@@ -282,6 +284,35 @@ int main(int argc, char **argv)
          fname = argv[i];
          i++;
       }
+      else if (strcmp(argv[i], "--sorted") == 0) {
+         i++;
+         walk.sorted = 1;
+      }
+      else if (strcmp(argv[i], "--exclude") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         if (exclude_add(argv[i], 0)) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--exclude-from") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         if (exclude_add_file(argv[i])) return -1;
+         i++;
+      }
+      else if (strcmp(argv[i], "--one-file-system") == 0) {
+         i++;
+         walk.xdev = 1;
+      }
       else if (strcmp(argv[i], "--recycle") == 0) {
          if (i == argc-1) {
             usage();
@@ -293,31 +324,31 @@ int main(int argc, char **argv)
       }
       else if (strcmp(argv[i], "--crtime") == 0) {
          i++;
-         crtimeflag = 1;
+         walk.crtime = 1;
       }
       else if (strcmp(argv[i], "--mtime") == 0) {
          i++;
-         mtimeflag = 1;
+         walk.mtime = 1;
       }
       else if (strcmp(argv[i], "--lnkmtime") == 0) {
          i++;
-         lnkmtimeflag = 1;
+         walk.lnkmtime = 1;
       }
       else if (strcmp(argv[i], "--acl") == 0) {
          i++;
-         aclflag = 1;
+         walk.acl = 1;
       }
       else if (strcmp(argv[i], "--fixperms") == 0) {
          i++;
-         fixpermsflag = 1;
+         walk.fixperms = 1;
       }
       else if (strcmp(argv[i], "--lnkperms") == 0) {
          i++;
-         lnkpermsflag = 1;
+         walk.lnkperms = 1;
       }
       else if (strcmp(argv[i], "--perms") == 0) {
          i++;
-         allpermsflag = 1;
+         walk.allperms = 1;
       }
       else if (strcmp(argv[i], "--owner") == 0) {
          if (i == argc-1) {
@@ -337,12 +368,161 @@ int main(int argc, char **argv)
          group_name = argv[i];
          i++;
       }
+      else if (strcmp(argv[i], "--jobs") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         walk.num_jobs = string_to_long(argv[i]);
+         if (conversion_error ||
+             walk.num_jobs < 1 || walk.num_jobs > MAXJOBS) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--manifest") == 0) {
+         i++;
+         walk.manifest = 1;
+      }
+      else if (strcmp(argv[i], "--max-ops") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         max_ops = string_to_long(argv[i]);
+         if (conversion_error || max_ops < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--max-meta-ops") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         max_meta_ops = string_to_long(argv[i]);
+         if (conversion_error || max_meta_ops < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--max-bytes") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         max_bytes = string_to_long(argv[i]);
+         if (conversion_error || max_bytes < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--throttle-file") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         tname = argv[i];
+         i++;
+      }
+      else if (strcmp(argv[i], "--nice") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         nice_incr = string_to_long(argv[i]);
+         if (conversion_error || nice_incr < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--low-io") == 0) {
+         i++;
+         lowioflag = 1;
+      }
+      else if (strcmp(argv[i], "--progress") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         pname = argv[i];
+         i++;
+      }
+      else if (strcmp(argv[i], "--hotspots") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         hotspots = string_to_long(argv[i]);
+         if (conversion_error || hotspots < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--hotspots-json") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         hname = argv[i];
+         i++;
+      }
+      else if (strcmp(argv[i], "--id-cache") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         cname = argv[i];
+         i++;
+      }
+      else if (strcmp(argv[i], "--journal") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         jname = argv[i];
+         i++;
+      }
+      else if (strcmp(argv[i], "--resume") == 0) {
+         i++;
+         walk.resume = 1;
+      }
+      else if (strcmp(argv[i], "--deadline") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         deadline = string_to_long(argv[i]);
+         if (conversion_error || deadline < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
 
       else
          break;
    }
 
-   if (i != argc-2) {
+   if (i != argc-2 || (walk.resume && !jname)) {
       usage();
       return -1;
    }
@@ -367,6 +547,8 @@ int main(int argc, char **argv)
       return -1;
    }
 
+   walk.root_dev = srcstat.st_dev;
+
    if (lname) {
 
       strip_slashes(lname);
@@ -377,18 +559,26 @@ int main(int argc, char **argv)
       }
    }
 
-   if (!lstat(dstname, &dststat)) {
+   if (walk.resume) {
+      if (lstat(dstname, &dststat) || !S_ISDIR(dststat.st_mode)) {
+         WARN("split_xattr: %s does not exist -- nothing to resume\n", dstname);
+         return -1;
+      }
+   }
+   else if (!lstat(dstname, &dststat)) {
       WARN("split_xattr: %s already exists\n", dstname);
       return -1;
    }
 
-   source_name_len = srcname_len;
+   walk.source_name_len = srcname_len;
+
+   walk.destination_name = dstname;
 
-   destination_name = dstname;
+   walk.linkdir_name = lname;
 
-   linkdir_name = lname;
+   if (cname) load_id_cache(cname);
 
-   owner_status = set_owner_prefs(&oprefs, owner_name, group_name);
+   owner_status = set_owner_prefs(&walk.oprefs, owner_name, group_name);
 
    if (owner_status) {
       if (owner_status & 1) 
@@ -398,7 +588,82 @@ int main(int argc, char **argv)
       return -1;
    }
 
-   dirwalk(srcname, &srcstat, walk_state);
+   throttle_init(THROTTLE_OBJECTS, max_ops);
+   throttle_init(THROTTLE_OPS, max_meta_ops);
+   throttle_init(THROTTLE_BYTES, max_bytes);
+
+   if (tname && throttle_control(tname)) {
+      WARN("split_xattr: bad throttle file %s\n", tname);
+      return -1;
+   }
+
+   if (throttle_priority(nice_incr, lowioflag))
+      WARN("split_xattr: could not lower priority\n");
+
+   if (walk.num_jobs > 0 &&
+       workq_start(walk.num_jobs, TASKS_PER_JOB*walk.num_jobs)) {
+      WARN("split_xattr: no worker threads -- processing synchronously\n");
+      walk.num_jobs = 0;
+   }
+
+   if (!walk.resume && mkdir(dstname, 0777)) {
+      WARN("split_xattr: failed to create %s\n", dstname);
+      return -1;
+   }
+
+   if (jname) {
+      tag = checkpoint_tag("split_xattr", argc, argv);
+
+      if (checkpoint_open(jname, tag, walk.resume)) {
+         WARN("split_xattr: bad journal %s\n", jname);
+         return -1;
+      }
+      free(tag);
+      walk.journal = 1;
+   }
+
+   checkpoint_deadline(deadline);
+
+   if (pname && progress_open(pname, "split_xattr"))
+      WARN("split_xattr: failed to write %s\n", pname);
+
+   if (hname && hotspots == 0) hotspots = HOTSPOT_DEFAULT;
+   if (hotspots > 0) hotspot_init(hotspots);
+
+   walk.tool = "split_xattr";
+   walk.set_error = set_error;
+   split_walk_init(&walk);
+
+   if (!checkpoint_is_done(""))
+      split_dirwalk(srcname, &srcstat, walk_state);
+
+   workq_stop();
+
+   if (walk.journal) {
+      split_checkpoint();
+      if (checkpoint_close()) set_error();
+   }
+
+   if (cname) save_id_cache(cname);  /* a failure here only costs time */
+
+   progress_close(!walk.stopped);
+
+   if (hotspots > 0) hotspot_report(stderr, "split_xattr");
+
+   if (hname && hotspot_json(hname, "split_xattr")) {
+      WARN("split_xattr: failed to write %s\n", hname);
+      return_value = -1;
+   }
+
+   if (walk.stopped) {
+      WARN("split_xattr: deadline reached -- stopped early\n");
+      return (return_value ? -1 : 1);
+   }
+
+   if (walk.manifest && manifest_build(dstname, 0)) {
+      WARN("split_xattr: failed to build manifest\n");
+      return_value = -1;
+   }
 
    return return_value;
 
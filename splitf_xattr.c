@@ -1,6 +1,10 @@
 
 /* usage: splitf_xattr options srcdir 
  *    options:  --files-from file
+ *              --sorted
+ *              --exclude pattern
+ *              --exclude-from file
+ *              --one-file-system
  *              --crtime
  *              --mtime
  *              --lnkmtime
@@ -10,6 +14,16 @@
  *              --perms
  *              --owner oname
  *              --group gname
+ *              --jobs n
+ *              --merge
+ *              --max-ops n
+ *              --max-meta-ops n
+ *              --max-bytes n
+ *              --throttle-file file
+ *              --nice n
+ *              --low-io
+ *              --progress file
+ *              --id-cache file
  * 
  * Works like split_xattr, but writes all xattr information to
  * stdout, rather than creating a directory structure.
@@ -17,6 +31,18 @@
  * with the --files-from file option, the contructed repository is 
  * pruned to only include those files and directories listed in file.
  *
+ * the --sorted flag causes the entries of each directory to be
+ * visited in sorted (strcmp) order, rather than in readdir order,
+ * so that an unchanged tree always yields an identical stream.
+ *
+ * the --exclude and --exclude-from options add rsync-style exclude
+ * rules (see exclude.h), in the order given; they are matched against
+ * paths relative to srcdir, and excluded directories are not walked.
+ *
+ * the --one-file-system flag keeps the walk on the file system of
+ * srcdir: a mount point gets a container of its own, but is not
+ * walked.
+ *
  * the --crtime flag causes the creation times of all files to
  * be preserved 
  *
@@ -46,6 +72,36 @@
  * group name will not be saved if it is equal to gname;
  * gname can be either symbolic or numeric.
  *
+ * the --jobs flag causes n worker threads to encode the entries
+ * into memory buffers concurrently; the entries are still written
+ * to stdout in traversal order, so that the output is identical
+ * to that produced without this flag.
+ *
+ * the --merge flag writes the stream in the form read by mergef_xattr,
+ * which merges it straight into a repository like the one split_xattr
+ * creates: only those entries for which split_xattr would create a
+ * container are written; the path of a directory entry ends in "/."
+ * (so the path of srcdir itself is "/."); and, if no errors were
+ * detected, the stream ends with an entry whose path is "." and
+ * which has no container, so that a stream cut short can be
+ * recognized.  Such a stream is not meant for joinf_xattr.
+ *
+ * the --max-ops flag limits the walk to about n objects per second
+ * (see throttle.h), so as to leave some of the disk to others;
+ * --max-meta-ops and --max-bytes limit, in the same way, the metadata
+ * operations made on the objects, and the bytes of containers
+ * written.  The --throttle-file, --nice and --low-io options are as
+ * in split_xattr.
+ *
+ * with the --progress file option, the objects walked, the entries
+ * written, the rate and an estimate of the time left are written to
+ * file every few seconds (see progress.h).
+ *
+ * with the --id-cache file option, the lookups of user and group
+ * names and ACL uuids start out with those saved in file, and all
+ * the lookups made are saved back to it at the end (see
+ * load_id_cache in util.c).
+ *
  * Returns -1 if errors detected, and 0 otherwise.
  *
  */
@@ -56,11 +112,18 @@
  *   - for each entry:
  *       - a null terminated relative path name (starting with "/", if non-empty)
  *       - an xattr container
+ *   - with --merge, a final entry consisting of the path "." alone
  */
 
 
+#include <pthread.h>
+
 #include "util.h"
 #include "xattr_util.h"
+#include "dirscan.h"
+#include "exclude.h"
+#include "throttle.h"
+#include "progress.h"
 
 
 
@@ -74,21 +137,38 @@ static int lnkpermsflag = 0;
 static owner_prefs_t oprefs;
 
 static int return_value = 0;
+static int sortedflag = 0;
+static int xdevflag = 0;
+static dev_t root_dev = 0;
+static int mergeflag = 0;
 static int source_name_len = 0;
 
 
 static char magic[8] = { 0xb7, 0x0e, 0xbf, 0xb2, 0xc2, 0x91, 0xf2, 0x92 };
 
 
-void process_xattrs(const char *itemname, const struct stat *itemstat)
+/* writes the entry for itemname (its name followed by its xattr
+ * container) to ofp.  Returns -1 on error.  *access_err is set
+ * if some metadata was unreadable.  With --merge, nothing is written
+ * if no container is needed.
+ */
+
+static
+int write_entry(const char *itemname, const struct stat *itemstat, FILE *ofp,
+                int *access_err)
 {
    acl_t acl=0;
    const char *ext;
    long extlen;
    int saveperms;
    int savemtime;
+   int ret;
+   long ops, bytes;
 
 
+   ops = xattr_meta_ops;
+   bytes = xattr_io_bytes;
+
    xattr_access_error = 0;
 
    if (aclflag) acl = get_acl(itemname, itemstat);
@@ -102,35 +182,290 @@ void process_xattrs(const char *itemname, const struct stat *itemstat)
    ext = itemname + source_name_len;
    extlen = strlen(ext);
 
-   if (fwrite(ext, 1, extlen+1, stdout) != extlen+1 ||
-       split_xattr(itemname, itemstat, "", crtimeflag, savemtime,  
-                   acl, saveperms, &oprefs)) {
+   ret = 0;
+
+   if (mergeflag) {
+      if (!need_container(itemname, itemstat, crtimeflag, savemtime,
+                          acl, saveperms, &oprefs)) 
+         goto done;
+
+      if (S_ISDIR(itemstat->st_mode)) {
+         if (fwrite(ext, 1, extlen, ofp) != extlen) {
+            ret = -1;
+            goto done;
+         }
+
+         ext = "/.";
+         extlen = 2;
+      }
+   }
+
+   if (fwrite(ext, 1, extlen+1, ofp) != extlen+1 ||
+       split_xattr_fp(itemname, itemstat, ofp, crtimeflag, savemtime,  
+                      acl, saveperms, &oprefs)) 
+      ret = -1;
+
+done:
+
+   *access_err = xattr_access_error;
+
+   if (acl) acl_free(acl);
+
+   if (ret == 0 && xattr_io_bytes > bytes)
+      progress_item(xattr_io_bytes - bytes);
+
+   /* the lstat of the object was charged by the walker */
+
+   throttle(THROTTLE_OPS, xattr_meta_ops - ops);
+   throttle(THROTTLE_BYTES, xattr_io_bytes - bytes);
+
+   return ret;
+}
+
+
+/* The ring used by --jobs.
+ * The walker fills the slots in traversal order (SLOT_FREE -> SLOT_READY),
+ * the workers take them in the same order and encode them into 
+ * memory buffers (SLOT_READY -> SLOT_BUSY -> SLOT_DONE), possibly
+ * finishing out of order, and the walker writes them to stdout,
+ * again in traversal order (SLOT_DONE -> SLOT_FREE).
+ */
+
+#define MAXJOBS (256)
+#define SLOTS_PER_JOB (8)
+
+#define SLOT_FREE  (0)
+#define SLOT_READY (1)
+#define SLOT_BUSY  (2)
+#define SLOT_DONE  (3)
+
+struct slot {
+   int state;
+   char itemname[MAXLEN];
+   struct stat itemstat;
+   char *buf;
+   size_t len;
+   int err;
+   int access_err;
+};
+
+static long num_jobs = 0;
+static struct slot *ring = 0;
+static long num_slots = 0;
+static long ring_head = 0; /* seq of next slot to be taken by a worker */
+static long ring_tail = 0; /* seq of next slot to be filled by the walker */
+static long ring_out = 0;  /* seq of next slot to be written to stdout */
+static int ring_eof = 0;
+
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ring_cond = PTHREAD_COND_INITIALIZER;
+
+
+static
+void *worker(void *arg)
+{
+   struct slot *sp;
+   FILE *ofp;
+
+   for (;;) {
+      pthread_mutex_lock(&ring_lock);
+
+      for (;;) {
+         if (ring_eof && ring_head == ring_tail) {
+            pthread_mutex_unlock(&ring_lock);
+            return 0;
+         }
+
+         sp = &ring[ring_head % num_slots];
+         if (ring_head < ring_tail && sp->state == SLOT_READY) break;
+
+         pthread_cond_wait(&ring_cond, &ring_lock);
+      }
+
+      sp->state = SLOT_BUSY;
+      ring_head++;
+
+      pthread_mutex_unlock(&ring_lock);
+
+      sp->buf = 0;
+      sp->len = 0;
+      sp->err = 0;
+      sp->access_err = 0;
+
+      ofp = open_memstream(&sp->buf, &sp->len);
+      if (!ofp) {
+         WARNING;
+         sp->err = -1;
+      }
+      else {
+         if (write_entry(sp->itemname, &sp->itemstat, ofp, &sp->access_err))
+            sp->err = -1;
+         if (fclose(ofp)) 
+            sp->err = -1;
+      }
+
+      pthread_mutex_lock(&ring_lock);
+
+      sp->state = SLOT_DONE;
+      pthread_cond_broadcast(&ring_cond);
+
+      pthread_mutex_unlock(&ring_lock);
+   }
+}
+
+
+/* writes the oldest entry in the ring to stdout.
+ * If wait is zero, nothing is done unless that entry is ready.
+ * Returns 1 if an entry was written, 0 otherwise.
+ */
+
+static
+int write_oldest(int wait)
+{
+   struct slot *sp;
+
+   pthread_mutex_lock(&ring_lock);
+
+   sp = &ring[ring_out % num_slots];
+
+   if (ring_out == ring_tail || (!wait && sp->state != SLOT_DONE)) {
+      pthread_mutex_unlock(&ring_lock);
+      return 0;
+   }
+
+   while (sp->state != SLOT_DONE) 
+      pthread_cond_wait(&ring_cond, &ring_lock);
+
+   pthread_mutex_unlock(&ring_lock);
+
+   if ((sp->len > 0 && fwrite(sp->buf, 1, sp->len, stdout) != sp->len) || 
+       sp->err) {
+      WARN("splitf_xattr: error processing %s --- aborting\n", sp->itemname);
+      exit(-1);
+   }
+
+   if (sp->access_err) {
+      WARN("splitf_xattr: some metadata unreadable: %s\n", sp->itemname);
+      return_value = -1;
+   }
+
+   free(sp->buf);
+   sp->buf = 0;
+
+   pthread_mutex_lock(&ring_lock);
+
+   sp->state = SLOT_FREE;
+   ring_out++;
+
+   pthread_mutex_unlock(&ring_lock);
+
+   return 1;
+}
+
+
+static
+void submit_entry(const char *itemname, const struct stat *itemstat)
+{
+   struct slot *sp;
+
+   while (ring_tail - ring_out >= num_slots) 
+      write_oldest(1);
+
+   sp = &ring[ring_tail % num_slots];
+
+   if (snprintf(sp->itemname, MAXLEN, "%s", itemname) >= MAXLEN) overflow();
+   sp->itemstat = *itemstat;
+
+   pthread_mutex_lock(&ring_lock);
+
+   sp->state = SLOT_READY;
+   ring_tail++;
+   pthread_cond_broadcast(&ring_cond);
+
+   pthread_mutex_unlock(&ring_lock);
+
+   while (write_oldest(0)) ;
+}
+
+
+static
+pthread_t *start_jobs(void)
+{
+   pthread_t *threads;
+   long i;
+
+   num_slots = SLOTS_PER_JOB*num_jobs;
+   ring = (struct slot *) calloc(num_slots, sizeof(struct slot));
+   threads = (pthread_t *) calloc(num_jobs, sizeof(pthread_t));
+
+   if (!ring || !threads) {
+      WARNING;
+      exit(-1);
+   }
+
+   for (i = 0; i < num_jobs; i++) {
+      if (pthread_create(&threads[i], 0, worker, 0)) {
+         WARNING;
+         exit(-1);
+      }
+   }
+
+   return threads;
+}
+
+
+static
+void finish_jobs(pthread_t *threads)
+{
+   long i;
+
+   while (write_oldest(1)) ;
+
+   pthread_mutex_lock(&ring_lock);
+   ring_eof = 1;
+   pthread_cond_broadcast(&ring_cond);
+   pthread_mutex_unlock(&ring_lock);
+
+   for (i = 0; i < num_jobs; i++) 
+      pthread_join(threads[i], 0);
+}
+
+
+void process_xattrs(const char *itemname, const struct stat *itemstat)
+{
+   int access_err;
+
+   if (num_jobs > 0) {
+      submit_entry(itemname, itemstat);
+      return;
+   }
+
+   if (write_entry(itemname, itemstat, stdout, &access_err)) {
 
          WARN("splitf_xattr: error processing %s --- aborting\n", itemname);
          exit(-1);
 
    }
 
-   if (xattr_access_error) {
+   if (access_err) {
       WARN("splitf_xattr: some metadata unreadable: %s\n", itemname);
       return_value = -1;
    }
-
-   if (acl) acl_free(acl);
-
 }
 
 
 void dirwalk(const char *dirname, const struct stat *dirstat, int walk_state)
 {
    char itemname[MAXLEN];
-   DIR *dirlist;
-   struct dirent *diritem; 
+   dirscan_t *dirlist;
+   struct dirscan_item *diritem;
    struct stat itemstat;
    int walk_state1;
 
 
-   dirlist = opendir(dirname);
+   progress_current(dirname);
+
+   dirlist = dirscan_open(dirname, sortedflag);
 
    if (!dirlist) {
       WARN("splitf_xattr: opendir failed on %s\n", dirname);
@@ -138,11 +473,11 @@ void dirwalk(const char *dirname, const struct stat *dirstat, int walk_state)
       return;
    }
 
-   while ( (diritem = readdir(dirlist)) ) {
+   while ( (diritem = dirscan_next(dirlist)) ) {
 
-      if (strcmp(diritem->d_name, ".") == 0 
-          || strcmp(diritem->d_name, "..") == 0)
-         continue;
+      throttle(THROTTLE_OBJECTS, 1);
+      throttle(THROTTLE_OPS, 1);
+      progress_object();
 
       if (snprintf(itemname, MAXLEN, "%s/%s", 
           dirname, diritem->d_name) >= MAXLEN) overflow();
@@ -155,6 +490,9 @@ void dirwalk(const char *dirname, const struct stat *dirstat, int walk_state)
 	    if (walk_state1 == -1) continue; /* pruning */
       }
 
+      if (exclude_item(itemname + source_name_len + 1, 
+                       itemname, diritem->d_type)) continue;
+
       if (lstat(itemname, &itemstat)) {
          WARN("splitf_xattr: lstat failed on %s\n", itemname);
          return_value = -1;
@@ -172,12 +510,21 @@ void dirwalk(const char *dirname, const struct stat *dirstat, int walk_state)
          process_xattrs(itemname, &itemstat);
 
       if (S_ISDIR(itemstat.st_mode)) {
+         if (xdevflag && itemstat.st_dev != root_dev) {
+            /* a mount point: just the directory itself */
+            process_xattrs(itemname, &itemstat);
+            continue;
+         }
+
 	 dirwalk(itemname, &itemstat, walk_state1);
       }
 
    }
 
-   closedir(dirlist);
+   if (dirscan_close(dirlist)) {
+      WARN("splitf_xattr: readdir failed on %s\n", dirname);
+      return_value = -1;
+   }
 
    process_xattrs(dirname, dirstat);
 }
@@ -186,6 +533,10 @@ void usage()
 {
    WARN("usage: splitf_xattr options srcdir\n");
    WARN("  options:  --files-from file\n");
+   WARN("            --sorted\n");
+   WARN("            --exclude pattern\n");
+   WARN("            --exclude-from file\n");
+   WARN("            --one-file-system\n");
    WARN("            --crtime\n");
    WARN("            --mtime\n");
    WARN("            --lnkmtime\n");
@@ -195,6 +546,16 @@ void usage()
    WARN("            --perms\n");
    WARN("            --owner oname\n");
    WARN("            --group gname\n");
+   WARN("            --jobs n\n");
+   WARN("            --merge\n");
+   WARN("            --max-ops n\n");
+   WARN("            --max-meta-ops n\n");
+   WARN("            --max-bytes n\n");
+   WARN("            --throttle-file file\n");
+   WARN("            --nice n\n");
+   WARN("            --low-io\n");
+   WARN("            --progress file\n");
+   WARN("            --id-cache file\n");
 }
 
 
@@ -206,11 +567,25 @@ int main(int argc, char **argv)
    int walk_state;
    char *owner_name, *group_name;
    int owner_status;
+   char *cname;
+   long max_ops, max_meta_ops, max_bytes;
+   char *tname;
+   long nice_incr;
+   int lowioflag;
+   char *pname;
 
 
    int i;
 
    fname = 0;
+   cname = 0;
+   max_ops = 0;
+   max_meta_ops = 0;
+   max_bytes = 0;
+   tname = 0;
+   nice_incr = 0;
+   lowioflag = 0;
+   pname = 0;
    owner_name = 0;
    group_name = 0;
 
@@ -226,6 +601,35 @@ int main(int argc, char **argv)
          fname = argv[i];
          i++;
       }
+      else if (strcmp(argv[i], "--sorted") == 0) {
+         i++;
+         sortedflag = 1;
+      }
+      else if (strcmp(argv[i], "--exclude") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         if (exclude_add(argv[i], 0)) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--exclude-from") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         if (exclude_add_file(argv[i])) return -1;
+         i++;
+      }
+      else if (strcmp(argv[i], "--one-file-system") == 0) {
+         i++;
+         xdevflag = 1;
+      }
       else if (strcmp(argv[i], "--crtime") == 0) {
          i++;
          crtimeflag = 1;
@@ -272,6 +676,106 @@ int main(int argc, char **argv)
          group_name = argv[i];
          i++;
       }
+      else if (strcmp(argv[i], "--jobs") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         num_jobs = string_to_long(argv[i]);
+         if (conversion_error || num_jobs < 1 || num_jobs > MAXJOBS) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--merge") == 0) {
+         i++;
+         mergeflag = 1;
+      }
+      else if (strcmp(argv[i], "--max-ops") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         max_ops = string_to_long(argv[i]);
+         if (conversion_error || max_ops < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--max-meta-ops") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         max_meta_ops = string_to_long(argv[i]);
+         if (conversion_error || max_meta_ops < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--max-bytes") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         max_bytes = string_to_long(argv[i]);
+         if (conversion_error || max_bytes < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--throttle-file") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         tname = argv[i];
+         i++;
+      }
+      else if (strcmp(argv[i], "--nice") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         nice_incr = string_to_long(argv[i]);
+         if (conversion_error || nice_incr < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--low-io") == 0) {
+         i++;
+         lowioflag = 1;
+      }
+      else if (strcmp(argv[i], "--progress") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         pname = argv[i];
+         i++;
+      }
+      else if (strcmp(argv[i], "--id-cache") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         cname = argv[i];
+         i++;
+      }
       else
          break;
    }
@@ -298,6 +802,8 @@ int main(int argc, char **argv)
       return -1;
    }
 
+   root_dev = srcstat.st_dev;
+
    source_name_len = srcname_len;
 
    if (fwrite(magic, 1, 8, stdout) != 8) {
@@ -305,6 +811,8 @@ int main(int argc, char **argv)
       return -1;
    }
 
+   if (cname) load_id_cache(cname);
+
    owner_status = set_owner_prefs(&oprefs, owner_name, group_name);
 
    if (owner_status) {
@@ -315,7 +823,40 @@ int main(int argc, char **argv)
       return -1;
    }
 
-   dirwalk(srcname, &srcstat, walk_state);
+   throttle_init(THROTTLE_OBJECTS, max_ops);
+   throttle_init(THROTTLE_OPS, max_meta_ops);
+   throttle_init(THROTTLE_BYTES, max_bytes);
+
+   if (tname && throttle_control(tname)) {
+      WARN("splitf_xattr: bad throttle file %s\n", tname);
+      return -1;
+   }
+
+   if (throttle_priority(nice_incr, lowioflag))
+      WARN("splitf_xattr: could not lower priority\n");
+
+   if (pname && progress_open(pname, "splitf_xattr"))
+      WARN("splitf_xattr: failed to write %s\n", pname);
+
+   if (num_jobs > 0) {
+      pthread_t *threads = start_jobs();
+      dirwalk(srcname, &srcstat, walk_state);
+      finish_jobs(threads);
+   }
+   else {
+      dirwalk(srcname, &srcstat, walk_state);
+   }
+
+   if (cname) save_id_cache(cname);  /* a failure here only costs time */
+
+   progress_close(1);
+
+   if (mergeflag && return_value == 0) {
+      if (fwrite(".", 1, 2, stdout) != 2 || fflush(stdout)) {
+         WARN("write error --- aborting\n");
+         return -1;
+      }
+   }
 
    return return_value;
 
@@ -0,0 +1,549 @@
+#include <pthread.h>
+
+#include "util.h"
+#include "xattr_util.h"
+#include "dirscan.h"
+#include "exclude.h"
+#include "throttle.h"
+#include "progress.h"
+#include "hotspot.h"
+#include "workq.h"
+#include "manifest.h"
+#include "prune.h"
+#include "checkpoint.h"
+#include "inodes.h"
+#include "splitwalk.h"
+
+
+static struct split_walk *w = 0;
+
+static long error_count = 0;
+static long flushed_errors = 0;
+static pthread_mutex_t error_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+void split_walk_init(struct split_walk *walk)
+{
+   w = walk;
+   w->stopped = 0;
+}
+
+
+static
+void set_error(void)
+{
+   pthread_mutex_lock(&error_lock);
+   error_count++;
+   pthread_mutex_unlock(&error_lock);
+
+   w->set_error();
+}
+
+
+static
+long errors_so_far(void)
+{
+   long n;
+
+   pthread_mutex_lock(&error_lock);
+   n = error_count;
+   pthread_mutex_unlock(&error_lock);
+
+   return n;
+}
+
+
+/* dir_changed reports the directory holding the container dblname */
+
+static
+void dir_changed(const char *dblname)
+{
+   char dir[MAXLEN];
+   char *p;
+
+   if (!w->dir_changed) return;
+
+   if (snprintf(dir, MAXLEN, "%s", dblname) >= MAXLEN) overflow();
+
+   p = strrchr(dir, '/');
+   if (!p) return;
+   *p = '\0';
+
+   w->dir_changed(dir);
+}
+
+
+/* make_container_dir makes sure that the directory that will hold
+ * the container dblname exists.  Each thread remembers the last
+ * directory it made, which, since the walk is depth first,
+ * saves nearly all of the mkdir calls; but not in a live tree,
+ * whose container directories come and go.
+ */
+
+static __thread char last_made_dir[MAXLEN];
+
+static
+int make_container_dir(const char *dblname)
+{
+   char dir[MAXLEN];
+   char *p;
+
+   if (snprintf(dir, MAXLEN, "%s", dblname) >= MAXLEN) overflow();
+
+   p = strrchr(dir, '/');
+   if (!p) return 0;
+   *p = '\0';
+
+   if (!w->live && strcmp(dir, last_made_dir) == 0) return 0;
+
+   if (make_dirs(dir)) {
+      WARN("%s: failed to create %s\n", w->tool, dir);
+      return -1;
+   }
+
+   if (w->live) {
+      if (w->dir_changed) w->dir_changed(dir);
+   }
+   else {
+      strcpy(last_made_dir, dir);
+   }
+
+   return 0;
+}
+
+
+void split_object(const char *itemname, const struct stat *itemstat,
+                  const char *dirname, const char *basename)
+{
+   acl_t acl=0;
+   struct stat linkstat;
+   struct stat checkstat;
+   int gotlink;
+   int saveperms;
+   int savemtime;
+   char dblname[MAXLEN];
+   char linkname[MAXLEN];
+   char firstname[MAXLEN];
+   int shared, made, ok;
+   long ops, bytes, size;
+
+   if (snprintf(dblname, MAXLEN, "%s%s/%s%s",
+      w->destination_name,
+      dirname + w->source_name_len,
+      basename,
+      DBL_SUFFIX) >= MAXLEN) overflow();
+
+   /* the other links of an object with several links get hard links
+    * to the container written for the first one (if any)
+    */
+
+   shared = !w->live;
+
+   if (shared && inode_lookup(itemstat, firstname)) {
+      if (!firstname[0]) return;
+
+      if (make_container_dir(dblname)) {
+         set_error();
+         return;
+      }
+
+      if (link(firstname, dblname) == 0) return;
+
+      /* e.g., too many links: write a container of its own */
+
+      unlink(dblname);
+      shared = 0;
+   }
+
+   made = 0;
+   ok = 1;
+
+   ops = xattr_meta_ops;
+   bytes = xattr_io_bytes;
+
+   xattr_access_error = 0;
+
+   if (w->acl) acl = get_acl(itemname, itemstat);
+
+   saveperms = w->allperms || (w->lnkperms && S_ISLNK(itemstat->st_mode))
+               || (w->fixperms && problem_perms(itemstat));
+
+   savemtime = w->mtime || (w->lnkmtime && S_ISLNK(itemstat->st_mode));
+
+   if ( need_container(itemname, itemstat, w->crtime, savemtime,
+                       acl, saveperms, &w->oprefs) ) {
+
+      gotlink = 0;
+
+      if (make_container_dir(dblname)) {
+         set_error();
+         ok = 0;
+         goto done;
+      }
+
+      if (w->linkdir_name) {
+         if (snprintf(linkname, MAXLEN, "%s%s/%s%s",
+            w->linkdir_name,
+            dirname + w->source_name_len,
+            basename,
+            DBL_SUFFIX) >= MAXLEN) overflow();
+
+         if (lstat(linkname, &linkstat) == 0 &&
+             S_ISREG(linkstat.st_mode) &&
+             linkstat.st_mtime == itemstat->st_ctime) {
+
+            if (rename(linkname, dblname)) {
+               WARN("%s: could not move %s to %s\n",
+                    w->tool, linkname, dblname);
+               set_error();
+               ok = 0;
+            }
+            else {
+               gotlink = 1;
+               made = 1;
+            }
+         }
+      }
+
+      if (!gotlink) {
+
+         if ( split_xattr(itemname, itemstat, dblname, w->crtime, savemtime,
+                          acl, saveperms, &w->oprefs) ||
+              set_mtime(dblname, itemstat->st_ctime) ) {
+
+            /* in a live tree, the object may have just gone away,
+             * in which case there will be another event for it
+             */
+
+            if (w->live && lstat(itemname, &checkstat) && errno == ENOENT) {
+               unlink(dblname);
+               xattr_access_error = 0;
+            }
+            else {
+               WARN("%s: error making %s\n", w->tool, dblname);
+               set_error();
+            }
+            ok = 0;
+
+         }
+         else {
+            made = 1;
+         }
+
+      }
+   }
+   else if (w->live) {
+      if (unlink(dblname) == 0) {
+         dir_changed(dblname);
+      }
+      else if (errno != ENOENT && errno != ENOTDIR) {
+         WARN("%s: failed to remove %s\n", w->tool, dblname);
+         set_error();
+      }
+   }
+
+done:
+
+   if (xattr_access_error) {
+      WARN("%s: some metadata unreadable: %s\n", w->tool, itemname);
+      set_error();
+      ok = 0;
+   }
+
+   if (shared) inode_done(itemstat, made ? dblname : 0, ok);
+
+   if (made) {
+      size = gotlink ? linkstat.st_size : xattr_io_bytes - bytes;
+      progress_item(size);
+      hotspot_add(HOTSPOT_SIZE, size, itemname);
+      if (!gotlink) hotspot_add(HOTSPOT_XATTRS, xattr_count, itemname);
+   }
+
+   if (acl) acl_free(acl);
+
+   /* the lstat of the object was charged by the walker */
+
+   throttle(THROTTLE_OPS, xattr_meta_ops - ops);
+   throttle(THROTTLE_BYTES, xattr_io_bytes - bytes);
+}
+
+
+int split_name_conflict(const char *itemname, const char *basename)
+{
+   if (is_suffix(DBL_SUFFIX, DBL_SUFFIX_LEN, basename, strlen(basename)) ||
+       (w->manifest && strcmp(basename, MANIFEST_NAME) == 0)) {
+      WARN("%s: name conflict: %s\n", w->tool, itemname);
+      set_error();
+      return 1;
+   }
+
+   return 0;
+}
+
+
+/* with num_jobs > 0, each object is handed to the work queue as a
+ * task; objects that readdir reports as non-directories are not even
+ * lstat'ed by the walker.
+ */
+
+struct task {
+   int need_stat;
+   struct stat itemstat;
+   char itemname[MAXLEN];
+   char dirname[MAXLEN];
+   char basename[MAXLEN];
+};
+
+static
+void run_task(void *arg)
+{
+   struct task *tp = (struct task *) arg;
+
+   if (tp->need_stat) {
+      if (lstat(tp->itemname, &tp->itemstat)) {
+         if (!(w->live && errno == ENOENT)) {
+            WARN("%s: lstat failed on %s\n", w->tool, tp->itemname);
+            set_error();
+         }
+         free(tp);
+         return;
+      }
+   }
+
+   split_object(tp->itemname, &tp->itemstat, tp->dirname, tp->basename);
+   free(tp);
+}
+
+static
+void submit_task(const char *itemname, const struct stat *itemstat,
+                 const char *dirname, const char *basename)
+{
+   struct task *tp;
+
+   tp = (struct task *) malloc(sizeof(struct task));
+   if (!tp) {
+      Warning("malloc error");
+      exit(-1);
+   }
+
+   if (itemstat) {
+      tp->need_stat = 0;
+      tp->itemstat = *itemstat;
+   }
+   else {
+      tp->need_stat = 1;
+   }
+
+   if (snprintf(tp->itemname, MAXLEN, "%s", itemname) >= MAXLEN ||
+       snprintf(tp->dirname, MAXLEN, "%s", dirname) >= MAXLEN ||
+       snprintf(tp->basename, MAXLEN, "%s", basename) >= MAXLEN) overflow();
+
+   workq_submit(run_task, tp);
+}
+
+
+/* with a journal, the directories finished are recorded in batches;
+ * the work queue is drained first, so that all the containers of a
+ * batch are really written, and the batch is dropped if any errors
+ * were detected while it was being done.
+ */
+
+void split_checkpoint(void)
+{
+   long errors;
+
+   if (w->num_jobs > 0) workq_drain();
+
+   errors = errors_so_far();
+
+   if (checkpoint_flush(errors == flushed_errors)) {
+      WARN("%s: failed to write journal\n", w->tool);
+      set_error();
+   }
+
+   flushed_errors = errors_so_far();
+}
+
+
+/* when resuming, the container directory of a directory that was
+ * not finished may hold containers that are out of date, or for
+ * objects that are gone; so its containers (but not its subdirectories,
+ * which may belong to finished directories) are removed, as are the
+ * subdirectories that no longer have a directory in srcdir.
+ */
+
+static
+void clean_container_dir(const char *dirname)
+{
+   char dir[MAXLEN];
+   char itemname[MAXLEN];
+   char srcitem[MAXLEN];
+   char *path;
+   dirscan_t *dirlist;
+   struct dirscan_item *diritem;
+   struct stat itemstat;
+
+   if (snprintf(dir, MAXLEN, "%s%s",
+       w->destination_name, dirname + w->source_name_len) >= MAXLEN)
+      overflow();
+
+   dirlist = dirscan_open(dir, 0);
+   if (!dirlist) return;  /* nothing written there yet */
+
+   while ( (diritem = dirscan_next(dirlist)) ) {
+
+      if (snprintf(itemname, MAXLEN, "%s/%s",
+          dir, diritem->d_name) >= MAXLEN) overflow();
+
+      if (lstat(itemname, &itemstat)) continue;
+
+      if (!S_ISDIR(itemstat.st_mode)) {
+         if (unlink(itemname)) {
+            WARN("%s: failed to remove %s\n", w->tool, itemname);
+            set_error();
+         }
+         continue;
+      }
+
+      if (snprintf(srcitem, MAXLEN, "%s/%s",
+          dirname, diritem->d_name) >= MAXLEN) overflow();
+
+      if (lstat(srcitem, &itemstat) || !S_ISDIR(itemstat.st_mode)) {
+         path = itemname;
+         if (prune_tree(&path, 1, 1, 0, 0)) {
+            WARN("%s: failed to remove %s\n", w->tool, itemname);
+            set_error();
+         }
+      }
+   }
+
+   dirscan_close(dirlist);
+}
+
+
+void split_dirwalk(const char *dirname, const struct stat *dirstat,
+                   int walk_state)
+{
+   char itemname[MAXLEN];
+   dirscan_t *dirlist;
+   struct dirscan_item *diritem;
+   struct stat itemstat;
+   int walk_state1;
+   long errors;
+   long start, below, t, entries;
+
+
+   errors = errors_so_far();
+
+   progress_current(dirname);
+
+   start = hotspot_time();
+   below = 0;
+   entries = 0;
+
+   if (w->resume) clean_container_dir(dirname);
+
+   dirlist = dirscan_open(dirname, w->sorted);
+
+   if (!dirlist) {
+      if (w->live && errno == ENOENT) return;
+      WARN("%s: opendir failed on %s\n", w->tool, dirname);
+      set_error();
+      return;
+   }
+
+   while ( (diritem = dirscan_next(dirlist)) ) {
+
+      if (checkpoint_expired()) {
+         w->stopped = 1;
+         break;
+      }
+
+      throttle(THROTTLE_OBJECTS, 1);
+      throttle(THROTTLE_OPS, 1);
+      progress_object();
+      entries++;
+
+      if (snprintf(itemname, MAXLEN, "%s/%s",
+          dirname, diritem->d_name) >= MAXLEN) overflow();
+
+      split_name_conflict(itemname, diritem->d_name);
+
+      walk_state1 = walk_state;
+
+      if (walk_state1 == 0) {
+	    walk_state1 = lookup_name(itemname + w->source_name_len + 1);
+	    if (walk_state1 == -1) continue; /* pruning */
+      }
+
+      if (exclude_item(itemname + w->source_name_len + 1,
+                       itemname, diritem->d_type)) continue;
+
+      if (w->num_jobs > 0 && walk_state1 == 1 &&
+          diritem->d_type != DT_DIR && diritem->d_type != DT_UNKNOWN) {
+         submit_task(itemname, 0, dirname, diritem->d_name);
+         continue;
+      }
+
+      if (lstat(itemname, &itemstat)) {
+         if (w->live && errno == ENOENT) continue;
+         WARN("%s: lstat failed on %s\n", w->tool, itemname);
+         set_error();
+         continue;
+      }
+
+
+#if 0
+      if (!(S_ISDIR(itemstat.st_mode) || S_ISREG_OR_LNK(itemstat.st_mode)))
+         continue;
+#endif
+
+      if (walk_state1 == 1 && !S_ISDIR(itemstat.st_mode)) {
+         if (w->num_jobs > 0)
+            submit_task(itemname, &itemstat, dirname, diritem->d_name);
+         else
+            split_object(itemname, &itemstat, dirname, diritem->d_name);
+      }
+
+      if (S_ISDIR(itemstat.st_mode)) {
+         if (w->xdev && itemstat.st_dev != w->root_dev) {
+            /* a mount point: just the directory itself */
+            if (w->num_jobs > 0)
+               submit_task(itemname, &itemstat, itemname, ".");
+            else
+               split_object(itemname, &itemstat, itemname, ".");
+            continue;
+         }
+
+         if (checkpoint_is_done(itemname + w->source_name_len)) continue;
+
+         t = hotspot_time();
+	 split_dirwalk(itemname, &itemstat, walk_state1);
+         below += hotspot_time() - t;
+         if (w->stopped) break;
+      }
+
+   }
+
+   if (dirscan_close(dirlist)) {
+      WARN("%s: readdir failed on %s\n", w->tool, dirname);
+      set_error();
+   }
+
+   if (w->stopped) return;
+
+   if (w->num_jobs > 0)
+      submit_task(dirname, dirstat, dirname, ".");
+   else
+      split_object(dirname, dirstat, dirname, ".");
+
+   if (w->journal) {
+      if (errors_so_far() == errors)
+         checkpoint_done(dirname + w->source_name_len);
+
+      if (checkpoint_due()) split_checkpoint();
+   }
+
+   hotspot_add(HOTSPOT_DIR_TIME, hotspot_time() - start - below, dirname);
+   hotspot_add(HOTSPOT_DIR_ENTRIES, entries, dirname);
+}
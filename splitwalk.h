@@ -0,0 +1,92 @@
+#ifndef XBUP__splitwalk_H
+#define XBUP__splitwalk_H
+
+/* splitwalk: the walk that writes the xattr containers of a tree
+ * into a repository, shared by split_xattr (which makes the
+ * repository from scratch) and xbup_watch (which keeps it up to
+ * date, by walking the parts of the tree that changed), so that
+ * the two always agree on which objects get containers, and what
+ * goes into them.
+ *
+ * The walk is set up by filling in a struct split_walk (the options
+ * are those of split_xattr) and passing it to split_walk_init, which
+ * keeps a pointer to it.  The checkpoint, progress, hotspot and
+ * throttle modules are used as set up by the caller (they do nothing
+ * until they are).
+ *
+ * With live set, the tree is taken to be in use, as it is for
+ * xbup_watch: objects that go away while they are looked at are not
+ * errors, the container of an object that no longer needs one is
+ * removed, and the links of an object with several links get
+ * containers of their own (rather than hard links to one container,
+ * which a later change to just one of them could not undo).
+ */
+
+#include <sys/stat.h>
+
+#include "xattr_util.h"
+
+struct split_walk {
+   const char *tool;               /* for messages */
+   int source_name_len;
+   const char *destination_name;
+   const char *linkdir_name;       /* split_xattr --recycle, or 0 */
+
+   int crtime, mtime, lnkmtime;
+   int acl, fixperms, allperms, lnkperms;
+   owner_prefs_t oprefs;
+
+   int sorted;
+   int xdev;                       /* with root_dev */
+   dev_t root_dev;
+   int manifest;                   /* MANIFEST_NAME is a name conflict */
+   int resume;                     /* see split_xattr --resume */
+   int journal;                    /* a checkpoint journal is open */
+   long num_jobs;                  /* workq_start must have been called */
+   int live;
+
+   /* set_error is called for every error detected (possibly from the
+    * worker threads); dir_changed, if not null, is called for every
+    * directory of the repository that a container was written to
+    * or removed from (live only).
+    */
+   void (*set_error)(void);
+   void (*dir_changed)(const char *dir);
+
+   /* set by the walk: the deadline was reached (see checkpoint.h) */
+   int stopped;
+};
+
+void split_walk_init(struct split_walk *w);
+
+/* split_dirwalk walks the directory dirname (of srcdir), writing the
+ * containers of everything in it and below it, and then that of
+ * dirname itself; walk_state is as for lookup_name (1 for all).
+ */
+
+void split_dirwalk(const char *dirname, const struct stat *dirstat,
+                   int walk_state);
+
+/* split_object writes (or, live, removes) the container of the one
+ * object itemname, whose directory is dirname, and whose name in
+ * it is basename ("." for dirname itself).
+ */
+
+void split_object(const char *itemname, const struct stat *itemstat,
+                  const char *dirname, const char *basename);
+
+/* split_name_conflict reports (as an error) an object of srcdir named
+ * like a container (or a manifest, with manifest set), which would
+ * clash with the containers in the repository; returns 1 if so.
+ */
+
+int split_name_conflict(const char *itemname, const char *basename);
+
+/* split_checkpoint flushes the journal (after draining the work
+ * queue); the walk calls it every few seconds, and the caller once
+ * more at the end.
+ */
+
+void split_checkpoint(void);
+
+#endif
@@ -1,7 +1,16 @@
 
 /* usage: strip_locks options srcdir 
  *   options:  --files-from file
+ *             --sorted
+ *             --exclude pattern
+ *             --exclude-from file
+ *             --one-file-system
  *             --acl
+ *             --max-ops n
+ *             --max-meta-ops n
+ *             --throttle-file file
+ *             --nice n
+ *             --low-io
  * 
  * strips locks from files in srcdir
  * 
@@ -9,18 +18,40 @@
  * are examined are those listed in file (and subdirectories
  * along the way)
  *
+ * the --sorted flag causes the entries of each directory to be
+ * visited in sorted (strcmp) order, rather than in readdir order.
+ *
+ * the --exclude and --exclude-from options add rsync-style exclude
+ * rules (see exclude.h), in the order given; they are matched against
+ * paths relative to srcdir, and excluded directories are not walked.
+ *
+ * the --one-file-system flag keeps the walk on the file system of
+ * srcdir: the locks of a mount point itself are stripped, but it
+ * is not walked.
+ *
  * with the --acl flag, acls are also stripped
  *
+ * the --max-ops and --max-meta-ops options limit the walk to about
+ * n objects, and n metadata operations (lstat, chflags, the ACL
+ * calls), per second (see throttle.h).  The --throttle-file, --nice
+ * and --low-io options are as in split_xattr.
+ *
  * Returns -1 if errors detected, and 0 otherwise.
  *
  */
 
 #include "util.h"
 #include "xattr_util.h"
+#include "dirscan.h"
+#include "exclude.h"
+#include "throttle.h"
 
 
 
 static int return_value = 0;
+static int sortedflag = 0;
+static int xdevflag = 0;
+static dev_t root_dev = 0;
 static int aclflag = 0;
    
 static int source_name_len = 0;
@@ -28,6 +59,8 @@ static int source_name_len = 0;
 
 void do_strip(const char *itemname, const struct stat *itemstat)
 {
+   long ops = xattr_meta_ops;
+
    if (has_locks(itemstat)) {
       // WARN("strip_locks: removing locks on %s\n", itemname);
 
@@ -45,6 +78,8 @@ void do_strip(const char *itemname, const struct stat *itemstat)
          return_value = -1;
       }
    }
+
+   throttle(THROTTLE_OPS, xattr_meta_ops - ops);
 }
 
 
@@ -52,13 +87,13 @@ void do_strip(const char *itemname, const struct stat *itemstat)
 void dirwalk(const char *dirname, const struct stat *dirstat, int walk_state)
 {
    char itemname[MAXLEN];
-   DIR *dirlist;
-   struct dirent *diritem; 
+   dirscan_t *dirlist;
+   struct dirscan_item *diritem;
    struct stat itemstat;
    int walk_state1;
 
 
-   dirlist = opendir(dirname);
+   dirlist = dirscan_open(dirname, sortedflag);
 
    if (!dirlist) {
       WARN("strip_locks: opendir failed on %s\n", dirname);
@@ -66,11 +101,10 @@ void dirwalk(const char *dirname, const struct stat *dirstat, int walk_state)
       return;
    }
 
-   while ( (diritem = readdir(dirlist)) ) {
+   while ( (diritem = dirscan_next(dirlist)) ) {
 
-      if (strcmp(diritem->d_name, ".") == 0 
-          || strcmp(diritem->d_name, "..") == 0)
-         continue;
+      throttle(THROTTLE_OBJECTS, 1);
+      throttle(THROTTLE_OPS, 1);
 
       if (snprintf(itemname, MAXLEN, "%s/%s", 
           dirname, diritem->d_name) >= MAXLEN) overflow();
@@ -82,6 +116,9 @@ void dirwalk(const char *dirname, const struct stat *dirstat, int walk_state)
 	    if (walk_state1 == -1) continue; /* pruning */
       }
 
+      if (exclude_item(itemname + source_name_len + 1, 
+                       itemname, diritem->d_type)) continue;
+
       if (lstat(itemname, &itemstat)) {
          WARN("strip_locks: lstat failed on %s\n", itemname);
          return_value = -1;
@@ -96,18 +133,31 @@ void dirwalk(const char *dirname, const struct stat *dirstat, int walk_state)
 
       do_strip(itemname, &itemstat);
 
-      if (S_ISDIR(itemstat.st_mode))
+      if (S_ISDIR(itemstat.st_mode) && 
+          !(xdevflag && itemstat.st_dev != root_dev))
 	 dirwalk(itemname, &itemstat, walk_state1);
    }
 
-   closedir(dirlist);
+   if (dirscan_close(dirlist)) {
+      WARN("strip_locks: readdir failed on %s\n", dirname);
+      return_value = -1;
+   }
 }
 
 void usage()
 {
    WARN("usage: strip_locks options srcdir\n");
    WARN("  options: --files-from file\n");
+   WARN("           --sorted\n");
+   WARN("           --exclude pattern\n");
+   WARN("           --exclude-from file\n");
+   WARN("           --one-file-system\n");
    WARN("           --acl\n");
+   WARN("           --max-ops n\n");
+   WARN("           --max-meta-ops n\n");
+   WARN("           --throttle-file file\n");
+   WARN("           --nice n\n");
+   WARN("           --low-io\n");
 }
 
 
@@ -117,9 +167,18 @@ int main(int argc, char **argv)
    struct stat srcstat;
    int srcname_len;
    int walk_state;
+   long max_ops, max_meta_ops;
+   char *tname;
+   long nice_incr;
+   int lowioflag;
    int i;
 
    fname = 0;
+   max_ops = 0;
+   max_meta_ops = 0;
+   tname = 0;
+   nice_incr = 0;
+   lowioflag = 0;
    
    i = 1;
    while (i < argc) {
@@ -127,6 +186,35 @@ int main(int argc, char **argv)
          i++;
          aclflag = 1;
       }
+      else if (strcmp(argv[i], "--sorted") == 0) {
+         i++;
+         sortedflag = 1;
+      }
+      else if (strcmp(argv[i], "--exclude") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         if (exclude_add(argv[i], 0)) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--exclude-from") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         if (exclude_add_file(argv[i])) return -1;
+         i++;
+      }
+      else if (strcmp(argv[i], "--one-file-system") == 0) {
+         i++;
+         xdevflag = 1;
+      }
       else if (strcmp(argv[i], "--files-from") == 0) {
          if (i == argc-1) {
             usage();
@@ -136,6 +224,58 @@ int main(int argc, char **argv)
          fname = argv[i];
          i++;
       }
+      else if (strcmp(argv[i], "--max-ops") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         max_ops = string_to_long(argv[i]);
+         if (conversion_error || max_ops < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--max-meta-ops") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         max_meta_ops = string_to_long(argv[i]);
+         if (conversion_error || max_meta_ops < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--throttle-file") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         tname = argv[i];
+         i++;
+      }
+      else if (strcmp(argv[i], "--nice") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         nice_incr = string_to_long(argv[i]);
+         if (conversion_error || nice_incr < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--low-io") == 0) {
+         i++;
+         lowioflag = 1;
+      }
       else
          break;
    }
@@ -162,6 +302,19 @@ int main(int argc, char **argv)
       return -1;
    }
 
+   root_dev = srcstat.st_dev;
+
+   throttle_init(THROTTLE_OBJECTS, max_ops);
+   throttle_init(THROTTLE_OPS, max_meta_ops);
+
+   if (tname && throttle_control(tname)) {
+      WARN("strip_locks: bad throttle file %s\n", tname);
+      return -1;
+   }
+
+   if (throttle_priority(nice_incr, lowioflag))
+      WARN("strip_locks: could not lower priority\n");
+
    do_strip(srcname, &srcstat);
 
    source_name_len = srcname_len;
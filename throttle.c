@@ -0,0 +1,256 @@
+
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "util.h"
+#include "throttle.h"
+
+
+struct bucket {
+   long rate;       /* the rate in force */
+   long base_rate;  /* the rate given to throttle_init */
+   double tokens;
+   double last;
+};
+
+static struct bucket buckets[THROTTLE_BUCKETS];
+
+/* the control file, and what it was like when last read */
+
+static char *control_name = 0;
+static int control_exists = 0;
+static struct stat control_stat;
+static double control_checked = 0;
+
+static pthread_mutex_t throttle_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *rate_names[THROTTLE_BUCKETS] = {
+   "max-ops", "max-meta-ops", "max-bytes"
+};
+
+
+static
+double now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+/* sets the rate of bp, with throttle_lock held; a bucket that was not
+ * limiting starts out full
+ */
+
+static
+void set_rate(struct bucket *bp, long rate)
+{
+   if (bp->rate <= 0 || bp->tokens > rate) bp->tokens = rate;
+   bp->rate = rate;
+   bp->last = now();
+}
+
+
+void throttle_init(int bucket, long rate)
+{
+   struct bucket *bp = &buckets[bucket];
+
+   pthread_mutex_lock(&throttle_lock);
+   bp->base_rate = rate;
+   set_rate(bp, rate);
+   pthread_mutex_unlock(&throttle_lock);
+}
+
+
+/* reads the rates in the control file into rates;
+ * returns 0 on success, and -1 if the file has errors
+ */
+
+static
+int read_control(const char *fname, long *rates)
+{
+   FILE *fp;
+   char line[MAXLEN];
+   char *val;
+   long len, rate;
+   int b, ret;
+
+   fp = fopen(fname, "r");
+   if (!fp) {
+      WARN("can't open %s\n", fname);
+      return -1;
+   }
+
+   ret = 0;
+
+   while (fgets(line, MAXLEN, fp)) {
+      len = strlen(line);
+      if (len > 0 && line[len-1] == '\n') line[--len] = '\0';
+      if (len > 0 && line[len-1] == '\r') line[--len] = '\0';
+
+      if (len == 0 || line[0] == '#') continue;
+
+      for (b = 0; b < THROTTLE_BUCKETS; b++) {
+         len = strlen(rate_names[b]);
+         if (strncmp(line, rate_names[b], len) == 0 && line[len] == ' ')
+            break;
+      }
+
+      rate = -1;
+      if (b < THROTTLE_BUCKETS) {
+         val = line + strlen(rate_names[b]);
+         rate = string_to_long(val);
+         if (conversion_error) rate = -1;
+      }
+
+      if (rate < 0) {
+         WARN("%s: bad line: %s\n", fname, line);
+         ret = -1;
+         continue;
+      }
+
+      rates[b] = rate;
+   }
+
+   if (ferror(fp)) {
+      WARN("error reading %s\n", fname);
+      ret = -1;
+   }
+
+   fclose(fp);
+
+   return ret;
+}
+
+
+/* checks the control file, with throttle_lock held, if it has not been
+ * checked for a second; if it has changed, the rates are reset to
+ * the base rates, and then to those it sets
+ */
+
+static
+void check_control(double t)
+{
+   struct stat sbuf;
+   long rates[THROTTLE_BUCKETS];
+   int exists, b;
+
+   if (t - control_checked < 1) return;
+   control_checked = t;
+
+   exists = (stat(control_name, &sbuf) == 0);
+
+   if (exists == control_exists &&
+       (!exists || (sbuf.st_ino == control_stat.st_ino &&
+                    sbuf.st_size == control_stat.st_size &&
+                    sbuf.st_mtime == control_stat.st_mtime)))
+      return;
+
+   control_exists = exists;
+   if (exists) control_stat = sbuf;
+
+   for (b = 0; b < THROTTLE_BUCKETS; b++)
+      rates[b] = buckets[b].base_rate;
+
+   /* a file with errors still sets the rates on its good lines */
+
+   if (exists) read_control(control_name, rates);
+
+   for (b = 0; b < THROTTLE_BUCKETS; b++) {
+      if (rates[b] != buckets[b].rate) {
+         WARN("throttle: %s %ld\n", rate_names[b], rates[b]);
+         set_rate(&buckets[b], rates[b]);
+      }
+   }
+}
+
+
+int throttle_control(const char *fname)
+{
+   long rates[THROTTLE_BUCKETS];
+
+   /* the file need not exist yet, but if it does, it has to be good */
+
+   if (access(fname, F_OK) == 0 && read_control(fname, rates)) return -1;
+
+   pthread_mutex_lock(&throttle_lock);
+
+   control_name = strdup(fname);
+   if (!control_name) {
+      Warning("malloc error");
+      exit(-1);
+   }
+
+   control_exists = 0;
+   control_checked = 0;
+   check_control(now());
+
+   pthread_mutex_unlock(&throttle_lock);
+
+   return 0;
+}
+
+
+void throttle(int bucket, long n)
+{
+   struct bucket *bp = &buckets[bucket];
+   struct timespec ts;
+   double t, wait;
+
+   if (!control_name && bp->rate <= 0) return;
+
+   pthread_mutex_lock(&throttle_lock);
+
+   t = now();
+
+   if (control_name) check_control(t);
+
+   if (bp->rate <= 0) {
+      pthread_mutex_unlock(&throttle_lock);
+      return;
+   }
+
+   bp->tokens += (t - bp->last) * bp->rate;
+   if (bp->tokens > bp->rate) bp->tokens = bp->rate;
+   bp->last = t;
+
+   /* the tokens are taken now, even if that leaves the bucket in
+    * debt; whoever comes next waits for the debt to be paid off
+    */
+
+   bp->tokens -= n;
+   wait = (bp->tokens < 0) ? -bp->tokens / bp->rate : 0;
+
+   pthread_mutex_unlock(&throttle_lock);
+
+   if (wait > 0) {
+      ts.tv_sec = (time_t) wait;
+      ts.tv_nsec = (long) ((wait - ts.tv_sec) * 1e9);
+      while (nanosleep(&ts, &ts) && errno == EINTR) ;
+   }
+}
+
+
+int throttle_priority(long incr, int lowio)
+{
+   int prio;
+
+   if (incr > 0) {
+      errno = 0;
+      prio = getpriority(PRIO_PROCESS, 0);
+      if (prio == -1 && errno) return -1;
+
+      prio += incr;
+      if (prio > PRIO_MAX) prio = PRIO_MAX;
+
+      if (setpriority(PRIO_PROCESS, 0, prio)) return -1;
+   }
+
+   if (lowio &&
+       setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_PROCESS, IOPOL_THROTTLE))
+      return -1;
+
+   return 0;
+}
@@ -0,0 +1,59 @@
+#ifndef XBUP__throttle_H
+#define XBUP__throttle_H
+
+/* throttle: token buckets limiting the rate at which a tree walker
+ * touches the file system, so that several walkers (say, one per
+ * volume, under xbup_multi), or a walker run during the day, can
+ * share a disk without starving everything else on it.
+ *
+ * There is one bucket for each kind of work:
+ *    THROTTLE_OBJECTS   objects walked (--max-ops)
+ *    THROTTLE_OPS       metadata operations: lstat, listxattr, getxattr,
+ *                       setxattr, chown, the ACL calls... (--max-meta-ops)
+ *    THROTTLE_BYTES     bytes of containers (or, for xsum, of data)
+ *                       read or written (--max-bytes)
+ *
+ * Each bucket fills at its rate in tokens per second, and holds at
+ * most one second's worth.  throttle(bucket, n) takes n tokens,
+ * sleeping until they are available; callers that find the bucket
+ * empty reserve their tokens before sleeping, so concurrent callers
+ * are served in turn.  Tokens may also be taken after the work is
+ * done (as the walkers do for metadata operations and bytes, which
+ * are only known then): the next caller then pays off the debt.
+ * throttle may be called from any thread.  A bucket whose rate is
+ * 0 (the default) does nothing.
+ */
+
+#define THROTTLE_OBJECTS (0)
+#define THROTTLE_OPS     (1)
+#define THROTTLE_BYTES   (2)
+
+#define THROTTLE_BUCKETS (3)
+
+void throttle_init(int bucket, long rate);
+void throttle(int bucket, long n);
+
+/* throttle_control makes the rates adjustable while the walker runs:
+ * fname is checked about once a second, and whenever it changes, the
+ * rates it sets replace those given to throttle_init.  Each line is
+ *    max-ops n
+ *    max-meta-ops n
+ *    max-bytes n
+ * with n = 0 for no limit; blank lines and lines starting with #
+ * are ignored, and a rate that is not set in the file (or a file that
+ * does not exist) reverts to the one given to throttle_init.
+ * Returns 0 on success, and -1 if fname has errors.
+ */
+
+int throttle_control(const char *fname);
+
+/* throttle_priority lowers the priority of the whole process:
+ * its nice value is raised by incr (if incr > 0), and with lowio,
+ * its disk I/O is given the "throttle" policy (see setiopolicy_np),
+ * so that it yields to any other I/O on the same disk.
+ * Returns 0 on success, and -1 on error.
+ */
+
+int throttle_priority(long incr, int lowio);
+
+#endif
@@ -1,5 +1,6 @@
 
 #include <ctype.h>
+#include <pthread.h>
 
 #include "util.h"
 #include "uthash.h"
@@ -7,6 +8,18 @@
 #undef uthash_fatal
 #define uthash_fatal(msg) (Warning(msg), exit(-1))
 
+
+/* The identity caches below are shared by all threads, so lookups
+ * are serialized with a single lock.  The cached names and ids are
+ * never freed, so pointers returned by map_uid_to_name and 
+ * map_gid_to_name remain valid after the lock is released.
+ */
+
+static pthread_mutex_t id_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define ID_LOCK() pthread_mutex_lock(&id_table_lock)
+#define ID_UNLOCK() pthread_mutex_unlock(&id_table_lock)
+
 int xbup_opt_preserve_uuids = 0;
 int xbup_opt_numeric_ids = 0;
 
@@ -20,7 +33,7 @@ int xbup_opt_numeric_ids = 0;
  * 
  * here W is whitespace, and D is a digit
  *
- * if the syntax is invalid, then the global variable conversion_error is
+ * if the syntax is invalid, then the (thread-local) variable conversion_error is
  * set to -1, errno is set to EINVAL, and 0 is returned.
  *
  * if the syntax is legal, but the number is out of range, then
@@ -32,7 +45,7 @@ int xbup_opt_numeric_ids = 0;
  *
  */
  
-int conversion_error = 0;
+__thread int conversion_error = 0;
 
 long string_to_long(const char *s)
 {
@@ -117,6 +130,33 @@ int strip_slashes(char *s)
 
 
 
+/* make_dirs creates the directory dir, along with any missing
+ * ancestors (much like mkdir -p); dir is modified temporarily.
+ */
+
+int make_dirs(char *dir)
+{
+   char *p;
+   int ret;
+
+   if (mkdir(dir, 0777) == 0 || errno == EEXIST) return 0;
+   if (errno != ENOENT) return -1;
+
+   p = strrchr(dir, '/');
+   if (!p || p == dir) return -1;
+
+   *p = '\0';
+   ret = make_dirs(dir);
+   *p = '/';
+
+   if (ret) return -1;
+
+   if (mkdir(dir, 0777) == 0 || errno == EEXIST) return 0;
+   return -1;
+}
+
+
+
 int is_prefix(const char *pat, const char *txt)
 {
    const char *p, *t;
@@ -341,6 +381,7 @@ char *map_uid_to_name(uid_t uid)
    struct uid2nam_table_entry *ptr;
    struct passwd *uid_entry;
 
+   ID_LOCK();
    ptr = uid2nam_find(uid);
    if (!ptr) {
       ptr = uid2nam_add(uid);
@@ -354,6 +395,7 @@ char *map_uid_to_name(uid_t uid)
       }
    }
 
+   ID_UNLOCK();
    return ptr->data;
 }
 
@@ -401,9 +443,12 @@ char *map_gid_to_name(gid_t gid)
    struct gid2nam_table_entry *ptr;
    struct group *gid_entry;
 
+   ID_LOCK();
    ptr = gid2nam_find(gid);
-   if (ptr) 
+   if (ptr) {
+      ID_UNLOCK();
       return ptr->data;
+   }
    else {
       ptr = gid2nam_add(gid);
       gid_entry = getgrgid(gid);
@@ -416,6 +461,7 @@ char *map_gid_to_name(gid_t gid)
       }
    }
 
+   ID_UNLOCK();
    return ptr->data;
 }
 
@@ -473,6 +519,7 @@ int map_name_to_uid(const char *s, uid_t *uid)
    struct nam2uid_table_entry *ptr;
    struct passwd *uid_entry;
 
+   ID_LOCK();
    ptr = nam2uid_find(s);
    if (!ptr) {
       ptr = nam2uid_add(s);
@@ -485,9 +532,11 @@ int map_name_to_uid(const char *s, uid_t *uid)
 
    if (ptr->known) {
       *uid = ptr->data;
+      ID_UNLOCK();
       return 0;
    }
    else {
+      ID_UNLOCK();
       return -1;
    }
 }
@@ -546,6 +595,7 @@ int map_name_to_gid(const char *s, gid_t *gid)
    struct nam2gid_table_entry *ptr;
    struct group *gid_entry;
 
+   ID_LOCK();
    ptr = nam2gid_find(s);
    if (!ptr) {
       ptr = nam2gid_add(s);
@@ -558,9 +608,11 @@ int map_name_to_gid(const char *s, gid_t *gid)
 
    if (ptr->known) {
       *gid = ptr->data;
+      ID_UNLOCK();
       return 0;
    }
    else {
+      ID_UNLOCK();
       return -1;
    }
 }
@@ -615,6 +667,7 @@ int map_uuid_to_id(uuid_t uu, uid_t *uid, int *id_type)
 {
    struct uuid2id_table_entry *ptr;
 
+   ID_LOCK();
    ptr = uuid2id_find(uu);
    if (!ptr) {
       ptr = uuid2id_add(uu);
@@ -626,9 +679,11 @@ int map_uuid_to_id(uuid_t uu, uid_t *uid, int *id_type)
    if (ptr->known) {
       *uid = ptr->data;
       *id_type = ptr->type;
+      ID_UNLOCK();
       return 0;
    }
    else {
+      ID_UNLOCK();
       return -1;
    }
 }
@@ -679,6 +734,7 @@ int map_uid_to_uuid(uid_t uid, uuid_t uuid)
 {
    struct uid2uuid_table_entry *ptr;
 
+   ID_LOCK();
    ptr = uid2uuid_find(uid);
    if (!ptr) {
       ptr = uid2uuid_add(uid);
@@ -689,9 +745,11 @@ int map_uid_to_uuid(uid_t uid, uuid_t uuid)
 
    if (ptr->known) {
       memcpy(uuid, ptr->data, sizeof(uuid_t));
+      ID_UNLOCK();
       return 0;
    }
    else {
+      ID_UNLOCK();
       return -1;
    }
 }
@@ -742,6 +800,7 @@ int map_gid_to_uuid(gid_t gid, uuid_t uuid)
 {
    struct gid2uuid_table_entry *ptr;
 
+   ID_LOCK();
    ptr = gid2uuid_find(gid);
    if (!ptr) {
       ptr = gid2uuid_add(gid);
@@ -752,13 +811,224 @@ int map_gid_to_uuid(gid_t gid, uuid_t uuid)
 
    if (ptr->known) {
       memcpy(uuid, ptr->data, sizeof(uuid_t));
+      ID_UNLOCK();
       return 0;
    }
    else {
+      ID_UNLOCK();
+      return -1;
+   }
+}
+
+/****** sharing the identity caches between runs ******/
+
+/* load_id_cache and save_id_cache let several runs (such as the
+ * volumes backed up by xbup_multi) share what they have learned
+ * from the directory service.  Each line of the file is one of
+ *
+ *    u uid name
+ *    g gid name
+ *    i uuid type id
+ *    U uid uuid
+ *    G gid uuid
+ *
+ * Only successful lookups are saved, and entries already in the
+ * tables are left alone when loading.  save_id_cache first loads
+ * whatever other runs have saved in the meantime, then replaces
+ * the file by renaming a temporary one, so the file only grows
+ * (a run that saves at just the wrong moment may drop another's
+ * new entries, which then just have to be looked up again).
+ */
+
+static
+int load_id_entry(char *line)
+{
+   char *kind, *f1, *f2;
+   struct uid2nam_table_entry *uptr;
+   struct gid2nam_table_entry *gptr;
+   struct uuid2id_table_entry *iptr;
+   struct uid2uuid_table_entry *uuptr;
+   struct gid2uuid_table_entry *guptr;
+   uuid_t uu;
+   long id, type;
+   char *name;
+
+   kind = strsep(&line, " ");
+   f1 = strsep(&line, " ");
+   if (!f1 || !line || strlen(kind) != 1) return -1;
+
+   if (kind[0] == 'i') {
+      f2 = strsep(&line, " ");
+      if (!line || uuid_parse(f1, uu)) return -1;
+      type = string_to_long(f2);
+      if (conversion_error) return -1;
+      id = string_to_long(line);
+      if (conversion_error) return -1;
+
+      if (!uuid2id_find(uu)) {
+         iptr = uuid2id_add(uu);
+         iptr->data = (uid_t) id;
+         iptr->type = type;
+         iptr->known = 1;
+      }
+      return 0;
+   }
+
+   id = string_to_long(f1);
+   if (conversion_error) return -1;
+
+   switch (kind[0]) {
+   case 'u':
+   case 'g':
+      if (*line == '\0') return -1;
+      name = strdup(line);
+      if (!name) {
+         Warning("malloc error");
+         exit(-1);
+      }
+
+      if (kind[0] == 'u' && !uid2nam_find((uid_t) id)) {
+         uptr = uid2nam_add((uid_t) id);
+         uptr->data = name;
+      }
+      else if (kind[0] == 'g' && !gid2nam_find((gid_t) id)) {
+         gptr = gid2nam_add((gid_t) id);
+         gptr->data = name;
+      }
+      else {
+         free(name);
+      }
+      return 0;
+
+   case 'U':
+      if (uuid_parse(line, uu)) return -1;
+      if (!uid2uuid_find((uid_t) id)) {
+         uuptr = uid2uuid_add((uid_t) id);
+         memcpy(uuptr->data, uu, sizeof(uuid_t));
+         uuptr->known = 1;
+      }
+      return 0;
+
+   case 'G':
+      if (uuid_parse(line, uu)) return -1;
+      if (!gid2uuid_find((gid_t) id)) {
+         guptr = gid2uuid_add((gid_t) id);
+         memcpy(guptr->data, uu, sizeof(uuid_t));
+         guptr->known = 1;
+      }
+      return 0;
+
+   default:
       return -1;
    }
 }
 
+
+int load_id_cache(const char *fname)
+{
+   char line[MAXLEN];
+   FILE *fp;
+   int ret, n;
+
+   fp = fopen(fname, "r");
+   if (!fp) {
+      if (errno == ENOENT) return 0;
+      WARN("can't open identity cache %s\n", fname);
+      return -1;
+   }
+
+   ret = 0;
+
+   ID_LOCK();
+
+   while ((n = readline(fp, line)) > 0) {
+      if (load_id_entry(line)) {
+         ret = -1;
+         break;
+      }
+   }
+
+   ID_UNLOCK();
+
+   if (n < 0) ret = -1;
+   fclose(fp);
+
+   if (ret) WARN("bad identity cache %s -- ignoring the rest\n", fname);
+
+   return ret;
+}
+
+
+int save_id_cache(const char *fname)
+{
+   char tmpname[MAXLEN];
+   char uu_str[40];
+   FILE *fp;
+   struct uid2nam_table_entry *uptr;
+   struct gid2nam_table_entry *gptr;
+   struct uuid2id_table_entry *iptr;
+   struct uid2uuid_table_entry *uuptr;
+   struct gid2uuid_table_entry *guptr;
+   int ret;
+
+   load_id_cache(fname);
+
+   if (snprintf(tmpname, MAXLEN, "%s.%ld", fname, (long) getpid()) >= MAXLEN)
+      overflow();
+
+   fp = fopen(tmpname, "w");
+   if (!fp) {
+      WARN("can't create %s\n", tmpname);
+      return -1;
+   }
+
+   ID_LOCK();
+
+   for (uptr = uid2nam_table; uptr; uptr = uptr->hh.next) 
+      if (uptr->data && !strchr(uptr->data, '\n'))
+         fprintf(fp, "u %lu %s\n", (unsigned long) uptr->key, uptr->data);
+
+   for (gptr = gid2nam_table; gptr; gptr = gptr->hh.next) 
+      if (gptr->data && !strchr(gptr->data, '\n'))
+         fprintf(fp, "g %lu %s\n", (unsigned long) gptr->key, gptr->data);
+
+   for (iptr = uuid2id_table; iptr; iptr = iptr->hh.next) {
+      if (iptr->known) {
+         uuid_unparse_upper(iptr->key, uu_str);
+         fprintf(fp, "i %s %d %lu\n", uu_str, iptr->type, 
+                 (unsigned long) iptr->data);
+      }
+   }
+
+   for (uuptr = uid2uuid_table; uuptr; uuptr = uuptr->hh.next) {
+      if (uuptr->known) {
+         uuid_unparse_upper(uuptr->data, uu_str);
+         fprintf(fp, "U %lu %s\n", (unsigned long) uuptr->key, uu_str);
+      }
+   }
+
+   for (guptr = gid2uuid_table; guptr; guptr = guptr->hh.next) {
+      if (guptr->known) {
+         uuid_unparse_upper(guptr->data, uu_str);
+         fprintf(fp, "G %lu %s\n", (unsigned long) guptr->key, uu_str);
+      }
+   }
+
+   ID_UNLOCK();
+
+   ret = 0;
+   if (ferror(fp)) ret = -1;
+   if (fclose(fp)) ret = -1;
+   if (ret == 0 && rename(tmpname, fname)) ret = -1;
+
+   if (ret) {
+      WARN("failed to write identity cache %s\n", fname);
+      unlink(tmpname);
+   }
+
+   return ret;
+}
+
 /****** user mapping stuff ******/
 
 /* first, a hash table to translate uids to uids */
@@ -97,10 +97,12 @@ extern int xbup_opt_preserve_uuids;
 extern int xbup_opt_numeric_ids;
 
 long string_to_long(const char *s);
-extern int conversion_error;
+extern __thread int conversion_error;
 
 int strip_slashes(char *s);
 
+int make_dirs(char *dir);
+
 
 int is_prefix(const char *pat, const char *txt);
 
@@ -118,6 +120,9 @@ int map_uuid_to_id(uuid_t uu, uid_t *uid, int *id_type); // non-zero on fail
 int map_uid_to_uuid(uid_t uid, uuid_t uuid);  // non-zero on fail
 int map_gid_to_uuid(gid_t uid, uuid_t uuid);  // non-zero on fail
 
+int load_id_cache(const char *fname); // non-zero on fail
+int save_id_cache(const char *fname); // non-zero on fail
+
 void process_usermap(char *str);
 void process_groupmap(char *str);
 
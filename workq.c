@@ -0,0 +1,152 @@
+
+#include <pthread.h>
+
+#include "util.h"
+#include "workq.h"
+
+
+struct task {
+   workq_fn fn;
+   void *arg;
+};
+
+static struct task *queue = 0;
+static long queue_len = 0;
+static long queue_head = 0;  /* next task to be run */
+static long queue_tail = 0;  /* next free position */
+static long num_running = 0; /* tasks taken but not yet completed */
+static int stopping = 0;
+
+static pthread_t *threads = 0;
+static long num_threads = 0;
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+
+static
+void *worker(void *dummy)
+{
+   struct task t;
+
+   pthread_mutex_lock(&queue_lock);
+
+   for (;;) {
+      while (!stopping && queue_head == queue_tail) 
+         pthread_cond_wait(&queue_cond, &queue_lock);
+
+      if (queue_head == queue_tail) break;
+
+      t = queue[queue_head % queue_len];
+      queue_head++;
+      num_running++;
+      pthread_cond_broadcast(&queue_cond);
+
+      pthread_mutex_unlock(&queue_lock);
+      t.fn(t.arg);
+      pthread_mutex_lock(&queue_lock);
+
+      num_running--;
+      pthread_cond_broadcast(&queue_cond);
+   }
+
+   pthread_mutex_unlock(&queue_lock);
+   return 0;
+}
+
+
+int workq_start(long nthreads, long qlen)
+{
+   long i;
+
+   if (nthreads <= 0) return -1;
+   if (qlen < nthreads) qlen = nthreads;
+
+   queue = (struct task *) calloc(qlen, sizeof(struct task));
+   threads = (pthread_t *) calloc(nthreads, sizeof(pthread_t));
+   if (!queue || !threads) {
+      Warning("malloc error");
+      exit(-1);
+   }
+
+   queue_len = qlen;
+
+   for (i = 0; i < nthreads; i++) {
+      if (pthread_create(&threads[i], 0, worker, 0)) break;
+      num_threads++;
+   }
+
+   if (num_threads == 0) {
+      free(queue);
+      free(threads);
+      queue = 0;
+      threads = 0;
+      return -1;
+   }
+
+   return 0;
+}
+
+
+void workq_submit(workq_fn fn, void *arg)
+{
+   if (num_threads == 0) {
+      fn(arg);
+      return;
+   }
+
+   pthread_mutex_lock(&queue_lock);
+
+   while (queue_tail - queue_head >= queue_len) 
+      pthread_cond_wait(&queue_cond, &queue_lock);
+
+   queue[queue_tail % queue_len].fn = fn;
+   queue[queue_tail % queue_len].arg = arg;
+   queue_tail++;
+   pthread_cond_broadcast(&queue_cond);
+
+   pthread_mutex_unlock(&queue_lock);
+}
+
+
+void workq_drain(void)
+{
+   if (num_threads == 0) return;
+
+   pthread_mutex_lock(&queue_lock);
+
+   while (queue_head != queue_tail || num_running > 0) 
+      pthread_cond_wait(&queue_cond, &queue_lock);
+
+   pthread_mutex_unlock(&queue_lock);
+}
+
+
+void workq_stop(void)
+{
+   long i;
+
+   if (num_threads == 0) return;
+
+   pthread_mutex_lock(&queue_lock);
+   stopping = 1;
+   pthread_cond_broadcast(&queue_cond);
+   pthread_mutex_unlock(&queue_lock);
+
+   for (i = 0; i < num_threads; i++) 
+      pthread_join(threads[i], 0);
+
+   free(queue);
+   free(threads);
+   queue = 0;
+   threads = 0;
+   num_threads = 0;
+   stopping = 0;
+}
+
+
+long workq_threads(void)
+{
+   return num_threads;
+}
+
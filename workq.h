@@ -0,0 +1,28 @@
+
+#ifndef XBUP__workq_H
+#define XBUP__workq_H
+
+/* A simple work queue: a fixed pool of threads executing tasks
+ * taken from a bounded FIFO queue.  
+ * 
+ * workq_start returns 0 on success, and -1 if no threads could be
+ * started;  in the latter case, workq_submit simply runs each task
+ * in the calling thread, so callers always have a synchronous 
+ * fallback.
+ *
+ * workq_submit blocks while the queue is full.
+ * workq_drain waits until all submitted tasks have completed.
+ * workq_stop drains the queue and stops the threads.
+ */
+
+typedef void (*workq_fn)(void *arg);
+
+int workq_start(long nthreads, long qlen);
+void workq_submit(workq_fn fn, void *arg);
+void workq_drain(void);
+void workq_stop(void);
+
+long workq_threads(void);
+
+#endif
+
@@ -1,5 +1,7 @@
 
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -13,6 +15,7 @@
 void usage()
 {
    fprintf(stderr, "usage: xat <option> <file>\n");
+   fprintf(stderr, "       xat --batch\n");
    fprintf(stderr, "   where <option> is one of the following:\n\n");
    fprintf(stderr, "--list               list xattr names and their lengths\n");
    fprintf(stderr, "--get <name>         write value of xattr <name> to stdout\n");
@@ -22,6 +25,8 @@ void usage()
    fprintf(stderr, "--set <name>=<value> set value of xattr <name> to <value>\n");
    fprintf(stderr, "--has <name>         test if xattr <name> exists (useful in find scripts)\n");
    fprintf(stderr, "--has-any            test if any xattrs exist (useful in find scripts)\n");
+   fprintf(stderr, "--batch              read NUL-separated commands from stdin, and write\n");
+   fprintf(stderr, "                     framed results to stdout (see xat.c for the format)\n");
 }
 
 
@@ -204,6 +209,347 @@ int do_set(const char *file, const char *name, const char *value)
 }
 
 
+/* Batch mode: commands are read from stdin, and results written to
+ * stdout, so that a script can audit or fix the xattrs of a whole
+ * tree with a single xat process.
+ *
+ * A command is a sequence of fields, each terminated by a '\0':
+ *
+ *    list <file>
+ *    has-any <file>
+ *    get <name> <file>
+ *    has <name> <file>
+ *    del <name> <file>
+ *    set <name> <file> <length>    followed by <length> bytes of value
+ *
+ * (the fields in the same order as on the command line).  For each
+ * command, a result is written, made up of a status and a length, each
+ * in decimal and terminated by a '\0', followed by <length> bytes of
+ * data.  The status is 0 on success, 1 if the answer to has or has-any
+ * is no, and -1 on error, in which case the data is the error message.
+ * The data of get is the value, and that of list is, for each xattr,
+ * its name and the length of its value, each terminated by a '\0'.
+ *
+ * Output is flushed whenever xat is about to wait for more input, so
+ * that xat can also be driven one command at a time.  xat exits with
+ * status 0 at the end of its input, and -1 on a malformed command
+ * (which includes a set longer than any value of that name can be).
+ */
+
+#define BATCH_BUFSZ (64*1024)
+
+/* the largest value a set will take: the value is read into memory
+ * first, so a bad length must not be taken at its word.  The resource
+ * fork is not bound by XATTR_MAXSIZE, but still has to fit in memory.
+ */
+
+#ifndef XATTR_MAXSIZE
+#define XATTR_MAXSIZE (64*1024*1024)
+#endif
+
+#define BATCH_RSRC_MAXSIZE (1024L*1024*1024)
+
+static char inbuf[BATCH_BUFSZ];
+static long inpos = 0, inlen = 0;
+
+/* the buffers are grown as needed, and reused from one command to the
+ * next
+ */
+
+struct batch_buf {
+   char *buf;
+   long sz;
+   long len;
+};
+
+static struct batch_buf verb_field, name_field, file_field, len_field;
+static struct batch_buf value_buf, list_buf, result_buf;
+
+
+void grow_buf(struct batch_buf *b, long sz)
+{
+   if (sz <= b->sz) return;
+
+   if (b->sz == 0) b->sz = 1024;
+   while (b->sz < sz) {
+      if (b->sz > LONG_MAX / 2) {
+         b->sz = sz;
+         break;
+      }
+      b->sz *= 2;
+   }
+
+   b->buf = realloc(b->buf, b->sz);
+   if (!b->buf) {
+      WARNING;
+      exit(-1);
+   }
+}
+
+void append_buf(struct batch_buf *b, const char *s, long len)
+{
+   grow_buf(b, b->len + len);
+   memcpy(b->buf + b->len, s, len);
+   b->len += len;
+}
+
+int fill_input()
+{
+   long nread;
+
+   fflush(stdout);
+
+   do {
+      nread = read(0, inbuf, BATCH_BUFSZ);
+   } while (nread < 0 && errno == EINTR);
+
+   if (nread < 0) {
+      WARNING;
+      return -1;
+   }
+
+   inpos = 0;
+   inlen = nread;
+
+   return nread > 0 ? 0 : -1;
+}
+
+/* reads a field into b; returns 0 on success, 1 at the end of input
+ * (before any of the field was read), and -1 on error
+ */
+
+int read_field(struct batch_buf *b)
+{
+   char *p;
+   long len;
+
+   b->len = 0;
+
+   for (;;) {
+      if (inpos == inlen && fill_input()) 
+         return b->len == 0 ? 1 : -1;
+
+      p = memchr(inbuf + inpos, '\0', inlen - inpos);
+      len = p ? p - (inbuf + inpos) : inlen - inpos;
+
+      append_buf(b, inbuf + inpos, len);
+      inpos += len;
+
+      if (p) {
+         inpos++;
+         append_buf(b, "", 1);
+         return 0;
+      }
+   }
+}
+
+int read_bytes(struct batch_buf *b, long sz)
+{
+   long len;
+
+   b->len = 0;
+   grow_buf(b, sz);
+
+   while (b->len < sz) {
+      if (inpos == inlen && fill_input()) 
+         return -1;
+
+      len = inlen - inpos;
+      if (len > sz - b->len) len = sz - b->len;
+
+      append_buf(b, inbuf + inpos, len);
+      inpos += len;
+   }
+
+   return 0;
+}
+
+void put_result(int status, const char *data, long len)
+{
+   printf("%d%c%ld%c", status, '\0', len, '\0');
+   if (len > 0) fwrite(data, 1, len, stdout);
+}
+
+void put_error(int err)
+{
+   const char *msg = strerror(err);
+
+   put_result(-1, msg, strlen(msg));
+}
+
+/* reads the value of name into value_buf; usually a single getxattr,
+ * as the buffer is already large enough
+ */
+
+long get_value(const char *file, const char *name)
+{
+   long sz;
+
+   grow_buf(&value_buf, 1);
+
+   for (;;) {
+      sz = getxattr(file, name, value_buf.buf, value_buf.sz, 0, XATTR_NOFOLLOW);
+      if (sz >= 0 || errno != ERANGE) return sz;
+
+      sz = getxattr(file, name, 0, 0, 0, XATTR_NOFOLLOW);
+      if (sz < 0) return sz;
+
+      grow_buf(&value_buf, sz);
+   }
+}
+
+long get_names(const char *file)
+{
+   long sz;
+
+   grow_buf(&list_buf, 1);
+
+   for (;;) {
+      sz = listxattr(file, list_buf.buf, list_buf.sz, XATTR_NOFOLLOW);
+      if (sz >= 0 || errno != ERANGE) return sz;
+
+      sz = listxattr(file, 0, 0, XATTR_NOFOLLOW);
+      if (sz < 0) return sz;
+
+      grow_buf(&list_buf, sz);
+   }
+}
+
+void batch_list(const char *file)
+{
+   long sz, i, len;
+   char numbuf[32];
+
+   sz = get_names(file);
+   if (sz < 0) {
+      put_error(errno);
+      return;
+   }
+
+   result_buf.len = 0;
+
+   for (i = 0; i < sz; i += strlen(list_buf.buf + i) + 1) {
+      append_buf(&result_buf, list_buf.buf + i, strlen(list_buf.buf + i) + 1);
+      len = getxattr(file, list_buf.buf + i, 0, 0, 0, XATTR_NOFOLLOW);
+      snprintf(numbuf, sizeof(numbuf), "%ld", len);
+      append_buf(&result_buf, numbuf, strlen(numbuf) + 1);
+   }
+
+   put_result(0, result_buf.buf, result_buf.len);
+}
+
+void batch_set(const char *file, const char *name, const char *value, long sz)
+{
+   if (strcmp(name, "com.apple.ResourceFork") == 0) {
+
+      /* as in do_set */
+
+      if (getxattr(file, name, 0, 0, 0, XATTR_NOFOLLOW) >= 0) {
+         if (removexattr(file, name, XATTR_NOFOLLOW) < 0) {
+            put_error(errno);
+            return;
+         }
+      }
+   }
+
+   if (setxattr(file, name, value, sz, 0, XATTR_NOFOLLOW)) 
+      put_error(errno);
+   else
+      put_result(0, 0, 0);
+}
+
+int do_batch()
+{
+   char *verb, *name, *file, *end;
+   long sz;
+   int ret;
+
+   for (;;) {
+      ret = read_field(&verb_field);
+      if (ret == 1) break;
+      if (ret) goto bad;
+
+      verb = verb_field.buf;
+
+      if (strcmp(verb, "list") == 0 || strcmp(verb, "has-any") == 0) {
+         name = 0;
+      }
+      else if (strcmp(verb, "get") == 0 || strcmp(verb, "has") == 0 ||
+               strcmp(verb, "del") == 0 || strcmp(verb, "set") == 0) {
+         if (read_field(&name_field)) goto bad;
+         name = name_field.buf;
+      }
+      else {
+         fprintf(stderr, "xat: bad batch command: %s\n", verb);
+         goto bad;
+      }
+
+      if (read_field(&file_field)) goto bad;
+      file = file_field.buf;
+
+      if (strcmp(verb, "list") == 0) {
+         batch_list(file);
+      }
+      else if (strcmp(verb, "has-any") == 0) {
+         sz = listxattr(file, 0, 0, XATTR_NOFOLLOW);
+         if (sz < 0)
+            put_error(errno);
+         else
+            put_result(sz > 0 ? 0 : 1, 0, 0);
+      }
+      else if (strcmp(verb, "get") == 0) {
+         sz = get_value(file, name);
+         if (sz < 0)
+            put_error(errno);
+         else
+            put_result(0, value_buf.buf, sz);
+      }
+      else if (strcmp(verb, "has") == 0) {
+         sz = getxattr(file, name, 0, 0, 0, XATTR_NOFOLLOW);
+         if (sz < 0 && errno != ENOATTR)
+            put_error(errno);
+         else
+            put_result(sz >= 0 ? 0 : 1, 0, 0);
+      }
+      else if (strcmp(verb, "del") == 0) {
+         if (getxattr(file, name, 0, 0, 0, XATTR_NOFOLLOW) >= 0 &&
+             removexattr(file, name, XATTR_NOFOLLOW))
+            put_error(errno);
+         else
+            put_result(0, 0, 0);
+      }
+      else {
+         if (read_field(&len_field)) goto bad;
+
+         errno = 0;
+         sz = strtol(len_field.buf, &end, 10);
+         if (errno || end == len_field.buf || *end || sz < 0 ||
+             sz > (strcmp(name, "com.apple.ResourceFork") == 0 ?
+                   BATCH_RSRC_MAXSIZE : XATTR_MAXSIZE)) {
+            fprintf(stderr, "xat: bad batch length: %s\n", len_field.buf);
+            goto bad;
+         }
+
+         if (read_bytes(&value_buf, sz)) goto bad;
+
+         batch_set(file, name, value_buf.buf, sz);
+      }
+
+      if (ferror(stdout)) {
+         WARNING;
+         return -1;
+      }
+   }
+
+   fflush(stdout);
+   return 0;
+
+bad:
+   fflush(stdout);
+   fprintf(stderr, "xat: malformed batch input\n");
+   return -1;
+}
+
 
 
 int main(int argc, char **argv)
@@ -218,6 +564,15 @@ int main(int argc, char **argv)
 
    verb = argv[1];
 
+   if (strcmp(verb, "--batch") == 0) {
+      if (argc != 2) {
+         usage();
+         return -1;
+      }
+
+      return do_batch();
+   }
+
    if (strcmp(verb, "--list") == 0) {
       if (argc != 3) {
          usage();
@@ -3,9 +3,10 @@
 #include "util.h"
 #include "xattr_util.h"
 #include "xbup_acl_translate.h"
+#include "scratch.h"
 
 
-int xattr_access_error = 0;
+__thread int xattr_access_error = 0;
   /* This gets set whenever an attempt is made to access xattrs
      that is denied for lack of permissions.
      set by: has_xattr, split_xattr
@@ -19,12 +20,29 @@ int xattr_access_error = 0;
      In the future, it may be necessary to modify the code
      in get_acl and strip_acl to check for access errors,
      if the current behavior changes....
+
+     NOTE: this is thread-local, so that several worker threads
+     may split and join objects concurrently (see joinf_xattr --jobs).
    */
 
-#define BUFSIZE (1024)
-#define MAXNAME (4*1024)
+__thread long xattr_meta_ops = 0;
+__thread long xattr_io_bytes = 0;
+  /* These count the metadata operations (getattrlist, listxattr,
+     getxattr, acl_get_link_np, setxattr, lchown...) made on the
+     objects split and joined, and the bytes of containers read and
+     written, so that the walkers can charge them to their throttles
+     (see throttle.h), without this file depending on throttle.c.
+     Thread-local, like xattr_access_error: a walker takes their values
+     before and after an object, in the thread that handles it.
+   */
+
+__thread long xattr_count = 0;
+  /* The number of xattrs of the last object split or joined (for the
+     hotspot reports of the walkers, see hotspot.h); 0 if it had none,
+     or if it failed before they were counted.  Thread-local too.
+   */
 
-static char name_buffer[MAXNAME];
+#define BUFSIZE (1024)
 
 
 
@@ -64,6 +82,7 @@ int get_crtime(const char *path, time_t* t)
    attrList.bitmapcount = ATTR_BIT_MAP_COUNT;
    attrList.commonattr  = ATTR_CMN_CRTIME;
 
+   xattr_meta_ops++;
    err = getattrlist(path, &attrList, &attrBuf, sizeof(attrBuf), FSOPT_NOFOLLOW);
    if (err == 0) {
       *t = attrBuf.ts.tv_sec;
@@ -89,6 +108,7 @@ int set_crtime(const char *path, time_t t)
    attrList.bitmapcount = ATTR_BIT_MAP_COUNT;
    attrList.commonattr  = ATTR_CMN_CRTIME;
 
+   xattr_meta_ops++;
    err = setattrlist(path, &attrList, &attrBuf.ts, sizeof(attrBuf.ts), FSOPT_NOFOLLOW);
 
    return err;
@@ -113,6 +133,7 @@ int hfs_chflags(const char *path, uint32_t t)
    attrList.bitmapcount = ATTR_BIT_MAP_COUNT;
    attrList.commonattr  = ATTR_CMN_FLAGS;
 
+   xattr_meta_ops++;
    err = setattrlist(path, &attrList, &t, sizeof(t), FSOPT_NOFOLLOW);
 
    return err;
@@ -140,6 +161,7 @@ int hfs_chmod(const char *path, mode_t tt)
    attrList.bitmapcount = ATTR_BIT_MAP_COUNT;
    attrList.commonattr  = ATTR_CMN_ACCESSMASK;
 
+   xattr_meta_ops++;
    err = setattrlist(path, &attrList, &t, sizeof(t), FSOPT_NOFOLLOW); 
 
    return err;
@@ -168,6 +190,7 @@ int set_mtime(const char *path, time_t tt)
    attrList.bitmapcount = ATTR_BIT_MAP_COUNT;
    attrList.commonattr  = ATTR_CMN_MODTIME;
 
+   xattr_meta_ops++;
    err = setattrlist(path, &attrList, &t, sizeof(t), FSOPT_NOFOLLOW); 
 
    return err;
@@ -219,6 +242,7 @@ acl_t get_acl(const char *fname, const struct stat *sbuf)
    acl_t acl;
    acl_entry_t dummy;
 
+   xattr_meta_ops++;
    acl = acl_get_link_np(fname, ACL_TYPE_EXTENDED);
    if (acl && acl_get_entry(acl, ACL_FIRST_ENTRY, &dummy) == -1) {
       acl_free(acl);
@@ -233,6 +257,7 @@ int put_acl(const char *fname, const struct stat *sbuf, acl_t acl)
    int retval = -1;
 
    if (!S_ISLNK(sbuf->st_mode)) {
+      xattr_meta_ops++;
       retval = acl_set_file(fname, ACL_TYPE_EXTENDED, acl);
    }
    else {
@@ -247,6 +272,7 @@ int put_acl(const char *fname, const struct stat *sbuf, acl_t acl)
       int fd;
       fd = open(fname, O_SYMLINK);
       if (fd >= 0) {
+         xattr_meta_ops++;
          retval = acl_set_fd_np(fd, acl, ACL_TYPE_EXTENDED);
          close(fd);
       }
@@ -278,6 +304,7 @@ int strip_acl(const char *fname, const struct stat *sbuf)
    int retval = 0;
    acl_entry_t dummy;
 
+   xattr_meta_ops++;
    acl = acl_get_link_np(fname, ACL_TYPE_EXTENDED);
    if (acl && acl_get_entry(acl, ACL_FIRST_ENTRY, &dummy) != -1) {
       empty_acl = acl_init(0);
@@ -385,6 +412,7 @@ int write_int4(uint32_t x, FILE *f)
    buf[1] = x & 0xffu; x = x >> 8;
    buf[0] = x & 0xffu; x = x >> 8;
 
+   xattr_io_bytes += 4;
    if (fwrite(buf, 1, 4, f) == 4)
       return 0;
    else
@@ -397,6 +425,7 @@ int read_int4(uint32_t *xp, FILE *f)
    unsigned char buf[4];
    uint32_t x;
 
+   xattr_io_bytes += 4;
    if (fread(buf, 1, 4, f) != 4)
       return -1;
 
@@ -418,6 +447,7 @@ int write_int2(uint16_t x, FILE *f)
    buf[1] = x & 0xffu; x = x >> 8;
    buf[0] = x & 0xffu; x = x >> 8;
 
+   xattr_io_bytes += 2;
    if (fwrite(buf, 1, 2, f) == 2)
       return 0;
    else
@@ -430,6 +460,7 @@ int read_int2(uint16_t *xp, FILE *f)
    unsigned char buf[2];
    uint32_t x;
 
+   xattr_io_bytes += 2;
    if (fread(buf, 1, 2, f) != 2)
       return -1;
 
@@ -448,6 +479,7 @@ int write_int1(uint8_t x, FILE *f)
 
    buf[0] = x & 0xffu; x = x >> 8;
 
+   xattr_io_bytes += 1;
    if (fwrite(buf, 1, 1, f) == 1)
       return 0;
    else
@@ -463,6 +495,7 @@ int read_str(char *buf, int len, FILE *f)
    for (;;) {
       c = getc(f);
       if (c == EOF) return -1;
+      xattr_io_bytes++;
       if (k >= len) return -1;
       buf[k] = c;
       k++;
@@ -470,43 +503,33 @@ int read_str(char *buf, int len, FILE *f)
    }
 }
 
+/* reads a null-terminated string of any length into the scratch
+ * arena (see scratch.h)
+ */
+
 static
 char * read_str1(FILE *f)
 {
-   int c, k;
-
+   int c;
+   size_t k, len;
    char *buf = 0;
-   int len = 0;
-
-   char *newbuf;
 
    k = 0;
+   len = 0;
    for (;;) {
       c = getc(f);
-      if (c == EOF) goto bad;
+      if (c == EOF) return 0;
+      xattr_io_bytes++;
 
       if (k >= len) {
-         if (len == 0) {
-            len = 64;
-            newbuf = malloc(len);
-         }
-         else {
-            len = 2 * len;
-            newbuf = realloc(buf, len);
-         }
-         if (!newbuf) goto bad;
-         buf = newbuf;
+         buf = scratch_grow(buf, len, len ? 2*len : 64);
+         len = len ? 2*len : 64;
       }
 
       buf[k] = c;
       k++;
       if (c == 0) return buf;
    }
-
-bad:
-
-   if (buf) free(buf);
-   return 0;
 }
 
 
@@ -590,6 +613,32 @@ int read_header(uint16_t *vp, FILE *f)
 
 
 
+/* sorts the numnames null-terminated names in namebuf into 
+ * strcmp order, setting up the array of pointers names
+ */
+
+static
+int cmp_names(const void *a, const void *b)
+{
+   return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static
+void sort_names(char *namebuf, long numnames, char **names)
+{
+   long i;
+   char *p;
+
+   p = namebuf;
+   for (i = 0; i < numnames; i++) {
+      names[i] = p;
+      p += strlen(p) + 1;
+   }
+
+   qsort(names, numnames, sizeof(char *), cmp_names);
+}
+
+
 /* read xattr's from file fname and store in container cname. 
  *    cname == "" => xattr's written to stdout
  * sbuf: should be stat struct for fname
@@ -599,21 +648,32 @@ int read_header(uint16_t *vp, FILE *f)
  *
  * design options: follow symlinks? no
  *                 create container if no xattr's? yes
+ *
+ * The xattrs are written in sorted order of their names, rather than
+ * in listxattr order, so that unchanged metadata always yields an 
+ * identical container.
+ *
+ * All the buffers (here, and in join_xattr and copy_xattr) come from
+ * the scratch arena, and are released before returning, so that the
+ * steady state makes no heap allocation per object.
  */
 
 
 
-int split_xattr(const char *fname, const struct stat *sbuf, const char *cname, 
-                int crtimeflag, int savemtime, acl_t acl,
-                int saveperms, const owner_prefs_t* oprefs)
+static
+int split_xattr_aux(const char *fname, const struct stat *sbuf, 
+                    const char *cname, FILE *ofp,
+                    int crtimeflag, int savemtime, acl_t acl,
+                    int saveperms, const owner_prefs_t* oprefs)
 {
    char *namebuf=0, *attrbuf=0;
+   char **names=0;
    FILE *cfp=0;
    char *acltext=0;
 
    int retval = -1;
 
-   char *attrname, *bp;
+   char *attrname;
    long numxattrs, i, namesz, attrnamesz, attrsz, bufsize;
 
    ssize_t acltextsz = 0;
@@ -622,7 +682,10 @@ int split_xattr(const char *fname, const struct stat *sbuf, const char *cname,
    uint16_t bsd_flags;
    time_t crtime;
 
+   scratch_mark_t mark = scratch_mark();
+
 
+   xattr_meta_ops++;
    namesz = listxattr(fname, 0, 0, XATTR_NOFOLLOW);
 
    /* NOTE: if namesz <= 0 (which is the same criteria used in has_xattr)
@@ -632,21 +695,15 @@ int split_xattr(const char *fname, const struct stat *sbuf, const char *cname,
    
    numxattrs = 0;
    bufsize = 0;
+   xattr_count = 0;
 
    if (namesz > 0) {
-      namebuf = (char *) malloc(namesz);
-      if (!namebuf) {
-         WARNING;
-         goto done;
-      }
+      namebuf = (char *) scratch_alloc(namesz);
 
       bufsize = BUFSIZE;
-      attrbuf = (char *) malloc(BUFSIZE);
-      if (!attrbuf) {
-         WARNING;
-         goto done; 
-      }
+      attrbuf = (char *) scratch_alloc(BUFSIZE);
 
+      xattr_meta_ops++;
       if (listxattr(fname, namebuf, namesz, XATTR_NOFOLLOW) != namesz) {
          WARNING;
          goto done;
@@ -656,6 +713,12 @@ int split_xattr(const char *fname, const struct stat *sbuf, const char *cname,
          if (!namebuf[i]) numxattrs++;
       }
 
+      xattr_count = numxattrs;
+
+      names = (char **) scratch_alloc(numxattrs * sizeof(char *));
+
+      sort_names(namebuf, numxattrs, names);
+
    }
 
    if (namesz < 0 && errno == EACCES) xattr_access_error = 1;
@@ -705,7 +768,10 @@ int split_xattr(const char *fname, const struct stat *sbuf, const char *cname,
       v |= XAT_FLAG;
    }
 
-   if (cname[0] != 0) {
+   if (ofp) {
+      cfp = ofp;
+   }
+   else if (cname[0] != 0) {
       cfp = fopen(cname, "w");
    }
    else {
@@ -764,6 +830,7 @@ int split_xattr(const char *fname, const struct stat *sbuf, const char *cname,
             WARNING;
             goto done;
          }
+         xattr_io_bytes += unamsz+1;
          if (fwrite(unam, 1, unamsz+1, cfp) != unamsz+1) {
             WARNING;
             goto done;
@@ -790,6 +857,7 @@ int split_xattr(const char *fname, const struct stat *sbuf, const char *cname,
             WARNING;
             goto done;
          }
+         xattr_io_bytes += grnamsz+1;
          if (fwrite(grnam, 1, grnamsz+1, cfp) != grnamsz+1) {
             WARNING;
             goto done;
@@ -810,6 +878,7 @@ int split_xattr(const char *fname, const struct stat *sbuf, const char *cname,
 
 
    if (acl) {
+      xattr_io_bytes += acltextsz+1;
       if (fwrite(acltext, 1, acltextsz+1, cfp) != acltextsz+1) {
          WARNING;
          goto done;
@@ -827,10 +896,11 @@ int split_xattr(const char *fname, const struct stat *sbuf, const char *cname,
          goto done;
       }
 
-      attrname = namebuf;
       for (i = 0; i < numxattrs; i++) {
+         attrname = names[i];
          attrnamesz = strlen(attrname);
 
+         xattr_meta_ops++;
          attrsz = getxattr(fname, attrname, 0, 0, 0, XATTR_NOFOLLOW);
 
          if (attrsz < 0) {
@@ -844,15 +914,11 @@ int split_xattr(const char *fname, const struct stat *sbuf, const char *cname,
          }
 
          if (attrsz > bufsize) {
+            attrbuf = scratch_grow(attrbuf, bufsize, attrsz);
             bufsize = attrsz;
-            bp = realloc(attrbuf, bufsize);
-            if (!bp) {
-               WARNING;
-               goto done;
-            }
-            attrbuf = bp;
          }
 
+         xattr_meta_ops++;
          if (getxattr(fname, attrname, attrbuf, bufsize, 0, XATTR_NOFOLLOW)
               != attrsz) {
             WARNING;
@@ -864,6 +930,7 @@ int split_xattr(const char *fname, const struct stat *sbuf, const char *cname,
             goto done;
          }
 
+         xattr_io_bytes += attrnamesz+1;
          if (fwrite(attrname, 1, attrnamesz+1, cfp) != attrnamesz+1) {
             WARNING;
             goto done;
@@ -879,13 +946,12 @@ int split_xattr(const char *fname, const struct stat *sbuf, const char *cname,
             goto done;
          }
 
+         xattr_io_bytes += attrsz;
          if (fwrite(attrbuf, 1, attrsz, cfp) != attrsz) {
             WARNING;
             goto done;
          }
 
-         attrname += attrnamesz + 1;
-
       }
    }
 
@@ -894,19 +960,43 @@ int split_xattr(const char *fname, const struct stat *sbuf, const char *cname,
 
 done:
 
-   if (cfp && cfp != stdout) fclose(cfp);
-   if (attrbuf) free(attrbuf);
-   if (namebuf) free(namebuf);
-   if (acltext) acl_free(acltext);
+   if (cfp && cfp != stdout && cfp != ofp) fclose(cfp);
+   scratch_release(mark);
 
    return retval;
 
 }
 
 
+int split_xattr(const char *fname, const struct stat *sbuf, const char *cname, 
+                int crtimeflag, int savemtime, acl_t acl,
+                int saveperms, const owner_prefs_t* oprefs)
+{
+   return split_xattr_aux(fname, sbuf, cname, 0, crtimeflag, savemtime, acl,
+                          saveperms, oprefs);
+}
+
+
+/* same as split_xattr, but the container is written to the open
+ * stream cfp (which is left open).  Used by splitf_xattr --jobs,
+ * where each worker writes its container to a memory buffer.
+ */
+
+int split_xattr_fp(const char *fname, const struct stat *sbuf, FILE *cfp,
+                   int crtimeflag, int savemtime, acl_t acl,
+                   int saveperms, const owner_prefs_t* oprefs)
+{
+   return split_xattr_aux(fname, sbuf, "", cfp, crtimeflag, savemtime, acl,
+                          saveperms, oprefs);
+}
+
+
 int has_xattr(const char *fname, const struct stat *sbuf)
 {
-   long retval =  listxattr(fname, 0, 0, XATTR_NOFOLLOW);
+   long retval;
+
+   xattr_meta_ops++;
+   retval =  listxattr(fname, 0, 0, XATTR_NOFOLLOW);
    if (retval < 0 && errno == EACCES) xattr_access_error = 1;
    return retval > 0;
 }
@@ -927,6 +1017,9 @@ int strip_xattr(const char *fname, const struct stat *sbuf)
    long numxattrs, i, namesz, attrnamesz;
    int fail;
 
+   scratch_mark_t mark = scratch_mark();
+
+   xattr_meta_ops++;
    namesz = listxattr(fname, 0, 0, XATTR_NOFOLLOW);
 
    if (namesz < 0 && errno == EACCES) {
@@ -939,12 +1032,9 @@ int strip_xattr(const char *fname, const struct stat *sbuf)
       goto done;
    }
 
-   namebuf = (char *) malloc(namesz);
-   if (!namebuf) {
-      WARNING;
-      goto done;
-   }
+   namebuf = (char *) scratch_alloc(namesz);
 
+   xattr_meta_ops++;
    if (listxattr(fname, namebuf, namesz, XATTR_NOFOLLOW) != namesz) {
       WARNING;
       goto done;
@@ -961,6 +1051,7 @@ int strip_xattr(const char *fname, const struct stat *sbuf)
    for (i = 0; i < numxattrs; i++) {
       attrnamesz = strlen(attrname);
 
+      xattr_meta_ops++;
       if (removexattr(fname, attrname, XATTR_NOFOLLOW)) {
          WARNING;
          fail = 1;
@@ -972,7 +1063,7 @@ int strip_xattr(const char *fname, const struct stat *sbuf)
    if (!fail) retval = 0;
 
 done:
-   if (namebuf) free(namebuf);
+   scratch_release(mark);
 
    return retval;
 }
@@ -997,29 +1088,35 @@ done:
  * This is especially important in conjunction with the joinf_xattr program.
  */
 
-int join_xattr(const char *fname, const struct stat *sbuf, const char *cname,
-               int aclflag, const owner_prefs_t *oprefs)
+static
+int join_xattr_aux(const char *fname, const struct stat *sbuf, 
+                   const char *cname, FILE *ifp,
+                   int aclflag, const owner_prefs_t *oprefs)
 {
    char *attrbuf=0;
    FILE *cfp=0;
    char *acltext=0;
    acl_t acl=0;
+   char name_buffer[MAXNAME];
 
    int retval = 0;
    uint16_t bsd_flags = 0;
 
-   char *bp;
    long numxattrs, i, attrsz, bufsize;
    uint16_t v, x;
    uint32_t xx;
    time_t crtime = 0;
    int got_crtime = 0;
 
+   scratch_mark_t mark = scratch_mark();
+
    mode_t mode = sbuf->st_mode;
    uid_t  uid = sbuf->st_uid;
    gid_t  gid = sbuf->st_gid;
    time_t mtime = sbuf->st_mtime;
 
+   xattr_count = 0;
+
    /* process uid and gid default values */
 
    if (oprefs->u_keep && oprefs->u_default) uid = oprefs->uid;
@@ -1063,11 +1160,14 @@ int join_xattr(const char *fname, const struct stat *sbuf, const char *cname,
    /* if no cname is given, the effect is to just strip locks, acl, xattrs,
       and to set owner/group to default values */
 
-   if (!cname) {
+   if (!cname && !ifp) {
       goto restore;
    }
 
-   if (cname[0] != 0) {
+   if (ifp) {
+      cfp = ifp;
+   }
+   else if (cname[0] != 0) {
       cfp = fopen(cname, "r");
    }
    else {
@@ -1196,17 +1296,14 @@ int join_xattr(const char *fname, const struct stat *sbuf, const char *cname,
       }
 
       numxattrs = x;
+      xattr_count = numxattrs;
 
       if (numxattrs == 0) {
          goto restore;
       }
 
       bufsize = BUFSIZE;
-      attrbuf = (char *) malloc(BUFSIZE);
-      if (!attrbuf) {
-         Warning("malloc error");
-         retval = -2; goto done; 
-      }
+      attrbuf = (char *) scratch_alloc(BUFSIZE);
 
       for (i = 0; i < numxattrs; i++) {
 
@@ -1228,20 +1325,17 @@ int join_xattr(const char *fname, const struct stat *sbuf, const char *cname,
          attrsz = xx;
 
          if (attrsz > bufsize) {
+            attrbuf = scratch_grow(attrbuf, bufsize, attrsz);
             bufsize = attrsz;
-            bp = realloc(attrbuf, bufsize);
-            if (!bp) {
-               Warning("malloc error");
-               retval = -2; goto done;
-            }
-            attrbuf = bp;
          }
 
+         xattr_io_bytes += attrsz;
          if (fread(attrbuf, 1, attrsz, cfp) != attrsz) {
             Warning("read error");
             retval = -2; goto done;
          }
 
+         xattr_meta_ops++;
          if (setxattr(fname, name_buffer, attrbuf, attrsz, 0, XATTR_NOFOLLOW)) {
             WARN("ERROR: failed to set xattr %s\n", name_buffer);
             retval = -1; 
@@ -1277,6 +1371,7 @@ restore:
       to preserve setuid and setgid bits */
 
    if (uid != sbuf->st_uid || gid != sbuf->st_gid) {
+      xattr_meta_ops++;
       if (lchown(fname, uid, gid)) {
          WARN("ERROR: lchown(%ld, %ld) failed\n", 
                  CAST_to_long(uid_t, uid), CAST_to_long(gid_t, gid));
@@ -1317,110 +1412,118 @@ restore:
                          
 
 done:
-   if (attrbuf) free(attrbuf);
-   if (cfp && cfp != stdin) fclose(cfp);
-   if (acltext) free(acltext);
+   if (cfp && cfp != stdin && cfp != ifp) fclose(cfp);
    if (acl) acl_free(acl);
+   scratch_release(mark);
 
    return retval;
    
 }
 
 
+int join_xattr(const char *fname, const struct stat *sbuf, const char *cname,
+               int aclflag, const owner_prefs_t *oprefs)
+{
+   return join_xattr_aux(fname, sbuf, cname, 0, aclflag, oprefs);
+}
 
-/* just reads and skips an xattr container -- used in conjunction
- * with the joinf_xattr program.
+
+/* same as join_xattr, but the container is read from the open
+ * stream cfp (which is left open).  Used by joinf_xattr --jobs,
+ * where each worker reads its container from a memory buffer.
+ */
+
+int join_xattr_fp(const char *fname, const struct stat *sbuf, FILE *cfp,
+                  int aclflag, const owner_prefs_t *oprefs)
+{
+   return join_xattr_aux(fname, sbuf, "", cfp, aclflag, oprefs);
+}
+
+
+
+/* reads one xattr container from cfp and copies it to ofp,
+ * checking its structure along the way -- used in conjunction 
+ * with the joinf_xattr program to frame the containers in its input.
+ *    ofp == NULL => the container is just read and skipped
  *
  * Return values are as in join_xattr, but all errors are
  * "unrecoverable", so the return value is -2 on error, 0
  * otherwise.
  */
 
+#define COPY_OUT(x) (ofp && (x))
 
-int skip_xattr(const char *cname)
+int copy_xattr(FILE *cfp, FILE *ofp)
 {
    char *attrbuf=0;
-   FILE *cfp=0;
    char *acltext=0;
+   char name_buffer[MAXNAME];
 
    int retval = -2;
 
-   char *bp;
    long numxattrs, i, attrsz, bufsize;
    uint16_t v, x;
    uint32_t xx;
 
+   scratch_mark_t mark = scratch_mark();
 
-   if (!cname) {
-      goto restore;
-   }
-
-   if (cname[0] != 0) {
-      cfp = fopen(cname, "r");
-   }
-   else {
-      cfp = stdin;
-   }
-
-   if (!cfp) {
+   if (read_header(&v, cfp) || (v & VERSION_MASK) != VERSION) {
       WARNING;
       goto done;
    }
 
-   if (read_header(&v, cfp) || (v & VERSION_MASK) != VERSION) {
+   if (COPY_OUT(write_header(v, ofp))) {
       WARNING;
       goto done;
    }
 
-   if (v & LOCKS_FLAG) {
-      if (read_int2(&x, cfp)) {
+   if (v & PERMS_FLAG) {
+      if (read_int2(&x, cfp) || COPY_OUT(write_int2(x, ofp))) {
          WARNING;
          goto done;
       }
    }
 
-   if (v & PERMS_FLAG) {
-      if (read_int2(&x, cfp)) {
+   if (v & LOCKS_FLAG) {
+      if (read_int2(&x, cfp) || COPY_OUT(write_int2(x, ofp))) {
          WARNING;
          goto done;
       }
    }
 
    if (v & CRTIME_FLAG) {
-
-      if (read_int4(&xx, cfp)) {
+      if (read_int4(&xx, cfp) || COPY_OUT(write_int4(xx, ofp))) {
          WARNING;
          goto done;
       }
-
    }
 
    if (v & MTIME_FLAG) {
-
-      if (read_int4(&xx, cfp)) {
+      if (read_int4(&xx, cfp) || COPY_OUT(write_int4(xx, ofp))) {
          WARNING;
          goto done;
       }
-
    }
 
    if (v & OWNER_FLAG) {
-      if (read_str(name_buffer, MAXNAME, cfp)) {
+      if (read_str(name_buffer, MAXNAME, cfp) || 
+          COPY_OUT(fputs(name_buffer, ofp) == EOF || write_int1(0, ofp))) {
          WARNING;
          goto done;
       }
-      if (read_int4(&xx, cfp)) {
+      if (read_int4(&xx, cfp) || COPY_OUT(write_int4(xx, ofp))) {
          WARNING;
          goto done;
       }
    }
 
    if (v & GROUP_FLAG) {
-      if (read_str(name_buffer, MAXNAME, cfp)) {
+      if (read_str(name_buffer, MAXNAME, cfp) || 
+          COPY_OUT(fputs(name_buffer, ofp) == EOF || write_int1(0, ofp))) {
          WARNING;
          goto done;
       }
-      if (read_int4(&xx, cfp)) {
+      if (read_int4(&xx, cfp) || COPY_OUT(write_int4(xx, ofp))) {
          WARNING;
          goto done;
       }
@@ -1432,31 +1535,28 @@ int skip_xattr(const char *cname)
          WARNING;
          goto done;
       }
+      if (COPY_OUT(fputs(acltext, ofp) == EOF || write_int1(0, ofp))) {
+         WARNING;
+         goto done;
+      }
    }
 
    if (v & XAT_FLAG) {
 
-      if (read_int2(&x, cfp)) {
+      if (read_int2(&x, cfp) || COPY_OUT(write_int2(x, ofp))) {
          WARNING;
          goto done;
       }
 
       numxattrs = x;
 
-      if (numxattrs == 0) {
-         goto restore;
-      }
-
       bufsize = BUFSIZE;
-      attrbuf = (char *) malloc(BUFSIZE);
-      if (!attrbuf) {
-         WARNING;
-         goto done; 
-      }
+      attrbuf = (char *) scratch_alloc(BUFSIZE);
 
       for (i = 0; i < numxattrs; i++) {
 
-         if (read_str(name_buffer, MAXNAME, cfp)) {
+         if (read_str(name_buffer, MAXNAME, cfp) || 
+             COPY_OUT(fputs(name_buffer, ofp) == EOF || write_int1(0, ofp))) {
             WARNING;
             goto done;
          }
@@ -1471,16 +1571,16 @@ int skip_xattr(const char *cname)
             goto done;
          }
 
+         if (COPY_OUT(write_int4(xx, ofp))) {
+            WARNING;
+            goto done;
+         }
+
          attrsz = xx;
 
          if (attrsz > bufsize) {
+            attrbuf = scratch_grow(attrbuf, bufsize, attrsz);
             bufsize = attrsz;
-            bp = realloc(attrbuf, bufsize);
-            if (!bp) {
-               WARNING;
-               goto done;
-            }
-            attrbuf = bp;
          }
 
          if (fread(attrbuf, 1, attrsz, cfp) != attrsz) {
@@ -1488,20 +1588,211 @@ int skip_xattr(const char *cname)
             goto done;
          }
 
+         if (COPY_OUT(fwrite(attrbuf, 1, attrsz, ofp) != attrsz)) {
+            WARNING;
+            goto done;
+         }
+
       }
    }
 
-restore:
-
    retval = 0;
 
 done:
-   if (attrbuf) free(attrbuf);
-   if (cfp && cfp != stdin) fclose(cfp);
-   if (acltext) free(acltext);
+   scratch_release(mark);
+
+   return retval;
+}
+
+
+/* just reads and skips an xattr container -- used in conjunction
+ * with the joinf_xattr program.
+ *
+ * Return values are as in copy_xattr.
+ */
+
+
+int skip_xattr(const char *cname)
+{
+   FILE *cfp=0;
+   int retval;
+
+   if (!cname) {
+      return 0;
+   }
+
+   if (cname[0] != 0) {
+      cfp = fopen(cname, "r");
+   }
+   else {
+      cfp = stdin;
+   }
+
+   if (!cfp) {
+      WARNING;
+      return -2;
+   }
+
+   retval = copy_xattr(cfp, 0);
+
+   if (cfp != stdin) fclose(cfp);
 
    return retval;
 }
 
 
+/* reads an xattr container from cfp into info, without applying it to
+ * anything (used by xquery).  The values of the xattrs are skipped;
+ * only their names and lengths are kept.  The buffers in info are
+ * reused from one call to the next, so info should be zeroed before
+ * the first call, and released with free_xattr_info after the last.
+ *
+ * Return values are as in copy_xattr.
+ */
+
+int read_xattr_info(FILE *cfp, xattr_info_t *info)
+{
+   char name_buffer[MAXNAME];
+   char skipbuf[BUFSIZE];
+
+   long numxattrs, i, len, namelen, nread;
+   uint16_t v, x;
+   uint32_t xx;
+   char *acltext;
+   void *p;
+
+   info->has_perms = info->has_flags = 0;
+   info->has_crtime = info->has_mtime = 0;
+   info->has_owner = info->has_group = 0;
+   info->acltext = 0;
+   info->numxattrs = 0;
+
+   if (read_header(&v, cfp) || (v & VERSION_MASK) != VERSION)
+      return -2;
+
+   if (v & PERMS_FLAG) {
+      if (read_int2(&x, cfp)) return -2;
+      info->has_perms = 1;
+      info->perms = x;
+   }
+
+   if (v & LOCKS_FLAG) {
+      if (read_int2(&x, cfp)) return -2;
+      info->has_flags = 1;
+      info->flags = x;
+   }
+
+   if (v & CRTIME_FLAG) {
+      if (read_int4(&xx, cfp)) return -2;
+      info->has_crtime = 1;
+      info->crtime = CAST_u32(time_t,xx);
+   }
+
+   if (v & MTIME_FLAG) {
+      if (read_int4(&xx, cfp)) return -2;
+      info->has_mtime = 1;
+      info->mtime = CAST_u32(time_t,xx);
+   }
+
+   if (v & OWNER_FLAG) {
+      if (read_str(info->owner, MAXNAME, cfp) || read_int4(&xx, cfp))
+         return -2;
+      info->has_owner = 1;
+      info->uid = CAST_u32(uid_t,xx);
+   }
+
+   if (v & GROUP_FLAG) {
+      if (read_str(info->group, MAXNAME, cfp) || read_int4(&xx, cfp))
+         return -2;
+      info->has_group = 1;
+      info->gid = CAST_u32(gid_t,xx);
+   }
+
+   if (v & ACLTEXT_FLAG) {
+      scratch_mark_t mark = scratch_mark();
+
+      acltext = read_str1(cfp);
+      len = acltext ? strlen(acltext) + 1 : 0;
+
+      if (len > info->aclbuf_size) {
+         p = realloc(info->aclbuf, len);
+         if (!p) {
+            WARNING;
+            scratch_release(mark);
+            return -2;
+         }
+         info->aclbuf = p;
+         info->aclbuf_size = len;
+      }
+
+      if (acltext) memcpy(info->aclbuf, acltext, len);
+      scratch_release(mark);
+
+      if (!acltext) return -2;
+      info->acltext = info->aclbuf;
+   }
+
+   if (v & XAT_FLAG) {
+
+      if (read_int2(&x, cfp)) return -2;
+
+      numxattrs = x;
+
+      if (numxattrs > info->sizes_size) {
+         p = realloc(info->sizes, numxattrs * sizeof(uint32_t));
+         if (!p) {
+            WARNING;
+            return -2;
+         }
+         info->sizes = p;
+         info->sizes_size = numxattrs;
+      }
+
+      len = 0;
+
+      for (i = 0; i < numxattrs; i++) {
+
+         if (read_str(name_buffer, MAXNAME, cfp) || read_int4(&xx, cfp)) 
+            return -2;
+
+         if (xx > (1UL << 30)) return -2;
+
+         namelen = strlen(name_buffer) + 1;
 
+         if (len + namelen > info->names_size) {
+            p = realloc(info->names, 2*(len + namelen));
+            if (!p) {
+               WARNING;
+               return -2;
+            }
+            info->names = p;
+            info->names_size = 2*(len + namelen);
+         }
+
+         memcpy(info->names + len, name_buffer, namelen);
+         len += namelen;
+
+         info->sizes[i] = xx;
+
+         /* skip the value */
+
+         while (xx > 0) {
+            nread = (xx < BUFSIZE) ? xx : BUFSIZE;
+            if (fread(skipbuf, 1, nread, cfp) != nread) return -2;
+            xx -= nread;
+         }
+      }
+
+      info->numxattrs = numxattrs;
+   }
+
+   return 0;
+}
+
+void free_xattr_info(xattr_info_t *info)
+{
+   free(info->aclbuf);
+   free(info->names);
+   free(info->sizes);
+   memset(info, 0, sizeof(xattr_info_t));
+}
@@ -17,7 +17,12 @@
 #include <grp.h>
 #include <errno.h>
 
-extern int xattr_access_error;
+extern __thread int xattr_access_error;
+extern __thread long xattr_meta_ops;
+extern __thread long xattr_io_bytes;
+extern __thread long xattr_count;
+
+#define MAXNAME (4*1024)
 
 struct owner_prefs_struct {
    int u_keep, u_default;
@@ -110,6 +115,10 @@ int split_xattr(const char *fname, const struct stat *sbuf,
                 const char *cname, int crtimeflag, int mtimeflag, acl_t acl,
                 int saveperms, const owner_prefs_t *oprefs);
 
+int split_xattr_fp(const char *fname, const struct stat *sbuf, FILE *cfp,
+                   int crtimeflag, int savemtime, acl_t acl,
+                   int saveperms, const owner_prefs_t *oprefs);
+
 acl_t get_acl(const char *fname, const struct stat *sbuf);
 int strip_acl(const char *fname, const struct stat *sbuf);
 
@@ -118,8 +127,37 @@ int has_acl(const char *fname, const struct stat *sbuf);
 int join_xattr(const char *fname, const struct stat *sbuf, const char *cname,
                int aclflag, const owner_prefs_t *oprefs);
 
+int join_xattr_fp(const char *fname, const struct stat *sbuf, FILE *cfp,
+                  int aclflag, const owner_prefs_t *oprefs);
+
 int skip_xattr(const char *cname);
 
+int copy_xattr(FILE *cfp, FILE *ofp);
+
+/* The contents of an xattr container, as read by read_xattr_info;
+ * the has_ fields say which of the others were recorded.
+ */
+
+struct xattr_info_struct {
+   int has_perms;   mode_t perms;
+   int has_flags;   uint32_t flags;
+   int has_crtime;  time_t crtime;
+   int has_mtime;   time_t mtime;
+   int has_owner;   char owner[MAXNAME];  uid_t uid;
+   int has_group;   char group[MAXNAME];  gid_t gid;
+   char *acltext;      /* in xbup_acl_to_text format, or null */
+   long numxattrs;
+   char *names;        /* numxattrs null-terminated names, back to back */
+   uint32_t *sizes;    /* the lengths of their values */
+   char *aclbuf;       /* holds acltext */
+   long names_size, sizes_size, aclbuf_size;
+};
+
+typedef struct xattr_info_struct xattr_info_t;
+
+int read_xattr_info(FILE *cfp, xattr_info_t *info);
+void free_xattr_info(xattr_info_t *info);
+
 static inline 
 int need_container(const char *fname, const struct stat *sbuf,
                    int crtimeflag, int savemtime, acl_t acl,
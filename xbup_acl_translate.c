@@ -28,6 +28,7 @@
 
 #include "xbup_acl_translate.h"
 #include "util.h"
+#include "scratch.h"
 
 #include <sys/types.h>
 #include <sys/acl.h>
@@ -87,7 +88,7 @@ static struct {
 };
 
 
-int xbup_acl_from_text_warning = 0;
+__thread int xbup_acl_from_text_warning = 0;
 
 acl_t
 xbup_acl_from_text(const char *buf_p)
@@ -104,6 +105,7 @@ xbup_acl_from_text(const char *buf_p)
     uid_t uid;
     gid_t gid;
     int id_type;
+    scratch_mark_t mark = scratch_mark();
 
     xbup_acl_from_text_warning = 0;
 
@@ -113,10 +115,9 @@ xbup_acl_from_text(const char *buf_p)
 	goto exit;
     }
 
-    if ((orig_buf = strdup(buf_p)) == NULL) {
-        error = ENOMEM;
-	goto exit;
-    }
+    // the working copies come from the scratch arena (see scratch.h)
+    orig_buf = scratch_alloc(strlen(buf_p) + 1);
+    strcpy(orig_buf, buf_p);
 
     buf = orig_buf;
 
@@ -126,11 +127,8 @@ xbup_acl_from_text(const char *buf_p)
     }
 
     // this fixes memory leak in original...
-    if((uu = calloc(1, sizeof(uuid_t))) == NULL)
-    {
-        error = ENOMEM;
-        goto exit;
-    }
+    uu = scratch_alloc(sizeof(uuid_t));
+    memset(uu, 0, sizeof(uuid_t));
 
     /* global acl flags
      * format: !#acl <version> [<flags>]
@@ -462,8 +460,7 @@ xbup_acl_from_text(const char *buf_p)
     }
 
 exit:
-    if (orig_buf) free(orig_buf);
-    if (uu) free(uu);
+    scratch_release(mark);
     if (error)
     {
 	if (acl_ret) acl_free(acl_ret);
@@ -475,7 +472,7 @@ exit:
 
 
 /*
- * reallocing snprintf with offset
+ * reallocing snprintf with offset (the buffer is in the scratch arena)
  */
 
 static int
@@ -497,10 +494,10 @@ raosnprintf(char **buf, size_t *size, ssize_t *offset, char *fmt, ...)
 		return ret;
 	    }
 	}
-	*buf = reallocf(*buf, (*size *= 2));
+	*buf = scratch_grow(*buf, *size, 2 * *size);
+	*size *= 2;
     } while (*buf);
 
-    //warn("reallocf failure");
     return 0;
 }
 
@@ -527,8 +524,7 @@ xbup_acl_to_text(acl_t acl, ssize_t *len_p)
 
 	*len_p = 0;
 
-	if ((buf = malloc(bufsize)) == NULL)
-	    goto err_nomem;
+	buf = scratch_alloc(bufsize);
 
 	if (!raosnprintf(&buf, &bufsize, len_p, "!#acl %d", 1))
 	    goto err_nomem;
@@ -563,7 +559,6 @@ xbup_acl_to_text(acl_t acl, ssize_t *len_p)
                 || (map_uuid_to_id(*uu, &id, &idt) != 0))  
             {
                  if (uu != NULL) acl_free(uu);
-                 if (buf != NULL) free(buf);
                  errno = EINVAL;
                  return NULL;
             }
@@ -593,7 +588,6 @@ xbup_acl_to_text(acl_t acl, ssize_t *len_p)
                     break;
 
                 default:
-                    if (buf != NULL) free(buf);
                     errno = EINVAL;
                     return NULL;
             }
@@ -636,7 +630,6 @@ xbup_acl_to_text(acl_t acl, ssize_t *len_p)
 	return buf;
 
 err_nomem:
-	if (buf != NULL) free(buf);
 	errno = ENOMEM;
 	return NULL;
 }
@@ -6,13 +6,15 @@
 #include <sys/types.h>
 #include <sys/acl.h>
 
-extern int xbup_acl_from_text_warning; 
+extern __thread int xbup_acl_from_text_warning; 
   /* set by xbup_acl_from_text if a translation to uuid fails */
 
 
 acl_t xbup_acl_from_text(const char *buf_p);
 
 char * xbup_acl_to_text(acl_t acl, ssize_t *len_p);
+  /* the text is in the scratch arena (see scratch.h), so it is
+     only valid until the caller releases it */
 
 
 #endif
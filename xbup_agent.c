@@ -0,0 +1,483 @@
+
+/* usage: xbup_agent
+ *
+ * serves requests from xbup on stdin/stdout, so that a single ssh
+ * session (or, for testing, a pair of local pipes) carries all of
+ * the work xbup needs done on the remote host.
+ *
+ * All traffic is in frames: a type byte, a 4-byte length (network
+ * byte order), and that many bytes of payload.
+ *
+ * A request is a 'Q' frame, whose payload is the command name
+ * followed by its arguments, each null terminated.  Commands that
+ * take input are followed by any number of 'D' (data) frames and
+ * an 'E' (end) frame.  The reply consists of 'M' (message) frames,
+ * to be shown to the user, then, for commands that produce output,
+ * 'D' frames and an 'E' frame, and finally an 'S' (status) frame,
+ * whose payload is "0" on success and "-1" on failure.
+ *
+ * commands:
+ *
+ *   hello
+ *      replies with a message giving the protocol version
+ *
+ *   prepare dst ext timestamp ndays [jobs]
+ *      does the work of xbup_helper: creates the directory
+ *      structure under dst (without following symlinks); unless
+ *      ndays is "-", removes archives older than ndays days (with
+ *      jobs threads, PRUNE_JOBS by default) and creates
+ *      archive/arch.timestamp
+ *
+ *   manifest-diff dir
+ *      input: manifests flattened by xmanifest --flatten;
+ *      output: the list produced by xmanifest --diff dir
+ *
+ *   ingest file
+ *      input: any byte stream (such as the output of splitf_xattr);
+ *      it is stored in file, which is replaced only once the
+ *      whole stream has arrived
+ *
+ *   quit
+ *
+ * The agent exits when it receives quit, or at end of file.
+ *
+ * Returns -1 on a protocol error, and 0 otherwise.
+ *
+ */
+
+#include <stdarg.h>
+#include <arpa/inet.h>
+
+#include "util.h"
+#include "manifest.h"
+#include "prune.h"
+
+
+#define PROTOCOL_VERSION (1)
+
+#define MAXREQUEST (4*MAXLEN)      /* max payload of a request */
+#define MAXFRAME (1024*1024)       /* max payload of any frame */
+#define DATA_CHUNK (64*1024)       /* payload of the data frames we send */
+#define MAXARGS (8)
+#define PRUNE_JOBS (8)             /* threads used to remove old archives */
+
+
+static char *frame_buf = 0;
+static char request_buf[MAXREQUEST];
+
+
+static
+void protocol_error(const char *msg)
+{
+   WARN("xbup_agent: protocol error: %s\n", msg);
+   exit(-1);
+}
+
+
+/* read_frame returns 0 at end of file (before any frame),
+ * and 1 otherwise; the payload is left in frame_buf.
+ */
+
+static
+int read_frame(int *type, long *len)
+{
+   unsigned char hdr[5];
+   uint32_t n;
+   size_t got;
+
+   got = fread(hdr, 1, 5, stdin);
+   if (got == 0 && feof(stdin)) return 0;
+   if (got != 5) protocol_error("truncated frame");
+
+   memcpy(&n, hdr+1, 4);
+   n = ntohl(n);
+   if (n > MAXFRAME) protocol_error("frame too large");
+
+   if (n > 0 && fread(frame_buf, 1, n, stdin) != n)
+      protocol_error("truncated frame");
+
+   *type = hdr[0];
+   *len = n;
+   return 1;
+}
+
+
+static
+void write_frame(int type, const void *buf, long len)
+{
+   unsigned char hdr[5];
+   uint32_t n;
+
+   hdr[0] = type;
+   n = htonl((uint32_t) len);
+   memcpy(hdr+1, &n, 4);
+
+   if (fwrite(hdr, 1, 5, stdout) != 5 ||
+       (len > 0 && fwrite(buf, 1, len, stdout) != len)) {
+      WARN("xbup_agent: error writing stdout\n");
+      exit(-1);
+   }
+}
+
+
+static
+void send_msg(const char *fmt, ...)
+{
+   char msg[2*MAXLEN];
+   va_list ap;
+   int n;
+
+   va_start(ap, fmt);
+   n = vsnprintf(msg, sizeof(msg), fmt, ap);
+   va_end(ap);
+
+   if (n >= sizeof(msg)) n = sizeof(msg)-1;
+   write_frame('M', msg, n);
+}
+
+
+static
+void send_status(int status)
+{
+   if (status)
+      write_frame('S', "-1", 2);
+   else
+      write_frame('S', "0", 1);
+
+   if (fflush(stdout)) {
+      WARN("xbup_agent: error writing stdout\n");
+      exit(-1);
+   }
+}
+
+
+static
+void send_data(const char *buf, long len)
+{
+   long n;
+
+   while (len > 0) {
+      n = (len > DATA_CHUNK) ? DATA_CHUNK : len;
+      write_frame('D', buf, n);
+      buf += n;
+      len -= n;
+   }
+
+   write_frame('E', 0, 0);
+}
+
+
+/* read_input copies the data frames following a request to ofp
+ * (if ofp is non-null); returns -1 if writing to ofp failed.
+ * The input is always consumed in full, so the conversation
+ * stays in sync.
+ */
+
+static
+int read_input(FILE *ofp)
+{
+   int type;
+   long len;
+   int ret;
+
+   ret = 0;
+
+   for (;;) {
+      if (!read_frame(&type, &len)) protocol_error("truncated input");
+
+      if (type == 'E') break;
+      if (type != 'D') protocol_error("unexpected frame in input");
+
+      if (ofp && ret == 0 && len > 0 && fwrite(frame_buf, 1, len, ofp) != len)
+         ret = -1;
+   }
+
+   return ret;
+}
+
+
+
+/* make_directory works much like mkdir -p, but will not follow symlinks;
+ * base must exist or be creatable, and ext is either empty or
+ * starts with a slash.
+ */
+
+static
+int make_directory_aux(const char *dir)
+{
+   struct stat dirstat;
+
+   if (lstat(dir, &dirstat) == 0) {
+      if (S_ISDIR(dirstat.st_mode)) return 0;
+      send_msg("mkdir: failed to create %s\n", dir);
+      return -1;
+   }
+
+   if (mkdir(dir, 0777)) {
+      send_msg("mkdir: failed to create %s\n", dir);
+      return -1;
+   }
+
+   send_msg("mkdir: created %s\n", dir);
+   return 0;
+}
+
+static
+int make_directory(const char *base, const char *ext)
+{
+   char dir[MAXLEN];
+   char *p;
+   char c;
+
+   if (snprintf(dir, MAXLEN, "%s%s", base, ext) >= MAXLEN) overflow();
+
+   /* create base, then each longer prefix of dir ending at a slash */
+
+   p = dir + strlen(base);
+
+   for (;;) {
+      c = *p;
+      *p = '\0';
+      if (make_directory_aux(dir)) return -1;
+      *p = c;
+
+      if (c == '\0') return 0;
+
+      p = strchr(p + 1, '/');
+      if (!p) p = dir + strlen(dir);
+   }
+}
+
+
+static
+int do_prepare(char **args, int nargs)
+{
+   const char *dst, *ext, *timestamp, *nds;
+   char dir[MAXLEN];
+   struct prune_stats stats;
+   long ndays, jobs;
+
+   if (nargs != 4 && nargs != 5) return -1;
+
+   dst = args[0];
+   ext = args[1];
+   timestamp = args[2];
+   nds = args[3];
+
+   ndays = 0;
+   if (strcmp(nds, "-") != 0) {
+      ndays = string_to_long(nds);
+      if (conversion_error || ndays < 0) {
+         send_msg("bad number of days: %s\n", nds);
+         return -1;
+      }
+   }
+
+   jobs = PRUNE_JOBS;
+   if (nargs == 5) {
+      jobs = string_to_long(args[4]);
+      if (conversion_error || jobs < 1) {
+         send_msg("bad number of jobs: %s\n", args[4]);
+         return -1;
+      }
+   }
+
+   if (dst[0] != '/' || (ext[0] != '\0' && ext[0] != '/') ||
+       strchr(timestamp, '/')) {
+      send_msg("bad arguments to prepare\n");
+      return -1;
+   }
+
+   /* check for global directory structure */
+
+   if (make_directory(dst, "/data") ||
+       make_directory(dst, "/xattr") ||
+       make_directory(dst, "/archive")) return -1;
+
+   /* check for local directory structure */
+
+   if (snprintf(dir, MAXLEN, "/data%s", ext) >= MAXLEN) overflow();
+   if (make_directory(dst, dir)) return -1;
+
+   if (snprintf(dir, MAXLEN, "/xattr%s", ext) >= MAXLEN) overflow();
+   if (make_directory(dst, dir)) return -1;
+
+   if (strcmp(nds, "-") != 0) {
+
+      /* remove old backups */
+
+      if (snprintf(dir, MAXLEN, "%s/archive", dst) >= MAXLEN) overflow();
+
+      if (prune_entries(dir, "arch.*", ndays, jobs, 0, &stats))
+         send_msg("failed to remove some old archives in %s\n", dir);
+
+      if (stats.dirs + stats.files > 0)
+         send_msg("removed old archives: %ld files, %ld directories\n",
+                  stats.files, stats.dirs);
+
+      /* create backup directory structure */
+
+      if (snprintf(dir, MAXLEN, "/archive/arch.%s", timestamp) >= MAXLEN)
+         overflow();
+      if (make_directory(dst, dir)) return -1;
+   }
+
+   return 0;
+}
+
+
+static
+int do_manifest_diff(char **args, int nargs)
+{
+   FILE *ifp, *ofp;
+   char *ibuf, *obuf;
+   size_t ilen, olen;
+   int ret;
+
+   ibuf = obuf = 0;
+   ifp = open_memstream(&ibuf, &ilen);
+   if (!ifp) {
+      Warning("open_memstream error");
+      exit(-1);
+   }
+
+   ret = read_input(ifp);
+
+   if (fclose(ifp)) {
+      Warning("open_memstream error");
+      exit(-1);
+   }
+
+   if (nargs != 1) ret = -1;
+
+   if (ret == 0) {
+      ofp = open_memstream(&obuf, &olen);
+      if (!ofp) {
+         Warning("open_memstream error");
+         exit(-1);
+      }
+
+      ret = manifest_diff(args[0], ibuf, ilen, ofp);
+
+      if (fclose(ofp)) {
+         Warning("open_memstream error");
+         exit(-1);
+      }
+
+      if (ret == 0) send_data(obuf, olen);
+   }
+
+   free(ibuf);
+   free(obuf);
+   return ret;
+}
+
+
+static
+int do_ingest(char **args, int nargs)
+{
+   char tmpname[MAXLEN];
+   FILE *ofp;
+   int ret;
+
+   ofp = 0;
+
+   if (nargs == 1) {
+      if (snprintf(tmpname, MAXLEN, "%s.tmp", args[0]) >= MAXLEN) overflow();
+      ofp = fopen(tmpname, "w");
+      if (!ofp) send_msg("failed to create %s\n", tmpname);
+   }
+
+   ret = read_input(ofp);
+
+   if (!ofp) return -1;
+
+   if (fclose(ofp)) ret = -1;
+
+   if (ret == 0 && rename(tmpname, args[0])) ret = -1;
+
+   if (ret) {
+      send_msg("failed to write %s\n", args[0]);
+      unlink(tmpname);
+   }
+
+   return ret;
+}
+
+
+void usage()
+{
+   WARN("usage: xbup_agent\n");
+}
+
+
+int main(int argc, char **argv)
+{
+   char *args[MAXARGS+1];
+   char *cmd, *p, *end;
+   int nargs;
+   int type;
+   long len;
+   int ret;
+
+   if (argc != 1) {
+      usage();
+      return -1;
+   }
+
+   frame_buf = (char *) malloc(MAXFRAME + 1);
+   if (!frame_buf) {
+      Warning("malloc error");
+      exit(-1);
+   }
+
+   while (read_frame(&type, &len)) {
+
+      if (type != 'Q') protocol_error("expected a request");
+      if (len == 0 || len > MAXREQUEST || frame_buf[len-1] != '\0')
+         protocol_error("bad request");
+
+      /* split the request into command and arguments; the request
+       * is copied, since frame_buf is reused to read the input
+       */
+
+      memcpy(request_buf, frame_buf, len);
+
+      cmd = request_buf;
+      p = cmd + strlen(cmd) + 1;
+      end = request_buf + len;
+      nargs = 0;
+
+      while (p < end) {
+         if (nargs == MAXARGS) protocol_error("too many arguments");
+         args[nargs++] = p;
+         p += strlen(p) + 1;
+      }
+
+      if (strcmp(cmd, "hello") == 0) {
+         send_msg("xbup_agent protocol %d\n", PROTOCOL_VERSION);
+         ret = 0;
+      }
+      else if (strcmp(cmd, "prepare") == 0) {
+         ret = do_prepare(args, nargs);
+      }
+      else if (strcmp(cmd, "manifest-diff") == 0) {
+         ret = do_manifest_diff(args, nargs);
+      }
+      else if (strcmp(cmd, "ingest") == 0) {
+         ret = do_ingest(args, nargs);
+      }
+      else if (strcmp(cmd, "quit") == 0) {
+         send_status(0);
+         break;
+      }
+      else {
+         send_msg("unknown command: %s\n", cmd);
+         ret = -1;
+      }
+
+      send_status(ret);
+   }
+
+   return 0;
+}
@@ -0,0 +1,216 @@
+
+/* usage: xbup_prune options path...
+ *    options:  --jobs n
+ *              --progress
+ *              --match pattern
+ *              --older-than days
+ *              --max-ops n
+ *              --max-meta-ops n
+ *              --throttle-file file
+ *              --nice n
+ *              --low-io
+ *
+ * removes each path, along with everything below it, much like
+ * rm -rf, but using a pool of n threads that remove files with
+ * unlinkat through directory file descriptors (see prune.h).
+ * Paths that do not exist are ignored.  Symlinks are never followed.
+ *
+ * with the --match or --older-than options, each path must be a
+ * directory, and only those of its entries whose names match the
+ * shell pattern, and whose mtime is more than days days old,
+ * are removed; so
+ *
+ *    xbup_prune --match 'arch.*' --older-than 30 dir
+ *
+ * does the same as
+ *
+ *    cd dir && find . \! -name . -prune -name 'arch.*' -mtime +30 \
+ *                 -exec rm -rf {} \;
+ *
+ * the --progress flag writes running totals to stderr about once
+ * a second, and final totals at the end.
+ *
+ * the --max-ops flag limits the removal to about n entries per
+ * second (see throttle.h), so as to leave some of the disk to others;
+ * --max-meta-ops does the same for the unlinkat calls, which here
+ * come to one per entry.  The --throttle-file, --nice and --low-io
+ * options are as in split_xattr.  (There is no --max-bytes, as no
+ * data is read or written.)
+ *
+ * Returns -1 if errors detected, and 0 otherwise.
+ *
+ */
+
+#include "util.h"
+#include "prune.h"
+#include "throttle.h"
+
+
+#define MAXJOBS (256)
+
+
+void usage()
+{
+   WARN("usage: xbup_prune options path...\n");
+   WARN("  options:  --jobs n\n");
+   WARN("            --progress\n");
+   WARN("            --match pattern\n");
+   WARN("            --older-than days\n");
+   WARN("            --max-ops n\n");
+   WARN("            --max-meta-ops n\n");
+   WARN("            --throttle-file file\n");
+   WARN("            --nice n\n");
+   WARN("            --low-io\n");
+}
+
+
+int main(int argc, char **argv)
+{
+   long num_jobs, days;
+   int progressflag;
+   char *pattern;
+   long max_ops, max_meta_ops;
+   char *tname;
+   long nice_incr;
+   int lowioflag;
+   int return_value;
+   int i;
+
+   num_jobs = 1;
+   days = -1;
+   progressflag = 0;
+   pattern = 0;
+   max_ops = 0;
+   max_meta_ops = 0;
+   tname = 0;
+   nice_incr = 0;
+   lowioflag = 0;
+
+   i = 1;
+   while (i < argc) {
+      if (strcmp(argv[i], "--jobs") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         num_jobs = string_to_long(argv[i]);
+         if (conversion_error || num_jobs < 1 || num_jobs > MAXJOBS) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--progress") == 0) {
+         i++;
+         progressflag = 1;
+      }
+      else if (strcmp(argv[i], "--match") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         pattern = argv[i];
+         i++;
+      }
+      else if (strcmp(argv[i], "--older-than") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         days = string_to_long(argv[i]);
+         if (conversion_error || days < 0) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--max-ops") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         max_ops = string_to_long(argv[i]);
+         if (conversion_error || max_ops < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--max-meta-ops") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         max_meta_ops = string_to_long(argv[i]);
+         if (conversion_error || max_meta_ops < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--throttle-file") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         tname = argv[i];
+         i++;
+      }
+      else if (strcmp(argv[i], "--nice") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         nice_incr = string_to_long(argv[i]);
+         if (conversion_error || nice_incr < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--low-io") == 0) {
+         i++;
+         lowioflag = 1;
+      }
+
+      else
+         break;
+   }
+
+   if (i == argc) {
+      usage();
+      return -1;
+   }
+
+   throttle_init(THROTTLE_OBJECTS, max_ops);
+   throttle_init(THROTTLE_OPS, max_meta_ops);
+
+   if (tname && throttle_control(tname)) {
+      WARN("xbup_prune: bad throttle file %s\n", tname);
+      return -1;
+   }
+
+   if (throttle_priority(nice_incr, lowioflag))
+      WARN("xbup_prune: could not lower priority\n");
+
+   if (!pattern && days < 0)
+      return prune_tree(argv + i, argc - i, num_jobs, progressflag, 0);
+
+   return_value = 0;
+
+   for (; i < argc; i++) {
+      strip_slashes(argv[i]);
+
+      if (prune_entries(argv[i], pattern, days,
+                        num_jobs, progressflag, 0)) return_value = -1;
+   }
+
+   return return_value;
+}
@@ -0,0 +1,980 @@
+
+/* usage: xbup_watch options srcdir dstdir
+ *    options:  --crtime
+ *              --mtime
+ *              --lnkmtime
+ *              --acl
+ *              --fixperms
+ *              --lnkperms
+ *              --perms
+ *              --owner oname
+ *              --group gname
+ *              --manifest
+ *              --latency secs
+ *              --exclude pattern
+ *              --exclude-from file
+ *              --max-ops n
+ *              --max-meta-ops n
+ *              --max-bytes n
+ *              --throttle-file file
+ *              --nice n
+ *              --low-io
+ *
+ * keeps dstdir, a repository of xattr containers for srcdir, just as
+ * split_xattr (given the same options) would make it, by watching
+ * srcdir for changes with FSEvents; it runs until killed.
+ *
+ * dstdir is first made from scratch (anything already there is
+ * removed).  From then on, each object that FSEvents reports as
+ * changed is looked at again: its container is rewritten, or removed
+ * if it is no longer needed (or the object is gone); so is that of
+ * the directory holding an object that was created, removed or
+ * renamed, as its own metadata changed with it.  A directory
+ * that is created, or moved into srcdir, is walked in full, just as
+ * split_xattr walks srcdir (see splitwalk.h).  Only if
+ * events were dropped (by FSEvents, or because we fell behind) is
+ * dstdir made from scratch again.
+ *
+ * with the --manifest flag, the manifests (see manifest.h) of the
+ * directories that changed, and of those above them, are rewritten
+ * after each batch of events.
+ *
+ * the --latency option sets how long (in seconds, default 2) FSEvents
+ * collects events before passing them on as one batch.
+ *
+ * the --exclude and --exclude-from options add rsync-style exclude
+ * rules (see exclude.h), as for split_xattr: excluded objects get no
+ * containers, and events below excluded directories are ignored.
+ *
+ * the --max-ops, --max-meta-ops, --max-bytes, --throttle-file, --nice
+ * and --low-io options are as in split_xattr; they pace the handling
+ * of events as well as the walks (a full rescan walks all of srcdir,
+ * while it is in use), and the removal of containers.
+ *
+ * While it works on dstdir, xbup_watch holds an exclusive lock (flock)
+ * on the file dstdir.lock;  xbup takes the same lock while it syncs
+ * dstdir, so it never sees a tree that is half updated.  Whenever
+ * dstdir is complete, and no errors have been detected since it was
+ * last made from scratch, the file dstdir.ok holds the process id of
+ * xbup_watch.
+ *
+ * A SIGHUP makes dstdir from scratch again (say, after errors);
+ * a SIGTERM or SIGINT removes dstdir.ok, and ends xbup_watch.
+ *
+ * Returns -1 if errors detected at startup.
+ *
+ */
+
+#include <signal.h>
+#include <time.h>
+#include <sys/file.h>
+#include <CoreServices/CoreServices.h>
+
+#include "util.h"
+#include "uthash.h"
+#include "xattr_util.h"
+#include "dirscan.h"
+#include "exclude.h"
+#include "manifest.h"
+#include "prune.h"
+#include "throttle.h"
+#include "splitwalk.h"
+
+
+#define PRUNE_JOBS (4)
+#define HUP_CHECK (5.0)      /* seconds between checks for SIGHUP */
+
+static int batch_error = 0;
+static int tree_ok = 0;
+static int manifestflag = 0;
+static int source_name_len = 0;
+static char *source_name = 0;
+static char *destination_name = 0;
+static int destination_name_len = 0;
+
+static char real_source[MAXLEN];
+static int real_source_len = 0;
+static char lock_name[MAXLEN];
+static char ok_name[MAXLEN];
+static int lock_fd = -1;
+
+static volatile sig_atomic_t rescan_requested = 0;
+
+/* the options of the walks (see splitwalk.h) */
+
+static struct split_walk walk;
+
+
+static
+void set_error(void)
+{
+   batch_error = 1;
+}
+
+
+/* the directories of dstdir whose contents changed in this batch;
+ * their manifests (and those of their ancestors) need rewriting,
+ * and they may have become empty
+ */
+
+struct dirty_entry {
+   char *key;
+   int depth;
+   UT_hash_handle hh;
+};
+
+static struct dirty_entry *dirty_table = NULL;
+
+/* the directories of srcdir that entries were created in, removed
+ * from, or renamed in or out of, in this batch; their own containers
+ * need rewriting (FSEvents only reports the entries)
+ */
+
+static struct dirty_entry *parent_table = NULL;
+
+static
+void add_dir(struct dirty_entry **table, const char *dir)
+{
+   struct dirty_entry *ptr;
+   const char *p;
+   size_t len;
+
+   len = strlen(dir);
+
+   HASH_FIND(hh, *table, dir, len, ptr);
+   if (ptr) return;
+
+   ptr = (struct dirty_entry *) malloc(sizeof(struct dirty_entry));
+   if (!ptr) {
+      Warning("malloc error");
+      exit(-1);
+   }
+
+   ptr->key = strdup(dir);
+   if (!ptr->key) {
+      Warning("malloc error");
+      exit(-1);
+   }
+
+   ptr->depth = 0;
+   for (p = dir; *p; p++)
+      if (*p == '/') ptr->depth++;
+
+   HASH_ADD_KEYPTR(hh, *table, ptr->key, len, ptr);
+}
+
+static
+void mark_dirty(const char *dir)
+{
+   add_dir(&dirty_table, dir);
+}
+
+/* marks the directory of dstdir holding the container dblname */
+
+static
+void mark_container_dir(const char *dblname)
+{
+   char dir[MAXLEN];
+   char *p;
+
+   if (snprintf(dir, MAXLEN, "%s", dblname) >= MAXLEN) overflow();
+
+   p = strrchr(dir, '/');
+   if (!p) return;
+   *p = '\0';
+
+   mark_dirty(dir);
+}
+
+static
+int dirty_cmp(const void *a, const void *b)
+{
+   const struct dirty_entry *x = *(const struct dirty_entry **) a;
+   const struct dirty_entry *y = *(const struct dirty_entry **) b;
+
+   if (x->depth != y->depth) return (x->depth > y->depth) ? -1 : 1;
+   return strcmp(x->key, y->key);
+}
+
+static
+void clear_dirs(struct dirty_entry **table)
+{
+   struct dirty_entry *ptr;
+
+   while (*table) {
+      ptr = *table;
+      HASH_DEL(*table, ptr);
+      free(ptr->key);
+      free(ptr);
+   }
+}
+
+
+/* remove_if_empty removes dir (and its manifest) if it holds nothing
+ * else, as split_xattr only makes directories to hold containers;
+ * returns 1 if dir is gone
+ */
+
+static
+int remove_if_empty(const char *dir)
+{
+   char mname[MAXLEN];
+   dirscan_t *dirlist;
+   struct dirscan_item *diritem;
+   long n;
+
+   dirlist = dirscan_open(dir, 0);
+   if (!dirlist) return (errno == ENOENT);
+
+   n = 0;
+   while ( (diritem = dirscan_next(dirlist)) )
+      if (strcmp(diritem->d_name, MANIFEST_NAME) != 0) n++;
+
+   if (dirscan_close(dirlist) || n > 0) return 0;
+
+   if (snprintf(mname, MAXLEN, "%s/%s", dir, MANIFEST_NAME) >= MAXLEN)
+      overflow();
+
+   unlink(mname);
+
+   if (rmdir(dir)) {
+      WARN("xbup_watch: failed to remove %s\n", dir);
+      set_error();
+      return 0;
+   }
+
+   return 1;
+}
+
+
+/* update_dirs deals with the dirty directories, and all those above
+ * them, deepest first
+ */
+
+static
+void update_dirs(void)
+{
+   char dir[MAXLEN];
+   struct dirty_entry *ptr, **list;
+   char *p;
+   long n, i;
+
+   /* add the ancestors */
+
+   for (ptr = dirty_table; ptr; ptr = ptr->hh.next) {
+      if (snprintf(dir, MAXLEN, "%s", ptr->key) >= MAXLEN) overflow();
+
+      while ( (p = strrchr(dir, '/')) && p - dir >= destination_name_len ) {
+         *p = '\0';
+         mark_dirty(dir);
+      }
+   }
+
+   n = HASH_COUNT(dirty_table);
+   if (n == 0) return;
+
+   list = (struct dirty_entry **) malloc(n * sizeof(struct dirty_entry *));
+   if (!list) {
+      Warning("malloc error");
+      exit(-1);
+   }
+
+   i = 0;
+   for (ptr = dirty_table; ptr; ptr = ptr->hh.next) list[i++] = ptr;
+
+   qsort(list, n, sizeof(struct dirty_entry *), dirty_cmp);
+
+   for (i = 0; i < n; i++) {
+      if (strcmp(list[i]->key, destination_name) != 0 &&
+          remove_if_empty(list[i]->key)) continue;
+
+      if (manifestflag && manifest_update(list[i]->key, 0)) {
+         WARN("xbup_watch: failed to update manifest of %s\n", list[i]->key);
+         set_error();
+      }
+   }
+
+   free(list);
+   clear_dirs(&dirty_table);
+}
+
+
+static
+void remove_tree(const char *dir)
+{
+   char *paths[1];
+
+   paths[0] = (char *) dir;
+
+   if (prune_tree(paths, 1, PRUNE_JOBS, 0, 0)) {
+      WARN("xbup_watch: failed to remove %s\n", dir);
+      set_error();
+   }
+}
+
+
+/* rescan makes the containers of the directory dirname (and everything
+ * below it) from scratch
+ */
+
+static
+void rescan(const char *dirname, const struct stat *dirstat)
+{
+   char dir[MAXLEN];
+
+   if (snprintf(dir, MAXLEN, "%s%s", destination_name,
+       dirname + source_name_len) >= MAXLEN) overflow();
+
+   remove_tree(dir);
+   mark_dirty(dir);
+
+   split_dirwalk(dirname, dirstat, 1);
+}
+
+
+static
+void write_ok(void)
+{
+   FILE *fp;
+
+   if (!tree_ok) {
+      unlink(ok_name);
+      return;
+   }
+
+   fp = fopen(ok_name, "w");
+   if (!fp || fprintf(fp, "%ld\n", (long) getpid()) < 0 || fclose(fp)) {
+      WARN("xbup_watch: failed to write %s\n", ok_name);
+      unlink(ok_name);
+   }
+}
+
+
+static
+void full_rescan(void)
+{
+   struct stat srcstat;
+   time_t start;
+
+   rescan_requested = 0;
+   tree_ok = 0;
+   unlink(ok_name);
+
+   WARN("xbup_watch: scanning %s\n", source_name);
+   start = time(0);
+
+   batch_error = 0;
+
+   remove_tree(destination_name);
+
+   if (mkdir(destination_name, 0777)) {
+      WARN("xbup_watch: failed to create %s\n", destination_name);
+      set_error();
+   }
+   else if (lstat(source_name, &srcstat) || !S_ISDIR(srcstat.st_mode)) {
+      WARN("xbup_watch: %s is gone\n", source_name);
+      set_error();
+   }
+   else {
+      split_dirwalk(source_name, &srcstat, 1);
+   }
+
+   clear_dirs(&dirty_table);
+
+   if (manifestflag && batch_error == 0 &&
+       manifest_build(destination_name, 0)) {
+      WARN("xbup_watch: failed to build manifest\n");
+      set_error();
+   }
+
+   tree_ok = (batch_error == 0);
+
+   WARN("xbup_watch: scan done in %lds%s\n", (long) (time(0) - start),
+        tree_ok ? "" : " (with errors)");
+}
+
+
+/* handle_event looks again at path (as given by FSEvents, so relative
+ * to real_source) and whatever its container should be
+ */
+
+/* an object is excluded if it, or any directory above it, is;
+ * path is relative to srcdir
+ */
+
+static
+int is_excluded(const char *itemname, const char *path)
+{
+   char buf[MAXLEN];
+   char *p;
+
+   if (snprintf(buf, MAXLEN, "%s", path) >= MAXLEN) overflow();
+
+   for (p = strchr(buf, '/'); p; p = strchr(p+1, '/')) {
+      *p = '\0';
+      if (exclude_match(buf, 1)) return 1;
+      *p = '/';
+   }
+
+   return exclude_item(path, itemname, DT_UNKNOWN);
+}
+
+
+static
+void handle_event(const char *path, FSEventStreamEventFlags flags)
+{
+   char itemname[MAXLEN];
+   char dirname[MAXLEN];
+   char dblname[MAXLEN];
+   char dir[MAXLEN];
+   struct stat itemstat, dirstat;
+   const char *ext;
+   char *p;
+   long len;
+   int excluded;
+
+   if (strncmp(path, real_source, real_source_len) != 0) return;
+
+   ext = path + real_source_len;
+   if (*ext != '\0' && *ext != '/') return;
+
+   if (snprintf(itemname, MAXLEN, "%s%s", source_name, ext) >= MAXLEN)
+      overflow();
+
+   len = strlen(itemname);
+   while (len > source_name_len && itemname[len-1] == '/')
+      itemname[--len] = '\0';
+
+   ext = itemname + source_name_len;
+
+   throttle(THROTTLE_OBJECTS, 1);
+   throttle(THROTTLE_OPS, 1);
+
+   if (*ext == '\0') {
+      if (lstat(itemname, &itemstat) || !S_ISDIR(itemstat.st_mode)) {
+         WARN("xbup_watch: %s is gone\n", itemname);
+         set_error();
+      }
+      else if (flags & kFSEventStreamEventFlagMustScanSubDirs) {
+         rescan(itemname, &itemstat);
+      }
+      else {
+         split_object(itemname, &itemstat, itemname, ".");
+      }
+      return;
+   }
+
+   if (snprintf(dblname, MAXLEN, "%s%s%s",
+       destination_name, ext, DBL_SUFFIX) >= MAXLEN) overflow();
+
+   if (snprintf(dir, MAXLEN, "%s%s", destination_name, ext) >= MAXLEN)
+      overflow();
+
+   if (snprintf(dirname, MAXLEN, "%s", itemname) >= MAXLEN) overflow();
+   p = strrchr(dirname, '/');
+   *p = '\0';
+
+   if (flags & (kFSEventStreamEventFlagItemCreated |
+                kFSEventStreamEventFlagItemRemoved |
+                kFSEventStreamEventFlagItemRenamed))
+      add_dir(&parent_table, dirname);
+
+   if (split_name_conflict(itemname, p+1)) return;
+
+   excluded = is_excluded(itemname, ext + 1);
+
+   if (excluded || lstat(itemname, &itemstat)) {
+      if (!excluded && errno != ENOENT && errno != ENOTDIR) {
+         WARN("xbup_watch: lstat failed on %s\n", itemname);
+         set_error();
+         return;
+      }
+
+      /* gone (or excluded): so are its containers */
+
+      if (unlink(dblname) == 0) mark_container_dir(dblname);
+      if (lstat(dir, &dirstat) == 0) {
+         remove_tree(dir);
+         mark_dirty(dir);
+      }
+      return;
+   }
+
+   if (S_ISDIR(itemstat.st_mode)) {
+      if (unlink(dblname) == 0) mark_container_dir(dblname);
+
+      if (flags & (kFSEventStreamEventFlagItemCreated |
+                   kFSEventStreamEventFlagItemRenamed |
+                   kFSEventStreamEventFlagMustScanSubDirs))
+         rescan(itemname, &itemstat);
+      else
+         split_object(itemname, &itemstat, itemname, ".");
+   }
+   else {
+      if (lstat(dir, &dirstat) == 0 && S_ISDIR(dirstat.st_mode)) {
+         remove_tree(dir);
+         mark_dirty(dir);
+      }
+
+      split_object(itemname, &itemstat, dirname, p+1);
+   }
+}
+
+
+/* update_parents rewrites the containers of the directories in
+ * parent_table (those that are gone will have events of their own)
+ */
+
+static
+void update_parents(void)
+{
+   struct dirty_entry *ptr;
+   struct stat dirstat;
+
+   for (ptr = parent_table; ptr; ptr = ptr->hh.next) {
+      if (ptr->key[source_name_len] != '\0' &&
+          is_excluded(ptr->key, ptr->key + source_name_len + 1)) continue;
+
+      if (lstat(ptr->key, &dirstat) || !S_ISDIR(dirstat.st_mode)) continue;
+
+      split_object(ptr->key, &dirstat, ptr->key, ".");
+   }
+
+   clear_dirs(&parent_table);
+}
+
+
+static
+void lock_tree(void)
+{
+   if (flock(lock_fd, LOCK_EX)) {
+      WARN("xbup_watch: failed to lock %s\n", lock_name);
+      exit(-1);
+   }
+}
+
+static
+void unlock_tree(void)
+{
+   flock(lock_fd, LOCK_UN);
+}
+
+
+static
+void callback(ConstFSEventStreamRef stream, void *info, size_t n,
+              void *paths, const FSEventStreamEventFlags flags[],
+              const FSEventStreamEventId ids[])
+{
+   char **path = (char **) paths;
+   int full;
+   size_t i;
+
+   full = rescan_requested;
+
+   for (i = 0; i < n; i++) {
+      if (flags[i] & (kFSEventStreamEventFlagUserDropped |
+                      kFSEventStreamEventFlagKernelDropped |
+                      kFSEventStreamEventFlagRootChanged)) full = 1;
+   }
+
+   lock_tree();
+
+   if (full) {
+      full_rescan();
+   }
+   else {
+      batch_error = 0;
+
+      for (i = 0; i < n; i++)
+         handle_event(path[i], flags[i]);
+
+      update_parents();
+      update_dirs();
+
+      if (batch_error) tree_ok = 0;
+   }
+
+   write_ok();
+   unlock_tree();
+}
+
+
+static
+void timer_callback(CFRunLoopTimerRef timer, void *info)
+{
+   if (!rescan_requested) return;
+
+   lock_tree();
+   full_rescan();
+   write_ok();
+   unlock_tree();
+}
+
+
+static
+void hup_handler(int sig)
+{
+   rescan_requested = 1;
+}
+
+static
+void term_handler(int sig)
+{
+   unlink(ok_name);
+   _exit(0);
+}
+
+
+void usage()
+{
+   WARN("usage: xbup_watch options srcdir dstdir\n");
+   WARN("  options:  --crtime\n");
+   WARN("            --mtime\n");
+   WARN("            --lnkmtime\n");
+   WARN("            --acl\n");
+   WARN("            --fixperms\n");
+   WARN("            --lnkperms\n");
+   WARN("            --perms\n");
+   WARN("            --owner oname\n");
+   WARN("            --group gname\n");
+   WARN("            --manifest\n");
+   WARN("            --latency secs\n");
+   WARN("            --exclude pattern\n");
+   WARN("            --exclude-from file\n");
+   WARN("            --max-ops n\n");
+   WARN("            --max-meta-ops n\n");
+   WARN("            --max-bytes n\n");
+   WARN("            --throttle-file file\n");
+   WARN("            --nice n\n");
+   WARN("            --low-io\n");
+}
+
+
+int main(int argc, char **argv)
+{
+   char *srcname, *dstname;
+   char real_dest[MAXLEN];
+   struct stat srcstat, dststat;
+   char *owner_name, *group_name;
+   int owner_status;
+   long latency;
+   long max_ops, max_meta_ops, max_bytes;
+   char *tname;
+   long nice_incr;
+   int lowioflag;
+   FSEventStreamRef stream;
+   CFStringRef cfsrc;
+   CFArrayRef cfpaths;
+   CFRunLoopTimerRef timer;
+
+   int i;
+
+   owner_name = 0;
+   group_name = 0;
+   latency = 2;
+   max_ops = 0;
+   max_meta_ops = 0;
+   max_bytes = 0;
+   tname = 0;
+   nice_incr = 0;
+   lowioflag = 0;
+
+   i = 1;
+   while (i < argc) {
+      if (strcmp(argv[i], "--crtime") == 0) {
+         i++;
+         walk.crtime = 1;
+      }
+      else if (strcmp(argv[i], "--mtime") == 0) {
+         i++;
+         walk.mtime = 1;
+      }
+      else if (strcmp(argv[i], "--lnkmtime") == 0) {
+         i++;
+         walk.lnkmtime = 1;
+      }
+      else if (strcmp(argv[i], "--acl") == 0) {
+         i++;
+         walk.acl = 1;
+      }
+      else if (strcmp(argv[i], "--fixperms") == 0) {
+         i++;
+         walk.fixperms = 1;
+      }
+      else if (strcmp(argv[i], "--lnkperms") == 0) {
+         i++;
+         walk.lnkperms = 1;
+      }
+      else if (strcmp(argv[i], "--perms") == 0) {
+         i++;
+         walk.allperms = 1;
+      }
+      else if (strcmp(argv[i], "--owner") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         owner_name = argv[i];
+         i++;
+      }
+      else if (strcmp(argv[i], "--group") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         group_name = argv[i];
+         i++;
+      }
+      else if (strcmp(argv[i], "--manifest") == 0) {
+         i++;
+         manifestflag = 1;
+      }
+      else if (strcmp(argv[i], "--latency") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         latency = string_to_long(argv[i]);
+         if (conversion_error || latency < 0) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--exclude") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         if (exclude_add(argv[i], 0)) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--exclude-from") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         if (exclude_add_file(argv[i])) return -1;
+         i++;
+      }
+      else if (strcmp(argv[i], "--max-ops") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         max_ops = string_to_long(argv[i]);
+         if (conversion_error || max_ops < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--max-meta-ops") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         max_meta_ops = string_to_long(argv[i]);
+         if (conversion_error || max_meta_ops < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--max-bytes") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         max_bytes = string_to_long(argv[i]);
+         if (conversion_error || max_bytes < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--throttle-file") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         tname = argv[i];
+         i++;
+      }
+      else if (strcmp(argv[i], "--nice") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         nice_incr = string_to_long(argv[i]);
+         if (conversion_error || nice_incr < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--low-io") == 0) {
+         i++;
+         lowioflag = 1;
+      }
+
+      else
+         break;
+   }
+
+   if (i != argc-2) {
+      usage();
+      return -1;
+   }
+
+   srcname = argv[argc-2];
+   dstname = argv[argc-1];
+
+   source_name_len = strip_slashes(srcname);
+   destination_name_len = strip_slashes(dstname);
+
+   if (lstat(srcname, &srcstat) || !S_ISDIR(srcstat.st_mode)) {
+      usage();
+      return -1;
+   }
+
+   source_name = srcname;
+   destination_name = dstname;
+
+   owner_status = set_owner_prefs(&walk.oprefs, owner_name, group_name);
+
+   if (owner_status) {
+      if (owner_status & 1)
+         WARN("xbup_watch: bad owner name %s\n", owner_name);
+      if (owner_status & 2)
+         WARN("xbup_watch: bad group name %s\n", group_name);
+      return -1;
+   }
+
+   throttle_init(THROTTLE_OBJECTS, max_ops);
+   throttle_init(THROTTLE_OPS, max_meta_ops);
+   throttle_init(THROTTLE_BYTES, max_bytes);
+
+   if (tname && throttle_control(tname)) {
+      WARN("xbup_watch: bad throttle file %s\n", tname);
+      return -1;
+   }
+
+   if (throttle_priority(nice_incr, lowioflag))
+      WARN("xbup_watch: could not lower priority\n");
+
+   if (snprintf(lock_name, MAXLEN, "%s.lock", dstname) >= MAXLEN ||
+       snprintf(ok_name, MAXLEN, "%s.ok", dstname) >= MAXLEN) overflow();
+
+   /* FSEvents reports paths with all symlinks resolved */
+
+   if (!realpath(srcname, real_source)) {
+      WARN("xbup_watch: can't resolve %s\n", srcname);
+      return -1;
+   }
+
+   real_source_len = strlen(real_source);
+   if (strcmp(real_source, "/") == 0) real_source_len = 0;
+
+   /* dstdir had better not be inside srcdir */
+
+   if (lstat(dstname, &dststat) && mkdir(dstname, 0777)) {
+      WARN("xbup_watch: failed to create %s\n", dstname);
+      return -1;
+   }
+
+   if (!realpath(dstname, real_dest)) {
+      WARN("xbup_watch: can't resolve %s\n", dstname);
+      return -1;
+   }
+
+   if (strncmp(real_dest, real_source, real_source_len) == 0 &&
+       (real_dest[real_source_len] == '/' ||
+        real_dest[real_source_len] == '\0')) {
+      WARN("xbup_watch: %s is inside %s\n", dstname, srcname);
+      return -1;
+   }
+
+   lock_fd = open(lock_name, O_RDWR | O_CREAT, 0666);
+   if (lock_fd < 0) {
+      WARN("xbup_watch: can't open %s\n", lock_name);
+      return -1;
+   }
+
+   if (flock(lock_fd, LOCK_EX | LOCK_NB)) {
+      WARN("xbup_watch: %s is locked (is xbup_watch already running?)\n",
+           lock_name);
+      return -1;
+   }
+
+   unlock_tree();
+
+   signal(SIGHUP, hup_handler);
+   signal(SIGTERM, term_handler);
+   signal(SIGINT, term_handler);
+
+   /* the stream is started before the first scan, so that nothing
+    * that changes during the scan is missed (the events are only
+    * delivered once the run loop runs)
+    */
+
+   cfsrc = CFStringCreateWithCString(NULL, real_source,
+                                     kCFStringEncodingUTF8);
+   cfpaths = CFArrayCreate(NULL, (const void **) &cfsrc, 1,
+                           &kCFTypeArrayCallBacks);
+
+   stream = FSEventStreamCreate(NULL, callback, NULL, cfpaths,
+                                kFSEventStreamEventIdSinceNow,
+                                (CFTimeInterval) latency,
+                                kFSEventStreamCreateFlagFileEvents |
+                                kFSEventStreamCreateFlagWatchRoot);
+
+   if (!stream) {
+      WARN("xbup_watch: can't watch %s\n", real_source);
+      return -1;
+   }
+
+   FSEventStreamScheduleWithRunLoop(stream, CFRunLoopGetCurrent(),
+                                    kCFRunLoopDefaultMode);
+
+   if (!FSEventStreamStart(stream)) {
+      WARN("xbup_watch: can't watch %s\n", real_source);
+      return -1;
+   }
+
+   walk.tool = "xbup_watch";
+   walk.source_name_len = source_name_len;
+   walk.destination_name = destination_name;
+   walk.manifest = manifestflag;
+   walk.live = 1;
+   walk.set_error = set_error;
+   walk.dir_changed = mark_dirty;
+   split_walk_init(&walk);
+
+   lock_tree();
+   full_rescan();
+   write_ok();
+   unlock_tree();
+
+   timer = CFRunLoopTimerCreate(NULL, CFAbsoluteTimeGetCurrent() + HUP_CHECK,
+                                HUP_CHECK, 0, 0, timer_callback, NULL);
+   CFRunLoopAddTimer(CFRunLoopGetCurrent(), timer, kCFRunLoopDefaultMode);
+
+   CFRunLoopRun();
+
+   unlink(ok_name);
+   return 0;
+}
@@ -0,0 +1,117 @@
+
+/* usage: xmanifest --flatten dir
+ *        xmanifest --diff dir
+ *
+ * compares two repositories of xattr containers whose manifests
+ * have been built with split_xattr --manifest (see manifest.h).
+ *
+ * with --flatten, the manifests of dir are written to stdout
+ * as a sequence of blocks, one per directory:
+ *
+ *    <path>\0<length>\0<manifest>
+ *
+ * where path is relative to dir ("." for dir itself).
+ *
+ * with --diff, such a flattened listing (of the "new" repository)
+ * is read from stdin, and compared against dir (the "old" repository).
+ * The names of the containers and directories that need to be copied
+ * to or deleted from dir, along with the manifests of all directories
+ * that differ, are written to stdout, null terminated, relative to dir;
+ * this list is suitable for rsync -r --from0 --files-from.
+ * Subtrees whose digests agree are skipped without being read.
+ * If dir has no manifest at all, the list is just ".".
+ *
+ * Returns -1 if errors detected, and 0 otherwise.
+ *
+ */
+
+#include "util.h"
+#include "manifest.h"
+
+
+static
+char *read_input(long *len)
+{
+   char *input;
+   long size, n;
+
+   size = 64*1024;
+   n = 0;
+   input = (char *) malloc(size);
+   if (!input) {
+      Warning("malloc error");
+      exit(-1);
+   }
+
+   for (;;) {
+      n += fread(input + n, 1, size - n, stdin);
+      if (n < size) break;
+
+      size *= 2;
+      input = (char *) realloc(input, size);
+      if (!input) {
+         Warning("malloc error");
+         exit(-1);
+      }
+   }
+
+   if (ferror(stdin)) {
+      WARN("xmanifest: error reading stdin\n");
+      free(input);
+      return 0;
+   }
+
+   *len = n;
+   return input;
+}
+
+
+void usage()
+{
+   WARN("usage: xmanifest --flatten dir\n");
+   WARN("       xmanifest --diff dir\n");
+}
+
+
+int main(int argc, char **argv)
+{
+   char *dir_name;
+   struct stat dirstat;
+   char *input;
+   long len;
+   int ret;
+
+   if (argc != 3) {
+      usage();
+      return -1;
+   }
+
+   dir_name = argv[2];
+   strip_slashes(dir_name);
+
+   if (strcmp(argv[1], "--flatten") == 0) {
+      if (lstat(dir_name, &dirstat) || !S_ISDIR(dirstat.st_mode)) {
+         usage();
+         return -1;
+      }
+
+      ret = manifest_flatten(dir_name, stdout);
+   }
+   else if (strcmp(argv[1], "--diff") == 0) {
+      input = read_input(&len);
+      if (!input) return -1;
+
+      ret = manifest_diff(dir_name, input, len, stdout);
+   }
+   else {
+      usage();
+      return -1;
+   }
+
+   if (fflush(stdout) || ferror(stdout)) {
+      WARN("xmanifest: error writing stdout\n");
+      return -1;
+   }
+
+   return ret;
+}
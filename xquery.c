@@ -0,0 +1,1315 @@
+
+/* usage: xquery options [predicates]
+ *    options:  --repo dir
+ *              --stream
+ *              --index file
+ *              --build file
+ *              --jobs n
+ *              --print0
+ *              --count
+ *              --long
+ *              --max-ops n
+ *              --max-meta-ops n
+ *              --max-bytes n
+ *              --throttle-file file
+ *              --nice n
+ *              --low-io
+ *    predicates:  --xattr name
+ *                 --owner name
+ *                 --group name
+ *                 --acl principal
+ *                 --flag name
+ *
+ * answers questions about the metadata held in a backup (which
+ * objects carry com.apple.quarantine, which have an ACE denying
+ * something to some group, which are locked) without going back to
+ * the live tree, and without decoding containers by hand.
+ *
+ * The metadata is read from one of:
+ *
+ *    --repo dir: a repository of xattr containers, like the one
+ *       split_xattr creates;
+ *    --stream: a stream of containers, like the one splitf_xattr
+ *       writes (with or without --merge), read from stdin;
+ *    --index file: an index built earlier by xquery --build.
+ *
+ * with the --build file option, nothing is selected; instead, the
+ * metadata read from the repository or stream is written to the index
+ * file, which can then answer any number of queries without reading
+ * a single container (see the format below).
+ *
+ * the --jobs flag reads the containers of a repository using a pool
+ * of n threads; the objects are then selected (or numbered, with
+ * --build) in no particular order.
+ *
+ * the --max-ops flag limits the walk of a repository to about n
+ * objects per second (see throttle.h), so as to leave some of the
+ * disk to others; --max-meta-ops does the same for the opens of
+ * containers (and the lstat calls), which here come to about one per
+ * object, and --max-bytes for the bytes of containers read.  The
+ * --throttle-file, --nice and --low-io options are as in split_xattr.
+ * A stream or an index is read without limits.
+ *
+ * An object is selected if it satisfies all the predicates given
+ * (so every object is selected if none are):
+ *
+ *    --xattr name: it has the xattr name;
+ *    --owner name, --group name: its container records that owner
+ *       or group (these are only recorded by split_xattr --owner and
+ *       --group, and, if a default name was given there, only when
+ *       they differ from it);
+ *    --acl principal: its ACL has an entry for principal, which is
+ *       user:name or group:name (or user:uuid or group:uuid, for an
+ *       entry whose name is unknown); with a prefix allow: or deny:,
+ *       only entries of that kind count, as in deny:group:staff;
+ *    --flag name: the flag name is set, where name is one of uchg,
+ *       uappnd, nodump and opaque (as in ls -lO).
+ *
+ * The paths of the selected objects are written to stdout, relative
+ * to the root of the backup (which is "."), one per line, or null
+ * terminated with --print0.  With --count, only their number is
+ * written.  With --long, each path is preceded by the permissions,
+ * flags, uid, gid and number of xattrs recorded in its container, in
+ * octal, hex, and decimal (- for those not recorded).
+ *
+ * Returns -1 if errors detected, and 0 otherwise.
+ *
+ */
+
+
+/* index file format:
+ *   - header:
+ *       - magic (8 bytes)
+ *       - number of objects (4 bytes)
+ *       - number of terms (4 bytes)
+ *       - for each section: offset (8 bytes) and length (8 bytes)
+ *   - the sections:
+ *       - for each object, the offset of its path (8 bytes)
+ *       - the paths, null terminated
+ *       - the columns: for each object, one field (in the order of
+ *         the objects) of the fields recorded in its container:
+ *           - which fields were recorded (2 bytes, see HAS_*)
+ *           - perms bits (2 bytes)
+ *           - bsd flags (2 bytes)
+ *           - uid (4 bytes)
+ *           - gid (4 bytes)
+ *           - create time (4 bytes)
+ *           - mod time (4 bytes)
+ *           - number of xattrs (2 bytes)
+ *       - the term dictionary: for each term, in strcmp order,
+ *           - the offset of the term (8 bytes)
+ *           - the position of its list in the postings (8 bytes)
+ *           - the length of its list (4 bytes)
+ *       - the terms, null terminated
+ *       - the postings: for each term, the list of the objects
+ *         that have it (4 bytes each), in increasing order
+ *
+ * A term is a letter naming a kind of predicate, a ':', and the
+ * argument of the predicate: "x:com.apple.quarantine", "o:alice",
+ * "g:staff", "a:group:staff", "a:deny:group:staff", "f:uchg".
+ * Objects are numbered from 0, in the order they were read.
+ *
+ * All numbers in "network byte order" (high-order byte first)
+ */
+
+
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "util.h"
+#include "xattr_util.h"
+#include "dirscan.h"
+#include "manifest.h"
+#include "workq.h"
+#include "uthash.h"
+#include "throttle.h"
+
+
+#define MAXJOBS (256)
+#define TASKS_PER_JOB (16)
+
+#define MAXPREDS (64)
+
+static char magic[8] = { 'x', 'b', 'u', 'p', 'i', 'd', 'x', 1 };
+
+#define HAS_PERMS    (0x01)
+#define HAS_FLAGS    (0x02)
+#define HAS_OWNER    (0x04)
+#define HAS_GROUP    (0x08)
+#define HAS_CRTIME   (0x10)
+#define HAS_MTIME    (0x20)
+
+enum {
+   SEC_PATHOFF, SEC_PATHS,
+   SEC_PRESENT, SEC_PERMS, SEC_FLAGS, SEC_UID, SEC_GID,
+   SEC_CRTIME, SEC_MTIME, SEC_NXATTRS,
+   SEC_DICT, SEC_TERMS, SEC_POSTINGS,
+   NUM_SECTIONS
+};
+
+#define HEADER_LEN (16 + 16*NUM_SECTIONS)
+#define DICT_ENTRY_LEN (20)
+
+static struct {
+   uint32_t flag;
+   char *name;
+} flag_names[] = {
+   { UF_IMMUTABLE, "uchg" },
+   { UF_APPEND, "uappnd" },
+   { UF_NODUMP, "nodump" },
+   { UF_OPAQUE, "opaque" },
+   { 0, 0 }
+};
+
+static int return_value = 0;
+static pthread_mutex_t return_value_lock = PTHREAD_MUTEX_INITIALIZER;
+static long num_jobs = 0;
+static int buildflag = 0;
+static int print0flag = 0;
+static int countflag = 0;
+static int longflag = 0;
+
+static char *preds[MAXPREDS];
+static long num_preds = 0;
+
+static long num_selected = 0;
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int source_name_len = 0;
+
+
+static
+void set_error(void)
+{
+   pthread_mutex_lock(&return_value_lock);
+   return_value = -1;
+   pthread_mutex_unlock(&return_value_lock);
+}
+
+
+/**** growable byte buffers, holding the sections of an index being built */
+
+struct column {
+   char *buf;
+   long len;
+   long size;
+};
+
+static
+void col_append(struct column *c, const void *s, long len)
+{
+   if (c->len + len > c->size) {
+      c->size = (c->size == 0) ? 4096 : 2*c->size;
+      if (c->size < c->len + len) c->size = c->len + len;
+      c->buf = realloc(c->buf, c->size);
+      if (!c->buf) {
+         Warning("malloc error");
+         exit(-1);
+      }
+   }
+
+   memcpy(c->buf + c->len, s, len);
+   c->len += len;
+}
+
+static
+void col_append2(struct column *c, uint32_t x)
+{
+   unsigned char buf[2];
+
+   buf[0] = (x >> 8) & 0xffu;
+   buf[1] = x & 0xffu;
+   col_append(c, buf, 2);
+}
+
+static
+void col_append4(struct column *c, uint32_t x)
+{
+   unsigned char buf[4];
+
+   buf[0] = (x >> 24) & 0xffu;
+   buf[1] = (x >> 16) & 0xffu;
+   buf[2] = (x >> 8) & 0xffu;
+   buf[3] = x & 0xffu;
+   col_append(c, buf, 4);
+}
+
+static
+void col_append8(struct column *c, uint64_t x)
+{
+   col_append4(c, (uint32_t) (x >> 32));
+   col_append4(c, (uint32_t) x);
+}
+
+static inline
+uint32_t get2(const unsigned char *p)
+{
+   return ((uint32_t) p[0] << 8) | p[1];
+}
+
+static inline
+uint32_t get4(const unsigned char *p)
+{
+   return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+          ((uint32_t) p[2] << 8) | p[3];
+}
+
+static inline
+uint64_t get8(const unsigned char *p)
+{
+   return ((uint64_t) get4(p) << 32) | get4(p + 4);
+}
+
+
+/**** the terms of an object */
+
+typedef void (*term_fn)(void *arg, const char *term);
+
+static
+void make_term(term_fn fn, void *arg, char kind, const char *s1,
+               const char *s2, const char *s3)
+{
+   char term[MAXLEN];
+
+   if (snprintf(term, MAXLEN, "%c:%s%s%s", kind, s1, s2 ? s2 : "",
+                s3 ? s3 : "") >= MAXLEN) overflow();
+
+   fn(arg, term);
+}
+
+/* acl_terms calls fn for the principal of each entry in acltext (see
+ * xbup_acl_to_text), both with and without the kind of the entry.
+ * An entry is <user|group>:<uuid>:<name>:<id>:<allow|deny>[,<flags>]...
+ */
+
+static
+void acl_terms(const char *acltext, term_fn fn, void *arg)
+{
+   char line[MAXLEN];
+   char principal[MAXLEN];
+   char *field[5];
+   const char *p, *q;
+   char *s;
+   long len;
+   int k;
+
+   for (p = acltext; p && *p; p = q) {
+      q = strchr(p, '\n');
+      len = q ? q - p : strlen(p);
+      if (q) q++;
+
+      if (len == 0 || *p == '!' || len >= MAXLEN) continue;
+
+      memcpy(line, p, len);
+      line[len] = '\0';
+
+      s = line;
+      for (k = 0; k < 5; k++) {
+         field[k] = s;
+         s = strchr(s, ':');
+         if (!s) break;
+         *s++ = '\0';
+      }
+
+      if (k < 4) continue;
+
+      s = strchr(field[4], ',');
+      if (s) *s = '\0';
+
+      if (snprintf(principal, MAXLEN, "%s:%s", field[0],
+                   field[2][0] ? field[2] : field[1]) >= MAXLEN) overflow();
+
+      make_term(fn, arg, 'a', principal, 0, 0);
+      make_term(fn, arg, 'a', field[4], ":", principal);
+   }
+}
+
+static
+void object_terms(const xattr_info_t *info, term_fn fn, void *arg)
+{
+   const char *name;
+   long i;
+
+   name = info->names;
+   for (i = 0; i < info->numxattrs; i++) {
+      make_term(fn, arg, 'x', name, 0, 0);
+      name += strlen(name) + 1;
+   }
+
+   if (info->has_owner) make_term(fn, arg, 'o', info->owner, 0, 0);
+   if (info->has_group) make_term(fn, arg, 'g', info->group, 0, 0);
+
+   if (info->has_flags) {
+      for (i = 0; flag_names[i].name; i++)
+         if (info->flags & flag_names[i].flag)
+            make_term(fn, arg, 'f', flag_names[i].name, 0, 0);
+   }
+
+   if (info->acltext) acl_terms(info->acltext, fn, arg);
+}
+
+
+/**** selecting objects as they are read */
+
+static
+void match_term(void *arg, const char *term)
+{
+   char *matched = (char *) arg;
+   long i;
+
+   for (i = 0; i < num_preds; i++)
+      if (strcmp(preds[i], term) == 0) matched[i] = 1;
+}
+
+static
+void format_long(char *buf, long len, uint32_t present, uint32_t perms,
+                 uint32_t flags, uint32_t uid, uint32_t gid, uint32_t nxattrs)
+{
+   char pbuf[16], fbuf[16], ubuf[16], gbuf[16];
+
+   strcpy(pbuf, "-");
+   strcpy(fbuf, "-");
+   strcpy(ubuf, "-");
+   strcpy(gbuf, "-");
+
+   if (present & HAS_PERMS) snprintf(pbuf, 16, "%04o", (unsigned) perms);
+   if (present & HAS_FLAGS) snprintf(fbuf, 16, "%#x", (unsigned) flags);
+   if (present & HAS_OWNER) snprintf(ubuf, 16, "%lu", (unsigned long) uid);
+   if (present & HAS_GROUP) snprintf(gbuf, 16, "%lu", (unsigned long) gid);
+
+   snprintf(buf, len, "%s %s %s %s %lu ", pbuf, fbuf, ubuf, gbuf,
+            (unsigned long) nxattrs);
+}
+
+static
+uint32_t info_present(const xattr_info_t *info)
+{
+   return (info->has_perms ? HAS_PERMS : 0) |
+          (info->has_flags ? HAS_FLAGS : 0) |
+          (info->has_owner ? HAS_OWNER : 0) |
+          (info->has_group ? HAS_GROUP : 0) |
+          (info->has_crtime ? HAS_CRTIME : 0) |
+          (info->has_mtime ? HAS_MTIME : 0);
+}
+
+/* output is called with output_lock held */
+
+static
+void output(const char *path, const char *prefix)
+{
+   num_selected++;
+
+   if (countflag) return;
+
+   if (prefix) fputs(prefix, stdout);
+   fputs(path, stdout);
+   putchar(print0flag ? '\0' : '\n');
+}
+
+static
+void select_object(const char *path, const xattr_info_t *info)
+{
+   char matched[MAXPREDS];
+   char prefix[128];
+   long i;
+
+   memset(matched, 0, MAXPREDS);
+   object_terms(info, match_term, matched);
+
+   for (i = 0; i < num_preds; i++)
+      if (!matched[i]) return;
+
+   if (longflag)
+      format_long(prefix, sizeof(prefix), info_present(info), info->perms,
+                  info->flags, info->uid, info->gid, info->numxattrs);
+
+   pthread_mutex_lock(&output_lock);
+   output(path, longflag ? prefix : 0);
+   pthread_mutex_unlock(&output_lock);
+}
+
+
+/**** building an index, as objects are read */
+
+struct term_table_entry {
+   char *key;
+   struct column postings;
+   long count;
+   long last;
+   UT_hash_handle hh;
+};
+
+static
+struct term_table_entry *term_table = NULL;
+
+static long num_objects = 0;
+static struct column sections[NUM_SECTIONS];
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static
+void add_posting(void *arg, const char *term)
+{
+   struct term_table_entry *ptr;
+   long id = *(long *) arg;
+
+   HASH_FIND(hh, term_table, term, strlen(term), ptr);
+
+   if (!ptr) {
+      ptr = malloc(sizeof(struct term_table_entry));
+      if (!ptr) {
+         Warning("malloc error");
+         exit(-1);
+      }
+
+      memset(ptr, 0, sizeof(struct term_table_entry));
+      ptr->key = strdup(term);
+      if (!ptr->key) {
+         Warning("malloc error");
+         exit(-1);
+      }
+      ptr->last = -1;
+      HASH_ADD_KEYPTR(hh, term_table, ptr->key, strlen(ptr->key), ptr);
+   }
+
+   /* an object may have the same term twice (two ACEs for one user) */
+
+   if (ptr->last == id) return;
+
+   col_append4(&ptr->postings, id);
+   ptr->count++;
+   ptr->last = id;
+}
+
+static
+void index_object(const char *path, const xattr_info_t *info)
+{
+   long id;
+
+   pthread_mutex_lock(&index_lock);
+
+   id = num_objects++;
+
+   if (num_objects > 0xffffffffL) {
+      WARN("xquery: too many objects for an index\n");
+      exit(-1);
+   }
+
+   col_append8(&sections[SEC_PATHOFF], sections[SEC_PATHS].len);
+   col_append(&sections[SEC_PATHS], path, strlen(path) + 1);
+
+   col_append2(&sections[SEC_PRESENT], info_present(info));
+   col_append2(&sections[SEC_PERMS], info->has_perms ? info->perms : 0);
+   col_append2(&sections[SEC_FLAGS], info->has_flags ? info->flags : 0);
+   col_append4(&sections[SEC_UID], info->has_owner ? info->uid : 0);
+   col_append4(&sections[SEC_GID], info->has_group ? info->gid : 0);
+   col_append4(&sections[SEC_CRTIME], info->has_crtime ? info->crtime : 0);
+   col_append4(&sections[SEC_MTIME], info->has_mtime ? info->mtime : 0);
+   col_append2(&sections[SEC_NXATTRS], info->numxattrs);
+
+   object_terms(info, add_posting, &id);
+
+   pthread_mutex_unlock(&index_lock);
+}
+
+static
+int cmp_terms(struct term_table_entry *a, struct term_table_entry *b)
+{
+   return strcmp(a->key, b->key);
+}
+
+static
+int write_index(const char *fname)
+{
+   struct term_table_entry *ptr;
+   struct column header;
+   uint64_t offset, pos;
+   long k;
+   FILE *fp;
+   int ret;
+
+   HASH_SORT(term_table, cmp_terms);
+
+   pos = 0;
+   for (ptr = term_table; ptr; ptr = ptr->hh.next) {
+      col_append8(&sections[SEC_DICT], sections[SEC_TERMS].len);
+      col_append8(&sections[SEC_DICT], pos);
+      col_append4(&sections[SEC_DICT], ptr->count);
+      col_append(&sections[SEC_TERMS], ptr->key, strlen(ptr->key) + 1);
+      pos += ptr->count;
+   }
+
+   memset(&header, 0, sizeof(header));
+   col_append(&header, magic, 8);
+   col_append4(&header, num_objects);
+   col_append4(&header, HASH_COUNT(term_table));
+
+   offset = HEADER_LEN;
+   for (k = 0; k < SEC_POSTINGS; k++) {
+      col_append8(&header, offset);
+      col_append8(&header, sections[k].len);
+      offset += sections[k].len;
+   }
+
+   col_append8(&header, offset);
+   col_append8(&header, pos*4);
+
+   fp = fopen(fname, "w");
+   if (!fp) {
+      WARN("xquery: failed to create %s\n", fname);
+      return -1;
+   }
+
+   ret = 0;
+
+   if (fwrite(header.buf, 1, header.len, fp) != header.len) ret = -1;
+
+   for (k = 0; k < SEC_POSTINGS && !ret; k++) {
+      if (sections[k].len > 0 &&
+          fwrite(sections[k].buf, 1, sections[k].len, fp) != sections[k].len)
+         ret = -1;
+   }
+
+   for (ptr = term_table; ptr; ptr = ptr->hh.next) {
+      if (ret) break;
+      if (fwrite(ptr->postings.buf, 1, ptr->postings.len, fp) !=
+          ptr->postings.len) ret = -1;
+   }
+
+   if (fclose(fp)) ret = -1;
+
+   if (ret) {
+      WARN("xquery: error writing %s\n", fname);
+      unlink(fname);
+   }
+
+   return ret;
+}
+
+
+/**** reading containers */
+
+static __thread xattr_info_t info;
+
+static
+void process_container(const char *path, FILE *cfp, const char *cname)
+{
+   if (read_xattr_info(cfp, &info)) {
+      WARN("xquery: corrupt container %s\n", cname);
+      set_error();
+      return;
+   }
+
+   if (buildflag)
+      index_object(path, &info);
+   else
+      select_object(path, &info);
+}
+
+struct task {
+   char path[MAXLEN];
+   char cname[MAXLEN];
+};
+
+static
+void run_task(void *arg)
+{
+   struct task *tp = (struct task *) arg;
+   FILE *cfp;
+
+   cfp = fopen(tp->cname, "r");
+   if (!cfp) {
+      WARN("xquery: failed to open %s\n", tp->cname);
+      set_error();
+   }
+   else {
+      process_container(tp->path, cfp, tp->cname);
+      throttle(THROTTLE_BYTES, ftell(cfp));
+      fclose(cfp);
+   }
+
+   free(tp);
+}
+
+/* container_path turns the path (relative to the repository) of a
+ * container into that of its object, or returns -1 if it is not the
+ * name of a container: a/b.__@ is the container of a/b, and a/..__@
+ * that of the directory a.
+ */
+
+static
+int container_path(const char *rel, char *path)
+{
+   long len = strlen(rel);
+
+   if (!is_suffix(DBL_SUFFIX, DBL_SUFFIX_LEN, rel, len) ||
+       len == DBL_SUFFIX_LEN) return -1;
+
+   len -= DBL_SUFFIX_LEN;
+
+   if (len == 1 && rel[0] == '.') {
+      strcpy(path, ".");
+   }
+   else if (len >= 2 && strncmp(rel + len - 2, "/.", 2) == 0) {
+      memcpy(path, rel, len - 2);
+      path[len - 2] = '\0';
+   }
+   else {
+      memcpy(path, rel, len);
+      path[len] = '\0';
+   }
+
+   return 0;
+}
+
+static
+void repo_walk(const char *dirname)
+{
+   char itemname[MAXLEN];
+   dirscan_t *dirlist;
+   struct dirscan_item *diritem;
+   struct stat itemstat;
+   struct task *tp;
+   int isdir;
+
+   dirlist = dirscan_open(dirname, 1);
+
+   if (!dirlist) {
+      WARN("xquery: opendir failed on %s\n", dirname);
+      set_error();
+      return;
+   }
+
+   while ( (diritem = dirscan_next(dirlist)) ) {
+
+      throttle(THROTTLE_OBJECTS, 1);
+      throttle(THROTTLE_OPS, 1);
+
+      if (snprintf(itemname, MAXLEN, "%s/%s",
+                   dirname, diritem->d_name) >= MAXLEN) overflow();
+
+      if (diritem->d_type == DT_DIR)
+         isdir = 1;
+      else if (diritem->d_type != DT_UNKNOWN)
+         isdir = 0;
+      else if (lstat(itemname, &itemstat) == 0)
+         isdir = S_ISDIR(itemstat.st_mode);
+      else
+         isdir = 0;
+
+      if (isdir) {
+         repo_walk(itemname);
+         continue;
+      }
+
+      if (strcmp(diritem->d_name, MANIFEST_NAME) == 0) continue;
+
+      tp = (struct task *) malloc(sizeof(struct task));
+      if (!tp) {
+         Warning("malloc error");
+         exit(-1);
+      }
+
+      if (container_path(itemname + source_name_len + 1, tp->path)) {
+         free(tp);
+         continue;
+      }
+
+      if (snprintf(tp->cname, MAXLEN, "%s", itemname) >= MAXLEN) overflow();
+
+      if (num_jobs > 0)
+         workq_submit(run_task, tp);
+      else
+         run_task(tp);
+   }
+
+   if (dirscan_close(dirlist)) {
+      WARN("xquery: readdir failed on %s\n", dirname);
+      set_error();
+   }
+}
+
+/* read_path reads the null-terminated path of the next entry of a
+ * stream.  Returns 1 if a path was read, 0 at end of file, and -1
+ * on error.
+ */
+
+static
+int read_path(char *path)
+{
+   int c, k;
+
+   c = getchar();
+   if (c == EOF) return 0;
+
+   k = 0;
+   for (;;) {
+      if (c == EOF) return -1;
+      if (k >= MAXLEN) return -1;
+      path[k] = c;
+      k++;
+      if (c == 0) return 1;
+      c = getchar();
+   }
+}
+
+/* stream paths are "" or /a/b, and, in a --merge stream, /. or /a/.
+ * for directories, with a final "." on its own
+ */
+
+static
+void read_stream(void)
+{
+   char mbuf[8];
+   char spath[MAXLEN];
+   char path[MAXLEN];
+   long len;
+   int ret;
+
+   if (fread(mbuf, 1, 8, stdin) != 8 ||
+       memcmp(mbuf, "\xb7\x0e\xbf\xb2\xc2\x91\xf2\x92", 8)) {
+      WARN("xquery: bad stream header\n");
+      set_error();
+      return;
+   }
+
+   while ( (ret = read_path(spath)) == 1 ) {
+      if (strcmp(spath, ".") == 0) break;
+
+      len = strlen(spath);
+      if (len >= 2 && strcmp(spath + len - 2, "/.") == 0)
+         spath[len - 2] = '\0';
+
+      if (spath[0] == '\0')
+         strcpy(path, ".");
+      else
+         strcpy(path, spath + 1);
+
+      process_container(path, stdin, path);
+      if (return_value) return;
+   }
+
+   if (ret < 0) {
+      WARN("xquery: bad stream\n");
+      set_error();
+   }
+}
+
+
+/**** answering queries from an index */
+
+static const unsigned char *index_base;
+static long index_len;
+
+/* the length of the field of each object in the sections that have one
+ * per object (0 for the others)
+ */
+
+static const int field_len[NUM_SECTIONS] = {
+   8, 0,
+   2, 2, 2, 4, 4,
+   4, 4, 2,
+   0, 0, 0
+};
+
+static
+const unsigned char *section(long k, uint64_t *len)
+{
+   const unsigned char *p = index_base + 16 + 16*k;
+
+   *len = get8(p + 8);
+   return index_base + get8(p);
+}
+
+static
+int map_index(const char *fname)
+{
+   struct stat st;
+   uint64_t off, len, nobjects;
+   void *p;
+   long k;
+   int fd;
+
+   fd = open(fname, O_RDONLY);
+   if (fd < 0 || fstat(fd, &st)) {
+      WARN("xquery: failed to open %s\n", fname);
+      if (fd >= 0) close(fd);
+      return -1;
+   }
+
+   if (st.st_size < HEADER_LEN) {
+      close(fd);
+      goto bad;
+   }
+
+   p = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+
+   if (p == MAP_FAILED) {
+      WARN("xquery: failed to map %s\n", fname);
+      return -1;
+   }
+
+   index_base = p;
+   index_len = st.st_size;
+
+   if (memcmp(index_base, magic, 8)) goto bad;
+
+   nobjects = get4(index_base + 8);
+
+   for (k = 0; k < NUM_SECTIONS; k++) {
+      off = get8(index_base + 16 + 16*k);
+      len = get8(index_base + 16 + 16*k + 8);
+      if (off > index_len || len > index_len - off) goto bad;
+
+      /* output_object reads the fields of any object by its number */
+
+      if (field_len[k] && len != nobjects * field_len[k]) goto bad;
+   }
+
+   return 0;
+
+bad:
+   WARN("xquery: %s is not an index\n", fname);
+   return -1;
+}
+
+/* find_term returns the postings of term, and their number in *count */
+
+static
+const unsigned char *find_term(const char *term, long *count)
+{
+   const unsigned char *dict, *terms, *postings, *e;
+   uint64_t dict_len, terms_len, postings_len;
+   long lo, hi, mid;
+   uint64_t off;
+   int c;
+
+   dict = section(SEC_DICT, &dict_len);
+   terms = section(SEC_TERMS, &terms_len);
+   postings = section(SEC_POSTINGS, &postings_len);
+
+   lo = 0;
+   hi = dict_len / DICT_ENTRY_LEN;
+
+   while (lo < hi) {
+      mid = lo + (hi - lo)/2;
+      e = dict + mid*DICT_ENTRY_LEN;
+
+      off = get8(e);
+      if (off >= terms_len) break;
+
+      c = strncmp(term, (const char *) terms + off, terms_len - off);
+      if (c == 0) {
+         *count = get4(e + 16);
+         off = get8(e + 8);
+         if (off*4 > postings_len || *count > (postings_len - off*4)/4)
+            break;
+         return postings + off*4;
+      }
+
+      if (c < 0)
+         hi = mid;
+      else
+         lo = mid + 1;
+   }
+
+   *count = 0;
+   return 0;
+}
+
+static
+int in_list(const unsigned char *list, long count, uint32_t id)
+{
+   long lo, hi, mid;
+   uint32_t x;
+
+   lo = 0;
+   hi = count;
+
+   while (lo < hi) {
+      mid = lo + (hi - lo)/2;
+      x = get4(list + 4*mid);
+      if (x == id) return 1;
+      if (x < id)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+
+   return 0;
+}
+
+static
+void output_object(uint32_t id)
+{
+   const unsigned char *pathoff, *paths;
+   uint64_t pathoff_len, paths_len, off;
+   char prefix[128];
+   const char *path;
+
+   pathoff = section(SEC_PATHOFF, &pathoff_len);
+   paths = section(SEC_PATHS, &paths_len);
+
+   if ((uint64_t) id*8 + 8 > pathoff_len) return;
+
+   off = get8(pathoff + id*8);
+   if (off >= paths_len || !memchr(paths + off, '\0', paths_len - off))
+      return;
+
+   path = (const char *) paths + off;
+
+   if (longflag) {
+      uint64_t len;
+
+      format_long(prefix, sizeof(prefix),
+                  get2(section(SEC_PRESENT, &len) + id*2),
+                  get2(section(SEC_PERMS, &len) + id*2),
+                  get2(section(SEC_FLAGS, &len) + id*2),
+                  get4(section(SEC_UID, &len) + id*4),
+                  get4(section(SEC_GID, &len) + id*4),
+                  get2(section(SEC_NXATTRS, &len) + id*2));
+   }
+
+   output(path, longflag ? prefix : 0);
+}
+
+static
+void query_index(void)
+{
+   const unsigned char *lists[MAXPREDS];
+   long counts[MAXPREDS];
+   const unsigned char *list;
+   uint32_t id, nobjects;
+   long i, j, best;
+
+   nobjects = get4(index_base + 8);
+
+   if (num_preds == 0) {
+      for (id = 0; id < nobjects; id++) output_object(id);
+      return;
+   }
+
+   best = 0;
+   for (i = 0; i < num_preds; i++) {
+      lists[i] = find_term(preds[i], &counts[i]);
+      if (counts[i] == 0) return;
+      if (counts[i] < counts[best]) best = i;
+   }
+
+   /* the shortest list drives; the others are probed */
+
+   list = lists[best];
+   for (j = 0; j < counts[best]; j++) {
+      id = get4(list + 4*j);
+
+      for (i = 0; i < num_preds; i++)
+         if (i != best && !in_list(lists[i], counts[i], id)) break;
+
+      if (i == num_preds && id < nobjects) output_object(id);
+   }
+}
+
+
+void usage()
+{
+   WARN("usage: xquery options [predicates]\n");
+   WARN("  options:  --repo dir\n");
+   WARN("            --stream\n");
+   WARN("            --index file\n");
+   WARN("            --build file\n");
+   WARN("            --jobs n\n");
+   WARN("            --print0\n");
+   WARN("            --count\n");
+   WARN("            --long\n");
+   WARN("            --max-ops n\n");
+   WARN("            --max-meta-ops n\n");
+   WARN("            --max-bytes n\n");
+   WARN("            --throttle-file file\n");
+   WARN("            --nice n\n");
+   WARN("            --low-io\n");
+   WARN("  predicates:  --xattr name\n");
+   WARN("               --owner name\n");
+   WARN("               --group name\n");
+   WARN("               --acl [allow:|deny:]user:name (or group:name)\n");
+   WARN("               --flag uchg|uappnd|nodump|opaque\n");
+}
+
+
+static
+int add_pred(char kind, const char *arg)
+{
+   char term[MAXLEN];
+   long k;
+
+   if (num_preds >= MAXPREDS) {
+      WARN("xquery: too many predicates\n");
+      return -1;
+   }
+
+   if (kind == 'f') {
+      for (k = 0; flag_names[k].name; k++)
+         if (strcmp(arg, flag_names[k].name) == 0) break;
+
+      if (!flag_names[k].name) {
+         WARN("xquery: unknown flag %s\n", arg);
+         return -1;
+      }
+   }
+
+   if (snprintf(term, MAXLEN, "%c:%s", kind, arg) >= MAXLEN) overflow();
+
+   preds[num_preds] = strdup(term);
+   if (!preds[num_preds]) {
+      Warning("malloc error");
+      exit(-1);
+   }
+
+   num_preds++;
+
+   return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+   char *repo_name = 0;
+   char *index_name = 0;
+   char *build_name = 0;
+   int streamflag = 0;
+   struct stat srcstat;
+   int srcname_len;
+   char kind;
+   long max_ops, max_meta_ops, max_bytes;
+   char *tname;
+   long nice_incr;
+   int lowioflag;
+
+   int i;
+
+   max_ops = 0;
+   max_meta_ops = 0;
+   max_bytes = 0;
+   tname = 0;
+   nice_incr = 0;
+   lowioflag = 0;
+
+   i = 1;
+   while (i < argc) {
+      kind = 0;
+
+      if (strcmp(argv[i], "--repo") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         repo_name = argv[i];
+         i++;
+      }
+      else if (strcmp(argv[i], "--stream") == 0) {
+         streamflag = 1;
+         i++;
+      }
+      else if (strcmp(argv[i], "--index") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         index_name = argv[i];
+         i++;
+      }
+      else if (strcmp(argv[i], "--build") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         build_name = argv[i];
+         buildflag = 1;
+         i++;
+      }
+      else if (strcmp(argv[i], "--jobs") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         num_jobs = string_to_long(argv[i]);
+         if (conversion_error || num_jobs < 1 || num_jobs > MAXJOBS) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--print0") == 0) {
+         print0flag = 1;
+         i++;
+      }
+      else if (strcmp(argv[i], "--count") == 0) {
+         countflag = 1;
+         i++;
+      }
+      else if (strcmp(argv[i], "--long") == 0) {
+         longflag = 1;
+         i++;
+      }
+      else if (strcmp(argv[i], "--max-ops") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         max_ops = string_to_long(argv[i]);
+         if (conversion_error || max_ops < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--max-meta-ops") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         max_meta_ops = string_to_long(argv[i]);
+         if (conversion_error || max_meta_ops < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--max-bytes") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         max_bytes = string_to_long(argv[i]);
+         if (conversion_error || max_bytes < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--throttle-file") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         tname = argv[i];
+         i++;
+      }
+      else if (strcmp(argv[i], "--nice") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         nice_incr = string_to_long(argv[i]);
+         if (conversion_error || nice_incr < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--low-io") == 0) {
+         i++;
+         lowioflag = 1;
+      }
+      else if (strcmp(argv[i], "--xattr") == 0)
+         kind = 'x';
+      else if (strcmp(argv[i], "--owner") == 0)
+         kind = 'o';
+      else if (strcmp(argv[i], "--group") == 0)
+         kind = 'g';
+      else if (strcmp(argv[i], "--acl") == 0)
+         kind = 'a';
+      else if (strcmp(argv[i], "--flag") == 0)
+         kind = 'f';
+      else {
+         usage();
+         return -1;
+      }
+
+      if (kind) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         if (add_pred(kind, argv[i])) return -1;
+         i++;
+      }
+   }
+
+   if ((repo_name != 0) + (streamflag != 0) + (index_name != 0) != 1 ||
+       (buildflag && (index_name || num_preds > 0 || countflag ||
+                      longflag || print0flag))) {
+      usage();
+      return -1;
+   }
+
+   if (index_name) {
+      if (map_index(index_name)) return -1;
+      query_index();
+   }
+   else if (streamflag) {
+      read_stream();
+   }
+   else {
+      srcname_len = strip_slashes(repo_name);
+      if (srcname_len == 0) {
+         WARN("xquery: bad repository name\n");
+         return -1;
+      }
+
+      if (lstat(repo_name, &srcstat) || !S_ISDIR(srcstat.st_mode)) {
+         WARN("xquery: %s is not a directory\n", repo_name);
+         return -1;
+      }
+
+      source_name_len = srcname_len;
+
+      throttle_init(THROTTLE_OBJECTS, max_ops);
+      throttle_init(THROTTLE_OPS, max_meta_ops);
+      throttle_init(THROTTLE_BYTES, max_bytes);
+
+      if (tname && throttle_control(tname)) {
+         WARN("xquery: bad throttle file %s\n", tname);
+         return -1;
+      }
+
+      if (throttle_priority(nice_incr, lowioflag))
+         WARN("xquery: could not lower priority\n");
+
+      if (num_jobs > 0 && workq_start(num_jobs, TASKS_PER_JOB*num_jobs)) {
+         WARN("xquery: no worker threads -- reading synchronously\n");
+         num_jobs = 0;
+      }
+
+      repo_walk(repo_name);
+
+      workq_stop();
+   }
+
+   if (buildflag) {
+      if (return_value) {
+         WARN("xquery: errors detected -- no index written\n");
+         return -1;
+      }
+
+      if (write_index(build_name)) return -1;
+   }
+
+   if (countflag) printf("%ld\n", num_selected);
+
+   if (fflush(stdout)) {
+      WARN("xquery: error writing output\n");
+      return -1;
+   }
+
+   return return_value;
+}
@@ -0,0 +1,694 @@
+
+/* usage: xsum options dir
+ *    options:  --cache file
+ *              --keep
+ *              --compare file
+ *              --jobs n
+ *              --max-ops n
+ *              --max-meta-ops n
+ *              --max-bytes n
+ *              --throttle-file file
+ *              --nice n
+ *              --low-io
+ *              --progress file
+ *
+ * computes a content hash (XXH64) of every regular file in dir,
+ * and writes the list of hashes to stdout, one record per file:
+ *
+ *    <16 hex digits> <path>\0
+ *
+ * where path is relative to dir.
+ *
+ * with the --cache file option, hashes are remembered in file,
+ * keyed by (dev, inode), and are reused as long as the size,
+ * mtime, and ctime of the file are unchanged, so only files that
+ * changed since the last run are actually read.  Files modified too
+ * close to the time of the run are not cached.  The cache is
+ * rewritten on every run, and (unless the --keep flag is given)
+ * only keeps entries for the files seen in this run;  use --keep
+ * when dir is only part of the tree the cache is used for.
+ *
+ * with the --compare file option, the list of hashes in file
+ * (written by xsum on some other copy of dir; "-" means stdin)
+ * is compared against dir, and instead of the list of hashes,
+ * the paths of all files that differ, or are missing from dir,
+ * are written to stdout, null terminated.  This list is suitable
+ * for rsync -I --from0 --files-from.
+ *
+ * the --jobs flag hashes files using a pool of n threads.
+ *
+ * the --max-ops flag limits the walk to about n objects per second
+ * (see throttle.h), so as to leave some of the disk to others;
+ * the --max-meta-ops flag limits the lstat calls (one per object),
+ * and the --max-bytes flag the bytes of data read to hash files
+ * (cached hashes cost nothing), to about n per second.  The
+ * --throttle-file, --nice and --low-io options are as in split_xattr.
+ *
+ * with the --progress file option, the objects walked, the files
+ * hashed (those whose hash was cached are not counted), the rate
+ * and an estimate of the time left are written to file every few
+ * seconds (see progress.h).
+ *
+ * Returns -1 if errors detected, and 0 otherwise.
+ *
+ */
+
+#include <pthread.h>
+#include <time.h>
+
+#include "util.h"
+#include "uthash.h"
+#include "digest.h"
+#include "dirscan.h"
+#include "throttle.h"
+#include "progress.h"
+#include "workq.h"
+
+
+#define MAXJOBS (256)
+#define TASKS_PER_JOB (16)
+
+static int return_value = 0;
+static pthread_mutex_t return_value_lock = PTHREAD_MUTEX_INITIALIZER;
+static long num_jobs = 0;
+static int source_name_len = 0;
+static int keepflag = 0;
+static int compareflag = 0;
+static time_t start_time = 0;
+
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static
+void set_error(void)
+{
+   pthread_mutex_lock(&return_value_lock);
+   return_value = -1;
+   pthread_mutex_unlock(&return_value_lock);
+}
+
+
+
+/* the cache: a table, keyed by (dev, inode), loaded at startup
+ * and only read during the walk; entries for the new cache are
+ * appended to new_cache_fp as they are found.
+ */
+
+static const char cache_magic[8] =
+   { 'x', 'b', 's', 'u', 'm', '0', '1', '\n' };
+
+struct cache_key {
+   uint64_t dev;
+   uint64_t ino;
+};
+
+struct cache_rec {
+   struct cache_key key;
+   uint64_t size;
+   int64_t mtime;
+   int64_t ctime;
+   uint64_t hash;
+};
+
+struct cache_table_entry {
+   struct cache_rec rec;
+   int used;
+   UT_hash_handle hh;
+};
+
+static
+struct cache_table_entry *cache_table = NULL;
+
+static FILE *new_cache_fp = 0;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static
+void load_cache(const char *cname)
+{
+   FILE *fp;
+   char magic[sizeof(cache_magic)];
+   struct cache_rec rec;
+   struct cache_table_entry *ptr;
+
+   fp = fopen(cname, "r");
+   if (!fp) return;
+
+   if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic) ||
+       memcmp(magic, cache_magic, sizeof(magic)) != 0) {
+      WARN("xsum: ignoring bad cache %s\n", cname);
+      fclose(fp);
+      return;
+   }
+
+   while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+      HASH_FIND(hh, cache_table, &rec.key, sizeof(struct cache_key), ptr);
+      if (ptr) continue;
+
+      ptr = malloc(sizeof(struct cache_table_entry));
+      if (!ptr) {
+         Warning("malloc error");
+         exit(-1);
+      }
+
+      ptr->rec = rec;
+      ptr->used = 0;
+      HASH_ADD(hh, cache_table, rec.key, sizeof(struct cache_key), ptr);
+   }
+
+   fclose(fp);
+}
+
+
+static
+void save_cache_rec(const struct cache_rec *rec)
+{
+   if (!new_cache_fp) return;
+
+   fwrite(rec, sizeof(*rec), 1, new_cache_fp);
+}
+
+
+static
+int get_hash(const char *itemname, const struct stat *itemstat,
+             uint64_t *hash)
+{
+   struct cache_rec rec;
+   struct cache_table_entry *ptr;
+
+   memset(&rec, 0, sizeof(rec));
+   rec.key.dev = itemstat->st_dev;
+   rec.key.ino = itemstat->st_ino;
+   rec.size = itemstat->st_size;
+   rec.mtime = itemstat->st_mtime;
+   rec.ctime = itemstat->st_ctime;
+
+   HASH_FIND(hh, cache_table, &rec.key, sizeof(struct cache_key), ptr);
+
+   if (ptr && ptr->rec.size == rec.size && ptr->rec.mtime == rec.mtime &&
+       ptr->rec.ctime == rec.ctime) {
+
+      *hash = ptr->rec.hash;
+
+      pthread_mutex_lock(&cache_lock);
+      if (!ptr->used) save_cache_rec(&ptr->rec);
+      ptr->used = 1;
+      pthread_mutex_unlock(&cache_lock);
+
+      return 0;
+   }
+
+   throttle(THROTTLE_BYTES, itemstat->st_size);
+
+   if (xxh64_file(itemname, hash)) return -1;
+
+   progress_item(itemstat->st_size);
+
+   rec.hash = *hash;
+
+   if (rec.mtime < start_time - 1 && rec.ctime < start_time - 1) {
+      pthread_mutex_lock(&cache_lock);
+      if (ptr) ptr->used = 1;
+      save_cache_rec(&rec);
+      pthread_mutex_unlock(&cache_lock);
+   }
+
+   return 0;
+}
+
+
+
+/* the list to compare against, keyed by path */
+
+struct list_table_entry {
+   char *key;
+   uint64_t hash;
+   int seen;
+   UT_hash_handle hh;
+};
+
+static
+struct list_table_entry *list_table = NULL;
+
+
+static
+int load_list(const char *lname)
+{
+   FILE *fp;
+   char s[MAXLEN + 20];
+   struct list_table_entry *ptr;
+   char *end;
+   int c;
+   long i;
+
+   if (strcmp(lname, "-") == 0)
+      fp = stdin;
+   else
+      fp = fopen(lname, "r");
+
+   if (!fp) {
+      WARN("xsum: can't open %s\n", lname);
+      return -1;
+   }
+
+   for (;;) {
+      i = 0;
+      while ( (c = getc(fp)) != EOF && c != '\0' ) {
+         if (i == MAXLEN + 19) overflow();
+         s[i++] = c;
+      }
+
+      if (c == EOF) break;
+      s[i] = '\0';
+
+      if (i < 2*XXH64_LEN + 2 || s[2*XXH64_LEN] != ' ') {
+         WARN("xsum: bad record in %s\n", lname);
+         return -1;
+      }
+
+      s[2*XXH64_LEN] = '\0';
+
+      ptr = malloc(sizeof(struct list_table_entry));
+      if (!ptr) {
+         Warning("malloc error");
+         exit(-1);
+      }
+
+      ptr->key = strdup(s + 2*XXH64_LEN + 1);
+      if (!ptr->key) {
+         Warning("malloc error");
+         exit(-1);
+      }
+
+      ptr->hash = strtoull(s, &end, 16);
+      if (*end != '\0') {
+         WARN("xsum: bad record in %s\n", lname);
+         return -1;
+      }
+
+      ptr->seen = 0;
+      HASH_ADD_KEYPTR(hh, list_table, ptr->key, strlen(ptr->key), ptr);
+   }
+
+   if (ferror(fp) || i != 0) {
+      WARN("xsum: error reading %s\n", lname);
+      return -1;
+   }
+
+   if (fp != stdin) fclose(fp);
+
+   return 0;
+}
+
+
+static
+void emit_path(const char *path)
+{
+   pthread_mutex_lock(&output_lock);
+   printf("%s", path);
+   putchar('\0');
+   pthread_mutex_unlock(&output_lock);
+}
+
+
+void process_file(const char *itemname, const struct stat *itemstat)
+{
+   const char *path = itemname + source_name_len + 1;
+   struct list_table_entry *ptr;
+   uint64_t hash;
+   int ret;
+
+   ret = get_hash(itemname, itemstat, &hash);
+
+   if (ret) {
+      WARN("xsum: error reading %s\n", itemname);
+      set_error();
+   }
+
+   if (compareflag) {
+      HASH_FIND(hh, list_table, path, strlen(path), ptr);
+      if (!ptr) return;
+
+      ptr->seen = 1;
+      if (ret || ptr->hash != hash) emit_path(path);
+   }
+   else if (!ret) {
+      pthread_mutex_lock(&output_lock);
+      printf("%016llx %s", (unsigned long long) hash, path);
+      putchar('\0');
+      pthread_mutex_unlock(&output_lock);
+   }
+}
+
+
+/* with --jobs, each file is handed to the work queue as a task */
+
+struct task {
+   int need_stat;
+   struct stat itemstat;
+   char itemname[MAXLEN];
+};
+
+static
+void run_task(void *arg)
+{
+   struct task *tp = (struct task *) arg;
+
+   if (tp->need_stat) {
+      if (lstat(tp->itemname, &tp->itemstat)) {
+         WARN("xsum: lstat failed on %s\n", tp->itemname);
+         set_error();
+         free(tp);
+         return;
+      }
+   }
+
+   if (S_ISREG(tp->itemstat.st_mode))
+      process_file(tp->itemname, &tp->itemstat);
+
+   free(tp);
+}
+
+static
+void submit_task(const char *itemname, const struct stat *itemstat)
+{
+   struct task *tp;
+
+   tp = (struct task *) malloc(sizeof(struct task));
+   if (!tp) {
+      Warning("malloc error");
+      exit(-1);
+   }
+
+   if (itemstat) {
+      tp->need_stat = 0;
+      tp->itemstat = *itemstat;
+   }
+   else {
+      tp->need_stat = 1;
+   }
+
+   if (snprintf(tp->itemname, MAXLEN, "%s", itemname) >= MAXLEN) overflow();
+
+   workq_submit(run_task, tp);
+}
+
+
+void dirwalk(const char *dirname)
+{
+   char itemname[MAXLEN];
+   dirscan_t *dirlist;
+   struct dirscan_item *diritem;
+   struct stat itemstat;
+
+
+   progress_current(dirname);
+
+   dirlist = dirscan_open(dirname, 0);
+
+   if (!dirlist) {
+      WARN("xsum: opendir failed on %s\n", dirname);
+      set_error();
+      return;
+   }
+
+   while ( (diritem = dirscan_next(dirlist)) ) {
+
+      throttle(THROTTLE_OBJECTS, 1);
+      throttle(THROTTLE_OPS, 1);
+      progress_object();
+
+      if (snprintf(itemname, MAXLEN, "%s/%s",
+          dirname, diritem->d_name) >= MAXLEN) overflow();
+
+      if (diritem->d_type == DT_REG) {
+         submit_task(itemname, 0);
+         continue;
+      }
+
+      if (diritem->d_type != DT_DIR && diritem->d_type != DT_UNKNOWN)
+         continue;
+
+      if (lstat(itemname, &itemstat)) {
+         WARN("xsum: lstat failed on %s\n", itemname);
+         set_error();
+         continue;
+      }
+
+      if (S_ISREG(itemstat.st_mode))
+         submit_task(itemname, &itemstat);
+
+      if (S_ISDIR(itemstat.st_mode)) {
+	 dirwalk(itemname);
+      }
+
+   }
+
+   if (dirscan_close(dirlist)) {
+      WARN("xsum: readdir failed on %s\n", dirname);
+      set_error();
+   }
+}
+
+void usage()
+{
+   WARN("usage: xsum options dir\n");
+   WARN("  options:  --cache file\n");
+   WARN("            --keep\n");
+   WARN("            --compare file\n");
+   WARN("            --jobs n\n");
+   WARN("            --max-ops n\n");
+   WARN("            --max-meta-ops n\n");
+   WARN("            --max-bytes n\n");
+   WARN("            --throttle-file file\n");
+   WARN("            --nice n\n");
+   WARN("            --low-io\n");
+   WARN("            --progress file\n");
+}
+
+
+int main(int argc, char **argv)
+{
+   char *cname, *lname, *srcname;
+   char newname[MAXLEN];
+   struct stat srcstat;
+   struct cache_table_entry *cptr;
+   struct list_table_entry *lptr;
+   long max_ops, max_meta_ops, max_bytes;
+   char *tname;
+   long nice_incr;
+   int lowioflag;
+   char *pname;
+   int i;
+
+   cname = 0;
+   max_ops = 0;
+   max_meta_ops = 0;
+   max_bytes = 0;
+   tname = 0;
+   nice_incr = 0;
+   lowioflag = 0;
+   pname = 0;
+   lname = 0;
+
+   i = 1;
+   while (i < argc) {
+      if (strcmp(argv[i], "--cache") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         cname = argv[i];
+         i++;
+      }
+      else if (strcmp(argv[i], "--keep") == 0) {
+         i++;
+         keepflag = 1;
+      }
+      else if (strcmp(argv[i], "--compare") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         lname = argv[i];
+         compareflag = 1;
+         i++;
+      }
+      else if (strcmp(argv[i], "--jobs") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         num_jobs = string_to_long(argv[i]);
+         if (conversion_error || num_jobs < 1 || num_jobs > MAXJOBS) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--max-ops") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         max_ops = string_to_long(argv[i]);
+         if (conversion_error || max_ops < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--max-meta-ops") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         max_meta_ops = string_to_long(argv[i]);
+         if (conversion_error || max_meta_ops < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--max-bytes") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         max_bytes = string_to_long(argv[i]);
+         if (conversion_error || max_bytes < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--throttle-file") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         tname = argv[i];
+         i++;
+      }
+      else if (strcmp(argv[i], "--nice") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         nice_incr = string_to_long(argv[i]);
+         if (conversion_error || nice_incr < 1) {
+            usage();
+            return -1;
+         }
+         i++;
+      }
+      else if (strcmp(argv[i], "--low-io") == 0) {
+         i++;
+         lowioflag = 1;
+      }
+      else if (strcmp(argv[i], "--progress") == 0) {
+         if (i == argc-1) {
+            usage();
+            return -1;
+         }
+         i++;
+         pname = argv[i];
+         i++;
+      }
+
+      else
+         break;
+   }
+
+   if (i != argc-1) {
+      usage();
+      return -1;
+   }
+
+   srcname = argv[argc-1];
+
+   source_name_len = strip_slashes(srcname);
+
+   if (lstat(srcname, &srcstat) || !S_ISDIR(srcstat.st_mode)) {
+      usage();
+      return -1;
+   }
+
+   if (compareflag && load_list(lname)) return -1;
+
+   if (cname) {
+      load_cache(cname);
+
+      if (snprintf(newname, MAXLEN, "%s.new", cname) >= MAXLEN) overflow();
+
+      new_cache_fp = fopen(newname, "w");
+      if (!new_cache_fp) {
+         WARN("xsum: can't create %s\n", newname);
+         return -1;
+      }
+
+      fwrite(cache_magic, 1, sizeof(cache_magic), new_cache_fp);
+   }
+
+   start_time = time(0);
+
+   throttle_init(THROTTLE_OBJECTS, max_ops);
+   throttle_init(THROTTLE_OPS, max_meta_ops);
+   throttle_init(THROTTLE_BYTES, max_bytes);
+
+   if (tname && throttle_control(tname)) {
+      WARN("xsum: bad throttle file %s\n", tname);
+      return -1;
+   }
+
+   if (throttle_priority(nice_incr, lowioflag))
+      WARN("xsum: could not lower priority\n");
+
+   if (pname && progress_open(pname, "xsum"))
+      WARN("xsum: failed to write %s\n", pname);
+
+   if (num_jobs > 0 && workq_start(num_jobs, TASKS_PER_JOB*num_jobs)) {
+      WARN("xsum: no worker threads -- processing synchronously\n");
+      num_jobs = 0;
+   }
+
+   dirwalk(srcname);
+
+   workq_stop();
+
+   if (compareflag) {
+      for (lptr = list_table; lptr; lptr = lptr->hh.next) {
+         if (!lptr->seen) emit_path(lptr->key);
+      }
+   }
+
+   if (cname) {
+      if (keepflag) {
+         for (cptr = cache_table; cptr; cptr = cptr->hh.next) {
+            if (!cptr->used) save_cache_rec(&cptr->rec);
+         }
+      }
+
+      if (fclose(new_cache_fp) || rename(newname, cname)) {
+         WARN("xsum: error writing %s\n", cname);
+         set_error();
+      }
+   }
+
+   if (fflush(stdout) || ferror(stdout)) {
+      WARN("xsum: error writing stdout\n");
+      set_error();
+   }
+
+   progress_close(1);
+
+   return return_value;
+}